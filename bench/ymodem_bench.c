@@ -0,0 +1,1512 @@
+/**
+ * @file ymodem_bench.c
+ * @brief Throughput and latency benchmark over a simulated link
+ * @date 2025-04-09
+ * 
+ * The sender and the receiver run against each other on two threads, joined
+ * by an in-memory link with a chosen baud rate, one-way latency, bit error
+ * rate and burst drops. Files live in memory, so only the protocol engine and
+ * the link are measured. Errors come from a seeded generator and are drawn
+ * per byte on the wire, so a run with the same options sees the same damage.
+ * 
+ * Without options a fixed set of scenarios is run (see _bench_suite); with
+ * options a single scenario is run, e.g.
+ *   ymodem_bench -b 921600 -l 5 -e 1e-5 -w 8 -s 256
+ * 
+ * With -m the same link carries three multiplexed channels instead: the
+ * file, a small urgent config download and a log upload the other way.
+ * 
+ * The round trips (see _bench_trips, -t for them alone) send a real file
+ * through the memory-mapped backend with compression, delta or resume on,
+ * some of them after a first attempt the receiver's storage cut short, and
+ * compare it at the other end. They are checks rather than figures.
+ * 
+ * With -p no link is simulated: a recorded sender stream is replayed into
+ * the blocking and the event-driven receiver to time the packet parser
+ * alone, and -B compares the figures with a baseline file (see
+ * bench/parser_baseline.txt, make bench_parser).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ymodem_common.h"
+#include "ymodem_send.h"
+#include "ymodem_receive.h"
+#include "ymodem_mux.h"
+#include "ymodem_fsm.h"
+#include "ymodem_mmap.h"
+#include "ymodem_readahead.h"
+
+/* Bytes a direction of the link can hold, like a UART FIFO plus driver buffer */
+#define BENCH_PIPE_SIZE         65536
+/* Bits per byte on an 8N1 line */
+#define BENCH_BITS_PER_BYTE     10
+/* Data used for the CRC figures */
+#define BENCH_CRC_SIZE          (1024 * 1024)
+#define BENCH_CRC_ROUNDS        64
+#define BENCH_FILENAME          "bench.bin"
+/* Parser figures: 1 KiB packets per replayed stream, best of the rounds counts */
+#define BENCH_PARSER_PACKETS    4096
+#define BENCH_PARSER_ROUNDS     8
+#define BENCH_PARSER_CALLS      200000
+/* Bytes handed to the event-driven receiver per ymodem_feed() */
+#define BENCH_PARSER_CHUNK      4096
+/* A figure more than this factor above its baseline fails -B */
+#define BENCH_PARSER_TOLERANCE  1.5
+/* Receiver hashes a round trip's delta map holds, 1 KiB blocks */
+#define BENCH_TRIP_MAP_HASHES   1024
+
+/* One scenario */
+typedef struct {
+    const char*      name;
+    uint32_t         baud;        /* 0 for no serialization delay */
+    uint32_t         latency_ms;  /* One way */
+    double           ber;         /* Bit error rate, both directions */
+    double           drop_rate;   /* Chance that a write loses a burst */
+    uint32_t         drop_len;    /* Bytes in a burst */
+    size_t           size_kib;    /* File size */
+    enum ymodem_mode mode;
+    int              window;      /* Packets in flight, 0 for stop-and-wait */
+    int              large_kib;   /* 8 or 32 for large blocks, 0 for none */
+    bool             adaptive;
+    enum ymodem_digest_type digest; /* Whole-file digest, YMODEM_DIGEST_NONE for none */
+} bench_config_t;
+
+/* One direction of the link */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    uint8_t         data[BENCH_PIPE_SIZE];
+    uint64_t        due_us[BENCH_PIPE_SIZE];   /* When each byte reaches the far end */
+    uint64_t        head;                      /* Bytes read */
+    uint64_t        tail;                      /* Bytes written */
+    uint64_t        wire_free_ns;              /* When the line is idle again */
+    uint64_t        byte_ns;                   /* Time of one byte on the wire */
+    uint64_t        latency_us;
+    double          byte_error;                /* Chance that a byte is hit */
+    double          drop_rate;
+    uint32_t        drop_len;
+    uint64_t        rng;
+    uint64_t        flipped;                   /* Bytes damaged */
+    uint64_t        dropped;                   /* Bytes lost */
+} bench_pipe_t;
+
+/* One end of the link with its file */
+typedef struct {
+    bench_pipe_t*  tx;
+    bench_pipe_t*  rx;
+    uint8_t*       file;
+    size_t         file_size;
+    size_t         offset;
+    bool           open;
+    uint64_t       done_us;    /* When the file was closed */
+} bench_side_t;
+
+/* Recorded stream replayed into a receiver, what it sends and writes is dropped */
+typedef struct {
+    const uint8_t* data;
+    size_t         length;
+    size_t         offset;
+    uint64_t       written;    /* File bytes that reached file_write */
+} bench_replay_t;
+
+/* One figure of the parser benchmark, lower is better */
+typedef struct {
+    const char*    name;
+    double         value;
+} bench_figure_t;
+
+/* Receiver thread arguments and result */
+typedef struct {
+    const bench_config_t* config;
+    bench_side_t*         side;
+    int                   result;
+    ymodem_stats_t        stats;
+    uint64_t              done_us;
+} bench_receiver_t;
+
+static uint64_t _bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+/* xorshift64*, enough for reproducible damage */
+static double _bench_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+static void _bench_pipe_init(bench_pipe_t* pipe, const bench_config_t* config, uint64_t seed)
+{
+    pthread_condattr_t attr;
+    
+    memset(pipe, 0, sizeof(*pipe));
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pipe->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    
+    pipe->byte_ns = (config->baud > 0) ? (uint64_t)BENCH_BITS_PER_BYTE * 1000000000u / config->baud : 0;
+    pipe->latency_us = (uint64_t)config->latency_ms * 1000u;
+    pipe->byte_error = 1.0 - pow(1.0 - config->ber, 8);
+    pipe->drop_rate = config->drop_rate;
+    pipe->drop_len = config->drop_len;
+    pipe->rng = seed;
+}
+
+static void _bench_pipe_destroy(bench_pipe_t* pipe)
+{
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->lock);
+}
+
+static void _bench_wait_until(bench_pipe_t* pipe, uint64_t until_us)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(until_us / 1000000u);
+    ts.tv_nsec = (long)(until_us % 1000000u) * 1000;
+    pthread_cond_timedwait(&pipe->cond, &pipe->lock, &ts);
+}
+
+/**
+ * @brief Put bytes on the line
+ * 
+ * Each byte leaves when the line is free and arrives latency later. Lost
+ * bytes still take their time on the wire. The writer only blocks while the
+ * far end has BENCH_PIPE_SIZE bytes it has not read.
+ */
+static size_t _bench_pipe_write(bench_pipe_t* pipe, const uint8_t* data, size_t length)
+{
+    uint64_t now = _bench_now_us();
+    size_t drop_from = length;
+    size_t drop_to = length;
+    size_t i;
+    
+    pthread_mutex_lock(&pipe->lock);
+    
+    /* A burst starts anywhere in the write and ends with it at the latest */
+    if (pipe->drop_rate > 0 && length > 0 && _bench_random(&pipe->rng) < pipe->drop_rate) {
+        drop_from = (size_t)(_bench_random(&pipe->rng) * (double)length);
+        drop_to = (pipe->drop_len < length - drop_from) ? drop_from + pipe->drop_len : length;
+    }
+    
+    for (i = 0; i < length; i++) {
+        uint8_t byte = data[i];
+    
+        while (pipe->tail - pipe->head == BENCH_PIPE_SIZE) {
+            _bench_wait_until(pipe, now + 1000);
+            now = _bench_now_us();
+        }
+    
+        /* Kept in ns so that fast lines do not round to zero */
+        if (pipe->wire_free_ns < now * 1000u) {
+            pipe->wire_free_ns = now * 1000u;
+        }
+        pipe->wire_free_ns += pipe->byte_ns;
+    
+        if (i >= drop_from && i < drop_to) {
+            pipe->dropped++;
+            continue;
+        }
+        if (pipe->byte_error > 0 && _bench_random(&pipe->rng) < pipe->byte_error) {
+            byte ^= (uint8_t)(1u << (int)(_bench_random(&pipe->rng) * 8));
+            pipe->flipped++;
+        }
+    
+        pipe->data[pipe->tail % BENCH_PIPE_SIZE] = byte;
+        pipe->due_us[pipe->tail % BENCH_PIPE_SIZE] = pipe->wire_free_ns / 1000u + pipe->latency_us;
+        pipe->tail++;
+    }
+    
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    
+    return length;
+}
+
+/**
+ * @brief Take whatever has arrived, waiting up to timeout_ms for the first byte
+ */
+static size_t _bench_pipe_read(bench_pipe_t* pipe, uint8_t* data, size_t max_length, uint32_t timeout_ms)
+{
+    uint64_t deadline = _bench_now_us() + (uint64_t)timeout_ms * 1000u;
+    size_t count = 0;
+    
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        uint64_t now = _bench_now_us();
+    
+        while (count < max_length && pipe->head < pipe->tail &&
+               pipe->due_us[pipe->head % BENCH_PIPE_SIZE] <= now) {
+            data[count++] = pipe->data[pipe->head % BENCH_PIPE_SIZE];
+            pipe->head++;
+        }
+        if (count > 0 || now >= deadline) {
+            break;
+        }
+    
+        /* Sleep until the next byte is due, a write or the timeout */
+        if (pipe->head < pipe->tail && pipe->due_us[pipe->head % BENCH_PIPE_SIZE] < deadline) {
+            _bench_wait_until(pipe, pipe->due_us[pipe->head % BENCH_PIPE_SIZE]);
+        } else {
+            _bench_wait_until(pipe, deadline);
+        }
+    }
+    if (count > 0) {
+        pthread_cond_broadcast(&pipe->cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    
+    return count;
+}
+
+/* Callbacks, user is the bench_side_t of that end */
+static void* _bench_file_open(void* user, const char* filename, enum ymodem_open_mode mode)
+{
+    bench_side_t* side = (bench_side_t*)user;
+    (void)filename;
+    (void)mode;
+    
+    if (side->open) {
+        return NULL;
+    }
+    side->open = true;
+    side->offset = 0;
+    return side;
+}
+
+static size_t _bench_file_read(void* user, void* file_handle, uint8_t* buffer, size_t size)
+{
+    bench_side_t* side = (bench_side_t*)file_handle;
+    (void)user;
+    
+    if (size > side->file_size - side->offset) {
+        size = side->file_size - side->offset;
+    }
+    memcpy(buffer, side->file + side->offset, size);
+    side->offset += size;
+    return size;
+}
+
+static size_t _bench_file_write(void* user, void* file_handle, const uint8_t* buffer, size_t size)
+{
+    bench_side_t* side = (bench_side_t*)file_handle;
+    (void)user;
+    
+    if (size > side->file_size - side->offset) {
+        return 0;
+    }
+    memcpy(side->file + side->offset, buffer, size);
+    side->offset += size;
+    return size;
+}
+
+static void _bench_file_close(void* user, void* file_handle)
+{
+    bench_side_t* side = (bench_side_t*)file_handle;
+    (void)user;
+    side->open = false;
+    side->done_us = _bench_now_us();
+}
+
+static int64_t _bench_file_size(void* user, void* file_handle)
+{
+    bench_side_t* side = (bench_side_t*)file_handle;
+    (void)user;
+    return (int64_t)side->file_size;
+}
+
+static size_t _bench_comm_send(void* user, const uint8_t* data, size_t length)
+{
+    bench_side_t* side = (bench_side_t*)user;
+    return _bench_pipe_write(side->tx, data, length);
+}
+
+static size_t _bench_comm_receive(void* user, uint8_t* data, size_t max_length, uint32_t timeout_ms)
+{
+    bench_side_t* side = (bench_side_t*)user;
+    return _bench_pipe_read(side->rx, data, max_length, timeout_ms);
+}
+
+static uint32_t _bench_get_time_ms(void* user)
+{
+    (void)user;
+    return (uint32_t)(_bench_now_us() / 1000u);
+}
+
+static void _bench_delay_ms(void* user, uint32_t ms)
+{
+    struct timespec ts;
+    (void)user;
+    ts.tv_sec = (time_t)(ms / 1000u);
+    ts.tv_nsec = (long)(ms % 1000u) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+static void _bench_callbacks(ymodem_callbacks_t* callbacks, bench_side_t* side)
+{
+    memset(callbacks, 0, sizeof(*callbacks));
+    callbacks->file_open = _bench_file_open;
+    callbacks->file_read = _bench_file_read;
+    callbacks->file_write = _bench_file_write;
+    callbacks->file_close = _bench_file_close;
+    callbacks->file_size = _bench_file_size;
+    callbacks->comm_send = _bench_comm_send;
+    callbacks->comm_receive = _bench_comm_receive;
+    callbacks->get_time_ms = _bench_get_time_ms;
+    callbacks->delay_ms = _bench_delay_ms;
+    callbacks->user = side;
+}
+
+static size_t _bench_block_size(const bench_config_t* config)
+{
+    if (config->large_kib == 32) {
+        return YMODEM_BLK32K_DATA_SIZE;
+    }
+    return (config->large_kib == 8) ? YMODEM_BLK8K_DATA_SIZE : 0;
+}
+
+static void* _bench_receiver(void* arg)
+{
+    bench_receiver_t* receiver = (bench_receiver_t*)arg;
+    static uint8_t buffer[YMODEM_MAX_BLK_PACKET_SIZE];
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    ymodem_file_info_t file_info;
+    ymodem_digest_t digest;
+    
+    _bench_callbacks(&callbacks, receiver->side);
+    receiver->result = ymodem_receive_init(&ctx, &callbacks, buffer, sizeof(buffer), receiver->config->mode);
+    if (receiver->result == YMODEM_ERR_NONE) {
+        ymodem_set_handshake(&ctx, 20, 0, false);
+        ymodem_receive_set_large_blocks(&ctx, _bench_block_size(receiver->config));
+        ymodem_receive_set_digest(&ctx, &digest);
+        receiver->result = ymodem_receive_file(&ctx, &file_info, 10);
+        if (receiver->result == YMODEM_ERR_NONE && file_info.verified != receiver->config->digest) {
+            receiver->result = YMODEM_ERR_SUM;
+        }
+        receiver->stats = *ymodem_get_stats(&ctx);
+        ymodem_receive_cleanup(&ctx);
+    }
+    receiver->done_us = _bench_now_us();
+    
+    return NULL;
+}
+
+/**
+ * @brief Run one scenario and print its line
+ * 
+ * @return int 0 if the file arrived intact
+ */
+static int _bench_run(const bench_config_t* config, uint64_t seed)
+{
+    static uint8_t buffer[YMODEM_MAX_BLK_PACKET_SIZE];
+    static uint8_t window_buffer[YMODEM_MAX_WINDOW * YMODEM_MAX_PACKET_SIZE];
+    static bench_pipe_t forward;
+    static bench_pipe_t backward;
+    size_t size = config->size_kib * 1024;
+    bench_side_t sender_side = { &forward, &backward, NULL, size, 0, false, 0 };
+    bench_side_t receiver_side = { &backward, &forward, NULL, size, 0, false, 0 };
+    bench_receiver_t receiver = { config, &receiver_side, YMODEM_ERR_CODE, { 0 }, 0 };
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    ymodem_digest_t digest;
+    const ymodem_stats_t* stats;
+    pthread_t thread;
+    uint64_t start_us;
+    double seconds;
+    bool intact;
+    int result;
+    size_t i;
+    
+    sender_side.file = (uint8_t*)malloc(size > 0 ? size : 1);
+    receiver_side.file = (uint8_t*)calloc(1, size > 0 ? size : 1);
+    if (sender_side.file == NULL || receiver_side.file == NULL) {
+        free(sender_side.file);
+        free(receiver_side.file);
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        sender_side.file[i] = (uint8_t)((i * 2654435761u) >> 13);
+    }
+    
+    _bench_pipe_init(&forward, config, seed);
+    _bench_pipe_init(&backward, config, seed ^ 0x9E3779B97F4A7C15ULL);
+    
+    _bench_callbacks(&callbacks, &sender_side);
+    result = ymodem_send_init(&ctx, &callbacks, buffer, sizeof(buffer), config->mode);
+    if (result == YMODEM_ERR_NONE && config->window > 1) {
+        result = ymodem_send_set_window(&ctx, window_buffer, sizeof(window_buffer), (uint8_t)config->window);
+    }
+    if (result == YMODEM_ERR_NONE && config->adaptive) {
+        result = ymodem_send_set_adaptive(&ctx, true);
+    }
+    if (result == YMODEM_ERR_NONE) {
+        result = ymodem_send_set_large_blocks(&ctx, _bench_block_size(config));
+    }
+    if (result == YMODEM_ERR_NONE) {
+        result = ymodem_send_set_digest(&ctx, &digest, config->digest);
+    }
+    
+    start_us = _bench_now_us();
+    if (result == YMODEM_ERR_NONE) {
+        pthread_create(&thread, NULL, _bench_receiver, &receiver);
+        result = ymodem_send_file(&ctx, BENCH_FILENAME, 10);
+        pthread_join(thread, NULL);
+    } else {
+        receiver.done_us = start_us;
+    }
+    
+    stats = ymodem_get_stats(&ctx);
+    seconds = (double)(receiver.done_us - start_us) / 1e6;
+    if (seconds <= 0) {
+        seconds = 1e-6;
+    }
+    intact = (result == YMODEM_ERR_NONE && receiver.result == YMODEM_ERR_NONE &&
+              receiver_side.offset == size && memcmp(sender_side.file, receiver_side.file, size) == 0);
+    
+    printf("%-22s %8zu %9.3f %9.0f %7u %7u %7u %7u  %s\n",
+           config->name, config->size_kib,
+           (double)size / seconds / 1e6,
+           (double)stats->packets_sent / seconds,
+           stats->retries, receiver.stats.crc_errors, stats->timeouts, stats->rtt_avg_ms,
+           intact ? "ok" : ymodem_error_to_str(result != YMODEM_ERR_NONE ? result : receiver.result));
+    if (forward.flipped + backward.flipped + forward.dropped + backward.dropped > 0) {
+        printf("%-22s %llu bytes damaged, %llu lost\n", "",
+               (unsigned long long)(forward.flipped + backward.flipped),
+               (unsigned long long)(forward.dropped + backward.dropped));
+    }
+    
+    ymodem_send_cleanup(&ctx);
+    _bench_pipe_destroy(&forward);
+    _bench_pipe_destroy(&backward);
+    free(sender_side.file);
+    free(receiver_side.file);
+    
+    return intact ? 0 : 1;
+}
+
+/* One channel of the multiplexed scenario, a session on each end of the link */
+typedef struct {
+    const char* name;
+    uint8_t     id;
+    uint8_t     priority;    /* 0 is served first */
+    size_t      size_kib;    /* 0 for the size of the scenario */
+    bool        upload;      /* Sent by the device end */
+} bench_channel_t;
+
+static const bench_channel_t _bench_channels[] = {
+    { "  ch1 firmware",  1, 1, 0,  false },
+    { "  ch2 config",    2, 0, 4,  false },
+    { "  ch3 logs",      3, 1, 64, true  },
+};
+
+#define BENCH_CHANNELS  (sizeof(_bench_channels) / sizeof(_bench_channels[0]))
+
+/* Device end of the multiplexed link */
+typedef struct {
+    ymodem_mux_t*       mux;
+    ymodem_callbacks_t* link;
+    int                 result;
+} bench_device_t;
+
+static void* _bench_mux_device(void* arg)
+{
+    bench_device_t* device = (bench_device_t*)arg;
+    device->result = ymodem_mux_run(device->mux, device->link);
+    return NULL;
+}
+
+/**
+ * @brief Run the channels of _bench_channels over one link and print a line per channel
+ * 
+ * The host sends the firmware and the config and receives the logs, the
+ * device the other way round. Both ends drive their sessions with
+ * ymodem_mux_run(); a channel's time runs until its receiver closes the file.
+ * 
+ * @return int 0 if every file arrived intact
+ */
+static int _bench_mux(const bench_config_t* config, uint64_t seed)
+{
+    static uint8_t buffers[BENCH_CHANNELS][2][YMODEM_MAX_PACKET_SIZE];
+    static ymodem_fsm_t sessions[BENCH_CHANNELS][2];
+    static bench_pipe_t forward;
+    static bench_pipe_t backward;
+    static ymodem_mux_t host;
+    static ymodem_mux_t device;
+    bench_side_t host_link = { &forward, &backward, NULL, 0, 0, false, 0 };
+    bench_side_t device_link = { &backward, &forward, NULL, 0, 0, false, 0 };
+    bench_side_t sides[BENCH_CHANNELS][2];  /* [0] sender, [1] receiver */
+    ymodem_callbacks_t host_callbacks;
+    ymodem_callbacks_t device_callbacks;
+    ymodem_callbacks_t callbacks;
+    bench_device_t device_run = { &device, &device_callbacks, YMODEM_ERR_CODE };
+    pthread_t thread;
+    uint64_t start_us;
+    uint32_t now;
+    int failed = 0;
+    int result;
+    size_t c;
+    size_t i;
+    
+    printf("%-22s %8s %9s %9s %7s %7s %7s %7s  %s\n",
+           config->name, "KiB", "MB/s", "pkt/s", "retry", "crcerr", "tmo", "done ms", "result");
+    
+    memset(sides, 0, sizeof(sides));
+    for (c = 0; c < BENCH_CHANNELS; c++) {
+        size_t size = (_bench_channels[c].size_kib ? _bench_channels[c].size_kib : config->size_kib) * 1024;
+        sides[c][0].file = (uint8_t*)malloc(size > 0 ? size : 1);
+        sides[c][1].file = (uint8_t*)calloc(1, size > 0 ? size : 1);
+        sides[c][0].file_size = size;
+        sides[c][1].file_size = size;
+        if (sides[c][0].file == NULL || sides[c][1].file == NULL) {
+            failed = 1;
+            break;
+        }
+        for (i = 0; i < size; i++) {
+            sides[c][0].file[i] = (uint8_t)(((i + c) * 2654435761u) >> 13);
+        }
+    }
+    
+    _bench_pipe_init(&forward, config, seed);
+    _bench_pipe_init(&backward, config, seed ^ 0x9E3779B97F4A7C15ULL);
+    _bench_callbacks(&host_callbacks, &host_link);
+    _bench_callbacks(&device_callbacks, &device_link);
+    
+    result = (failed == 0) ? ymodem_mux_init(&host, 0) : YMODEM_ERR_MEM;
+    if (result == YMODEM_ERR_NONE) {
+        result = ymodem_mux_init(&device, 0);
+    }
+    
+    now = _bench_get_time_ms(NULL);
+    for (c = 0; c < BENCH_CHANNELS && result == YMODEM_ERR_NONE; c++) {
+        const bench_channel_t* channel = &_bench_channels[c];
+        ymodem_mux_t* sender = channel->upload ? &device : &host;
+        ymodem_mux_t* receiver = channel->upload ? &host : &device;
+        
+        _bench_callbacks(&callbacks, &sides[c][0]);
+        result = ymodem_fsm_send_init(&sessions[c][0], &callbacks, buffers[c][0], sizeof(buffers[c][0]),
+                                      YMODEM_MODE_CRC, BENCH_FILENAME, 10, now);
+        if (result == YMODEM_ERR_NONE) {
+            _bench_callbacks(&callbacks, &sides[c][1]);
+            result = ymodem_fsm_receive_init(&sessions[c][1], &callbacks, buffers[c][1], sizeof(buffers[c][1]),
+                                             YMODEM_MODE_CRC, 10, now);
+        }
+        if (result == YMODEM_ERR_NONE) {
+            result = ymodem_mux_add(sender, channel->id, &sessions[c][0], channel->priority);
+        }
+        if (result == YMODEM_ERR_NONE) {
+            result = ymodem_mux_add(receiver, channel->id, &sessions[c][1], channel->priority);
+        }
+    }
+    
+    start_us = _bench_now_us();
+    if (result == YMODEM_ERR_NONE) {
+        pthread_create(&thread, NULL, _bench_mux_device, &device_run);
+        result = ymodem_mux_run(&host, &host_callbacks);
+        pthread_join(thread, NULL);
+    }
+    
+    for (c = 0; c < BENCH_CHANNELS && failed == 0; c++) {
+        const ymodem_stats_t* stats = &sessions[c][0].ctx.stats;
+        const bench_side_t* received = &sides[c][1];
+        int sent = ymodem_fsm_result(&sessions[c][0]);
+        int got = ymodem_fsm_result(&sessions[c][1]);
+        double seconds = (double)(received->done_us - start_us) / 1e6;
+        bool intact = (sent == YMODEM_ERR_NONE && got == YMODEM_ERR_NONE && received->done_us > 0 &&
+                       received->offset == received->file_size &&
+                       memcmp(sides[c][0].file, received->file, received->file_size) == 0);
+        
+        if (seconds <= 0) {
+            seconds = 1e-6;
+        }
+        printf("%-22s %8zu %9.3f %9.0f %7u %7u %7u %7.0f  %s\n",
+               _bench_channels[c].name, received->file_size / 1024,
+               (double)received->file_size / seconds / 1e6,
+               (double)stats->packets_sent / seconds,
+               stats->retries, sessions[c][1].ctx.stats.crc_errors, stats->timeouts, seconds * 1000.0,
+               intact ? "ok" : ymodem_error_to_str(sent != YMODEM_ERR_NONE ? sent : got));
+        failed |= intact ? 0 : 1;
+    }
+    if (failed && result != YMODEM_ERR_NONE) {
+        printf("%-22s %s\n", "", ymodem_error_to_str(result));
+    }
+    if (host.frames_dropped + device.frames_dropped > 0) {
+        printf("%-22s %llu bytes damaged, %llu lost, %llu frames dropped\n", "",
+               (unsigned long long)(forward.flipped + backward.flipped),
+               (unsigned long long)(forward.dropped + backward.dropped),
+               (unsigned long long)(host.frames_dropped + device.frames_dropped));
+    }
+    
+    ymodem_mux_cleanup(&host);
+    ymodem_mux_cleanup(&device);
+    _bench_pipe_destroy(&forward);
+    _bench_pipe_destroy(&backward);
+    for (c = 0; c < BENCH_CHANNELS; c++) {
+        free(sides[c][0].file);
+        free(sides[c][1].file);
+    }
+    
+    return failed;
+}
+
+/* One round trip of an optional feature over real files, see _bench_trip() */
+typedef struct {
+    const char*      name;
+    size_t           size_kib;    /* New file */
+    bool             lz;          /* Compressible data, sent compressed */
+    bool             delta;       /* The receiver has an older copy and updates it */
+    bool             resume;      /* Both ends offer resume, the receiver keeps a journal */
+    size_t           cut_kib;     /* The receiver's storage fails after this much on a first attempt, 0 for one attempt */
+    bool             readahead;   /* The sender reads through a threaded read-ahead stage */
+    enum ymodem_digest_type digest; /* Whole-file digest, YMODEM_DIGEST_NONE for none */
+} bench_trip_t;
+
+/* One end of a round trip: its link, the directory of its files and a storage fault */
+typedef struct {
+    bench_side_t     link;        /* First, the link callbacks take it as their user */
+    const char*      dir;
+    size_t           cut;         /* Bytes file_write takes before it fails once, 0 for no fault */
+    size_t           written;
+} bench_trip_side_t;
+
+/* Receiver thread arguments and result of a round trip */
+typedef struct {
+    const bench_trip_t* trip;
+    bench_trip_side_t*  side;
+    int                 result;
+    ymodem_file_info_t  info;
+    ymodem_stats_t      stats;
+} bench_trip_receiver_t;
+
+/* The memory-mapped file backend, the round trips call it with their directory and fault */
+static ymodem_callbacks_t _bench_mmap;
+
+static void* _bench_trip_open(void* user, const char* filename, enum ymodem_open_mode mode)
+{
+    bench_trip_side_t* side = (bench_trip_side_t*)user;
+    char path[256];
+    
+    snprintf(path, sizeof(path), "%s/%s", side->dir, filename);
+    return _bench_mmap.file_open(NULL, path, mode);
+}
+
+static size_t _bench_trip_write(void* user, void* file_handle, const uint8_t* buffer, size_t size)
+{
+    bench_trip_side_t* side = (bench_trip_side_t*)user;
+    
+    /* The fault strikes once, the journal written after it gets through */
+    if (side->cut > 0 && side->written + size > side->cut) {
+        side->cut = 0;
+        return 0;
+    }
+    side->written += size;
+    return _bench_mmap.file_write(NULL, file_handle, buffer, size);
+}
+
+/* Callbacks of a round trip, user is its bench_trip_side_t */
+static void _bench_trip_callbacks(ymodem_callbacks_t* callbacks, bench_trip_side_t* side)
+{
+    _bench_callbacks(callbacks, &side->link);
+    ymodem_mmap_set_callbacks(callbacks);
+    callbacks->file_open = _bench_trip_open;
+    callbacks->file_write = _bench_trip_write;
+}
+
+static bool _bench_trip_store(const char* dir, const uint8_t* data, size_t size)
+{
+    char path[256];
+    FILE* file;
+    bool stored;
+    
+    snprintf(path, sizeof(path), "%s/%s", dir, BENCH_FILENAME);
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    stored = (fwrite(data, 1, size, file) == size);
+    return (fclose(file) == 0) && stored;
+}
+
+static void* _bench_trip_receiver(void* arg)
+{
+    bench_trip_receiver_t* receiver = (bench_trip_receiver_t*)arg;
+    static uint8_t buffer[YMODEM_MAX_PACKET_SIZE];
+    static ymodem_lz_decoder_t decoder;
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    ymodem_digest_t digest;
+    
+    _bench_trip_callbacks(&callbacks, receiver->side);
+    receiver->result = ymodem_receive_init(&ctx, &callbacks, buffer, sizeof(buffer), YMODEM_MODE_CRC);
+    if (receiver->result == YMODEM_ERR_NONE) {
+        ymodem_set_handshake(&ctx, 20, 0, false);
+        ymodem_receive_set_resume(&ctx, receiver->trip->resume);
+        ymodem_receive_set_compression(&ctx, receiver->trip->lz ? &decoder : NULL);
+        ymodem_receive_set_delta(&ctx, receiver->trip->delta);
+        ymodem_receive_set_digest(&ctx, &digest);
+        receiver->result = ymodem_receive_file(&ctx, &receiver->info, 10);
+        receiver->stats = *ymodem_get_stats(&ctx);
+        ymodem_receive_cleanup(&ctx);
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief Send the file of a round trip once over a clean loopback link
+ * 
+ * @return int Result of the sender, the receiver's is in receiver->result
+ */
+static int _bench_trip_attempt(bench_trip_side_t* sender_side, bench_trip_receiver_t* receiver)
+{
+    static const bench_config_t loopback = { "loopback", 0, 0, 0, 0, 0, 0, YMODEM_MODE_CRC, 0, 0, false, YMODEM_DIGEST_NONE };
+    static uint8_t buffer[YMODEM_MAX_PACKET_SIZE];
+    static ymodem_lz_encoder_t encoder;
+    static uint32_t map[BENCH_TRIP_MAP_HASHES];
+    static uint8_t ring[8 * YMODEM_STX_DATA_SIZE];
+    static ymodem_readahead_t readahead;
+    const bench_trip_t* trip = receiver->trip;
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    ymodem_digest_t digest;
+    pthread_t thread;
+    int result;
+    
+    _bench_pipe_init(sender_side->link.tx, &loopback, 1);
+    _bench_pipe_init(sender_side->link.rx, &loopback, 1);
+    
+    _bench_trip_callbacks(&callbacks, sender_side);
+    result = YMODEM_ERR_NONE;
+    if (trip->readahead) {
+        result = ymodem_readahead_init(&readahead, &callbacks, ring, YMODEM_STX_DATA_SIZE, 8, true, &callbacks);
+    }
+    if (result == YMODEM_ERR_NONE) {
+        result = ymodem_send_init(&ctx, &callbacks, buffer, sizeof(buffer), YMODEM_MODE_CRC);
+    }
+    if (result == YMODEM_ERR_NONE) {
+        result = ymodem_send_set_resume(&ctx, trip->resume);
+    }
+    if (result == YMODEM_ERR_NONE) {
+        result = ymodem_send_set_compression(&ctx, trip->lz ? &encoder : NULL);
+    }
+    if (result == YMODEM_ERR_NONE) {
+        result = ymodem_send_set_delta(&ctx, trip->delta ? map : NULL, trip->delta ? BENCH_TRIP_MAP_HASHES : 0);
+    }
+    if (result == YMODEM_ERR_NONE) {
+        result = ymodem_send_set_digest(&ctx, &digest, trip->digest);
+    }
+    
+    receiver->result = YMODEM_ERR_CODE;
+    if (result == YMODEM_ERR_NONE) {
+        pthread_create(&thread, NULL, _bench_trip_receiver, receiver);
+        result = ymodem_send_file(&ctx, BENCH_FILENAME, 10);
+        pthread_join(thread, NULL);
+    }
+    
+    ymodem_send_cleanup(&ctx);
+    _bench_pipe_destroy(sender_side->link.tx);
+    _bench_pipe_destroy(sender_side->link.rx);
+    
+    return result;
+}
+
+/**
+ * @brief Run one round trip over real files and print its line
+ * 
+ * Both ends use the memory-mapped backend in their own directory under
+ * /tmp. With cut_kib the receiver's storage fails part way through the
+ * first attempt and the file is sent a second time, which continues it
+ * (resume) or updates the copy again (delta). The received file must match
+ * and the feature must have been used.
+ * 
+ * @return int 0 if the round trip passed
+ */
+static int _bench_trip(const bench_trip_t* trip)
+{
+    static const char text[] = "status ok, temperature nominal, fan 1200 rpm\n";
+    static bench_pipe_t forward;
+    static bench_pipe_t backward;
+    char root[] = "/tmp/ymodem_bench_XXXXXX";
+    char send_dir[64];
+    char recv_dir[64];
+    char path[96];
+    char journal[104];
+    size_t size = trip->size_kib * 1024;
+    size_t old_size = 0;
+    bench_trip_side_t sender_side = { { &forward, &backward, NULL, 0, 0, false, 0 }, send_dir, 0, 0 };
+    bench_trip_side_t receiver_side = { { &backward, &forward, NULL, 0, 0, false, 0 }, recv_dir, 0, 0 };
+    bench_trip_receiver_t receiver;
+    const char* failure = NULL;
+    const uint8_t* received;
+    size_t received_size = 0;
+    struct stat st;
+    uint8_t* data;
+    uint8_t* old = NULL;
+    int sent = YMODEM_ERR_NONE;
+    size_t i;
+    
+    memset(&receiver, 0, sizeof(receiver));
+    receiver.trip = trip;
+    receiver.side = &receiver_side;
+    ymodem_mmap_set_callbacks(&_bench_mmap);
+    
+    data = (uint8_t*)malloc(size > 0 ? size : 1);
+    if (data == NULL || mkdtemp(root) == NULL) {
+        free(data);
+        return 1;
+    }
+    snprintf(send_dir, sizeof(send_dir), "%s/send", root);
+    snprintf(recv_dir, sizeof(recv_dir), "%s/recv", root);
+    mkdir(send_dir, 0700);
+    mkdir(recv_dir, 0700);
+    
+    for (i = 0; i < size; i++) {
+        data[i] = trip->lz ? (uint8_t)text[(i + i / 4096) % (sizeof(text) - 1)] : (uint8_t)((i * 2654435761u) >> 13);
+    }
+    if (!_bench_trip_store(send_dir, data, size)) {
+        failure = "cannot store";
+    }
+    
+    /* An older release: a byte differs in every 16th block and the end is missing */
+    if (failure == NULL && trip->delta) {
+        old_size = size - 3 * 1024 - 100;
+        old = (uint8_t*)malloc(old_size);
+        if (old == NULL) {
+            failure = "no memory";
+        } else {
+            memcpy(old, data, old_size);
+            for (i = 5 * 1024; i < old_size; i += 16 * 1024) {
+                old[i] ^= 0x5A;
+            }
+            if (!_bench_trip_store(recv_dir, old, old_size)) {
+                failure = "cannot store";
+            }
+        }
+    }
+    
+    snprintf(path, sizeof(path), "%s/%s", recv_dir, BENCH_FILENAME);
+    snprintf(journal, sizeof(journal), "%s%s", path, YMODEM_JOURNAL_SUFFIX);
+    if (failure == NULL && trip->cut_kib > 0) {
+        receiver_side.cut = trip->cut_kib * 1024;
+        sent = _bench_trip_attempt(&sender_side, &receiver);
+        receiver_side.cut = 0;
+        if (sent == YMODEM_ERR_NONE || receiver.result != YMODEM_ERR_FILE) {
+            failure = "not cut";
+        } else if (trip->resume && stat(journal, &st) != 0) {
+            failure = "no journal";
+        } else if (trip->delta && (stat(path, &st) != 0 || (size_t)st.st_size < old_size)) {
+            failure = "copy trimmed";
+        }
+    }
+    
+    if (failure == NULL) {
+        sent = _bench_trip_attempt(&sender_side, &receiver);
+        received = ymodem_mmap_map(path, &received_size);
+        if (sent != YMODEM_ERR_NONE || receiver.result != YMODEM_ERR_NONE) {
+            failure = ymodem_error_to_str(sent != YMODEM_ERR_NONE ? sent : receiver.result);
+        } else if (received == NULL || received_size != size || memcmp(received, data, size) != 0) {
+            failure = "differs";
+        } else if (trip->lz && receiver.stats.lz_wire_bytes >= receiver.stats.lz_file_bytes) {
+            failure = "not compressed";
+        } else if (trip->delta && receiver.stats.delta_skipped_bytes == 0) {
+            failure = "nothing skipped";
+        } else if (trip->resume && receiver.info.resumed == 0) {
+            failure = "not resumed";
+        } else if (receiver.info.verified != trip->digest) {
+            failure = "not verified";
+        }
+        if (received != NULL) {
+            ymodem_mmap_unmap(received, received_size);
+        }
+    }
+    
+    printf("%-22s %8zu %9llu %9llu %9llu  %s\n", trip->name, trip->size_kib,
+           (unsigned long long)(receiver.info.resumed / 1024),
+           (unsigned long long)(receiver.stats.delta_skipped_bytes / 1024),
+           (unsigned long long)(receiver.stats.lz_wire_bytes / 1024),
+           (failure == NULL) ? "ok" : failure);
+    
+    unlink(path);
+    unlink(journal);
+    snprintf(path, sizeof(path), "%s/%s", send_dir, BENCH_FILENAME);
+    unlink(path);
+    rmdir(send_dir);
+    rmdir(recv_dir);
+    rmdir(root);
+    free(data);
+    free(old);
+    
+    return (failure == NULL) ? 0 : 1;
+}
+
+/**
+ * @brief Time the CRC kernels and the SHA-256 digest over a buffer that stays in cache
+ */
+static void _bench_crc(void)
+{
+    static uint8_t data[BENCH_CRC_SIZE];
+    volatile uint32_t sink = 0;
+    ymodem_digest_t digest;
+    uint64_t start_us;
+    double ns16;
+    double ns32;
+    double ns256;
+    int round;
+    size_t i;
+    
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 131u + 7u);
+    }
+    
+    start_us = _bench_now_us();
+    for (round = 0; round < BENCH_CRC_ROUNDS; round++) {
+        sink += ymodem_calc_crc16(data, sizeof(data));
+    }
+    ns16 = (double)(_bench_now_us() - start_us) * 1000.0 / ((double)sizeof(data) * BENCH_CRC_ROUNDS);
+    
+    start_us = _bench_now_us();
+    for (round = 0; round < BENCH_CRC_ROUNDS; round++) {
+        sink += ymodem_crc32_update(0, data, sizeof(data));
+    }
+    ns32 = (double)(_bench_now_us() - start_us) * 1000.0 / ((double)sizeof(data) * BENCH_CRC_ROUNDS);
+    
+    /* SHA-256 is an order of magnitude slower, a few rounds are enough */
+    start_us = _bench_now_us();
+    ymodem_digest_init(&digest, YMODEM_DIGEST_SHA256);
+    for (round = 0; round < BENCH_CRC_ROUNDS / 8; round++) {
+        ymodem_digest_update(&digest, data, sizeof(data));
+    }
+    ymodem_digest_final(&digest);
+    sink += digest.value[0];
+    ns256 = (double)(_bench_now_us() - start_us) * 1000.0 / ((double)sizeof(data) * (BENCH_CRC_ROUNDS / 8));
+    (void)sink;
+    
+    printf("CRC16 (%s): %.3f ns/byte, CRC32 (%s): %.3f ns/byte, SHA-256: %.3f ns/byte\n\n",
+           ymodem_crc16_kernel_name(), ns16, ymodem_crc32_kernel_name(), ns32, ns256);
+}
+
+/* Replay callbacks, user is the bench_replay_t */
+static void* _bench_replay_open(void* user, const char* filename, enum ymodem_open_mode mode)
+{
+    (void)filename;
+    (void)mode;
+    return user;
+}
+
+static size_t _bench_replay_write(void* user, void* file_handle, const uint8_t* buffer, size_t size)
+{
+    (void)file_handle;
+    (void)buffer;
+    ((bench_replay_t*)user)->written += size;
+    return size;
+}
+
+static void _bench_replay_close(void* user, void* file_handle)
+{
+    (void)user;
+    (void)file_handle;
+}
+
+static size_t _bench_replay_send(void* user, const uint8_t* data, size_t length)
+{
+    (void)user;
+    (void)data;
+    return length;
+}
+
+static size_t _bench_replay_receive(void* user, uint8_t* data, size_t max_length, uint32_t timeout_ms)
+{
+    bench_replay_t* replay = (bench_replay_t*)user;
+    size_t n = replay->length - replay->offset;
+    
+    /* Draining stale input must not eat the stream, only waits get it */
+    if (timeout_ms == 0) {
+        return 0;
+    }
+    if (n > max_length) {
+        n = max_length;
+    }
+    memcpy(data, replay->data + replay->offset, n);
+    replay->offset += n;
+    return n;
+}
+
+static void _bench_replay_delay(void* user, uint32_t ms)
+{
+    (void)user;
+    (void)ms;
+}
+
+static void _bench_replay_callbacks(ymodem_callbacks_t* callbacks, bench_replay_t* replay)
+{
+    memset(callbacks, 0, sizeof(*callbacks));
+    callbacks->file_open = _bench_replay_open;
+    callbacks->file_write = _bench_replay_write;
+    callbacks->file_close = _bench_replay_close;
+    callbacks->comm_send = _bench_replay_send;
+    callbacks->comm_receive = _bench_replay_receive;
+    callbacks->get_time_ms = _bench_get_time_ms;
+    callbacks->delay_ms = _bench_replay_delay;
+    callbacks->user = replay;
+}
+
+/**
+ * @brief Record what a sender puts on the line for one file of whole 1 KiB packets
+ * 
+ * @return size_t Bytes stored in stream
+ */
+static size_t _bench_parser_stream(uint8_t* stream, size_t packets)
+{
+    char info[64];
+    int info_length;
+    size_t length = 0;
+    size_t n;
+    
+    info_length = snprintf(info, sizeof(info), "%s%c%lu 14614336320 100644",
+                           BENCH_FILENAME, '\0', (unsigned long)(packets * YMODEM_STX_DATA_SIZE));
+    
+    memset(stream + 3, 0, YMODEM_SOH_DATA_SIZE);
+    memcpy(stream + 3, info, (size_t)info_length);
+    ymodem_frame_packet(stream, 0, YMODEM_SOH_DATA_SIZE);
+    length += YMODEM_SOH_PACKET_SIZE;
+    
+    for (n = 0; n < packets; n++) {
+        uint8_t* packet = stream + length;
+        size_t i;
+        for (i = 0; i < YMODEM_STX_DATA_SIZE; i++) {
+            packet[3 + i] = (uint8_t)((n * YMODEM_STX_DATA_SIZE + i) * 131u + 7u);
+        }
+        ymodem_frame_packet(packet, (uint8_t)(n + 1), YMODEM_STX_DATA_SIZE);
+        length += YMODEM_STX_PACKET_SIZE;
+    }
+    
+    /* EOT twice (NAK, ACK), then the null packet 0 that ends the batch */
+    stream[length++] = YMODEM_CODE_EOT;
+    stream[length++] = YMODEM_CODE_EOT;
+    memset(stream + length + 3, 0, YMODEM_SOH_DATA_SIZE);
+    ymodem_frame_packet(stream + length, 0, YMODEM_SOH_DATA_SIZE);
+    length += YMODEM_SOH_PACKET_SIZE;
+    
+    return length;
+}
+
+/* One pass of the blocking receiver over the stream, returns its time in us or 0 if it failed */
+static uint64_t _bench_parser_blocking(bench_replay_t* replay, uint8_t* buffer, size_t buffer_size)
+{
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    ymodem_file_info_t file_info;
+    uint64_t start_us;
+    int result;
+    
+    _bench_replay_callbacks(&callbacks, replay);
+    replay->offset = 0;
+    replay->written = 0;
+    
+    start_us = _bench_now_us();
+    result = ymodem_receive_init(&ctx, &callbacks, buffer, buffer_size, YMODEM_MODE_CRC);
+    if (result == YMODEM_ERR_NONE) {
+        result = ymodem_receive_file(&ctx, &file_info, 10);
+        ymodem_receive_cleanup(&ctx);
+    }
+    
+    return (result == YMODEM_ERR_NONE) ? _bench_now_us() - start_us + 1 : 0;
+}
+
+/* One pass of the event-driven receiver, the stream is fed in BENCH_PARSER_CHUNK pieces */
+static uint64_t _bench_parser_fsm(bench_replay_t* replay, uint8_t* buffer, size_t buffer_size)
+{
+    static ymodem_fsm_t fsm;
+    ymodem_callbacks_t callbacks;
+    uint8_t out[64];
+    uint64_t start_us;
+    uint32_t now;
+    int result;
+    
+    _bench_replay_callbacks(&callbacks, replay);
+    replay->offset = 0;
+    replay->written = 0;
+    
+    start_us = _bench_now_us();
+    now = _bench_get_time_ms(NULL);
+    result = ymodem_fsm_receive_init(&fsm, &callbacks, buffer, buffer_size, YMODEM_MODE_CRC, 10, now);
+    while (result == YMODEM_ERR_NONE || result == YMODEM_FSM_BUSY) {
+        size_t n = replay->length - replay->offset;
+    
+        while (ymodem_poll(&fsm, now, out, sizeof(out), NULL) > 0) {
+        }
+        result = ymodem_fsm_result(&fsm);
+        if (result != YMODEM_FSM_BUSY || n == 0) {
+            break;
+        }
+        if (n > BENCH_PARSER_CHUNK) {
+            n = BENCH_PARSER_CHUNK;
+        }
+        ymodem_feed(&fsm, replay->data + replay->offset, n, now);
+        replay->offset += n;
+    }
+    ymodem_fsm_cleanup(&fsm);
+    
+    return (result == YMODEM_ERR_NONE) ? _bench_now_us() - start_us + 1 : 0;
+}
+
+/* BENCH_PARSER_CALLS parses of packet 0 of the stream, returns the time in us */
+static uint64_t _bench_parser_info(bench_replay_t* replay, uint8_t* buffer, size_t buffer_size)
+{
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    ymodem_file_info_t file_info;
+    uint64_t start_us;
+    int i;
+    
+    _bench_replay_callbacks(&callbacks, replay);
+    if (ymodem_receive_init(&ctx, &callbacks, buffer, buffer_size, YMODEM_MODE_CRC) != YMODEM_ERR_NONE) {
+        return 0;
+    }
+    memcpy(buffer, replay->data, YMODEM_SOH_PACKET_SIZE);
+    
+    start_us = _bench_now_us();
+    for (i = 0; i < BENCH_PARSER_CALLS; i++) {
+        if (ymodem_parse_file_info(&ctx, &file_info) != YMODEM_ERR_NONE) {
+            return 0;
+        }
+    }
+    start_us = _bench_now_us() - start_us + 1;
+    ymodem_receive_cleanup(&ctx);
+    
+    return start_us;
+}
+
+/**
+ * @brief Compare the figures with a baseline file of "name value" lines
+ * 
+ * @return int Number of figures above BENCH_PARSER_TOLERANCE times their baseline, -1 if the file cannot be read
+ */
+static int _bench_parser_check(const char* path, const bench_figure_t* figures, size_t count)
+{
+    char line[128];
+    int slower = 0;
+    FILE* f = fopen(path, "r");
+    
+    if (f == NULL) {
+        fprintf(stderr, "cannot read %s\n", path);
+        return -1;
+    }
+    
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[64];
+        double baseline;
+        size_t i;
+    
+        if (line[0] == '#' || sscanf(line, "%63s %lf", name, &baseline) != 2 || baseline <= 0) {
+            continue;
+        }
+        for (i = 0; i < count; i++) {
+            double ratio;
+            if (strcmp(figures[i].name, name) != 0) {
+                continue;
+            }
+            ratio = figures[i].value / baseline;
+            printf("  %-22s %10.1f  baseline %10.1f  %5.2fx%s\n", name, figures[i].value, baseline, ratio,
+                   (ratio > BENCH_PARSER_TOLERANCE) ? "  SLOWER" : "");
+            if (ratio > BENCH_PARSER_TOLERANCE) {
+                slower++;
+            }
+        }
+    }
+    fclose(f);
+    
+    return slower;
+}
+
+/* Store the figures as a new baseline */
+static int _bench_parser_write(const char* path, const bench_figure_t* figures, size_t count)
+{
+    FILE* f = fopen(path, "w");
+    size_t i;
+    
+    if (f == NULL) {
+        fprintf(stderr, "cannot write %s\n", path);
+        return -1;
+    }
+    fprintf(f, "# Parser benchmark baseline (ymodem_bench -p -W), ns per call or packet, lower is better.\n");
+    fprintf(f, "# ymodem_bench -p -B fails when a figure exceeds its baseline by more than %.1fx.\n",
+            BENCH_PARSER_TOLERANCE);
+    for (i = 0; i < count; i++) {
+        fprintf(f, "%s %.1f\n", figures[i].name, figures[i].value);
+    }
+    fclose(f);
+    
+    return 0;
+}
+
+/**
+ * @brief Time packet 0 parsing and both receivers on a replayed stream
+ * 
+ * @param baseline Baseline file to compare with, NULL for none
+ * @param record File to store the figures in as a new baseline, NULL for none
+ * @return int 0 if every run succeeded and no figure regressed
+ */
+static int _bench_parser(const char* baseline, const char* record)
+{
+    static uint8_t buffer[YMODEM_MAX_PACKET_SIZE];
+    bench_replay_t replay;
+    bench_figure_t figures[3];
+    uint64_t best_info = 0;
+    uint64_t best_blocking = 0;
+    uint64_t best_fsm = 0;
+    uint8_t* stream;
+    int failed = 0;
+    int round;
+    
+    stream = (uint8_t*)malloc(2 * YMODEM_SOH_PACKET_SIZE + BENCH_PARSER_PACKETS * YMODEM_STX_PACKET_SIZE + 2);
+    if (stream == NULL) {
+        return 1;
+    }
+    memset(&replay, 0, sizeof(replay));
+    replay.data = stream;
+    replay.length = _bench_parser_stream(stream, BENCH_PARSER_PACKETS);
+    
+    for (round = 0; round < BENCH_PARSER_ROUNDS; round++) {
+        uint64_t us = _bench_parser_info(&replay, buffer, sizeof(buffer));
+        if (us == 0) {
+            failed = 1;
+        } else if (best_info == 0 || us < best_info) {
+            best_info = us;
+        }
+    
+        us = _bench_parser_blocking(&replay, buffer, sizeof(buffer));
+        if (us == 0 || replay.written != (uint64_t)BENCH_PARSER_PACKETS * YMODEM_STX_DATA_SIZE) {
+            failed = 1;
+        } else if (best_blocking == 0 || us < best_blocking) {
+            best_blocking = us;
+        }
+    
+        us = _bench_parser_fsm(&replay, buffer, sizeof(buffer));
+        if (us == 0 || replay.written != (uint64_t)BENCH_PARSER_PACKETS * YMODEM_STX_DATA_SIZE) {
+            failed = 1;
+        } else if (best_fsm == 0 || us < best_fsm) {
+            best_fsm = us;
+        }
+    }
+    free(stream);
+    
+    if (failed) {
+        printf("Parser: a replayed transfer FAILED\n");
+        return 1;
+    }
+    
+    figures[0].name = "parse_file_info_ns";
+    figures[0].value = (double)best_info * 1000.0 / BENCH_PARSER_CALLS;
+    figures[1].name = "receive_packet_ns";
+    figures[1].value = (double)best_blocking * 1000.0 / BENCH_PARSER_PACKETS;
+    figures[2].name = "fsm_packet_ns";
+    figures[2].value = (double)best_fsm * 1000.0 / BENCH_PARSER_PACKETS;
+    
+    printf("Parser (%d x 1 KiB packets, best of %d):\n", BENCH_PARSER_PACKETS, BENCH_PARSER_ROUNDS);
+    printf("  packet 0 parse:  %8.1f ns/call\n", figures[0].value);
+    printf("  blocking:        %8.1f ns/packet %9.1f MB/s\n", figures[1].value,
+           YMODEM_STX_DATA_SIZE * 1000.0 / figures[1].value);
+    printf("  event-driven:    %8.1f ns/packet %9.1f MB/s\n", figures[2].value,
+           YMODEM_STX_DATA_SIZE * 1000.0 / figures[2].value);
+    
+    if (record != NULL && _bench_parser_write(record, figures, 3) != 0) {
+        return 1;
+    }
+    if (baseline != NULL) {
+        int slower;
+        printf("Against %s (fails above %.1fx):\n", baseline, BENCH_PARSER_TOLERANCE);
+        slower = _bench_parser_check(baseline, figures, 3);
+        if (slower != 0) {
+            printf("Parser: %s\n", (slower < 0) ? "no baseline" : "REGRESSION");
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+static void _bench_header(void)
+{
+    printf("%-22s %8s %9s %9s %7s %7s %7s %7s  %s\n",
+           "scenario", "KiB", "MB/s", "pkt/s", "retry", "crcerr", "tmo", "rtt ms", "result");
+}
+
+/* The default set: the engine alone, then a fast serial line clean and noisy */
+static const bench_config_t _bench_suite[] = {
+    /* name                  baud     lat  ber    drop   len  KiB   mode            win  blk  adapt  digest */
+    { "loopback",           0,       0,   0,     0,     0,   4096, YMODEM_MODE_CRC, 0,   0,   false, YMODEM_DIGEST_NONE },
+    { "loopback window 8",  0,       0,   0,     0,     0,   4096, YMODEM_MODE_CRC, 8,   0,   false, YMODEM_DIGEST_NONE },
+    { "loopback G",         0,       0,   0,     0,     0,   4096, YMODEM_MODE_G,   0,   0,   false, YMODEM_DIGEST_NONE },
+    { "loopback 32K",       0,       0,   0,     0,     0,   4096, YMODEM_MODE_CRC, 0,   32,  false, YMODEM_DIGEST_NONE },
+    { "921600 5ms",         921600,  5,   0,     0,     0,   256,  YMODEM_MODE_CRC, 0,   0,   false, YMODEM_DIGEST_NONE },
+    { "921600 5ms window 8", 921600, 5,   0,     0,     0,   256,  YMODEM_MODE_CRC, 8,   0,   false, YMODEM_DIGEST_NONE },
+    { "921600 5ms G",       921600,  5,   0,     0,     0,   256,  YMODEM_MODE_G,   0,   0,   false, YMODEM_DIGEST_NONE },
+    { "loopback sha256",    0,       0,   0,     0,     0,   4096, YMODEM_MODE_CRC, 0,   0,   false, YMODEM_DIGEST_SHA256 },
+    { "921600 5ms 8K",      921600,  5,   0,     0,     0,   256,  YMODEM_MODE_CRC, 0,   8,   false, YMODEM_DIGEST_NONE },
+    { "921600 ber 1e-5",    921600,  5,   1e-5,  0,     0,   256,  YMODEM_MODE_CRC, 0,   0,   false, YMODEM_DIGEST_NONE },
+    { "921600 ber 1e-5 adapt", 921600, 5, 1e-5,  0,     0,   256,  YMODEM_MODE_CRC, 0,   0,   true,  YMODEM_DIGEST_NONE },
+    { "921600 ber 1e-5 win 8", 921600, 5, 1e-5,  0,     0,   256,  YMODEM_MODE_CRC, 8,   0,   false, YMODEM_DIGEST_NONE },
+    { "921600 ber 1e-5 sha256", 921600, 5, 1e-5, 0,     0,   256,  YMODEM_MODE_CRC, 0,   0,   false, YMODEM_DIGEST_SHA256 },
+    { "921600 drops adapt", 921600,  5,   0,     0.005, 64,  128,  YMODEM_MODE_CRC, 0,   0,   true,  YMODEM_DIGEST_NONE },
+    { "921600 drops win 8", 921600,  5,   0,     0.005, 64,  128,  YMODEM_MODE_CRC, 8,   0,   false, YMODEM_DIGEST_NONE },
+};
+
+/* Multiplexed runs after the suite, the firmware channel takes the file size */
+static const bench_config_t _bench_mux_suite[] = {
+    { "921600 5ms mux",     921600,  5,   0,     0,     0,   256,  YMODEM_MODE_CRC, 0,   0,   false, YMODEM_DIGEST_NONE },
+    { "921600 ber 1e-5 mux", 921600, 5,   1e-5,  0,     0,   256,  YMODEM_MODE_CRC, 0,   0,   false, YMODEM_DIGEST_NONE },
+};
+
+/* Round trips over real files after the mux runs, one per optional feature */
+static const bench_trip_t _bench_trips[] = {
+    /* name                  KiB   lz     delta  resume cut  ahead  digest */
+    { "lz",                 256,  true,  false, false, 0,   false, YMODEM_DIGEST_NONE },
+    { "resume after cut",   256,  false, false, true,  100, false, YMODEM_DIGEST_NONE },
+    { "delta",              256,  false, true,  false, 0,   false, YMODEM_DIGEST_NONE },
+    { "delta after cut",    256,  false, true,  false, 8,   false, YMODEM_DIGEST_NONE },
+    { "delta sha256",       256,  false, true,  false, 0,   false, YMODEM_DIGEST_SHA256 },
+    { "resume read-ahead",  256,  false, false, true,  100, true,  YMODEM_DIGEST_SHA256 },
+    { "delta read-ahead",   256,  false, true,  false, 0,   true,  YMODEM_DIGEST_SHA256 },
+};
+
+static void _bench_trip_header(void)
+{
+    printf("%-22s %8s %9s %9s %9s  %s\n",
+           "round trip", "KiB", "resumed", "skipped", "lz wire", "result");
+}
+
+static void _bench_usage(const char* program)
+{
+    printf("Usage: %s [options]   (no options runs the standard suite)\n", program);
+    printf("  -b N   baud rate, 0 for no serialization delay (default 0)\n");
+    printf("  -l N   one-way latency in ms (default 0)\n");
+    printf("  -e X   bit error rate, e.g. 1e-5 (default 0)\n");
+    printf("  -d X   chance that a write loses a burst (default 0)\n");
+    printf("  -D N   bytes lost in a burst (default 64)\n");
+    printf("  -s N   file size in KiB (default 1024)\n");
+    printf("  -w N   keep N packets in flight\n");
+    printf("  -g     YMODEM-G\n");
+    printf("  -L N   8 or 32 KiB blocks\n");
+    printf("  -a     adaptive packet size and timeouts\n");
+    printf("  -v D   send and check a whole-file digest, crc32 or sha256\n");
+    printf("  -m     three multiplexed channels over the link (stop-and-wait only)\n");
+    printf("  -t     only the round trips over real files in /tmp (compression, delta, resume)\n");
+    printf("  -p     time the packet parser on a replayed stream, no link\n");
+    printf("  -B F   with -p, fail if a figure is %.1fx above its value in baseline file F\n", BENCH_PARSER_TOLERANCE);
+    printf("  -W F   with -p, store the figures in F as a new baseline\n");
+    printf("  -S N   seed of the error generator (default 1)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    bench_config_t config = { "custom", 0, 0, 0, 0, 64, 1024, YMODEM_MODE_CRC, 0, 0, false, YMODEM_DIGEST_NONE };
+    uint64_t seed = 1;
+    bool mux = false;
+    bool parser = false;
+    bool trips = false;
+    const char* baseline = NULL;
+    const char* record = NULL;
+    int failed = 0;
+    size_t n;
+    int i;
+    
+    for (i = 1; i < argc; i++) {
+        bool has_value = (i + 1 < argc);
+        if (strcmp(argv[i], "-b") == 0 && has_value) {
+            config.baud = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-l") == 0 && has_value) {
+            config.latency_ms = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-e") == 0 && has_value) {
+            config.ber = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && has_value) {
+            config.drop_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-D") == 0 && has_value) {
+            config.drop_len = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-s") == 0 && has_value) {
+            config.size_kib = (size_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-w") == 0 && has_value) {
+            config.window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-g") == 0) {
+            config.mode = YMODEM_MODE_G;
+        } else if (strcmp(argv[i], "-L") == 0 && has_value) {
+            config.large_kib = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-a") == 0) {
+            config.adaptive = true;
+        } else if (strcmp(argv[i], "-v") == 0 && has_value) {
+            i++;
+            config.digest = ymodem_digest_parse(argv[i], strlen(argv[i]));
+        } else if (strcmp(argv[i], "-m") == 0) {
+            mux = true;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            trips = true;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            parser = true;
+        } else if (strcmp(argv[i], "-B") == 0 && has_value) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "-W") == 0 && has_value) {
+            record = argv[++i];
+        } else if (strcmp(argv[i], "-S") == 0 && has_value) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else {
+            _bench_usage(argv[0]);
+            return (strcmp(argv[i], "-h") == 0) ? 0 : 2;
+        }
+    }
+    if (seed == 0) {
+        seed = 1;  /* xorshift never leaves 0 */
+    }
+    
+    if (parser) {
+        return _bench_parser(baseline, record);
+    }
+    
+    if (trips) {
+        _bench_trip_header();
+        for (n = 0; n < sizeof(_bench_trips) / sizeof(_bench_trips[0]); n++) {
+            failed += _bench_trip(&_bench_trips[n]);
+        }
+        return failed ? 1 : 0;
+    }
+    
+    _bench_crc();
+    if (!mux) {
+        _bench_header();
+    }
+    
+    if (argc > 1) {
+        return mux ? _bench_mux(&config, seed) : _bench_run(&config, seed);
+    }
+    
+    for (n = 0; n < sizeof(_bench_suite) / sizeof(_bench_suite[0]); n++) {
+        failed += _bench_run(&_bench_suite[n], seed);
+    }
+    for (n = 0; n < sizeof(_bench_mux_suite) / sizeof(_bench_mux_suite[0]); n++) {
+        printf("\n");
+        failed += _bench_mux(&_bench_mux_suite[n], seed);
+    }
+    
+    printf("\n");
+    _bench_trip_header();
+    for (n = 0; n < sizeof(_bench_trips) / sizeof(_bench_trips[0]); n++) {
+        failed += _bench_trip(&_bench_trips[n]);
+    }
+    
+    return failed ? 1 : 0;
+}
@@ -1,154 +1,254 @@
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200112L
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
-#include <termios.h>
 #include <sys/stat.h>
 #include <string.h>  /* For memcpy, strcpy, strcmp */
 #include "ymodem_common.h"
 #include "ymodem_send.h"
 #include "ymodem_receive.h"
-#include <sys/select.h>
+#include "ymodem_readahead.h"
+#include "ymodem_mmap.h"
+#include "ymodem_serial.h"
+#include "ymodem_net.h"
 
 // 文件操作回调
-void* file_open_callback(const char* filename, bool writing) {
+void* file_open_callback(void* user, const char* filename, enum ymodem_open_mode mode) {
+    (void)user;
     FILE* file;
-    if (writing) {
+    if (mode == YMODEM_OPEN_WRITE) {
         file = fopen(filename, "wb");
+    } else if (mode == YMODEM_OPEN_RESUME) {
+        file = fopen(filename, "r+b");  // 续传：保留已有内容
     } else {
         file = fopen(filename, "rb");
     }
     return file;
 }
 
-size_t file_read_callback(void* file_handle, uint8_t* buffer, size_t size) {
+size_t file_read_callback(void* user, void* file_handle, uint8_t* buffer, size_t size) {
+    (void)user;
     return fread(buffer, 1, size, (FILE*)file_handle);
 }
 
-size_t file_write_callback(void* file_handle, const uint8_t* buffer, size_t size) {
+size_t file_write_callback(void* user, void* file_handle, const uint8_t* buffer, size_t size) {
+    (void)user;
     return fwrite(buffer, 1, size, (FILE*)file_handle);
 }
 
-void file_close_callback(void* file_handle) {
+void file_close_callback(void* user, void* file_handle) {
+    (void)user;
     fclose((FILE*)file_handle);
 }
 
-int file_size_callback(void* file_handle) {
+// 把数据刷到存储介质上
+int file_sync_callback(void* user, void* file_handle) {
+    (void)user;
     FILE* file = (FILE*)file_handle;
-    long current_pos = ftell(file);
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, current_pos, SEEK_SET);
-    return (int)size;
+    if (fflush(file) != 0) {
+        return -1;
+    }
+    return fsync(fileno(file));
 }
 
-// 串口通信回调
-int serial_fd = -1;
+int64_t file_size_callback(void* user, void* file_handle) {
+    (void)user;
+    FILE* file = (FILE*)file_handle;
+    off_t current_pos = ftello(file);
+    // 管道等无法定位的输入（例如 zstd -dc 的输出）按未知长度流式发送
+    if (current_pos < 0 || fseeko(file, 0, SEEK_END) != 0) {
+        return YMODEM_FILE_SIZE_UNKNOWN;
+    }
+    off_t size = ftello(file);
+    fseeko(file, current_pos, SEEK_SET);
+    return (int64_t)size;
+}
 
-size_t comm_send_callback(const uint8_t* data, size_t length) {
-    return write(serial_fd, data, length);
+// 续传时定位到已接收/待发送的位置
+int file_seek_callback(void* user, void* file_handle, uint64_t offset) {
+    (void)user;
+    return fseeko((FILE*)file_handle, (off_t)offset, SEEK_SET);
 }
 
-// 时间处理回调
-uint32_t get_time_ms_callback(void) {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+// 修改时间和权限写入packet 0
+int file_stat_callback(void* user, void* file_handle, uint64_t* mtime, uint32_t* mode) {
+    (void)user;
+    struct stat st;
+    if (fstat(fileno((FILE*)file_handle), &st) != 0) {
+        return -1;
+    }
+    *mtime = st.st_mtime > 0 ? (uint64_t)st.st_mtime : 0;
+    *mode = (uint32_t)st.st_mode;
+    return 0;
 }
 
-size_t comm_receive_callback(uint8_t* data, size_t max_length, uint32_t timeout_ms) {
-    // 在阻塞模式下，我们可以使用select来实现超时
-    fd_set fds;
-    struct timeval tv;
-    size_t total_received = 0;
-    
-    while (total_received < max_length) {
-        FD_ZERO(&fds);
-        FD_SET(serial_fd, &fds);
-        
-        // 设置select超时
-        tv.tv_sec = timeout_ms / 1000;
-        tv.tv_usec = (timeout_ms % 1000) * 1000;
-        
-        int ret = select(serial_fd + 1, &fds, NULL, NULL, &tv);
-        
-        if (ret <= 0) {
-            // 超时或错误
-            break;
-        }
-        
-        // 阻塞读取，但有select超时保护
-        ssize_t bytes_read = read(serial_fd, data + total_received, max_length - total_received);
-        
-        if (bytes_read <= 0) {
-            // 读取错误
-            break;
+// 命令行选项
+typedef struct {
+    enum ymodem_mode mode;      // -g: YMODEM-G 流式模式
+    int              window;    // -w N: 发送端滑动窗口包数
+    int              readahead; // -r N: 发送端后台线程预读 N 个数据块
+    int              chunk;     // -b N: 接收端写缓冲块大小（字节）
+    bool             sync;      // -s: 接收完成后 fsync
+    bool             mmap;      // -m: 使用内存映射文件代替 stdio
+    bool             resume;    // -c: 发送端提供续传，接收端记录日志并续传中断的文件
+    bool             adaptive;  // -a: 发送端按链路质量调整包长和超时
+    int              large;     // -L N: 协商 N KiB 大数据块（8 或 32）
+    bool             progress;  // -p: 每秒打印一次传输进度
+    int              trace;     // -t N: 把 N 级及以下的跟踪记入环形缓冲，结束后打印
+    int              interval;  // -i N: 接收端每 N 毫秒发一次 'C'
+    bool             fast;      // -f: 发送端认为对方已在等待，不等 'C' 直接发包0
+    int              baud;      // -B N: 波特率，非标准值在 Linux 上通过 termios2 设置
+    bool             flow;      // -H: RTS/CTS 硬件流控
+    bool             low_latency; // -l: 低延迟模式和 FTDI latency timer
+    bool             compress;  // -z: 对方同意时压缩文件数据
+    bool             delta;     // -d: 接收端已有旧文件时只传变化的块
+    bool             verify;    // -v: 传输时计算整个文件的 SHA-256，收完即已校验
+} demo_options_t;
+
+// 串口或网络连接（tcp://、rfc2217://、udp://）
+typedef struct {
+    bool             is_net;
+    ymodem_serial_t  serial;
+    ymodem_net_t     net;
+} demo_port_t;
+
+// 按命令行选项打开并设置端口
+int open_port(demo_port_t* port, const char* path, const demo_options_t* opts) {
+    port->is_net = (strstr(path, "://") != NULL);
+    if (port->is_net) {
+        // RFC 2217 时 -B 和 -H 设置的是终端服务器上的串口
+        ymodem_net_config_t config;
+        ymodem_net_default_config(&config);
+        config.baud = (opts->baud > 0) ? (uint32_t)opts->baud : 0;
+        config.flow_control = opts->flow;
+        if (ymodem_net_open(&port->net, path, &config) != YMODEM_ERR_NONE) {
+            printf("Failed to connect to %s\n", path);
+            return -1;
         }
-        
-        total_received += bytes_read;
-        
-        // 如果我们只是想读取任何可用数据，可以在这里立即返回
-        // 如果我们需要满足特定长度的读取，保持循环直到达到长度或超时
-        // 根据YMODEM实现的需要决定策略
-        
-        // 简单优化：如果只请求一个字节，并且我们已经读取了一个字节，直接返回
-        if (max_length == 1 && total_received == 1) {
-            break;
+        if (port->net.kind == YMODEM_NET_RFC2217) {
+            if (port->net.server_baud != 0) {
+                printf("Server port at %u baud\n", port->net.server_baud);
+            } else {
+                printf("Server did not answer the COM-PORT-OPTION\n");
+            }
         }
+        return 0;
+    }
+    
+    ymodem_serial_config_t config;
+    ymodem_serial_default_config(&config);
+    if (opts->baud > 0) {
+        config.baud = (uint32_t)opts->baud;
     }
+    config.flow_control = opts->flow;
+    config.low_latency = opts->low_latency;
     
-    return total_received;
+    if (ymodem_serial_open(&port->serial, path, &config) != YMODEM_ERR_NONE) {
+        printf("Failed to open serial port %s at %u baud\n", path, config.baud);
+        return -1;
+    }
+    if (opts->low_latency) {
+        printf("Low latency %s, latency timer %s\n", port->serial.low_latency_set ? "on" : "not supported",
+               port->serial.latency_timer_set ? "1 ms" : "unchanged");
+    }
+    return 0;
 }
 
-void delay_ms_callback(uint32_t ms) {
-    usleep(ms * 1000);
+void port_set_callbacks(demo_port_t* port, ymodem_callbacks_t* callbacks) {
+    if (port->is_net) {
+        ymodem_net_set_callbacks(&port->net, callbacks);
+    } else {
+        ymodem_serial_set_callbacks(&port->serial, callbacks);
+    }
 }
 
-// 打开串口
-int open_serial_port(const char* port) {
-    // 移除O_NONBLOCK标志
-    int fd = open(port, O_RDWR | O_NOCTTY);
-    if (fd == -1) {
-        perror("open_serial_port: Unable to open port");
-        return -1;
+void close_port(demo_port_t* port) {
+    if (port->is_net) {
+        ymodem_net_close(&port->net);
+    } else {
+        ymodem_serial_close(&port->serial);
+    }
+}
+
+// 跟踪环形缓冲：传输中只做内存拷贝，不会拖慢收发
+static char trace_storage[8192];
+static ymodem_trace_ring_t trace_ring;
+
+void setup_trace(ymodem_context_t* ctx, const demo_options_t* opts) {
+    if (opts->trace <= 0) {
+        return;
+    }
+    ymodem_trace_ring_init(&trace_ring, trace_storage, sizeof(trace_storage));
+    if (ymodem_set_trace(ctx, ymodem_trace_ring_sink, &trace_ring, opts->trace) != YMODEM_ERR_NONE) {
+        printf("Invalid trace level %d\n", opts->trace);
+    }
+}
+
+// 握手：更密的 'C' 和不等 'C' 的快速开始，适合产线上的短会话
+void setup_handshake(ymodem_context_t* ctx, const demo_options_t* opts) {
+    if (opts->interval <= 0 && !opts->fast) {
+        return;
+    }
+    if (ymodem_set_handshake(ctx, (uint32_t)(opts->interval > 0 ? opts->interval : 0), 0, opts->fast) != YMODEM_ERR_NONE) {
+        printf("Cannot set handshake options\n");
     }
-    
-    struct termios options;
-    tcgetattr(fd, &options);
-    
-    // 设置波特率
-    cfsetispeed(&options, B115200);
-    cfsetospeed(&options, B115200);
-    
-    // 设置为原始模式
-    options.c_cflag |= (CLOCAL | CREAD);
-    options.c_cflag &= ~PARENB;
-    options.c_cflag &= ~CSTOPB;
-    options.c_cflag &= ~CSIZE;
-    options.c_cflag |= CS8;
-    options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-    options.c_iflag &= ~(IXON | IXOFF | IXANY);
-    options.c_oflag &= ~OPOST;
-    
-    // 设置阻塞读取的超时
-    // 这里设置了一个非零的VMIN，表示至少要读取一个字符
-    // 并设置了VTIME为超时时间（单位为0.1秒）
-    options.c_cc[VMIN] = 1;    // 至少读取1个字符
-    options.c_cc[VTIME] = 1;   // 0.1秒超时
-    
-    tcsetattr(fd, TCSANOW, &options);
-    
-    return fd;
 }
 
-int ymodem_send_test(const char* serial_port, const char* filename) {
-    // 打开串口
-    serial_fd = open_serial_port(serial_port);
-    if (serial_fd < 0) {
-        printf("Failed to open serial port %s\n", serial_port);
+void dump_trace(const demo_options_t* opts) {
+    static char text[sizeof(trace_storage) + 1];
+    if (opts->trace <= 0) {
+        return;
+    }
+    ymodem_trace_ring_read(&trace_ring, text, sizeof(text));
+    printf("Trace (latest messages):\n%s", text);
+}
+
+// 进度回调：阶段变化时和传输中每秒调用一次
+void progress_callback(void* user, enum ymodem_stage stage, const ymodem_stats_t* stats) {
+    (void)user;
+    printf("[%s] %llu bytes, %u B/s, %u retries, %u CRC errors, %u timeouts\n",
+           ymodem_stage_to_str(stage), (unsigned long long)stats->payload_bytes, stats->effective_bps,
+           stats->retries, stats->crc_errors, stats->timeouts);
+}
+
+// 传输结束后打印统计：链路噪声（重传、CRC错误）和文件读写耗时分开显示
+void print_stats(const ymodem_stats_t* stats) {
+    printf("Statistics: %llu file bytes in %u ms (%u B/s effective, %u B/s on the link)\n",
+           (unsigned long long)stats->payload_bytes, stats->elapsed_ms, stats->effective_bps, stats->raw_bps);
+    printf("  packets sent %u, received %u, retries %u, NAKs %u\n",
+           stats->packets_sent, stats->packets_received, stats->retries, stats->naks);
+    printf("  CRC errors %u, sequence errors %u, timeouts %u\n",
+           stats->crc_errors, stats->seq_errors, stats->timeouts);
+    if (stats->rtt_samples > 0) {
+        printf("  ACK round trip min/avg/max %u/%u/%u ms\n", stats->rtt_min_ms, stats->rtt_avg_ms, stats->rtt_max_ms);
+    }
+    printf("  file I/O %u ms, transmitting %u ms\n", stats->file_ms, stats->stage_ms[YMODEM_STAGE_TRANSMITTING]);
+    if (stats->lz_file_bytes > 0) {
+        printf("  compressed %llu file bytes to %llu on the link (%u%%)\n", (unsigned long long)stats->lz_file_bytes,
+               (unsigned long long)stats->lz_wire_bytes, (unsigned int)(stats->lz_wire_bytes * 100 / stats->lz_file_bytes));
+    }
+    if (stats->delta_skipped_bytes > 0) {
+        printf("  skipped %llu unchanged bytes\n", (unsigned long long)stats->delta_skipped_bytes);
+    }
+}
+
+// 压缩状态：编码器约 14 KiB，解码器就是它的窗口
+static ymodem_lz_encoder_t lz_encoder;
+static ymodem_lz_decoder_t lz_decoder;
+
+// 增量传输的块表：每 KiB 一个 CRC32，256 KiB 覆盖 64 MiB，更大的文件后面部分照常发送
+static uint32_t delta_map[65536];
+
+// 整个文件的摘要状态
+static ymodem_digest_t digest;
+
+int ymodem_send_test(const char* serial_port, const char* const* filenames, size_t file_count, const demo_options_t* opts) {
+    // 打开端口，端口对象同时是所有回调的 user
+    demo_port_t port;
+    if (open_port(&port, serial_port, opts) != 0) {
         return -1;
     }
     
@@ -159,52 +259,133 @@ int ymodem_send_test(const char* serial_port, const char* filename) {
         .file_write = file_write_callback,
         .file_close = file_close_callback,
         .file_size = file_size_callback,
-        .comm_send = comm_send_callback,
-        .comm_receive = comm_receive_callback,
-        .get_time_ms = get_time_ms_callback,
-        .delay_ms = delay_ms_callback
+        .file_sync = file_sync_callback,
+        .file_seek = file_seek_callback,
+        .file_stat = file_stat_callback,
     };
+    port_set_callbacks(&port, &callbacks);
+    if (opts->mmap) {
+        ymodem_mmap_set_callbacks(&callbacks);
+    }
+    
+    // 可选的预读：后台线程在数据包传输期间读取后续数据
+    ymodem_readahead_t readahead;
+    uint8_t* ring = NULL;
+    if (opts->readahead > 1) {
+        ring = (uint8_t*)malloc((size_t)opts->readahead * YMODEM_STX_DATA_SIZE);
+        if (ymodem_readahead_init(&readahead, &callbacks, ring, YMODEM_STX_DATA_SIZE,
+                                  (size_t)opts->readahead, true, &callbacks) != YMODEM_ERR_NONE) {
+            printf("Invalid read-ahead depth %d\n", opts->readahead);
+        }
+    }
     
-    // 分配缓冲区
-    uint8_t* buffer = (uint8_t*)malloc(YMODEM_MAX_PACKET_SIZE);
-    uint8_t* send_buffer = (uint8_t*)malloc(YMODEM_MAX_PACKET_SIZE);
+    // 分配缓冲区（大数据块需要能容纳整个块）
+    size_t buffer_size = (opts->large > 0) ? YMODEM_MAX_BLK_PACKET_SIZE : YMODEM_MAX_PACKET_SIZE;
+    uint8_t* buffer = (uint8_t*)malloc(buffer_size);
     
     // 初始化YMODEM上下文
     ymodem_context_t ctx;
-    int ret = ymodem_send_init(&ctx, &callbacks, buffer, YMODEM_MAX_PACKET_SIZE, 
-                               send_buffer, YMODEM_MAX_PACKET_SIZE);
+    int ret = ymodem_send_init(&ctx, &callbacks, buffer, buffer_size, opts->mode);
     if (ret != YMODEM_ERR_NONE) {
         printf("Failed to initialize YMODEM context: %d\n", ret);
-        close(serial_fd);
+        close_port(&port);
         free(buffer);
-        free(send_buffer);
+        free(ring);
         return -1;
     }
     
-    // 发送文件
-    printf("Sending file %s...\n", filename);
-    ret = ymodem_send_file(&ctx, filename, 10); // 10秒握手超时
+    // 可选的滑动窗口
+    uint8_t* window_buffer = NULL;
+    if (opts->window > 1) {
+        window_buffer = (uint8_t*)malloc((size_t)opts->window * YMODEM_MAX_PACKET_SIZE);
+        ret = ymodem_send_set_window(&ctx, window_buffer, (size_t)opts->window * YMODEM_MAX_PACKET_SIZE,
+                                     (uint8_t)opts->window);
+        if (ret != YMODEM_ERR_NONE) {
+            printf("Invalid window size %d: %d\n", opts->window, ret);
+        }
+    }
+    
+    // 可选的续传：接收端保留了部分文件时从其偏移继续发送
+    if (opts->resume && ymodem_send_set_resume(&ctx, true) != YMODEM_ERR_NONE) {
+        printf("Resuming needs a seekable source\n");
+    }
+    
+    // 可选的自适应：噪声大时改用 128 字节包，超时按实测往返时间计算
+    if (opts->adaptive) {
+        ymodem_send_set_adaptive(&ctx, true);
+    }
+    
+    // 可选的大数据块：接收端同意时使用 8/32 KiB 的 BLK 包
+    if (opts->large > 0 && ymodem_send_set_large_blocks(&ctx, (size_t)opts->large * 1024) != YMODEM_ERR_NONE) {
+        printf("Invalid block size %d KiB\n", opts->large);
+    }
+    
+    // 可选的压缩：接收端同意时发送压缩后的数据
+    if (opts->compress) {
+        ymodem_send_set_compression(&ctx, &lz_encoder);
+    }
+    
+    // 可选的增量传输：接收端发来旧文件的块表，相同的块只发一个跳过帧
+    if (opts->delta) {
+        ymodem_send_set_delta(&ctx, delta_map, sizeof(delta_map) / sizeof(delta_map[0]));
+    }
+    
+    // 可选的整文件校验：边读边算 SHA-256，最后一个数据包之后发给接收端核对
+    if (opts->verify) {
+        ymodem_send_set_digest(&ctx, &digest, YMODEM_DIGEST_SHA256);
+    }
+    
+    if (opts->progress) {
+        ymodem_set_progress(&ctx, progress_callback, 1000);
+    }
+    setup_trace(&ctx, opts);
+    setup_handshake(&ctx, opts);
+    
+    // 发送文件（多个文件在同一个批处理会话中发送）
+    printf("Sending %zu file(s), first %s...\n", file_count, filenames[0]);
+    ret = ymodem_send_files(&ctx, filenames, file_count, 10); // 10秒握手超时
     
     if (ret == YMODEM_ERR_NONE) {
         printf("File sent successfully.\n");
     } else {
         printf("Failed to send file: %d\n", ret);
     }
+    print_stats(ymodem_get_stats(&ctx));
+    dump_trace(opts);
     
     // 清理资源
     ymodem_send_cleanup(&ctx);
-    close(serial_fd);
+    close_port(&port);
     free(buffer);
-    free(send_buffer);
+    free(window_buffer);
+    free(ring);
     
     return ret;
 }
 
-int ymodem_receive_test(const char* serial_port, const char* save_path) {
-    // 打开串口
-    serial_fd = open_serial_port(serial_port);
-    if (serial_fd < 0) {
-        printf("Failed to open serial port %s\n", serial_port);
+// 批处理中每收完一个文件调用一次
+int file_done_callback(void* user, const ymodem_file_info_t* file_info) {
+    (void)user;
+    printf("File received successfully: %s, size: %llu bytes", file_info->filename,
+           (unsigned long long)file_info->filesize);
+    if (file_info->resumed > 0) {
+        printf(" (resumed after %llu bytes)", (unsigned long long)file_info->resumed);
+    }
+    printf("\n");
+    if (file_info->verified != YMODEM_DIGEST_NONE) {
+        printf("  %s verified: ", ymodem_digest_name(file_info->verified));
+        for (size_t i = 0; i < ymodem_digest_size(file_info->verified); i++) {
+            printf("%02x", file_info->digest[i]);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+int ymodem_receive_test(const char* serial_port, const char* save_path, const demo_options_t* opts) {
+    // 打开端口，端口对象同时是所有回调的 user
+    demo_port_t port;
+    if (open_port(&port, serial_port, opts) != 0) {
         return -1;
     }
     
@@ -215,47 +396,90 @@ int ymodem_receive_test(const char* serial_port, const char* save_path) {
         .file_write = file_write_callback,
         .file_close = file_close_callback,
         .file_size = file_size_callback,
-        .comm_send = comm_send_callback,
-        .comm_receive = comm_receive_callback,
-        .get_time_ms = get_time_ms_callback,
-        .delay_ms = delay_ms_callback
+        .file_sync = file_sync_callback,
+        .file_seek = file_seek_callback,
+        .file_stat = file_stat_callback,
     };
+    port_set_callbacks(&port, &callbacks);
+    if (opts->mmap) {
+        ymodem_mmap_set_callbacks(&callbacks);
+    }
     
-    // 分配缓冲区
-    uint8_t* buffer = (uint8_t*)malloc(YMODEM_MAX_PACKET_SIZE);
+    // 分配缓冲区（大数据块需要能容纳整个块）
+    size_t buffer_size = (opts->large > 0) ? YMODEM_MAX_BLK_PACKET_SIZE : YMODEM_MAX_PACKET_SIZE;
+    uint8_t* buffer = (uint8_t*)malloc(buffer_size);
     
     // 初始化YMODEM上下文
     ymodem_context_t ctx;
-    int ret = ymodem_receive_init(&ctx, &callbacks, buffer, YMODEM_MAX_PACKET_SIZE);
+    int ret = ymodem_receive_init(&ctx, &callbacks, buffer, buffer_size, opts->mode);
     if (ret != YMODEM_ERR_NONE) {
         printf("Failed to initialize YMODEM context: %d\n", ret);
-        close(serial_fd);
+        close_port(&port);
         free(buffer);
         return -1;
     }
     
-    // 准备接收文件
-    ymodem_file_info_t file_info;
+    // 可选的写缓冲：按块写文件，数据一进缓冲就ACK
+    uint8_t* chunk_buffer = NULL;
+    if (opts->chunk > 0) {
+        chunk_buffer = (uint8_t*)malloc((size_t)opts->chunk);
+    }
+    ymodem_receive_set_write_behind(&ctx, chunk_buffer, (size_t)opts->chunk,
+                                    opts->sync ? YMODEM_SYNC_END : YMODEM_SYNC_NONE);
+    
+    // 可选的续传：中断后重新接收同一文件时从已写入的位置继续
+    if (opts->resume) {
+        ymodem_receive_set_resume(&ctx, true);
+    }
+    
+    // 可选的大数据块：发送端提出时接受 8/32 KiB 的 BLK 包
+    if (opts->large > 0 && ymodem_receive_set_large_blocks(&ctx, (size_t)opts->large * 1024) != YMODEM_ERR_NONE) {
+        printf("Invalid block size %d KiB\n", opts->large);
+    }
+    
+    // 可选的压缩：接受发送端提出的压缩，写文件前解压
+    if (opts->compress) {
+        ymodem_receive_set_compression(&ctx, &lz_decoder);
+    }
+    
+    // 可选的增量传输：已有同名文件时就地更新，只接收变化的块
+    if (opts->delta) {
+        ymodem_receive_set_delta(&ctx, true);
+    }
+    
+    // 可选的整文件校验：边写边算摘要，与发送端的不一致时取消传输
+    if (opts->verify) {
+        ymodem_receive_set_digest(&ctx, &digest);
+    }
     
     // 如果save_path是目录，则在其中保存文件
     // 否则直接使用save_path作为文件路径
     char save_dir[256] = {0};
     strcpy(save_dir, save_path);
     
-    printf("Waiting to receive file...\n");
-    ret = ymodem_receive_file(&ctx, &file_info, 60); // 60秒握手超时
+    if (opts->progress) {
+        ymodem_set_progress(&ctx, progress_callback, 1000);
+    }
+    setup_trace(&ctx, opts);
+    setup_handshake(&ctx, opts);
+    
+    printf("Waiting to receive files...\n");
+    size_t file_count = 0;
+    ret = ymodem_receive_files(&ctx, file_done_callback, &file_count, 60); // 60秒握手超时
     
     if (ret == YMODEM_ERR_NONE) {
-        printf("File received successfully: %s, size: %lu bytes\n", 
-               file_info.filename, file_info.filesize);
+        printf("Batch complete, %zu file(s) received\n", file_count);
     } else {
         printf("Failed to receive file: %d\n", ret);
     }
+    print_stats(ymodem_get_stats(&ctx));
+    dump_trace(opts);
     
     // 清理资源
     ymodem_receive_cleanup(&ctx);
-    close(serial_fd);
+    close_port(&port);
     free(buffer);
+    free(chunk_buffer);
     
     return ret;
 }
@@ -263,16 +487,92 @@ int ymodem_receive_test(const char* serial_port, const char* save_path) {
 int main(int argc, char* argv[]) {
     if (argc < 3) {
         printf("Usage:\n");
-        printf("  Send file: %s send <serial_port> <file_to_send>\n", argv[0]);
-        printf("  Receive file: %s receive <serial_port> <save_directory>\n", argv[0]);
+        printf("  Send files: %s send <serial_port> <file_to_send> [more files...] [options]\n", argv[0]);
+        printf("              (/dev/stdin streams a pipe of unknown length)\n");
+        printf("  Receive file: %s receive <serial_port> <save_directory> [options]\n", argv[0]);
+        printf("  <serial_port> is a device such as /dev/ttyUSB0, or tcp://host:port, rfc2217://host:port, udp://host:port\n");
+        printf("Options:\n");
+        printf("  -g     use YMODEM-G streaming mode\n");
+        printf("  -w N   keep N packets in flight when sending\n");
+        printf("  -r N   read N blocks ahead on a background thread when sending\n");
+        printf("  -b N   write received data to the file in chunks of N bytes\n");
+        printf("  -m     use memory-mapped files instead of stdio\n");
+        printf("  -s     fsync the received file before acknowledging the end\n");
+        printf("  -c     continue interrupted files (sender offers it, receiver keeps a journal)\n");
+        printf("  -a     adapt packet size and timeouts to the link when sending\n");
+        printf("  -L N   use N KiB blocks (8 or 32) when the other side agrees\n");
+        printf("  -p     print progress once a second\n");
+        printf("  -t N   trace up to level N (1 errors ... 5 bytes) and print it at the end\n");
+        printf("  -i N   send the receiver's 'C' every N ms while waiting for the sender\n");
+        printf("  -f     start sending at once, the receiver is already waiting\n");
+        printf("  -B N   line speed in baud (default 115200, any rate the adapter supports)\n");
+        printf("         for rfc2217:// the speed of the server's port (default: keep it)\n");
+        printf("  -H     use RTS/CTS hardware flow control\n");
+        printf("  -l     ask the driver for low latency (FTDI latency timer 1 ms)\n");
+        printf("  -z     compress the file data when the other side agrees\n");
+        printf("  -d     update an existing copy in place, sending only the changed blocks\n");
+        printf("  -v     verify every file with a SHA-256 computed during the transfer\n");
         return 1;
     }
     
+    // 发送时 argv[3] 起直到第一个选项都是文件名
+    int first_option = 4;
+    while (strcmp(argv[1], "send") == 0 && first_option < argc && argv[first_option][0] != '-') {
+        first_option++;
+    }
+    
+    // 解析可选参数
+    demo_options_t opts = { .mode = YMODEM_MODE_CRC, .window = 0, .readahead = 0, .chunk = 0, .sync = false, .mmap = false, .resume = false, .adaptive = false, .large = 0, .progress = false, .trace = 0, .interval = 0, .fast = false, .baud = 0, .flow = false, .low_latency = false, .compress = false, .delta = false, .verify = false };
+    for (int i = first_option; i < argc; i++) {
+        if (strcmp(argv[i], "-g") == 0) {
+            opts.mode = YMODEM_MODE_G;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            opts.window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            opts.readahead = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            opts.chunk = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            opts.mmap = true;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            opts.sync = true;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            opts.resume = true;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            opts.adaptive = true;
+        } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+            opts.large = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            opts.progress = true;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            opts.trace = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            opts.interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            opts.fast = true;
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            opts.baud = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-H") == 0) {
+            opts.flow = true;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            opts.low_latency = true;
+        } else if (strcmp(argv[i], "-z") == 0) {
+            opts.compress = true;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            opts.delta = true;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            opts.verify = true;
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    
     if (strcmp(argv[1], "send") == 0 && argc >= 4) {
-        return ymodem_send_test(argv[2], argv[3]);
+        return ymodem_send_test(argv[2], (const char* const*)&argv[3], (size_t)(first_option - 3), &opts);
     } 
     else if (strcmp(argv[1], "receive") == 0 && argc >= 4) {
-        return ymodem_receive_test(argv[2], argv[3]);
+        return ymodem_receive_test(argv[2], argv[3], &opts);
     } 
     else {
         printf("Invalid command\n");
@@ -0,0 +1,52 @@
+/**
+ * @file ymodem_config_bootloader.h
+ * @brief Example compile-time profile for a small bootloader
+ * 
+ * Receives one image per session with short file names and no host-only
+ * modules. Build the library and the application with the same profile:
+ * -DYMODEM_CONFIG_FILE=\"ymodem_config_bootloader.h\" (see make lib_profile).
+ */
+
+#ifndef __YMODEM_CONFIG_BOOTLOADER_H__
+#define __YMODEM_CONFIG_BOOTLOADER_H__
+
+// 只接收，每次会话一个文件
+#define YMODEM_SEND_ENABLE              0
+#define YMODEM_BATCH_ENABLE             0
+
+// 文件名缓冲区（含结尾的 NUL），上下文和 ymodem_file_info_t 各一份
+#define YMODEM_MAX_FILENAME_LENGTH      32
+
+// 主机只发 128 字节包时（例如 sb 不带 -k）改为 0，包缓冲区从 1029 降到 133 字节
+#ifndef YMODEM_STX_ENABLE
+#define YMODEM_STX_ENABLE               1
+#endif
+#define YMODEM_BLK_ENABLE               0
+
+// 32/64 字节的 CRC16/CRC32 表，不编译跟踪信息
+#define YMODEM_CRC16_IMPL               YMODEM_CRC16_IMPL_NIBBLE
+#define YMODEM_CRC32_IMPL               YMODEM_CRC32_IMPL_NIBBLE
+#define YMODEM_CRC16_HW                 0
+#define YMODEM_TRACE_LEVEL              YMODEM_TRACE_NONE
+
+// 主机平台上的模块
+#define YMODEM_MMAP_ENABLE              0
+#define YMODEM_READAHEAD_ENABLE         0
+#define YMODEM_SERIAL_ENABLE            0
+#define YMODEM_NET_ENABLE               0
+#define YMODEM_MANAGER_ENABLE           0
+
+// 一条链路只跑一个会话，不需要多路复用
+#define YMODEM_MUX_ENABLE               0
+
+// 固件镜像整个重传，不续传、不压缩、不做增量更新，也不统计；校验交给镜像自己的头部
+#define YMODEM_RESUME_ENABLE            0
+#define YMODEM_LZ_ENABLE                0
+#define YMODEM_DELTA_ENABLE             0
+#define YMODEM_DIGEST_ENABLE            0
+#define YMODEM_STATS_ENABLE             0
+
+// 写回缓冲保留：按 Flash 页大小攒满再写（ymodem_receive_set_write_behind()）
+#define YMODEM_WRITE_BEHIND_ENABLE      1
+
+#endif /* __YMODEM_CONFIG_BOOTLOADER_H__ */
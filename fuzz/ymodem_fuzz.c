@@ -0,0 +1,953 @@
+/**
+ * @file ymodem_fuzz.c
+ * @brief Fuzz harness for the packet parser and the state machines
+ * @date 2025-04-09
+ * 
+ * Every input is one session: the first byte picks the engine and its
+ * options, the rest is what the peer sends, handed out by a mock
+ * comm_receive to reads that wait (a read without a timeout finds the
+ * line empty, so answers never overtake what they answer). What the engine
+ * sends is thrown away. Time is virtual: a wait on an empty line returns
+ * at once and moves the clock by its timeout, so retry and timeout paths
+ * run at full speed, and a session that still runs FUZZ_MAX_IDLE_MS after
+ * the input ran out is reported as a hang (abort()). Buffers are allocated with their exact size so that the
+ * sanitizers see reads past a packet.
+ * 
+ * Built with -DYMODEM_FUZZ_LIBFUZZER and -fsanitize=fuzzer only
+ * LLVMFuzzerTestOneInput() is compiled. Otherwise the program has its own
+ * main (see make fuzz_check):
+ *   ymodem_fuzz                  run the input read from stdin (AFL)
+ *   ymodem_fuzz FILE|DIR...      run inputs, print "name result" for each
+ *   ymodem_fuzz -seed DIR        write the seed corpus
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "ymodem_common.h"
+#include "ymodem_send.h"
+#include "ymodem_receive.h"
+#include "ymodem_fsm.h"
+#include "ymodem_mux.h"
+
+/* Receiver storage, writes beyond it fail like a full disk */
+#define FUZZ_FILE_SIZE          (64 * 1024)
+#define FUZZ_JOURNAL_SIZE       256
+/* File offered by the sending targets and kept by a resuming receiver */
+#define FUZZ_SEND_SIZE          3000
+/* Virtual time a session may still run once the input is used up */
+#define FUZZ_MAX_IDLE_MS        (10u * 60u * 1000u)
+/* Reads without a timeout in a row before a session counts as spinning */
+#define FUZZ_MAX_POLLS          100000
+#define FUZZ_MAX_INPUT          (1024 * 1024)
+#define FUZZ_FILENAME           "fuzz.bin"
+
+/* Low bits of the first byte: the engine */
+enum {
+    FUZZ_RECEIVE = 0,       /* ymodem_receive_file() */
+    FUZZ_BATCH,             /* ymodem_receive_files() */
+    FUZZ_SEND,              /* ymodem_send_file(), the input is the receiver's answers */
+    FUZZ_FSM_RECEIVE,       /* Event-driven receiver */
+    FUZZ_FSM_SEND,          /* Event-driven sender */
+    FUZZ_MUX,               /* Receiver on channel 1 and sender on channel 2 of a multiplexer */
+    FUZZ_PARSE,             /* ymodem_parse_file_info() on the input as packet 0 */
+    FUZZ_PACKET,            /* One-shot against chunked packet check */
+};
+
+/* High bits of the first byte: options */
+#define FUZZ_OPT_G              0x08  /* YMODEM-G */
+#define FUZZ_OPT_EXT            0x10  /* Large blocks, compression, digest, write-behind / adaptive */
+#define FUZZ_OPT_ALT            0x20  /* Receiver: delta, sender: window of 8 */
+#define FUZZ_OPT_TRICKLE        0x40  /* comm_receive returns one byte at a time */
+#define FUZZ_OPT_OLD            0x80  /* Receiver: resume, with an old file and a journal taken from the input; sender: resume and delta */
+
+/* One in-memory file */
+typedef struct {
+    uint8_t* data;
+    size_t   capacity;
+    size_t   size;
+    size_t   pos;
+    bool     open;
+} fuzz_file_t;
+
+/* Mock link, clock and files of one session */
+typedef struct {
+    const uint8_t* input;
+    size_t         length;
+    size_t         offset;
+    bool           trickle;
+    uint32_t       now;
+    uint32_t       idle_since;       /* Clock when the input ran out */
+    uint32_t       polls;            /* Reads without a timeout since the last wait */
+    fuzz_file_t    file;             /* Written by receivers */
+    fuzz_file_t    source;           /* Read by senders */
+    fuzz_file_t    journal;
+} fuzz_env_t;
+
+static void _fuzz_hang(const fuzz_env_t* env)
+{
+    if (env->polls > FUZZ_MAX_POLLS) {
+        fprintf(stderr, "hang: %u reads without a timeout in a row\n", env->polls);
+    } else {
+        fprintf(stderr, "hang: session still running %u ms after the input ended\n", env->now - env->idle_since);
+    }
+    abort();
+}
+
+/* Move the clock, a session must end within FUZZ_MAX_IDLE_MS once the input is gone */
+static void _fuzz_advance(fuzz_env_t* env, uint32_t ms)
+{
+    env->now += ms;
+    if (env->offset >= env->length && env->now - env->idle_since > FUZZ_MAX_IDLE_MS) {
+        _fuzz_hang(env);
+    }
+}
+
+static size_t _fuzz_comm_receive(void* user, uint8_t* data, size_t max_length, uint32_t timeout_ms)
+{
+    fuzz_env_t* env = (fuzz_env_t*)user;
+    size_t n = env->length - env->offset;
+    
+    /* A poll finds the line empty, the peer only answers while the engine waits */
+    if (timeout_ms == 0) {
+        if (++env->polls > FUZZ_MAX_POLLS) {
+            _fuzz_hang(env);
+        }
+        return 0;
+    }
+    env->polls = 0;
+    
+    if (n == 0) {
+        /* Nothing more will come, the wait runs out */
+        _fuzz_advance(env, timeout_ms);
+        return 0;
+    }
+    
+    if (n > max_length) {
+        n = max_length;
+    }
+    if (env->trickle && n > 1) {
+        n = 1;
+    }
+    memcpy(data, env->input + env->offset, n);
+    env->offset += n;
+    if (env->offset == env->length) {
+        env->idle_since = env->now;
+    }
+    return n;
+}
+
+static size_t _fuzz_comm_send(void* user, const uint8_t* data, size_t length)
+{
+    (void)user;
+    (void)data;
+    return length;
+}
+
+static uint32_t _fuzz_get_time_ms(void* user)
+{
+    return ((fuzz_env_t*)user)->now;
+}
+
+static void _fuzz_delay_ms(void* user, uint32_t ms)
+{
+    _fuzz_advance((fuzz_env_t*)user, ms);
+}
+
+static void* _fuzz_file_open(void* user, const char* filename, enum ymodem_open_mode mode)
+{
+    fuzz_env_t* env = (fuzz_env_t*)user;
+    size_t name_len = strlen(filename);
+    size_t suffix_len = sizeof(YMODEM_JOURNAL_SUFFIX) - 1;
+    fuzz_file_t* file;
+    
+    if (name_len >= suffix_len && strcmp(filename + name_len - suffix_len, YMODEM_JOURNAL_SUFFIX) == 0) {
+        file = &env->journal;
+    } else {
+        file = (mode == YMODEM_OPEN_READ) ? &env->source : &env->file;
+    }
+    
+    /* An empty journal or receiver file does not exist */
+    if (file->open || (mode != YMODEM_OPEN_WRITE && file->size == 0 && file != &env->source)) {
+        return NULL;
+    }
+    file->open = true;
+    file->pos = 0;
+    if (mode == YMODEM_OPEN_WRITE) {
+        file->size = 0;
+    }
+    return file;
+}
+
+static size_t _fuzz_file_read(void* user, void* file_handle, uint8_t* buffer, size_t size)
+{
+    fuzz_file_t* file = (fuzz_file_t*)file_handle;
+    (void)user;
+    
+    if (size > file->size - file->pos) {
+        size = file->size - file->pos;
+    }
+    memcpy(buffer, file->data + file->pos, size);
+    file->pos += size;
+    return size;
+}
+
+static size_t _fuzz_file_write(void* user, void* file_handle, const uint8_t* buffer, size_t size)
+{
+    fuzz_file_t* file = (fuzz_file_t*)file_handle;
+    (void)user;
+    
+    if (size > file->capacity - file->pos) {
+        return 0;
+    }
+    memcpy(file->data + file->pos, buffer, size);
+    file->pos += size;
+    if (file->pos > file->size) {
+        file->size = file->pos;
+    }
+    return size;
+}
+
+static void _fuzz_file_close(void* user, void* file_handle)
+{
+    (void)user;
+    ((fuzz_file_t*)file_handle)->open = false;
+}
+
+static int64_t _fuzz_file_size(void* user, void* file_handle)
+{
+    (void)user;
+    return (int64_t)((fuzz_file_t*)file_handle)->size;
+}
+
+static int _fuzz_file_seek(void* user, void* file_handle, uint64_t offset)
+{
+    fuzz_file_t* file = (fuzz_file_t*)file_handle;
+    (void)user;
+    
+    if (offset > file->size) {
+        return -1;
+    }
+    file->pos = (size_t)offset;
+    return 0;
+}
+
+static void _fuzz_callbacks(ymodem_callbacks_t* callbacks, fuzz_env_t* env)
+{
+    memset(callbacks, 0, sizeof(*callbacks));
+    callbacks->file_open = _fuzz_file_open;
+    callbacks->file_read = _fuzz_file_read;
+    callbacks->file_write = _fuzz_file_write;
+    callbacks->file_close = _fuzz_file_close;
+    callbacks->file_size = _fuzz_file_size;
+    callbacks->file_seek = _fuzz_file_seek;
+    callbacks->comm_send = _fuzz_comm_send;
+    callbacks->comm_receive = _fuzz_comm_receive;
+    callbacks->get_time_ms = _fuzz_get_time_ms;
+    callbacks->delay_ms = _fuzz_delay_ms;
+    callbacks->user = env;
+}
+
+/* The file the senders offer, and the old copy a resuming or delta receiver has */
+static void _fuzz_pattern(uint8_t* data, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        data[i] = (uint8_t)((i * 2654435761u) >> 13);
+    }
+}
+
+/**
+ * @brief Blocking receiver, one file or a whole batch
+ */
+static int _fuzz_receive(fuzz_env_t* env, uint8_t options, bool batch)
+{
+    static ymodem_lz_decoder_t decoder;
+    static ymodem_digest_t digest;
+    static uint8_t wb_buffer[512];
+    bool ext = (options & FUZZ_OPT_EXT) != 0;
+    size_t buffer_size = ext ? YMODEM_MAX_BLK_PACKET_SIZE : YMODEM_MAX_PACKET_SIZE;
+    uint8_t* buffer = (uint8_t*)malloc(buffer_size);
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    ymodem_file_info_t file_info;
+    size_t file_count = 0;
+    int result;
+    
+    if (buffer == NULL) {
+        return YMODEM_ERR_MEM;
+    }
+    
+    _fuzz_callbacks(&callbacks, env);
+    result = ymodem_receive_init(&ctx, &callbacks, buffer, buffer_size,
+                                 (options & FUZZ_OPT_G) ? YMODEM_MODE_G : YMODEM_MODE_CRC);
+    if (result == YMODEM_ERR_NONE) {
+        ymodem_set_trace(&ctx, NULL, NULL, YMODEM_TRACE_NONE);
+        if (ext) {
+            ymodem_receive_set_large_blocks(&ctx, YMODEM_BLK32K_DATA_SIZE);
+            ymodem_receive_set_compression(&ctx, &decoder);
+            ymodem_receive_set_digest(&ctx, &digest);
+            ymodem_receive_set_write_behind(&ctx, wb_buffer, sizeof(wb_buffer), YMODEM_SYNC_END);
+        }
+        if (options & FUZZ_OPT_ALT) {
+            ymodem_receive_set_delta(&ctx, true);
+        }
+        if (options & FUZZ_OPT_OLD) {
+            ymodem_receive_set_resume(&ctx, true);
+        }
+        if (batch) {
+            result = ymodem_receive_files(&ctx, NULL, &file_count, 2);
+        } else {
+            result = ymodem_receive_file(&ctx, &file_info, 2);
+        }
+        ymodem_receive_cleanup(&ctx);
+    }
+    
+    free(buffer);
+    return result;
+}
+
+#if YMODEM_SEND_ENABLE
+/**
+ * @brief Blocking sender of FUZZ_SEND_SIZE bytes
+ */
+static int _fuzz_send(fuzz_env_t* env, uint8_t options)
+{
+    static ymodem_lz_encoder_t encoder;
+    static ymodem_digest_t digest;
+    static uint8_t window_buffer[8 * YMODEM_MAX_PACKET_SIZE];
+    static uint32_t map[8];
+    bool ext = (options & FUZZ_OPT_EXT) != 0;
+    size_t buffer_size = ext ? YMODEM_BLK_PACKET_SIZE(YMODEM_BLK8K_DATA_SIZE) : YMODEM_MAX_PACKET_SIZE;
+    uint8_t* buffer = (uint8_t*)malloc(buffer_size);
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    int result;
+    
+    if (buffer == NULL) {
+        return YMODEM_ERR_MEM;
+    }
+    
+    _fuzz_callbacks(&callbacks, env);
+    result = ymodem_send_init(&ctx, &callbacks, buffer, buffer_size,
+                              (options & FUZZ_OPT_G) ? YMODEM_MODE_G : YMODEM_MODE_CRC);
+    if (result == YMODEM_ERR_NONE) {
+        ymodem_set_trace(&ctx, NULL, NULL, YMODEM_TRACE_NONE);
+        if (ext) {
+            ymodem_send_set_large_blocks(&ctx, YMODEM_BLK8K_DATA_SIZE);
+            ymodem_send_set_compression(&ctx, &encoder);
+            ymodem_send_set_digest(&ctx, &digest, YMODEM_DIGEST_SHA256);
+            ymodem_send_set_adaptive(&ctx, true);
+        }
+        if (options & FUZZ_OPT_ALT) {
+            ymodem_send_set_window(&ctx, window_buffer, sizeof(window_buffer), 8);
+        }
+        if (options & FUZZ_OPT_OLD) {
+            ymodem_send_set_resume(&ctx, true);
+            ymodem_send_set_delta(&ctx, map, sizeof(map) / sizeof(map[0]));
+        }
+        result = ymodem_send_file(&ctx, FUZZ_FILENAME, 2);
+        ymodem_send_cleanup(&ctx);
+    }
+    
+    free(buffer);
+    return result;
+}
+#endif
+
+/**
+ * @brief Drive an event-driven session, or a multiplexer, until it ends
+ */
+static int _fuzz_drive(fuzz_env_t* env, ymodem_fsm_t* fsm, ymodem_mux_t* mux)
+{
+    uint8_t out[YMODEM_MUX_IO_SIZE];
+    uint8_t in[256];
+    
+    for (;;) {
+        int result = (mux != NULL) ? ymodem_mux_result(mux) : ymodem_fsm_result(fsm);
+        uint32_t deadline;
+        uint32_t timeout = 0;
+        size_t n;
+    
+        if (result != YMODEM_FSM_BUSY) {
+            return result;
+        }
+    
+        if (mux != NULL) {
+            ymodem_mux_poll(mux, env->now, out, sizeof(out), &deadline);
+        } else {
+            ymodem_poll(fsm, env->now, out, sizeof(out), &deadline);
+        }
+        if ((int32_t)(deadline - env->now) > 0) {
+            timeout = deadline - env->now;
+        }
+    
+        n = _fuzz_comm_receive(env, in, sizeof(in), timeout);
+        if (n > 0 && mux != NULL) {
+            ymodem_mux_feed(mux, in, n, env->now);
+        } else if (n > 0) {
+            ymodem_feed(fsm, in, n, env->now);
+        }
+    }
+}
+
+/**
+ * @brief Event-driven receiver, sender, or both on a multiplexer
+ */
+static int _fuzz_fsm(fuzz_env_t* env, uint8_t options, int target)
+{
+    enum ymodem_mode mode = (options & FUZZ_OPT_G) ? YMODEM_MODE_G : YMODEM_MODE_CRC;
+    uint8_t* rx_buffer = (uint8_t*)malloc(YMODEM_MAX_PACKET_SIZE);
+    uint8_t* tx_buffer = (uint8_t*)malloc(YMODEM_MAX_PACKET_SIZE);
+    ymodem_callbacks_t callbacks;
+    ymodem_fsm_t receiver;
+    ymodem_fsm_t sender;
+    ymodem_mux_t mux;
+    int result = YMODEM_ERR_MEM;
+    
+    _fuzz_callbacks(&callbacks, env);
+    if (rx_buffer == NULL || tx_buffer == NULL) {
+        goto out;
+    }
+    
+    if (target == FUZZ_FSM_RECEIVE) {
+        result = ymodem_fsm_receive_init(&receiver, &callbacks, rx_buffer, YMODEM_MAX_PACKET_SIZE, mode, 2, env->now);
+        if (result == YMODEM_ERR_NONE) {
+            result = _fuzz_drive(env, &receiver, NULL);
+            ymodem_fsm_cleanup(&receiver);
+        }
+        goto out;
+    }
+    
+#if YMODEM_SEND_ENABLE
+    result = ymodem_fsm_send_init(&sender, &callbacks, tx_buffer, YMODEM_MAX_PACKET_SIZE, mode, FUZZ_FILENAME, 2, env->now);
+    if (result != YMODEM_ERR_NONE) {
+        goto out;
+    }
+    
+    if (target == FUZZ_FSM_SEND) {
+        result = _fuzz_drive(env, &sender, NULL);
+    } else {
+        result = ymodem_fsm_receive_init(&receiver, &callbacks, rx_buffer, YMODEM_MAX_PACKET_SIZE, mode, 2, env->now);
+        if (result == YMODEM_ERR_NONE) {
+            ymodem_mux_init(&mux, 0);
+            ymodem_mux_add(&mux, 1, &receiver, 0);
+            ymodem_mux_add(&mux, 2, &sender, 1);
+            result = _fuzz_drive(env, NULL, &mux);
+            ymodem_fsm_cleanup(&receiver);
+        }
+    }
+    ymodem_fsm_cleanup(&sender);
+#else
+    (void)sender;
+    (void)mux;
+    result = YMODEM_ERR_CODE;
+#endif
+    
+out:
+    free(rx_buffer);
+    free(tx_buffer);
+    return result;
+}
+
+/**
+ * @brief Parse the input as the data of packet 0
+ */
+static int _fuzz_parse(const uint8_t* data, size_t size)
+{
+    uint8_t* buffer = (uint8_t*)malloc(YMODEM_MAX_PACKET_SIZE);
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    ymodem_file_info_t file_info;
+    fuzz_env_t env;
+    size_t data_size = (size > YMODEM_SOH_DATA_SIZE) ? YMODEM_MAX_DATA_SIZE : YMODEM_SOH_DATA_SIZE;
+    int result;
+    
+    if (buffer == NULL) {
+        return YMODEM_ERR_MEM;
+    }
+    
+    memset(&env, 0, sizeof(env));
+    _fuzz_callbacks(&callbacks, &env);
+    result = ymodem_receive_init(&ctx, &callbacks, buffer, YMODEM_MAX_PACKET_SIZE, YMODEM_MODE_CRC);
+    if (result == YMODEM_ERR_NONE) {
+        ymodem_set_trace(&ctx, NULL, NULL, YMODEM_TRACE_NONE);
+        memset(buffer + 3, 0, data_size);
+        memcpy(buffer + 3, data, size < data_size ? size : data_size);
+        ymodem_frame_packet(buffer, 0, data_size);
+        result = ymodem_parse_file_info(&ctx, &file_info);
+        ymodem_receive_cleanup(&ctx);
+    }
+    
+    free(buffer);
+    return result;
+}
+
+/**
+ * @brief Check a packet in one go and in chunks of the first input byte, both must agree
+ */
+static int _fuzz_packet(const uint8_t* data, size_t size)
+{
+    uint8_t* packet = (uint8_t*)calloc(1, YMODEM_MAX_BLK_PACKET_SIZE);
+    ymodem_rx_crc_t rc;
+    size_t step;
+    size_t packet_size;
+    size_t received;
+    size_t data_size = 0;
+    size_t chunk_data_size = 0;
+    uint8_t seq = 0;
+    uint8_t chunk_seq = 0;
+    int result;
+    int chunk_result;
+    
+    if (packet == NULL) {
+        return YMODEM_ERR_MEM;
+    }
+    if (size < 2) {
+        free(packet);
+        return YMODEM_ERR_DSZ;
+    }
+    
+    step = (data[0] > 0) ? data[0] : YMODEM_MAX_BLK_PACKET_SIZE;
+    memcpy(packet, data + 1, (size - 1 < YMODEM_MAX_BLK_PACKET_SIZE) ? size - 1 : YMODEM_MAX_BLK_PACKET_SIZE);
+    
+    if (YMODEM_BLK_ENABLE && packet[0] == YMODEM_CODE_BLK) {
+        packet_size = YMODEM_BLK_PACKET_SIZE(YMODEM_BLK8K_DATA_SIZE);
+        result = ymodem_check_block(packet, YMODEM_BLK8K_DATA_SIZE, &seq);
+        data_size = YMODEM_BLK8K_DATA_SIZE;
+    } else {
+        packet_size = ymodem_packet_size(packet[0]);
+        if (packet_size == 0) {
+            free(packet);
+            return YMODEM_ERR_CODE;
+        }
+        result = ymodem_check_packet(packet, &seq, &data_size);
+    }
+    
+    ymodem_rx_crc_start(&rc, packet[0], packet_size);
+    for (received = 1; received < packet_size; ) {
+        received = (step < packet_size - received) ? received + step : packet_size;
+        ymodem_rx_crc_update(&rc, packet, received);
+    }
+    chunk_result = ymodem_rx_crc_finish(&rc, packet, &chunk_seq, &chunk_data_size);
+    if (chunk_result == YMODEM_ERR_NONE && packet[0] == YMODEM_CODE_BLK) {
+        chunk_data_size = YMODEM_BLK8K_DATA_SIZE;
+    }
+    
+    if (chunk_result != result || (result == YMODEM_ERR_NONE && (chunk_seq != seq || chunk_data_size != data_size))) {
+        fprintf(stderr, "packet check differs: %d in one go, %d in chunks of %zu\n", result, chunk_result, step);
+        abort();
+    }
+    
+    free(packet);
+    return result;
+}
+
+/**
+ * @brief Run one input
+ * 
+ * @return int Result of the session
+ */
+static int _fuzz_run(const uint8_t* data, size_t size)
+{
+    static fuzz_env_t env;
+    static uint8_t file_data[FUZZ_FILE_SIZE];
+    static uint8_t source_data[FUZZ_SEND_SIZE];
+    static uint8_t journal_data[FUZZ_JOURNAL_SIZE];
+    uint8_t options;
+    int target;
+    
+    if (size == 0) {
+        return YMODEM_ERR_DSZ;
+    }
+    options = data[0];
+    target = options & 0x07;
+    data++;
+    size--;
+    
+    if (target == FUZZ_PARSE) {
+        return _fuzz_parse(data, size);
+    }
+    if (target == FUZZ_PACKET) {
+        return _fuzz_packet(data, size);
+    }
+    
+    memset(&env, 0, sizeof(env));
+    env.now = 1000;
+    env.trickle = (options & FUZZ_OPT_TRICKLE) != 0;
+    env.file.data = file_data;
+    env.file.capacity = sizeof(file_data);
+    env.source.data = source_data;
+    env.source.capacity = sizeof(source_data);
+    env.source.size = sizeof(source_data);
+    env.journal.data = journal_data;
+    env.journal.capacity = sizeof(journal_data);
+    _fuzz_pattern(source_data, sizeof(source_data));
+    
+    /* A resuming receiver finds the old file and a journal: its length byte and bytes lead the input */
+    if ((options & FUZZ_OPT_OLD) && target != FUZZ_SEND && target != FUZZ_FSM_SEND) {
+        size_t journal_length = (size > 0) ? data[0] : 0;
+        if (journal_length > size - (size > 0 ? 1 : 0)) {
+            journal_length = size - (size > 0 ? 1 : 0);
+        }
+        if (size > 0) {
+            memcpy(journal_data, data + 1, journal_length);
+            data += 1 + journal_length;
+            size -= 1 + journal_length;
+        }
+        env.journal.size = journal_length;
+        memcpy(file_data, source_data, sizeof(source_data));
+        env.file.size = sizeof(source_data);
+    }
+    
+    env.input = data;
+    env.length = size;
+    if (size == 0) {
+        env.idle_since = env.now;
+    }
+    
+    switch (target) {
+    case FUZZ_RECEIVE:
+        return _fuzz_receive(&env, options, false);
+    case FUZZ_BATCH:
+        return _fuzz_receive(&env, options, true);
+#if YMODEM_SEND_ENABLE
+    case FUZZ_SEND:
+        return _fuzz_send(&env, options);
+#endif
+    case FUZZ_FSM_RECEIVE:
+    case FUZZ_FSM_SEND:
+    case FUZZ_MUX:
+        return _fuzz_fsm(&env, options, target);
+    default:
+        return YMODEM_ERR_CODE;
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    _fuzz_run(data, size);
+    return 0;
+}
+
+#ifndef YMODEM_FUZZ_LIBFUZZER
+
+/* Seed corpus: well-formed sessions for every target to start mutating from */
+
+typedef struct {
+    uint8_t data[16 * 1024];
+    size_t  length;
+} fuzz_seed_t;
+
+static void _seed_bytes(fuzz_seed_t* seed, const void* data, size_t length)
+{
+    if (length > sizeof(seed->data) - seed->length) {
+        length = sizeof(seed->data) - seed->length;
+    }
+    memcpy(seed->data + seed->length, data, length);
+    seed->length += length;
+}
+
+static void _seed_byte(fuzz_seed_t* seed, uint8_t byte)
+{
+    _seed_bytes(seed, &byte, 1);
+}
+
+static void _seed_packet(fuzz_seed_t* seed, uint8_t seq, const void* data, size_t length, size_t data_size)
+{
+    uint8_t packet[YMODEM_STX_PACKET_SIZE];
+    
+    memset(packet + 3, (seq == 0) ? 0x00 : 0x1A, data_size);
+    memcpy(packet + 3, data, length < data_size ? length : data_size);
+    ymodem_frame_packet(packet, seq, data_size);
+    _seed_bytes(seed, packet, 1 + 2 + data_size + 2);
+}
+
+/* What a sender puts on the line for one file, packet 0 with the given fields */
+static void _seed_file(fuzz_seed_t* seed, const char* info, size_t info_length)
+{
+    static uint8_t file[FUZZ_SEND_SIZE];
+    size_t offset;
+    uint8_t seq = 1;
+    
+    _fuzz_pattern(file, sizeof(file));
+    _seed_packet(seed, 0, info, info_length, YMODEM_SOH_DATA_SIZE);
+    for (offset = 0; offset < sizeof(file); offset += YMODEM_STX_DATA_SIZE, seq++) {
+        size_t length = sizeof(file) - offset;
+        _seed_packet(seed, seq, file + offset, length, length > YMODEM_SOH_DATA_SIZE ? YMODEM_STX_DATA_SIZE : YMODEM_SOH_DATA_SIZE);
+    }
+    _seed_byte(seed, YMODEM_CODE_EOT);
+    _seed_byte(seed, YMODEM_CODE_EOT);
+}
+
+static void _seed_end(fuzz_seed_t* seed)
+{
+    _seed_packet(seed, 0, "", 0, YMODEM_SOH_DATA_SIZE);
+}
+
+/* What a receiver answers to a sender of FUZZ_SEND_SIZE bytes */
+static void _seed_answers(fuzz_seed_t* seed)
+{
+    static const uint8_t answers[] = {
+        YMODEM_CODE_C, YMODEM_CODE_ACK, YMODEM_CODE_C,          /* packet 0 */
+        YMODEM_CODE_ACK, YMODEM_CODE_NAK, YMODEM_CODE_ACK, YMODEM_CODE_ACK, /* data, one resend */
+        YMODEM_CODE_NAK, YMODEM_CODE_ACK, YMODEM_CODE_C,        /* EOT, EOT */
+        YMODEM_CODE_ACK,                                        /* null packet 0 */
+    };
+    _seed_bytes(seed, answers, sizeof(answers));
+}
+
+static int _seed_write(const char* dir, const char* name, const fuzz_seed_t* seed)
+{
+    char path[1024];
+    FILE* f;
+    
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "wb");
+    if (f == NULL || fwrite(seed->data, 1, seed->length, f) != seed->length) {
+        fprintf(stderr, "cannot write %s\n", path);
+        if (f != NULL) {
+            fclose(f);
+        }
+        return 1;
+    }
+    fclose(f);
+    return 0;
+}
+
+#define SEED_INFO(s)    s, sizeof(s)
+
+static int _fuzz_write_seeds(const char* dir)
+{
+    static const char info[] = "fuzz.bin\0" "3000 14614336320 100644";
+    static const char info_ext[] = "fuzz.bin\0" "3000 14614336320 100644 resume delta sum=crc32";
+    static const char info_parse[] = "fuzz.bin\0" "3000 14614336320 100644 1 resume blk=8192 lz=10 delta sum=sha256";
+    static const char info_big[] = "fuzz.bin\0" "99999999999999999999999 777777777777777777777777";
+    static const uint8_t garbage[] = { 0x00, 0xFF, YMODEM_CODE_STX, 0x05, 0x43, YMODEM_CODE_CAN, 0x7F };
+    fuzz_seed_t seed;
+    int failed = 0;
+    uint8_t mux_frame[YMODEM_MUX_FRAME_SIZE(YMODEM_MUX_FRAME_DATA_SIZE)];
+    fuzz_seed_t inner;
+    size_t offset;
+    unsigned i;
+    
+    mkdir(dir, 0755);
+    
+    /* Blocking receiver */
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_RECEIVE);
+    _seed_file(&seed, SEED_INFO(info));
+    _seed_end(&seed);
+    failed |= _seed_write(dir, "receive", &seed);
+    
+    seed.data[0] = FUZZ_RECEIVE | FUZZ_OPT_TRICKLE;
+    failed |= _seed_write(dir, "receive-trickle", &seed);
+    
+    seed.data[0] = FUZZ_RECEIVE | FUZZ_OPT_G;
+    failed |= _seed_write(dir, "receive-g", &seed);
+    
+    seed.data[0] = FUZZ_RECEIVE | FUZZ_OPT_EXT;
+    failed |= _seed_write(dir, "receive-ext", &seed);
+    
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_RECEIVE);
+    _seed_bytes(&seed, garbage, sizeof(garbage));
+    _seed_file(&seed, SEED_INFO(info));
+    seed.data[1 + sizeof(garbage) + YMODEM_SOH_PACKET_SIZE + 40] ^= 0x20;   /* Bad CRC in packet 1 */
+    _seed_bytes(&seed, garbage, sizeof(garbage));
+    _seed_end(&seed);
+    failed |= _seed_write(dir, "receive-noise", &seed);
+    
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_RECEIVE | FUZZ_OPT_OLD | FUZZ_OPT_ALT | FUZZ_OPT_EXT);
+    _seed_byte(&seed, 0);                                   /* No journal */
+    _seed_file(&seed, SEED_INFO(info_ext));
+    _seed_end(&seed);
+    failed |= _seed_write(dir, "receive-resume", &seed);
+    
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_BATCH);
+    _seed_file(&seed, SEED_INFO(info));
+    _seed_file(&seed, SEED_INFO(info));
+    _seed_end(&seed);
+    failed |= _seed_write(dir, "batch", &seed);
+    
+    /* Blocking sender */
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_SEND);
+    _seed_answers(&seed);
+    failed |= _seed_write(dir, "send", &seed);
+    
+    seed.data[0] = FUZZ_SEND | FUZZ_OPT_ALT;
+    failed |= _seed_write(dir, "send-window", &seed);
+    
+    seed.data[0] = FUZZ_SEND | FUZZ_OPT_EXT | FUZZ_OPT_OLD;
+    failed |= _seed_write(dir, "send-ext", &seed);
+    
+    /* Event-driven engines */
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_FSM_RECEIVE);
+    _seed_file(&seed, SEED_INFO(info));
+    _seed_end(&seed);
+    failed |= _seed_write(dir, "fsm-receive", &seed);
+    
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_FSM_SEND);
+    _seed_answers(&seed);
+    failed |= _seed_write(dir, "fsm-send", &seed);
+    
+    /* Multiplexer: the file for channel 1, then the answers for channel 2 */
+    inner.length = 0;
+    _seed_file(&inner, SEED_INFO(info));
+    _seed_end(&inner);
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_MUX);
+    for (offset = 0; offset < inner.length; offset += YMODEM_MUX_FRAME_DATA_SIZE) {
+        size_t n = inner.length - offset;
+        if (n > YMODEM_MUX_FRAME_DATA_SIZE) {
+            n = YMODEM_MUX_FRAME_DATA_SIZE;
+        }
+        mux_frame[0] = YMODEM_CODE_MUX;
+        mux_frame[1] = 1;
+        mux_frame[2] = (uint8_t)n;
+        mux_frame[3] = (uint8_t)~(1 ^ n);
+        memcpy(mux_frame + YMODEM_MUX_HEADER_SIZE, inner.data + offset, n);
+        _seed_bytes(&seed, mux_frame, YMODEM_MUX_FRAME_SIZE(n));
+    }
+    inner.length = 0;
+    _seed_answers(&inner);
+    mux_frame[0] = YMODEM_CODE_MUX;
+    mux_frame[1] = 2;
+    mux_frame[2] = (uint8_t)inner.length;
+    mux_frame[3] = (uint8_t)~(2 ^ inner.length);
+    memcpy(mux_frame + YMODEM_MUX_HEADER_SIZE, inner.data, inner.length);
+    _seed_bytes(&seed, mux_frame, YMODEM_MUX_FRAME_SIZE(inner.length));
+    failed |= _seed_write(dir, "mux", &seed);
+    
+    /* Packet 0 parser */
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_PARSE);
+    _seed_bytes(&seed, SEED_INFO(info_parse));
+    failed |= _seed_write(dir, "parse", &seed);
+    
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_PARSE);
+    _seed_bytes(&seed, SEED_INFO(info_big));
+    failed |= _seed_write(dir, "parse-overflow", &seed);
+    
+    /* A name, then digits up to the last byte of the packet and a CRC that reads as digits too */
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_PARSE);
+    _seed_bytes(&seed, "x", 2);
+    while (seed.length < 1 + YMODEM_STX_DATA_SIZE) {
+        _seed_byte(&seed, '0');
+    }
+    for (i = 0; i < 10000; i++) {
+        uint16_t crc;
+        snprintf((char*)seed.data + seed.length - 4, 5, "%04u", i);
+        crc = ymodem_calc_crc16(seed.data + 1, YMODEM_STX_DATA_SIZE);
+        if ((crc >> 8) >= '0' && (crc >> 8) <= '9' && (crc & 0xFF) >= '0' && (crc & 0xFF) <= '9') {
+            break;
+        }
+    }
+    failed |= _seed_write(dir, "parse-digits", &seed);
+    
+    /* Packet checks, whole and in odd chunks */
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_PACKET);
+    _seed_byte(&seed, 7);
+    _seed_packet(&seed, 1, info, sizeof(info), YMODEM_STX_DATA_SIZE);
+    failed |= _seed_write(dir, "packet-stx", &seed);
+    
+    seed.length = 0;
+    _seed_byte(&seed, FUZZ_PACKET);
+    _seed_byte(&seed, 0);
+    _seed_packet(&seed, 0xFF, info, sizeof(info), YMODEM_SOH_DATA_SIZE);
+    seed.data[seed.length - 1] ^= 0x01;                     /* Bad CRC */
+    failed |= _seed_write(dir, "packet-soh-crc", &seed);
+    
+    return failed;
+}
+
+static int _fuzz_file(const char* path, const char* name)
+{
+    static uint8_t data[FUZZ_MAX_INPUT];
+    FILE* f = fopen(path, "rb");
+    size_t size;
+    
+    if (f == NULL) {
+        fprintf(stderr, "cannot read %s\n", path);
+        return 1;
+    }
+    size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    
+    printf("%s %s\n", name, ymodem_error_to_str(_fuzz_run(data, size)));
+    return 0;
+}
+
+static int _fuzz_path(const char* path)
+{
+    struct dirent** entries;
+    struct stat st;
+    char entry_path[1024];
+    const char* name = strrchr(path, '/');
+    int failed = 0;
+    int count;
+    int i;
+    
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "cannot read %s\n", path);
+        return 1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return _fuzz_file(path, name != NULL ? name + 1 : path);
+    }
+    
+    /* Sorted, so that the output can be compared with a baseline */
+    count = scandir(path, &entries, NULL, alphasort);
+    if (count < 0) {
+        fprintf(stderr, "cannot list %s\n", path);
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        if (entries[i]->d_name[0] != '.') {
+            snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entries[i]->d_name);
+            failed |= _fuzz_file(entry_path, entries[i]->d_name);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    
+    return failed;
+}
+
+int main(int argc, char* argv[])
+{
+    static uint8_t data[FUZZ_MAX_INPUT];
+    int failed = 0;
+    int i;
+    
+    if (argc == 3 && strcmp(argv[1], "-seed") == 0) {
+        return _fuzz_write_seeds(argv[2]);
+    }
+    
+    if (argc == 1) {
+        size_t size = fread(data, 1, sizeof(data), stdin);
+        _fuzz_run(data, size);
+        return 0;
+    }
+    
+    for (i = 1; i < argc; i++) {
+        failed |= _fuzz_path(argv[i]);
+    }
+    
+    return failed;
+}
+
+#endif /* YMODEM_FUZZ_LIBFUZZER */
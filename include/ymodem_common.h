@@ -15,16 +15,76 @@
 #include <stdbool.h>
 #include <stdio.h>
 
-/* Debug switch - set to 1 to enable debug output, 0 to disable */
-#define YMODEM_DEBUG_ENABLE 1
+/* Optional configuration header, e.g. -DYMODEM_CONFIG_FILE=\"ymodem_config.h\", for the
+ * settings below and the profile switches. It is read before every default. */
+#ifdef YMODEM_CONFIG_FILE
+#include YMODEM_CONFIG_FILE
+#endif
+
+#include "ymodem_lz.h"
+#include "ymodem_digest.h"
 
-/* Debug print macros */
+/* Debug switch - set to 1 to print every trace event to stdout by default, 0 to disable */
+#ifndef YMODEM_DEBUG_ENABLE
+#define YMODEM_DEBUG_ENABLE 0
+#endif
+
+/* Debug print macros, for code that has no context to trace into */
 #if YMODEM_DEBUG_ENABLE
     #define YMODEM_DEBUG_PRINT(format, ...) printf("[YMODEM] " format, ##__VA_ARGS__)
 #else
     #define YMODEM_DEBUG_PRINT(format, ...) do {} while(0)
 #endif
 
+/* Trace levels, each one includes the ones above it */
+#define YMODEM_TRACE_NONE               0     /* Nothing */
+#define YMODEM_TRACE_ERROR              1     /* Session failed or was cancelled */
+#define YMODEM_TRACE_WARN               2     /* Retries, NAKs, timeouts and other recovered errors */
+#define YMODEM_TRACE_INFO               3     /* Handshake, files and the end of the session */
+#define YMODEM_TRACE_DEBUG              4     /* Every packet */
+#define YMODEM_TRACE_BYTES              5     /* Every read and write on the link, hex dumped */
+
+/* Highest level compiled in, the calls above it cost nothing */
+#ifndef YMODEM_TRACE_LEVEL
+    #if YMODEM_DEBUG_ENABLE
+        #define YMODEM_TRACE_LEVEL      YMODEM_TRACE_BYTES
+    #else
+        #define YMODEM_TRACE_LEVEL      YMODEM_TRACE_INFO
+    #endif
+#endif
+
+/* Level a new context starts with, see ymodem_set_trace() */
+#if YMODEM_DEBUG_ENABLE
+    #define YMODEM_TRACE_DEFAULT        YMODEM_TRACE_LEVEL
+#else
+    #define YMODEM_TRACE_DEFAULT        YMODEM_TRACE_NONE
+#endif
+
+#ifndef YMODEM_TRACE_LINE_SIZE
+#define YMODEM_TRACE_LINE_SIZE          128   /* Longest trace message, longer ones are cut */
+#endif
+
+/* Lets the compiler check trace formats like printf's */
+#if defined(__GNUC__) || defined(__clang__)
+    #define YMODEM_PRINTF_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+    #define YMODEM_PRINTF_FORMAT(fmt, args)
+#endif
+
+/* Whether a trace level is passed on by ctx, constant 0 when the level is not compiled in */
+#if YMODEM_TRACE_LEVEL > YMODEM_TRACE_NONE
+    #define YMODEM_TRACE_ON(ctx, level) ((level) <= YMODEM_TRACE_LEVEL && (level) <= (ctx)->trace_level)
+#else
+    #define YMODEM_TRACE_ON(ctx, level) 0
+#endif
+
+/* Trace macro: level must be a constant so that levels above YMODEM_TRACE_LEVEL compile out */
+#define YMODEM_TRACE(ctx, level, format, ...) do { \
+    if (YMODEM_TRACE_ON(ctx, level)) { \
+        ymodem_trace((ctx), (level), format, ##__VA_ARGS__); \
+    } \
+} while (0)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -34,11 +94,18 @@ enum ymodem_code {
     YMODEM_CODE_NONE = 0x00,
     YMODEM_CODE_SOH  = 0x01,  /* Start of header (128 byte data) */
     YMODEM_CODE_STX  = 0x02,  /* Start of header (1024 byte data) */
+    YMODEM_CODE_BLK  = 0x03,  /* Start of large block (negotiated 8/32 KiB data, CRC32) */
     YMODEM_CODE_EOT  = 0x04,  /* End of transmission */
+    YMODEM_CODE_SKP  = 0x05,  /* Skip frame: the receiver already has the next bytes (negotiated in packet 0) */
     YMODEM_CODE_ACK  = 0x06,  /* Acknowledge */
+    YMODEM_CODE_SUM  = 0x07,  /* Digest frame after the last data packet (negotiated in packet 0) */
     YMODEM_CODE_NAK  = 0x15,  /* Negative acknowledge */
+    YMODEM_CODE_MUX  = 0x16,  /* Start of a multiplexed frame (ymodem_mux.h, both ends) */
     YMODEM_CODE_CAN  = 0x18,  /* Cancel transmission */
     YMODEM_CODE_C    = 0x43,  /* ASCII 'C' - CRC mode */
+    YMODEM_CODE_G    = 0x47,  /* ASCII 'G' - YMODEM-G streaming mode */
+    YMODEM_CODE_V    = 0x56,  /* ASCII 'V' - whole-file digest accepted (negotiated in packet 0) */
+    YMODEM_CODE_Z    = 0x5A,  /* ASCII 'Z' - compressed data accepted (negotiated in packet 0) */
 };
 
 /* YMODEM error codes */
@@ -53,6 +120,7 @@ enum ymodem_error {
     YMODEM_ERR_ACK   = -7,    /* Wrong answer, wrong ACK or C */
     YMODEM_ERR_FILE  = -8,    /* File operation error */
     YMODEM_ERR_MEM   = -9,    /* Memory allocation error */
+    YMODEM_ERR_SUM   = -10,   /* The file arrived but its digest does not match the sender's */
 };
 
 /* YMODEM stages */
@@ -65,6 +133,26 @@ enum ymodem_stage {
     YMODEM_STAGE_FINISHED,        /* Set when transmission is really finished */
 };
 
+/* YMODEM transfer modes */
+enum ymodem_mode {
+    YMODEM_MODE_CRC = 0,          /* Classic YMODEM, stop-and-wait with CRC16 and retransmission */
+    YMODEM_MODE_G,                /* YMODEM-G, packets are streamed without ACK, any error aborts */
+};
+
+/* Durability of received data */
+enum ymodem_sync {
+    YMODEM_SYNC_NONE = 0,         /* Never call file_sync */
+    YMODEM_SYNC_END,              /* Call file_sync once the whole file is written */
+    YMODEM_SYNC_CHUNK,            /* Call file_sync after every flushed write-behind chunk */
+};
+
+/* How file_open is asked to open a file */
+enum ymodem_open_mode {
+    YMODEM_OPEN_READ = 0,         /* Read from the start (sender) */
+    YMODEM_OPEN_WRITE,            /* Create or truncate for writing (receiver) */
+    YMODEM_OPEN_RESUME,           /* Read and write an existing file without truncating it (resuming receiver) */
+};
+
 /* Default YMODEM settings */
 #ifndef YMODEM_WAIT_CHAR_TIMEOUT_MS
 #define YMODEM_WAIT_CHAR_TIMEOUT_MS     3000  /* 3 seconds timeout for character */
@@ -86,36 +174,204 @@ enum ymodem_stage {
 #define YMODEM_CAN_SEND_COUNT           7     /* Number of CAN bytes to send when cancelling */
 #endif
 
+#ifndef YMODEM_PURGE_TIMEOUT_MS
+#define YMODEM_PURGE_TIMEOUT_MS         100   /* Line must be idle this long before a NAK is sent */
+#endif
+
+#ifndef YMODEM_RTO_MIN_MS
+#define YMODEM_RTO_MIN_MS               100   /* Lower bound of the adaptive retransmit timeout */
+#endif
+
+#ifndef YMODEM_ADAPT_CLEAN_PACKETS
+#define YMODEM_ADAPT_CLEAN_PACKETS      32    /* Clean 128-byte packets before going back to 1 KiB */
+#endif
+
+#ifndef YMODEM_RESUME_JOURNAL_INTERVAL
+#define YMODEM_RESUME_JOURNAL_INTERVAL  (64 * 1024) /* Committed bytes between two journal updates */
+#endif
+
+#ifndef YMODEM_MAX_WINDOW
+#define YMODEM_MAX_WINDOW               32    /* Maximum packets in flight (must stay below 128) */
+#endif
+
+/* CRC16 kernels, select one with YMODEM_CRC16_IMPL */
+#define YMODEM_CRC16_IMPL_BITWISE       0     /* No table, smallest code */
+#define YMODEM_CRC16_IMPL_NIBBLE        1     /* 32-byte table for small MCUs */
+#define YMODEM_CRC16_IMPL_TABLE         2     /* Classic 512-byte table */
+#define YMODEM_CRC16_IMPL_SLICE4        3     /* Slice-by-4, 2 KiB of tables */
+#define YMODEM_CRC16_IMPL_SLICE8        4     /* Slice-by-8, 4 KiB of tables */
+
+#ifndef YMODEM_CRC16_IMPL
+    #if defined(__unix__) || defined(__APPLE__) || defined(_WIN32)
+        #define YMODEM_CRC16_IMPL       YMODEM_CRC16_IMPL_SLICE8
+    #else
+        #define YMODEM_CRC16_IMPL       YMODEM_CRC16_IMPL_TABLE
+    #endif
+#endif
+
+/* CRC32 kernels for BLK packets and whole-file checks, select one with YMODEM_CRC32_IMPL */
+#define YMODEM_CRC32_IMPL_BITWISE       0     /* No table, smallest code */
+#define YMODEM_CRC32_IMPL_NIBBLE        1     /* 64-byte table for small MCUs */
+#define YMODEM_CRC32_IMPL_TABLE         2     /* Classic 1 KiB table */
+#define YMODEM_CRC32_IMPL_SLICE4        3     /* Slice-by-4, 4 KiB of tables */
+#define YMODEM_CRC32_IMPL_SLICE8        4     /* Slice-by-8, 8 KiB of tables */
+
+#ifndef YMODEM_CRC32_IMPL
+    #if defined(__unix__) || defined(__APPLE__) || defined(_WIN32)
+        #define YMODEM_CRC32_IMPL       YMODEM_CRC32_IMPL_SLICE8
+    #else
+        #define YMODEM_CRC32_IMPL       YMODEM_CRC32_IMPL_TABLE
+    #endif
+#endif
+
+#ifndef YMODEM_CRC16_HW
+#define YMODEM_CRC16_HW                 1     /* Use PCLMULQDQ/PMULL at runtime when available */
+#endif
+
+/* Compile-time profile: features a small target can leave out. The branches
+ * on them are constant, the compiler drops the code that is left out */
+#ifndef YMODEM_SEND_ENABLE
+#define YMODEM_SEND_ENABLE              1     /* 0 for receiver-only builds, no sender code or sender state in the context */
+#endif
+
+#ifndef YMODEM_STX_ENABLE
+#define YMODEM_STX_ENABLE               1     /* 0 for 128-byte SOH packets only, buffers shrink to YMODEM_SOH_PACKET_SIZE */
+#endif
+
+#ifndef YMODEM_BLK_ENABLE
+#define YMODEM_BLK_ENABLE               YMODEM_STX_ENABLE /* Negotiated 8/32 KiB blocks */
+#endif
+
+#ifndef YMODEM_BATCH_ENABLE
+#define YMODEM_BATCH_ENABLE             1     /* 0 for one file per session */
+#endif
+
+#ifndef YMODEM_RESUME_ENABLE
+#define YMODEM_RESUME_ENABLE            1     /* Restarting interrupted files, the receiver's journal */
+#endif
+
+#ifndef YMODEM_WRITE_BEHIND_ENABLE
+#define YMODEM_WRITE_BEHIND_ENABLE      1     /* Receiver: batching file_write through a caller buffer */
+#endif
+
+#ifndef YMODEM_LZ_ENABLE
+#define YMODEM_LZ_ENABLE                1     /* Compressed transfers, ymodem_lz.c */
+#endif
+
+#ifndef YMODEM_DELTA_ENABLE
+#define YMODEM_DELTA_ENABLE             1     /* Skipping the blocks the receiver already has */
+#endif
+
+#ifndef YMODEM_DIGEST_ENABLE
+#define YMODEM_DIGEST_ENABLE            1     /* Whole-file digests and SUM frames, ymodem_digest.c */
+#endif
+
+#ifndef YMODEM_STATS_ENABLE
+#define YMODEM_STATS_ENABLE             1     /* Transfer statistics and the progress callback */
+#endif
+
+#if YMODEM_BLK_ENABLE && !YMODEM_STX_ENABLE
+#error "YMODEM_BLK_ENABLE needs YMODEM_STX_ENABLE"
+#endif
+
 /* YMODEM packet sizes */
 #define YMODEM_SOH_DATA_SIZE            128   /* SOH data size */
 #define YMODEM_STX_DATA_SIZE            1024  /* STX data size */
+#define YMODEM_MAX_DATA_SIZE            (YMODEM_STX_ENABLE ? YMODEM_STX_DATA_SIZE : YMODEM_SOH_DATA_SIZE)
 
 #define YMODEM_SOH_PACKET_SIZE          (1+2+YMODEM_SOH_DATA_SIZE+2)   /* SOH + seq + ~seq + data + CRC16 */
 #define YMODEM_STX_PACKET_SIZE          (1+2+YMODEM_STX_DATA_SIZE+2)   /* STX + seq + ~seq + data + CRC16 */
 
-#define YMODEM_MAX_PACKET_SIZE          YMODEM_STX_PACKET_SIZE         /* Maximum packet size */
-#define YMODEM_MAX_FILENAME_LENGTH      256   /* Maximum filename length */
+#define YMODEM_MAX_PACKET_SIZE          (1+2+YMODEM_MAX_DATA_SIZE+2)   /* Largest SOH/STX packet of the profile */
+
+/* Large blocks, only used once both sides agreed on them in packet 0 */
+#define YMODEM_BLK8K_DATA_SIZE          8192  /* 8 KiB block data size */
+#define YMODEM_BLK32K_DATA_SIZE         32768 /* 32 KiB block data size */
+
+#define YMODEM_BLK_PACKET_SIZE(size)    (1+2+(size)+4)                 /* BLK + seq + ~seq + data + CRC32 */
+#define YMODEM_BLK8K_PACKET_SIZE        YMODEM_BLK_PACKET_SIZE(YMODEM_BLK8K_DATA_SIZE)
+#define YMODEM_BLK32K_PACKET_SIZE       YMODEM_BLK_PACKET_SIZE(YMODEM_BLK32K_DATA_SIZE)
+
+#define YMODEM_MAX_BLK_PACKET_SIZE      YMODEM_BLK32K_PACKET_SIZE      /* Buffer size for any large block */
+
+/* Delta mode: blocks of the receiver's copy are hashed, unchanged ones are skipped */
+#define YMODEM_DELTA_BLOCK_SIZE         1024  /* Bytes covered by one hash of the map */
+#define YMODEM_DELTA_MAP_HASHES         30    /* CRC32s in one map packet, after the 8-byte header */
+#define YMODEM_SKP_PACKET_SIZE          (1+2+4+2)                      /* SKP + seq + ~seq + byte count + CRC16 */
+
+/* Whole-file digest, sent after the last data packet, shorter digests are padded with zeros */
+#define YMODEM_SUM_PACKET_SIZE          (1+2+YMODEM_DIGEST_MAX_SIZE+2) /* SUM + seq + ~seq + digest + CRC16 */
+
+#ifndef YMODEM_MAX_FILENAME_LENGTH
+#define YMODEM_MAX_FILENAME_LENGTH      256   /* Filename buffers, NUL included; longer names are cut */
+#endif
+
+/* Returned by file_size for a source without a known length (pipe, live compressor) */
+#define YMODEM_FILE_SIZE_UNKNOWN        (-2)
+
+/* Packet 0 extension token of a sender that can restart a file from an offset */
+#define YMODEM_EXT_RESUME               "resume"
+
+/* Packet 0 extension token of a sender that can send large blocks, followed by the largest data size */
+#define YMODEM_EXT_BLOCK                "blk="
+
+/* Packet 0 extension token of a sender that can compress the data, followed by its window bits */
+#define YMODEM_EXT_LZ                   "lz="
+
+/* Packet 0 extension token of a sender that can skip the blocks the receiver already has */
+#define YMODEM_EXT_DELTA                "delta"
+
+/* Packet 0 extension token of a sender that sends a digest of the whole file, followed by its name */
+#define YMODEM_EXT_DIGEST               "sum="
+
+/* Suffix of the receiver's resume journal, kept next to the received file */
+#define YMODEM_JOURNAL_SUFFIX           ".ymj"
 
 /* YMODEM file info structure */
 typedef struct {
-    char    filename[YMODEM_MAX_FILENAME_LENGTH];  /* File name */
-    size_t  filesize;                              /* File size */
+    char     filename[YMODEM_MAX_FILENAME_LENGTH]; /* File name */
+    uint64_t filesize;                             /* File size, 0 if not announced */
+    uint64_t mtime;                                /* Modification time in seconds since 1970 UTC, 0 if not announced */
+    uint32_t mode;                                 /* Unix file mode, 0 if not announced */
+    uint64_t resumed;                              /* Bytes kept from an earlier interrupted transfer */
+#if YMODEM_DIGEST_ENABLE
+    enum ymodem_digest_type verified;              /* Digest the whole file was checked with, YMODEM_DIGEST_NONE if none */
+    uint8_t  digest[YMODEM_DIGEST_MAX_SIZE];       /* Its value, as ymodem_digest_t.value */
+#endif
 } ymodem_file_info_t;
 
-/* File operation callbacks */
-typedef void* (*ymodem_file_open_func)(const char* filename, bool writing);
-typedef size_t (*ymodem_file_read_func)(void* file_handle, uint8_t* buffer, size_t size);
-typedef size_t (*ymodem_file_write_func)(void* file_handle, const uint8_t* buffer, size_t size);
-typedef void (*ymodem_file_close_func)(void* file_handle);
-typedef int (*ymodem_file_size_func)(void* file_handle);
+/* File operation callbacks - user is the pointer registered in ymodem_callbacks_t */
+typedef void* (*ymodem_file_open_func)(void* user, const char* filename, enum ymodem_open_mode mode);
+typedef size_t (*ymodem_file_read_func)(void* user, void* file_handle, uint8_t* buffer, size_t size);
+typedef size_t (*ymodem_file_write_func)(void* user, void* file_handle, const uint8_t* buffer, size_t size);
+typedef void (*ymodem_file_close_func)(void* user, void* file_handle);
+/* Size in bytes, YMODEM_FILE_SIZE_UNKNOWN to stream until file_read returns 0, other negatives on error */
+typedef int64_t (*ymodem_file_size_func)(void* user, void* file_handle);
+typedef int (*ymodem_file_sync_func)(void* user, void* file_handle);    /* 0 on success */
+/* Zero-copy read: point at up to size bytes at the read position and advance past them.
+ * The data must stay valid until file_close, NULL means the handle cannot be peeked. */
+typedef const uint8_t* (*ymodem_file_peek_func)(void* user, void* file_handle, size_t size, size_t* available);
+/* Tell a file opened for writing how big it is going to be, 0 on success */
+typedef int (*ymodem_file_reserve_func)(void* user, void* file_handle, uint64_t size);
+/* Move the read/write position to offset bytes from the start, 0 on success */
+typedef int (*ymodem_file_seek_func)(void* user, void* file_handle, uint64_t offset);
+/* Modification time (seconds since 1970 UTC) and Unix mode of an open file, 0 on success */
+typedef int (*ymodem_file_stat_func)(void* user, void* file_handle, uint64_t* mtime, uint32_t* mode);
+
+/* One piece of a scatter-gather send */
+typedef struct {
+    const uint8_t* data;
+    size_t         length;
+} ymodem_iovec_t;
 
 /* Communication callbacks - modified for multi-byte operations */
-typedef size_t (*ymodem_comm_send_func)(const uint8_t* data, size_t length);
-typedef size_t (*ymodem_comm_receive_func)(uint8_t* data, size_t max_length, uint32_t timeout_ms);
+typedef size_t (*ymodem_comm_send_func)(void* user, const uint8_t* data, size_t length);
+typedef size_t (*ymodem_comm_sendv_func)(void* user, const ymodem_iovec_t* iov, size_t iov_count);
+typedef size_t (*ymodem_comm_receive_func)(void* user, uint8_t* data, size_t max_length, uint32_t timeout_ms);
 
 /* Timing callbacks */
-typedef uint32_t (*ymodem_get_time_ms_func)(void);
-typedef void (*ymodem_delay_ms_func)(uint32_t ms);
+typedef uint32_t (*ymodem_get_time_ms_func)(void* user);
+typedef void (*ymodem_delay_ms_func)(void* user, uint32_t ms);
 
 /* Callback collection structure */
 typedef struct {
@@ -124,30 +380,173 @@ typedef struct {
     ymodem_file_read_func     file_read;
     ymodem_file_write_func    file_write;
     ymodem_file_close_func    file_close;
-    ymodem_file_size_func     file_size;
+    ymodem_file_size_func     file_size;         /* Optional for sending, NULL streams like YMODEM_FILE_SIZE_UNKNOWN */
+    ymodem_file_sync_func     file_sync;         /* Optional, e.g. fsync() */
+    ymodem_file_peek_func     file_peek;         /* Optional, sender sends file data in place */
+    ymodem_file_reserve_func  file_reserve;      /* Optional, receiver announces the size from packet 0 */
+    ymodem_file_seek_func     file_seek;         /* Optional, needed on both sides to resume a file */
+    ymodem_file_stat_func     file_stat;         /* Optional, sender announces mtime and mode in packet 0 */
     
     /* Communication callbacks */
     ymodem_comm_send_func     comm_send;
+    ymodem_comm_sendv_func    comm_sendv;        /* Optional, writev-style, returns total bytes sent */
     ymodem_comm_receive_func  comm_receive;
     
     /* Timing callbacks */
     ymodem_get_time_ms_func   get_time_ms;
     ymodem_delay_ms_func      delay_ms;
+    
+    /* Per-session user data, passed as first argument to every callback */
+    void*                     user;
 } ymodem_callbacks_t;
 
+/* Transfer statistics of a context, see ymodem_get_stats() */
+typedef struct {
+    uint64_t bytes_sent;         /* Raw bytes handed to the link */
+    uint64_t bytes_received;     /* Raw bytes read from the link, purged ones included */
+    uint64_t payload_bytes;      /* File bytes acknowledged (sender: packet data bytes when compressed) or written (receiver) */
+    uint32_t packets_sent;       /* Packets put on the wire, resends included */
+    uint32_t packets_received;   /* Packets received with a good CRC, duplicates included */
+    uint32_t retries;            /* Packets sent again (sender) or received again (receiver) */
+    uint32_t naks;               /* NAKs received (sender) or sent (receiver) */
+    uint32_t crc_errors;         /* Packets dropped for a bad CRC */
+    uint32_t seq_errors;         /* Packets dropped for a bad or unexpected sequence number */
+    uint32_t timeouts;           /* Waits for a packet or an answer that ran out */
+    uint32_t rtt_samples;        /* Sender: packets whose ACK round trip was measured */
+    uint32_t rtt_min_ms;         /* Sender: fastest ACK round trip */
+    uint32_t rtt_avg_ms;         /* Sender: mean ACK round trip */
+    uint32_t rtt_max_ms;         /* Sender: slowest ACK round trip */
+    uint32_t file_ms;            /* Time spent in file_read, file_peek and file_write */
+    uint32_t stage_ms[YMODEM_STAGE_FINISHED + 1]; /* Time spent in each stage */
+    uint32_t elapsed_ms;         /* Since the session started */
+    uint32_t raw_bps;            /* Link bytes per second, both directions */
+    uint32_t effective_bps;      /* File bytes per second */
+    uint64_t lz_file_bytes;      /* Compressed files: file bytes read (sender) or written (receiver) */
+    uint64_t lz_wire_bytes;      /* Compressed files: packet data bytes they took */
+    uint64_t delta_skipped_bytes; /* Delta mode: file bytes the receiver already had, not sent */
+} ymodem_stats_t;
+
+/* Add to a counter of ctx->stats, nothing is counted without YMODEM_STATS_ENABLE */
+#if YMODEM_STATS_ENABLE
+    #define YMODEM_STATS_ADD(ctx, counter, value) ((ctx)->stats.counter += (value))
+#else
+    #define YMODEM_STATS_ADD(ctx, counter, value) ((void)sizeof(value))
+#endif
+
+/* Progress callback: every stage change, and at most every interval during the transfer */
+typedef void (*ymodem_progress_func)(void* user, enum ymodem_stage stage, const ymodem_stats_t* stats);
+
+/* Trace sink: one message per call, without a trailing newline */
+typedef void (*ymodem_trace_func)(void* user, int level, const char* message);
+
+/* Ring buffer that keeps the latest trace messages, see ymodem_trace_ring_sink() */
+typedef struct {
+    char*  buffer;                /* Storage, messages are separated by '\n' */
+    size_t size;                  /* Size of buffer */
+    size_t head;                  /* Next byte to write */
+    bool   wrapped;               /* Older messages were overwritten */
+} ymodem_trace_ring_t;
+
+/* Running check of a packet that arrives in pieces, see ymodem_rx_crc_update() */
+typedef struct {
+    size_t   size;                /* Full packet size, header and CRC included */
+    size_t   trailer;             /* CRC bytes at the end, 2 (CRC16) or 4 (CRC32) */
+    size_t   checked;             /* Packet bytes covered by crc so far */
+    uint32_t crc;                 /* CRC of the data bytes checked so far */
+} ymodem_rx_crc_t;
+
+/* Deadline of a wait made of several receives, see ymodem_deadline_start() */
+typedef struct {
+    uint32_t start_ms;            /* Clock at the start */
+    uint32_t budget_ms;           /* Length of the wait */
+    uint32_t spent_ms;            /* Without get_time_ms: time counted by ymodem_deadline_spend() */
+    bool     clock;               /* get_time_ms is there, spent_ms is not used */
+} ymodem_deadline_t;
+
 /* YMODEM context structure */
 typedef struct {
     ymodem_callbacks_t callbacks;        /* Registered callbacks */
     enum ymodem_stage  stage;            /* Current transmission stage */
     uint8_t*           buffer;           /* Data buffer */
     size_t             buffer_size;      /* Buffer size */
-    uint8_t*           send_buffer;      /* Send Data buffer */
-    size_t             send_buffer_size; /* Send Buffer size */
     void*              file_handle;      /* Current file handle */
-    int                file_size;        /* Current file size */
+    int64_t            file_size;        /* Current file size, YMODEM_FILE_SIZE_UNKNOWN when streaming */
+    uint64_t           file_mtime;       /* Modification time announced in packet 0, 0 if none */
+    uint32_t           file_mode;        /* Unix mode announced in packet 0, 0 if none */
+    uint64_t           file_offset;      /* Bytes of the current file already in place before packet 1 */
     char               filename[YMODEM_MAX_FILENAME_LENGTH]; /* Current filename */
     uint8_t            packet_seq;       /* Current packet sequence number */
     uint8_t            error_count;      /* Error counter */
+    enum ymodem_mode   mode;             /* Requested transfer mode */
+    uint8_t            start_code;       /* Handshake character in use ('C' or 'G') */
+#if YMODEM_SEND_ENABLE /* Sender state, left out of receiver-only builds */
+    uint8_t*           window_buffer;    /* Ring of built packets for pipelined sending */
+    uint8_t            window_count;     /* Packets kept in flight, 0 for stop-and-wait */
+    size_t             packet_data_size; /* Sender: data bytes read per packet, 1024 or 128 on a noisy link */
+    bool               adaptive;         /* Sender: adapt packet size and retransmit timeout to the link */
+    uint32_t           srtt_ms;          /* Sender: smoothed round trip time, 0 until measured */
+    uint32_t           rttvar_ms;        /* Sender: round trip time variation */
+    uint32_t           rto_ms;           /* Sender: current retransmit timeout */
+    uint16_t           clean_packets;    /* Sender: packets ACKed at the first attempt in a row */
+#if YMODEM_LZ_ENABLE
+    ymodem_lz_encoder_t* lz_encoder;     /* Sender: compressor, NULL to send plain data */
+#endif
+#if YMODEM_DELTA_ENABLE
+    uint32_t*          delta_map;        /* Sender: block hashes of the receiver's copy, NULL to not offer delta mode */
+    size_t             delta_map_size;   /* Sender: hashes delta_map can hold */
+    uint64_t           delta_offset;     /* Sender: file position of the next packet to build */
+#endif
+#endif
+    size_t             block_max;        /* Largest block offered (sender) or accepted (receiver), 0 for none */
+    size_t             block_size;       /* Large block data size agreed for the current file, 0 for STX */
+    size_t             peer_block;       /* Receiver: largest block offered in packet 0, 0 if none */
+#if YMODEM_WRITE_BEHIND_ENABLE
+    uint8_t*           wb_buffer;        /* Write-behind buffer of the receiver, NULL for direct writes */
+    size_t             wb_size;          /* Chunk size handed to file_write */
+    size_t             wb_fill;          /* Bytes waiting in wb_buffer */
+#endif
+    enum ymodem_sync   sync;             /* When the receiver calls file_sync */
+#if YMODEM_RESUME_ENABLE
+    bool               resume;           /* Sender: offers to restart from an offset. Receiver: keeps a journal */
+    bool               peer_resume;      /* Receiver: packet 0 carried YMODEM_EXT_RESUME */
+    uint64_t           committed;        /* Receiver: bytes of the file handed to file_write */
+    uint32_t           committed_crc;    /* Receiver: CRC32 of those bytes */
+    uint64_t           journal_mark;     /* Receiver: committed at the last journal update */
+#endif
+#if YMODEM_LZ_ENABLE
+    ymodem_lz_decoder_t* lz_decoder;     /* Receiver: decompressor, NULL to refuse compression */
+    uint8_t            peer_lz;          /* Receiver: window bits offered in packet 0, 0 if none */
+    bool               lz;               /* The data of the current file is compressed */
+#endif
+#if YMODEM_DELTA_ENABLE
+    uint32_t           delta_blocks;     /* Blocks in the map of the current file (sender: announced, maybe more than held) */
+    bool               delta_accept;     /* Receiver: answers a delta offer with the map of an existing copy */
+    bool               peer_delta;       /* Receiver: packet 0 carried YMODEM_EXT_DELTA */
+    bool               delta;            /* Skip frames are in use for the current file */
+#endif
+#if YMODEM_DIGEST_ENABLE
+    ymodem_digest_t*   digest;           /* Whole-file digest (sender: of the type offered), NULL for none */
+    uint8_t            peer_digest;      /* Receiver: digest type offered in packet 0, YMODEM_DIGEST_NONE if none */
+    bool               verify;           /* The current file is hashed and ends with a SUM frame */
+#endif
+    uint32_t           now_ms;           /* Clock of the event-driven engine, used when get_time_ms is NULL */
+#if YMODEM_STATS_ENABLE
+    ymodem_stats_t     stats;            /* Counters and timings of the session */
+    uint32_t           stats_start_ms;   /* When the session started */
+    uint32_t           stage_start_ms;   /* When the current stage was entered */
+    uint64_t           rtt_total_ms;     /* Sum of the measured round trips */
+    ymodem_progress_func progress;       /* Optional progress callback */
+    uint32_t           progress_interval_ms; /* Least time between two progress calls */
+    uint32_t           progress_last_ms; /* Time of the last progress call */
+#endif
+    uint32_t           handshake_interval_ms; /* Receiver: time between two 'C' ('G') */
+    uint32_t           handshake_timeout_ms; /* Handshake timeout, 0 to use the one given in seconds */
+    bool               peer_waiting;     /* Sender: receiver is already polling, send packet 0 at once */
+#if YMODEM_TRACE_LEVEL > YMODEM_TRACE_NONE
+    ymodem_trace_func  trace;            /* Trace sink, NULL for stdout */
+    void*              trace_user;       /* User argument of the trace sink */
+    int                trace_level;      /* Highest level passed on, YMODEM_TRACE_NONE for off */
+#endif
 } ymodem_context_t;
 
 /* Debug helper functions */
@@ -157,11 +556,146 @@ const char* ymodem_stage_to_str(enum ymodem_stage stage);
 
 /* Common helper functions */
 uint16_t ymodem_calc_crc16(const uint8_t* buffer, size_t size);
+uint16_t ymodem_crc16_update(uint16_t crc, const uint8_t* buffer, size_t size);
+const char* ymodem_crc16_kernel_name(void);
+uint32_t ymodem_crc32_update(uint32_t crc, const uint8_t* buffer, size_t size);
+const char* ymodem_crc32_kernel_name(void);
 const char* ymodem_get_path_basename(const char* path);
 size_t ymodem_send_bytes(ymodem_context_t* ctx, const uint8_t* data, size_t length);
+size_t ymodem_send_vec(ymodem_context_t* ctx, const ymodem_iovec_t* iov, size_t iov_count);
 size_t ymodem_receive_bytes(ymodem_context_t* ctx, uint8_t* data, size_t length, uint32_t timeout_ms);
 bool ymodem_send_byte(ymodem_context_t* ctx, uint8_t data);
 int ymodem_receive_byte(ymodem_context_t* ctx, uint32_t timeout_ms);
+void ymodem_send_cancel(ymodem_context_t* ctx);
+void ymodem_purge(ymodem_context_t* ctx);
+
+/* Statistics, kept by both engines */
+uint32_t ymodem_now_ms(ymodem_context_t* ctx);
+void ymodem_stats_reset(ymodem_context_t* ctx);
+void ymodem_set_stage(ymodem_context_t* ctx, enum ymodem_stage stage);
+void ymodem_stats_rtt(ymodem_context_t* ctx, uint32_t rtt_ms);
+void ymodem_stats_payload(ymodem_context_t* ctx, size_t length);
+
+/**
+ * @brief Get the statistics of the current (or last) session
+ * 
+ * Counters run from the start of a session (ymodem_send_files(),
+ * ymodem_receive_files() or an event-driven init) until the next one
+ * starts. Elapsed time and throughput are brought up to date on every
+ * packet that gets through, every stage change and when the session ends.
+ * Durations need get_time_ms (the event-driven engine uses its own clock).
+ * file_ms against the time in YMODEM_STAGE_TRANSMITTING, together with the
+ * error counters, tells a slow file source from a noisy link. Without
+ * YMODEM_STATS_ENABLE nothing is counted and every field stays 0.
+ * 
+ * @param ctx YMODEM context
+ * @return const ymodem_stats_t* Statistics, valid as long as ctx
+ */
+const ymodem_stats_t* ymodem_get_stats(const ymodem_context_t* ctx);
+
+/**
+ * @brief Register a progress callback
+ * 
+ * The callback is called on every stage change and, during the transfer,
+ * after a packet when at least interval_ms have passed since the last call.
+ * It runs on the transfer path and must return quickly. It needs
+ * YMODEM_STATS_ENABLE, without it only NULL is accepted.
+ * 
+ * @param ctx Initialized YMODEM context
+ * @param progress Callback, its user argument is callbacks.user; NULL to remove it
+ * @param interval_ms Least time between two calls, 0 for every packet
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_set_progress(ymodem_context_t* ctx, ymodem_progress_func progress, uint32_t interval_ms);
+
+/**
+ * @brief Tune the handshake for short sessions
+ * 
+ * The handshake runs against a deadline in milliseconds and every wait
+ * returns as soon as a byte arrives, so a sender answers the first 'C' at
+ * once and a receiver takes packet 0 as soon as it starts. interval_ms sets
+ * how often the receiver repeats its 'C' ('G'): the sender can start up to
+ * one interval before it is heard. With peer_waiting a sender that knows the
+ * receiver is already polling (e.g. it is started by the same production
+ * script) does not wait for a 'C' at all: stale 'C's are drained and packet
+ * 0 goes out right away. Precise timing needs get_time_ms, without it the
+ * waits are added up. Call after the init function.
+ * 
+ * @param ctx Initialized YMODEM context
+ * @param interval_ms Receiver: time between two 'C', 0 for YMODEM_HANDSHAKE_INTERVAL_MS
+ * @param timeout_ms Handshake timeout, 0 to use the seconds given to the send/receive call
+ * @param peer_waiting Sender: send packet 0 without waiting for 'C'
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_set_handshake(ymodem_context_t* ctx, uint32_t interval_ms, uint32_t timeout_ms, bool peer_waiting);
+
+/* Handshake deadlines shared by the sender and the receiver */
+void ymodem_deadline_start(ymodem_context_t* ctx, ymodem_deadline_t* deadline, uint32_t budget_ms);
+uint32_t ymodem_deadline_elapsed(ymodem_context_t* ctx, const ymodem_deadline_t* deadline);
+void ymodem_deadline_spend(ymodem_deadline_t* deadline, uint32_t ms);
+uint32_t ymodem_handshake_budget_ms(const ymodem_context_t* ctx, int timeout_s);
+void ymodem_drain(ymodem_context_t* ctx);
+
+/**
+ * @brief Route the trace of a context to a sink
+ * 
+ * Messages up to level are formatted (at most YMODEM_TRACE_LINE_SIZE bytes)
+ * and handed to trace on the transfer path, so the sink must be quick,
+ * ymodem_trace_ring_sink() only copies into memory. Levels above
+ * YMODEM_TRACE_LEVEL are not compiled in and are never passed on. A new
+ * context starts at YMODEM_TRACE_DEFAULT without a sink.
+ * 
+ * @param ctx Initialized YMODEM context
+ * @param trace Sink, NULL to print to stdout
+ * @param trace_user User argument of the sink
+ * @param level Highest level passed on, YMODEM_TRACE_NONE to turn tracing off
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_set_trace(ymodem_context_t* ctx, ymodem_trace_func trace, void* trace_user, int level);
+void ymodem_trace(ymodem_context_t* ctx, int level, const char* format, ...) YMODEM_PRINTF_FORMAT(3, 4);
+const char* ymodem_trace_level_to_str(int level);
+
+/**
+ * @brief Prepare a ring buffer for ymodem_trace_ring_sink()
+ * 
+ * @param ring Ring to initialize
+ * @param buffer Storage for the messages
+ * @param size Size of buffer
+ */
+void ymodem_trace_ring_init(ymodem_trace_ring_t* ring, char* buffer, size_t size);
+
+/**
+ * @brief Trace sink that appends to a ymodem_trace_ring_t given as user
+ * 
+ * Each message is stored as "<level> <message>\n", the oldest bytes are
+ * overwritten once the ring is full.
+ */
+void ymodem_trace_ring_sink(void* user, int level, const char* message);
+
+/**
+ * @brief Copy the kept messages out of a ring, oldest first
+ * 
+ * A partly overwritten oldest message is skipped.
+ * 
+ * @param ring Ring filled by ymodem_trace_ring_sink()
+ * @param out Destination, NUL terminated
+ * @param out_size Size of out
+ * @return size_t Bytes copied, without the NUL
+ */
+size_t ymodem_trace_ring_read(const ymodem_trace_ring_t* ring, char* out, size_t out_size);
+
+/* Packet helpers shared by the blocking and the event-driven engines */
+size_t ymodem_packet_size(uint8_t code);
+size_t ymodem_frame_size(const ymodem_context_t* ctx, uint8_t code);
+void ymodem_frame_packet(uint8_t* packet, uint8_t seq, size_t data_size);
+size_t ymodem_load_packet(ymodem_context_t* ctx, uint8_t* packet, uint8_t seq);
+int ymodem_check_packet(const uint8_t* packet, uint8_t* seq, size_t* data_size);
+int ymodem_check_block(const uint8_t* packet, size_t data_size, uint8_t* seq);
+void ymodem_rx_crc_start(ymodem_rx_crc_t* rc, uint8_t code, size_t packet_size);
+void ymodem_rx_crc_update(ymodem_rx_crc_t* rc, const uint8_t* packet, size_t length);
+int ymodem_rx_crc_finish(const ymodem_rx_crc_t* rc, const uint8_t* packet, uint8_t* seq, size_t* data_size);
+int ymodem_prepare_file_info_packet(ymodem_context_t* ctx, const char* filename);
+int ymodem_parse_file_info(ymodem_context_t* ctx, ymodem_file_info_t* file_info);
 
 #ifdef __cplusplus
 }
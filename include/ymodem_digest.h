@@ -0,0 +1,86 @@
+/**
+ * @file ymodem_digest.h
+ * @brief Whole-file digest header
+ * @date 2025-04-09
+ * 
+ * This file contains the API of the digest both sides run over the file
+ * data when they agree on it in packet 0 (YMODEM_EXT_DIGEST). The sender
+ * hashes the bytes as it reads them, the receiver as it writes them, and
+ * the sender's value follows the last data packet in a SUM frame. The
+ * packet CRCs only cover one packet each; the digest also catches lost,
+ * repeated or reordered data and a wrong cut of the last packet.
+ */
+
+#ifndef __YMODEM_DIGEST_H__
+#define __YMODEM_DIGEST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Digest kinds, the names are the ones used in packet 0 */
+enum ymodem_digest_type {
+    YMODEM_DIGEST_NONE = 0,
+    YMODEM_DIGEST_CRC32,          /* "crc32", the CRC32 of the resume journal, 4 bytes big-endian */
+    YMODEM_DIGEST_SHA256,         /* "sha256", FIPS 180-4, 32 bytes */
+};
+
+#define YMODEM_DIGEST_MAX_SIZE          32    /* Largest digest, the data size of a SUM frame */
+
+/* Digest state, about 150 bytes */
+typedef struct {
+    enum ymodem_digest_type type;     /* Kind of digest */
+    uint64_t length;                  /* Bytes hashed since the init */
+    uint32_t state[8];                /* SHA-256 chaining value, state[0] is the CRC32 */
+    uint8_t  block[64];               /* SHA-256 input not yet compressed */
+    uint8_t  value[YMODEM_DIGEST_MAX_SIZE]; /* Result of ymodem_digest_final() */
+} ymodem_digest_t;
+
+/**
+ * @brief Start a new digest
+ * 
+ * @param digest Digest state
+ * @param type YMODEM_DIGEST_CRC32 or YMODEM_DIGEST_SHA256
+ */
+void ymodem_digest_init(ymodem_digest_t* digest, enum ymodem_digest_type type);
+
+/**
+ * @brief Hash the next size bytes
+ */
+void ymodem_digest_update(ymodem_digest_t* digest, const uint8_t* data, size_t size);
+
+/**
+ * @brief Finish the digest into digest->value
+ * 
+ * @param digest Digest state, it needs a new init before the next update
+ * @return size_t Bytes of the digest, the rest of value is zero
+ */
+size_t ymodem_digest_final(ymodem_digest_t* digest);
+
+/**
+ * @brief Size of a digest of this type, 0 for YMODEM_DIGEST_NONE
+ */
+size_t ymodem_digest_size(enum ymodem_digest_type type);
+
+/**
+ * @brief Name of a digest type as used in packet 0
+ */
+const char* ymodem_digest_name(enum ymodem_digest_type type);
+
+/**
+ * @brief Digest type of a name used in packet 0
+ * 
+ * @param name Name, not necessarily NUL terminated
+ * @param length Length of the name
+ * @return enum ymodem_digest_type YMODEM_DIGEST_NONE for an unknown name
+ */
+enum ymodem_digest_type ymodem_digest_parse(const char* name, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __YMODEM_DIGEST_H__ */
@@ -0,0 +1,154 @@
+/**
+ * @file ymodem_fsm.h
+ * @brief Non-blocking, event-driven YMODEM engine header
+ * @date 2025-04-09
+ * 
+ * This file contains the API of the reentrant YMODEM state machine. Instead
+ * of blocking in comm_receive, the caller feeds received bytes in, polls for
+ * bytes to transmit and for the next deadline, and drives the timeouts with
+ * its own clock. One event loop (epoll, libuv, a bare-metal main loop or a
+ * UART ISR with DMA) can serve any number of sessions.
+ * 
+ * The state machine speaks the same protocol as ymodem_send_file() and
+ * ymodem_receive_file(): classic stop-and-wait with retransmission and
+ * YMODEM-G streaming, one file per session. comm_send, comm_receive,
+ * get_time_ms and delay_ms are not used, only the file callbacks are; the
+ * statistics (see ymodem_get_stats() on fsm->ctx) follow the caller's clock.
+ */
+
+#ifndef __YMODEM_FSM_H__
+#define __YMODEM_FSM_H__
+
+#include "ymodem_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returned by ymodem_feed()/ymodem_fsm_result() while the session is still running */
+#define YMODEM_FSM_BUSY     1
+
+/* Event-driven session */
+typedef struct {
+    ymodem_context_t   ctx;              /* Protocol state shared with the blocking engine */
+    bool               sending;          /* true for a sender, false for a receiver */
+    uint8_t            state;            /* Step inside ctx.stage */
+    int                result;           /* YMODEM_FSM_BUSY while running, then the final result */
+    uint32_t           now;              /* Time of the last feed/poll */
+    uint32_t           deadline;         /* Absolute time of the next timeout */
+    uint32_t           wait_ms;          /* Timeout armed once the pending output is drained */
+    uint32_t           handshake_end;    /* Absolute end of the handshake */
+    size_t             rx_length;        /* Bytes of the current packet collected in ctx.buffer */
+    size_t             rx_expected;      /* Full size of the packet being collected */
+    ymodem_rx_crc_t    rx_crc;           /* CRC of the packet, updated as each chunk is fed */
+    const uint8_t*     tx_data;          /* Pending output */
+    size_t             tx_length;        /* Bytes of pending output left */
+    uint8_t            tx_small[YMODEM_CAN_SEND_COUNT + 4]; /* Storage for control bytes */
+    uint8_t            expected_seq;     /* Next data packet expected by the receiver */
+    uint8_t            retries;          /* Retries of the current step */
+    bool               nak_pending;      /* Receiver: NAK sent, waiting for the resend */
+    bool               got_ack;          /* Sender: packet 0 acknowledged */
+    bool               late_c;           /* Sender: 'C' without ACK after packet 0, waiting briefly for the ACK */
+    bool               last_packet;      /* Sender: packet in flight is the last one */
+    uint64_t           total;            /* File bytes sent or written so far */
+    ymodem_file_info_t file_info;        /* Receiver: info from packet 0 */
+} ymodem_fsm_t;
+
+#if YMODEM_SEND_ENABLE
+/**
+ * @brief Start an event-driven sender
+ * 
+ * The file is opened right away. Nothing is transmitted until the receiver
+ * sends 'C' (or 'G' when mode is YMODEM_MODE_G).
+ * 
+ * @param fsm Session to initialize
+ * @param callbacks File callbacks (open, read, close, optional size) and their user data
+ * @param buffer Packet buffer (at least YMODEM_MAX_PACKET_SIZE bytes)
+ * @param buffer_size Size of buffer
+ * @param mode YMODEM_MODE_G also accepts a YMODEM-G receiver
+ * @param filename File to send
+ * @param handshake_timeout_s Handshake timeout in seconds
+ * @param now_ms Current time in milliseconds
+ * @return int YMODEM_ERR_NONE on success or error code
+ */
+int ymodem_fsm_send_init(ymodem_fsm_t* fsm,
+                        const ymodem_callbacks_t* callbacks,
+                        uint8_t* buffer,
+                        size_t buffer_size,
+                        enum ymodem_mode mode,
+                        const char* filename,
+                        int handshake_timeout_s,
+                        uint32_t now_ms);
+#endif
+
+/**
+ * @brief Start an event-driven receiver
+ * 
+ * The first 'C' ('G' for YMODEM_MODE_G) is queued right away and repeated
+ * every fsm->ctx.handshake_interval_ms (YMODEM_HANDSHAKE_INTERVAL_MS, see
+ * ymodem_set_handshake() for the cadence) until the sender answers.
+ * 
+ * @param fsm Session to initialize
+ * @param callbacks File callbacks (open, write, close) and their user data
+ * @param buffer Packet buffer (at least YMODEM_MAX_PACKET_SIZE bytes)
+ * @param buffer_size Size of buffer
+ * @param mode Transfer mode to request
+ * @param handshake_timeout_s Handshake timeout in seconds
+ * @param now_ms Current time in milliseconds
+ * @return int YMODEM_ERR_NONE on success or error code
+ */
+int ymodem_fsm_receive_init(ymodem_fsm_t* fsm,
+                           const ymodem_callbacks_t* callbacks,
+                           uint8_t* buffer,
+                           size_t buffer_size,
+                           enum ymodem_mode mode,
+                           int handshake_timeout_s,
+                           uint32_t now_ms);
+
+/**
+ * @brief Hand received bytes to the session
+ * 
+ * Safe to call with any split of the byte stream, e.g. from a DMA or
+ * read() completion. Responses are queued and collected with ymodem_poll().
+ * 
+ * @param fsm Session
+ * @param data Received bytes
+ * @param length Number of bytes
+ * @param now_ms Current time in milliseconds
+ * @return int YMODEM_FSM_BUSY while running, then the final result
+ */
+int ymodem_feed(ymodem_fsm_t* fsm, const uint8_t* data, size_t length, uint32_t now_ms);
+
+/**
+ * @brief Run expired timers and collect bytes to transmit
+ * 
+ * Call whenever the link can take more output and whenever the deadline
+ * returned through deadline_ms has passed.
+ * 
+ * @param fsm Session
+ * @param now_ms Current time in milliseconds
+ * @param out Buffer for bytes to transmit
+ * @param max_length Size of out
+ * @param deadline_ms Optional, returns the absolute time poll must be called again
+ * @return size_t Number of bytes stored in out
+ */
+size_t ymodem_poll(ymodem_fsm_t* fsm, uint32_t now_ms, uint8_t* out, size_t max_length, uint32_t* deadline_ms);
+
+/**
+ * @brief Get the outcome of a session
+ * 
+ * @return int YMODEM_FSM_BUSY while running or while output is still pending,
+ *             YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_fsm_result(const ymodem_fsm_t* fsm);
+
+/**
+ * @brief Close the file if the session was abandoned before it finished
+ */
+void ymodem_fsm_cleanup(ymodem_fsm_t* fsm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __YMODEM_FSM_H__ */
@@ -0,0 +1,154 @@
+/**
+ * @file ymodem_lz.h
+ * @brief Streaming LZ compression header
+ * @date 2025-04-09
+ * 
+ * This file contains the API of the compression used for file data when
+ * both sides agree on it in packet 0 (YMODEM_EXT_LZ). It is an LZSS byte
+ * stream: a flag byte announces the next eight items, least significant bit
+ * first; a 0 bit is one literal byte, a 1 bit a big-endian 16-bit match of
+ * window_bits bits distance - 1 and 16 - window_bits bits length - 3. The
+ * stream has no header and no end marker, the receiver stops after the file
+ * size announced in packet 0. Both sides work in fixed memory: the decoder
+ * is its window, the encoder its window twice plus a hash table. Any chunking
+ * of the stream into packets decodes the same.
+ */
+
+#ifndef __YMODEM_LZ_H__
+#define __YMODEM_LZ_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Settings can come from the configuration header, see ymodem_common.h */
+#ifdef YMODEM_CONFIG_FILE
+#include YMODEM_CONFIG_FILE
+#endif
+
+/* log2 of the window, 8 to 12. A receiver accepts streams of this window or a smaller one */
+#ifndef YMODEM_LZ_WINDOW_BITS
+#define YMODEM_LZ_WINDOW_BITS           10
+#endif
+
+#ifndef YMODEM_LZ_CHAIN_DEPTH
+#define YMODEM_LZ_CHAIN_DEPTH           16    /* Earlier positions tried per match search */
+#endif
+
+#if YMODEM_LZ_WINDOW_BITS < 8 || YMODEM_LZ_WINDOW_BITS > 12
+#error "YMODEM_LZ_WINDOW_BITS must be between 8 and 12"
+#endif
+
+#define YMODEM_LZ_WINDOW_SIZE           (1u << YMODEM_LZ_WINDOW_BITS)
+#define YMODEM_LZ_MIN_MATCH             3
+#define YMODEM_LZ_MAX_MATCH             (YMODEM_LZ_MIN_MATCH + (1u << (16 - YMODEM_LZ_WINDOW_BITS)) - 1)
+#define YMODEM_LZ_HASH_BITS             (YMODEM_LZ_WINDOW_BITS + 1)
+#define YMODEM_LZ_BUFFER_SIZE           (2 * YMODEM_LZ_WINDOW_SIZE + YMODEM_LZ_MAX_MATCH)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Compressor state, about 14 KiB with the default window */
+typedef struct {
+    uint8_t  buffer[YMODEM_LZ_BUFFER_SIZE]; /* History and input not yet encoded */
+    uint32_t head[1u << YMODEM_LZ_HASH_BITS]; /* Latest stream position + 1 of each hash, 0 for none */
+    uint32_t prev[YMODEM_LZ_WINDOW_SIZE];   /* Previous position + 1 with the same hash */
+    uint32_t base;                    /* Stream position of buffer[0] */
+    size_t   pos;                     /* Next byte to encode */
+    size_t   end;                     /* End of the input */
+    bool     eof;                     /* No more input will come */
+    uint8_t  group[1 + 2 * 8];        /* Flag byte and items being collected */
+    size_t   group_length;
+    uint8_t  group_items;
+    size_t   ready;                   /* Bytes of group complete and not yet handed out */
+    size_t   ready_pos;
+    uint64_t total_in;                /* Bytes taken in since the reset */
+    uint64_t total_out;               /* Bytes handed out since the reset */
+} ymodem_lz_encoder_t;
+
+/* Decompressor state, the window and a few bytes */
+typedef struct {
+    uint8_t  window[YMODEM_LZ_WINDOW_SIZE]; /* Output ring, also the history of the matches */
+    size_t   pos;                     /* Next output position in window */
+    uint8_t  bits;                    /* Window bits of the stream */
+    uint8_t  flags;                   /* Flag byte of the current group */
+    uint8_t  flag_count;              /* Items of the group still to come */
+    uint8_t  token;                   /* First byte of a match that was split */
+    bool     split;                   /* token is valid */
+    uint16_t match_length;            /* Bytes of a match still to copy */
+    uint16_t match_distance;
+    uint64_t total_in;                /* Bytes taken in since the reset */
+    uint64_t total_out;               /* Bytes produced since the reset */
+} ymodem_lz_decoder_t;
+
+/**
+ * @brief Start a new stream
+ */
+void ymodem_lz_encoder_reset(ymodem_lz_encoder_t* encoder);
+
+/**
+ * @brief Room for more input
+ * 
+ * @param encoder Compressor
+ * @param room Returns how many bytes can be stored at the returned pointer, 0 when full
+ * @return uint8_t* Where to put the input, pass the count to ymodem_lz_encoder_commit()
+ */
+uint8_t* ymodem_lz_encoder_input(ymodem_lz_encoder_t* encoder, size_t* room);
+
+/**
+ * @brief Take length bytes stored at ymodem_lz_encoder_input(), 0 marks the end of the input
+ */
+void ymodem_lz_encoder_commit(ymodem_lz_encoder_t* encoder, size_t length);
+
+/**
+ * @brief Produce compressed bytes
+ * 
+ * Encodes as far as the input allows: without the end of the input a match
+ * needs YMODEM_LZ_MAX_MATCH bytes ahead. Returns less than size when more
+ * input is needed or the stream is complete, see ymodem_lz_encoder_done().
+ * 
+ * @param encoder Compressor
+ * @param out Output
+ * @param size Room in out
+ * @return size_t Bytes written to out
+ */
+size_t ymodem_lz_encode(ymodem_lz_encoder_t* encoder, uint8_t* out, size_t size);
+
+/**
+ * @brief Whether the input has ended and all of it was handed out compressed
+ */
+bool ymodem_lz_encoder_done(const ymodem_lz_encoder_t* encoder);
+
+/**
+ * @brief Start a new stream
+ * 
+ * @param decoder Decompressor
+ * @param bits Window bits of the stream, at most YMODEM_LZ_WINDOW_BITS
+ * @return bool false if the window does not fit
+ */
+bool ymodem_lz_decoder_reset(ymodem_lz_decoder_t* decoder, unsigned int bits);
+
+/**
+ * @brief Decompress the next piece of the stream
+ * 
+ * The output stays in the window: it is the bytes at *out, up to the end of
+ * the window or the input. They are valid until the next call, so take them
+ * and call again with the rest of the input until *consumed covers it and
+ * nothing more comes out.
+ * 
+ * @param decoder Decompressor
+ * @param in Compressed bytes
+ * @param length Number of them
+ * @param consumed Returns how many were used
+ * @param out Returns the start of the output
+ * @return size_t Bytes of output
+ */
+size_t ymodem_lz_decode(ymodem_lz_decoder_t* decoder, const uint8_t* in, size_t length,
+                        size_t* consumed, const uint8_t** out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __YMODEM_LZ_H__ */
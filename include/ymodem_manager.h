@@ -0,0 +1,117 @@
+/**
+ * @file ymodem_manager.h
+ * @brief Multi-port YMODEM transfer manager header
+ * @date 2025-04-09
+ * 
+ * This file contains the API for running many YMODEM sessions in parallel
+ * on a fixed pool of worker threads, e.g. flashing the same image onto a
+ * rack of boards. It is built on top of ymodem_send_file/ymodem_receive_file
+ * and needs POSIX threads, so it is only available on hosted platforms.
+ */
+
+#ifndef __YMODEM_MANAGER_H__
+#define __YMODEM_MANAGER_H__
+
+#include "ymodem_common.h"
+
+/* Sessions send as well as receive, so a receiver-only profile has no manager */
+#ifndef YMODEM_MANAGER_ENABLE
+    #if (defined(__unix__) || defined(__APPLE__)) && YMODEM_SEND_ENABLE
+        #define YMODEM_MANAGER_ENABLE   1
+    #else
+        #define YMODEM_MANAGER_ENABLE   0
+    #endif
+#endif
+
+#if YMODEM_MANAGER_ENABLE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* One port (session) driven by the manager */
+typedef struct {
+    /* Filled in by the caller */
+    const char*        name;             /* Port label for reports, e.g. "/dev/ttyUSB3" */
+    ymodem_callbacks_t callbacks;        /* Communication/timing callbacks and their user data.
+                                          * File callbacks are only used when receiving. */
+    enum ymodem_mode   mode;             /* Transfer mode for this port */
+    uint8_t            window_count;     /* Packets in flight when sending, 0 for stop-and-wait */
+    
+    /* Filled in by the manager */
+    int                result;           /* YMODEM_ERR_NONE or error code */
+    uint64_t           bytes;            /* File bytes transferred */
+    uint32_t           elapsed_ms;       /* Wall time of this session */
+    ymodem_stats_t     stats;            /* Link statistics, durations need get_time_ms */
+    ymodem_file_info_t file_info;        /* Received file info (receive only) */
+} ymodem_port_t;
+
+/* Aggregate results of one manager run */
+typedef struct {
+    size_t             ports_ok;         /* Sessions that completed successfully */
+    size_t             ports_failed;     /* Sessions that returned an error */
+    uint64_t           total_bytes;      /* Sum of bytes over all ports */
+    uint32_t           elapsed_ms;       /* Wall time of the whole run */
+    uint64_t           bytes_per_second; /* Aggregate throughput over all ports */
+} ymodem_manager_stats_t;
+
+/**
+ * @brief Send one in-memory image to many ports in parallel
+ * 
+ * The image is shared read-only by all sessions, each session only keeps its
+ * own read cursor. Ports are handed out to worker_count threads in order.
+ * 
+ * @param ports Array of ports, results are written back into each entry
+ * @param port_count Number of ports
+ * @param worker_count Number of worker threads (0 for one thread per port)
+ * @param filename File name announced in packet 0 (the path is stripped)
+ * @param image Image data
+ * @param image_size Size of the image
+ * @param handshake_timeout_s Handshake timeout in seconds for each port
+ * @param stats Optional aggregate results, may be NULL
+ * @return int YMODEM_ERR_NONE if every port succeeded, the first error code otherwise
+ */
+int ymodem_manager_send_image(ymodem_port_t* ports,
+                             size_t port_count,
+                             size_t worker_count,
+                             const char* filename,
+                             const uint8_t* image,
+                             size_t image_size,
+                             int handshake_timeout_s,
+                             ymodem_manager_stats_t* stats);
+
+/**
+ * @brief Send a file to many ports in parallel
+ * 
+ * The file is read from disk once and shared by all sessions, see
+ * ymodem_manager_send_image().
+ * 
+ * @return int YMODEM_ERR_NONE if every port succeeded, the first error code otherwise
+ */
+int ymodem_manager_send_file(ymodem_port_t* ports,
+                            size_t port_count,
+                            size_t worker_count,
+                            const char* path,
+                            int handshake_timeout_s,
+                            ymodem_manager_stats_t* stats);
+
+/**
+ * @brief Receive one file on each of many ports in parallel
+ * 
+ * Each port uses its own file callbacks to store the data.
+ * 
+ * @return int YMODEM_ERR_NONE if every port succeeded, the first error code otherwise
+ */
+int ymodem_manager_receive(ymodem_port_t* ports,
+                          size_t port_count,
+                          size_t worker_count,
+                          int handshake_timeout_s,
+                          ymodem_manager_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YMODEM_MANAGER_ENABLE */
+
+#endif /* __YMODEM_MANAGER_H__ */
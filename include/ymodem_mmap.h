@@ -0,0 +1,70 @@
+/**
+ * @file ymodem_mmap.h
+ * @brief Memory-mapped file backend header
+ * @date 2025-04-09
+ * 
+ * This file contains the API of the built-in file backend for hosted
+ * platforms. Files being sent are mapped read-only and handed to the sender
+ * through file_peek, so full packets go from the page cache to comm_sendv
+ * without a copy. Files being received are sized with file_reserve from the
+ * length in packet 0 and written straight into a shared mapping. A file
+ * opened to resume or update keeps at least its old length when the
+ * transfer stops early, so a failed delta update leaves the old blocks past
+ * the point it stopped in place; a longer copy is cut to the new size once
+ * the transfer is complete. Only POSIX mmap() is implemented.
+ */
+
+#ifndef __YMODEM_MMAP_H__
+#define __YMODEM_MMAP_H__
+
+#include "ymodem_common.h"
+
+#ifndef YMODEM_MMAP_ENABLE
+    #if defined(__unix__) || defined(__APPLE__)
+        #define YMODEM_MMAP_ENABLE      1
+    #else
+        #define YMODEM_MMAP_ENABLE      0
+    #endif
+#endif
+
+#if YMODEM_MMAP_ENABLE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Install the memory-mapped file callbacks
+ * 
+ * Sets file_open, file_read, file_write, file_close, file_size, file_sync,
+ * file_peek, file_reserve, file_seek and file_stat. The backend ignores the user pointer, the
+ * communication and timing callbacks are left untouched.
+ * 
+ * @param callbacks Callbacks to fill in
+ */
+void ymodem_mmap_set_callbacks(ymodem_callbacks_t* callbacks);
+
+/**
+ * @brief Map a whole file read-only
+ * 
+ * One mapping can be shared by any number of sessions, see
+ * ymodem_manager_send_file().
+ * 
+ * @param path File to map
+ * @param size Returns the size of the file
+ * @return const uint8_t* Mapped data (non-NULL for empty files too), NULL on error
+ */
+const uint8_t* ymodem_mmap_map(const char* path, size_t* size);
+
+/**
+ * @brief Release a mapping returned by ymodem_mmap_map()
+ */
+void ymodem_mmap_unmap(const uint8_t* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YMODEM_MMAP_ENABLE */
+
+#endif /* __YMODEM_MMAP_H__ */
@@ -0,0 +1,171 @@
+/**
+ * @file ymodem_mux.h
+ * @brief Channel multiplexer header
+ * @date 2025-04-09
+ * 
+ * This file contains the API of the channel multiplexer. It runs several
+ * event-driven sessions (see ymodem_fsm.h) over one physical link, e.g. a
+ * firmware download, a log upload and a small config file over a single
+ * UART. The output of each session is cut into short frames tagged with a
+ * channel ID, frames of different channels are interleaved on the wire and
+ * the frames received are handed to the session of their channel. Both ends
+ * of the link must use the multiplexer with the same channel IDs.
+ */
+
+#ifndef __YMODEM_MUX_H__
+#define __YMODEM_MUX_H__
+
+#include "ymodem_fsm.h"
+
+#ifndef YMODEM_MUX_ENABLE
+#define YMODEM_MUX_ENABLE               1
+#endif
+
+#if YMODEM_MUX_ENABLE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of channels on one link */
+#ifndef YMODEM_MUX_MAX_CHANNELS
+#define YMODEM_MUX_MAX_CHANNELS         8
+#endif
+
+/* Default payload of a frame, bounds the wait of an urgent channel behind a busy one */
+#ifndef YMODEM_MUX_FRAME_DATA_SIZE
+#define YMODEM_MUX_FRAME_DATA_SIZE      128
+#endif
+
+/* Largest payload, the length is one byte */
+#define YMODEM_MUX_MAX_FRAME_DATA_SIZE  255
+
+/* Frame: MUX, channel ID, length, check byte ~(ID ^ length), payload */
+#define YMODEM_MUX_HEADER_SIZE          4
+#define YMODEM_MUX_FRAME_SIZE(n)        (YMODEM_MUX_HEADER_SIZE + (n))
+
+/* Buffers of ymodem_mux_run() */
+#ifndef YMODEM_MUX_IO_SIZE
+#define YMODEM_MUX_IO_SIZE              512
+#endif
+
+/* One logical channel */
+typedef struct {
+    ymodem_fsm_t*      fsm;              /* Session of this channel */
+    uint8_t            id;               /* Channel ID on the wire */
+    uint8_t            priority;         /* 0 is served first, equal priorities take turns */
+    uint64_t           frames_sent;
+    uint64_t           frames_received;
+} ymodem_mux_channel_t;
+
+/* Multiplexer, one per link */
+typedef struct {
+    ymodem_mux_channel_t channels[YMODEM_MUX_MAX_CHANNELS];
+    size_t             channel_count;
+    size_t             frame_data_size;  /* Payload bytes per frame */
+    size_t             next;             /* Channel served first by the next poll */
+    
+    /* Frame being received */
+    uint8_t            rx_state;
+    uint8_t            rx_id;
+    uint8_t            rx_length;
+    uint8_t            rx_left;          /* Payload bytes still to come */
+    ymodem_mux_channel_t* rx_channel;    /* Channel of the payload, NULL to discard it */
+    
+    uint64_t           frames_dropped;   /* Bad check byte or unknown channel */
+    uint64_t           bytes_skipped;    /* Line noise between frames */
+} ymodem_mux_t;
+
+/**
+ * @brief Initialize a multiplexer without channels
+ * 
+ * @param mux Multiplexer
+ * @param frame_data_size Payload bytes per frame (1..YMODEM_MUX_MAX_FRAME_DATA_SIZE),
+ *                        0 for YMODEM_MUX_FRAME_DATA_SIZE
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_mux_init(ymodem_mux_t* mux, size_t frame_data_size);
+
+/**
+ * @brief Put a session on a channel
+ * 
+ * The session is started with ymodem_fsm_send_init() or
+ * ymodem_fsm_receive_init() as usual; a sender on one end pairs with a
+ * receiver on the same channel ID of the other end, so files can flow both
+ * ways at once. Among the channels with something to send the one with the
+ * lowest priority value gets the next frame, so a short urgent transfer only
+ * waits for the frame on the wire, not for a whole packet of a large one.
+ * 
+ * @param mux Multiplexer
+ * @param id Channel ID, unique on this link
+ * @param fsm Session, must outlive the multiplexer
+ * @param priority 0 for the most urgent channel
+ * @return int YMODEM_ERR_NONE on success, YMODEM_ERR_MEM if all channels are taken, error code otherwise
+ */
+int ymodem_mux_add(ymodem_mux_t* mux, uint8_t id, ymodem_fsm_t* fsm, uint8_t priority);
+
+/**
+ * @brief Hand received link bytes to the multiplexer
+ * 
+ * Any split of the byte stream is fine. The payload goes to the session of
+ * its channel as it arrives, without a CRC of its own: a damaged byte fails
+ * the packet CRC of the session, which NAKs right away as on a plain line.
+ * Frames with a bad header or an unknown channel are dropped and the
+ * sessions recover them like any other lost bytes.
+ * 
+ * @param mux Multiplexer
+ * @param data Received bytes
+ * @param length Number of bytes
+ * @param now_ms Current time in milliseconds
+ * @return int YMODEM_FSM_BUSY while a channel is running, then see ymodem_mux_result()
+ */
+int ymodem_mux_feed(ymodem_mux_t* mux, const uint8_t* data, size_t length, uint32_t now_ms);
+
+/**
+ * @brief Run the timers of all channels and collect frames to transmit
+ * 
+ * Fills out with whole frames. A channel waiting for its peer or for a
+ * timer takes no room, so while one session waits for an ACK the others
+ * keep the link busy.
+ * 
+ * @param mux Multiplexer
+ * @param now_ms Current time in milliseconds
+ * @param out Buffer for bytes to transmit, room for at least one frame with one byte
+ * @param max_length Size of out
+ * @param deadline_ms Optional, returns the absolute time poll must be called again
+ * @return size_t Number of bytes stored in out
+ */
+size_t ymodem_mux_poll(ymodem_mux_t* mux, uint32_t now_ms, uint8_t* out, size_t max_length, uint32_t* deadline_ms);
+
+/**
+ * @brief Get the outcome of all channels
+ * 
+ * @return int YMODEM_FSM_BUSY while a channel is running, YMODEM_ERR_NONE if
+ *             all succeeded, otherwise the result of the first channel that failed
+ */
+int ymodem_mux_result(const ymodem_mux_t* mux);
+
+/**
+ * @brief Drive the multiplexer over blocking link callbacks until all channels are done
+ * 
+ * Uses comm_send, comm_receive and get_time_ms of link; the sessions keep
+ * their own file callbacks.
+ * 
+ * @param mux Multiplexer with its channels added
+ * @param link Callbacks of the physical link
+ * @return int Same as ymodem_mux_result(), YMODEM_ERR_CODE if a callback is missing
+ */
+int ymodem_mux_run(ymodem_mux_t* mux, const ymodem_callbacks_t* link);
+
+/**
+ * @brief Close the files of the channels that did not finish
+ */
+void ymodem_mux_cleanup(ymodem_mux_t* mux);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YMODEM_MUX_ENABLE */
+
+#endif /* __YMODEM_MUX_H__ */
@@ -0,0 +1,141 @@
+/**
+ * @file ymodem_net.h
+ * @brief Network transport header
+ * @date 2025-04-09
+ * 
+ * This file contains the API of the built-in transports for ports reached
+ * over IP, e.g. through a terminal server:
+ *   tcp://host:port      raw TCP, Nagle and delayed ACKs turned off
+ *   rfc2217://host:port  Telnet COM-PORT-OPTION (RFC 2217), the line speed
+ *                        and flow control are set on the server's port
+ *   udp://host:port      every write is sent as datagrams of datagram_size
+ * Reads are buffered like in ymodem_serial.h: one recv() takes everything
+ * the kernel has and the socket is only waited on when that finds nothing.
+ */
+
+#ifndef __YMODEM_NET_H__
+#define __YMODEM_NET_H__
+
+#include "ymodem_common.h"
+
+#ifndef YMODEM_NET_ENABLE
+    #if defined(__unix__) || defined(__APPLE__)
+        #define YMODEM_NET_ENABLE       1
+    #else
+        #define YMODEM_NET_ENABLE       0
+    #endif
+#endif
+
+#if YMODEM_NET_ENABLE
+
+#ifndef YMODEM_NET_RX_BUFFER_SIZE
+#define YMODEM_NET_RX_BUFFER_SIZE       65536 /* Bytes taken from the kernel in one recv() */
+#endif
+
+#ifndef YMODEM_NET_TX_BUFFER_SIZE
+#define YMODEM_NET_TX_BUFFER_SIZE       8192  /* Telnet escaping and datagram assembly */
+#endif
+
+#ifndef YMODEM_NET_TX_TIMEOUT_MS
+#define YMODEM_NET_TX_TIMEOUT_MS        YMODEM_WAIT_PACKET_TIMEOUT_MS /* Longest wait for room to write */
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Kind of transport, given by the URL scheme */
+enum ymodem_net_kind {
+    YMODEM_NET_TCP = 0,
+    YMODEM_NET_RFC2217,
+    YMODEM_NET_UDP
+};
+
+/* Connection settings, see ymodem_net_default_config() */
+typedef struct {
+    uint32_t baud;               /* RFC 2217: rate to set on the server's port, 0 to keep its setting */
+    bool     flow_control;       /* RFC 2217: RTS/CTS on the server's port */
+    bool     nodelay;            /* TCP: TCP_NODELAY, small writes leave at once */
+    bool     quickack;           /* TCP: TCP_QUICKACK after every read (Linux), ACKs are not delayed */
+    size_t   socket_buffer;      /* SO_RCVBUF/SO_SNDBUF, 0 to keep the system default */
+    size_t   datagram_size;      /* UDP: largest datagram payload, longer writes are split */
+    uint32_t connect_timeout_ms; /* Connecting, and waiting for the RFC 2217 answer */
+} ymodem_net_config_t;
+
+/* A connection */
+typedef struct {
+    int                  fd;
+    enum ymodem_net_kind kind;
+    ymodem_net_config_t  config;
+    uint32_t             server_baud;   /* RFC 2217: rate the server reported, 0 if it did not answer */
+    bool                 negotiating;   /* RFC 2217: waiting for the answer to the speed */
+    uint8_t              telnet_state;  /* RFC 2217: parser state between reads */
+    uint8_t              telnet_command;
+    size_t               sb_length;     /* RFC 2217: bytes of the subnegotiation being read */
+    uint8_t              sb_buffer[16];
+    size_t               rx_head;       /* Next byte to hand out */
+    size_t               rx_tail;       /* End of the buffered bytes */
+    uint8_t              rx_buffer[YMODEM_NET_RX_BUFFER_SIZE];
+    uint8_t              tx_buffer[YMODEM_NET_TX_BUFFER_SIZE];
+} ymodem_net_t;
+
+/**
+ * @brief Defaults: Nagle and delayed ACKs off, 1472-byte datagrams, 3 s to connect
+ * 
+ * @param config Settings to fill in
+ */
+void ymodem_net_default_config(ymodem_net_config_t* config);
+
+/**
+ * @brief Connect to a port
+ * 
+ * For rfc2217:// the COM-PORT-OPTION, binary mode and 8N1 with config->baud
+ * and config->flow_control are negotiated, and the server's answer to the
+ * speed is waited for up to connect_timeout_ms (server_baud). Data that
+ * arrives meanwhile is kept.
+ * 
+ * @param net Connection to set up
+ * @param url "tcp://host:port", "rfc2217://host:port" or "udp://host:port", IPv6 hosts in []
+ * @param config Settings, NULL for ymodem_net_default_config()
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_net_open(ymodem_net_t* net, const char* url, const ymodem_net_config_t* config);
+
+/**
+ * @brief Use a connected socket, e.g. one returned by accept()
+ * 
+ * The socket is tuned like ymodem_net_open() does; for YMODEM_NET_RFC2217
+ * the negotiation is sent as well. The descriptor is closed by
+ * ymodem_net_close().
+ * 
+ * @param net Connection to set up
+ * @param fd Connected socket
+ * @param kind How to frame the data
+ * @param config Settings, NULL for ymodem_net_default_config()
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_net_attach(ymodem_net_t* net, int fd, enum ymodem_net_kind kind, const ymodem_net_config_t* config);
+
+/**
+ * @brief Install the transport callbacks
+ * 
+ * Sets comm_send, comm_sendv, comm_receive, get_time_ms and delay_ms and
+ * makes net the user pointer. The file callbacks are left untouched.
+ * 
+ * @param net Open connection
+ * @param callbacks Callbacks to fill in
+ */
+void ymodem_net_set_callbacks(ymodem_net_t* net, ymodem_callbacks_t* callbacks);
+
+/**
+ * @brief Close a connection
+ */
+void ymodem_net_close(ymodem_net_t* net);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YMODEM_NET_ENABLE */
+
+#endif /* __YMODEM_NET_H__ */
@@ -0,0 +1,98 @@
+/**
+ * @file ymodem_readahead.h
+ * @brief Sender read-ahead stage header
+ * @date 2025-04-09
+ * 
+ * This file contains the API of the read-ahead stage. It wraps a set of
+ * callbacks and serves the sender's file_read calls from a ring of blocks
+ * that a producer thread keeps filled, so slow sources (SPI flash, archives,
+ * network mounts) are read while the previous packets are on the wire.
+ * Without the thread the ring is refilled one large block at a time, which
+ * still turns many small reads into a few big ones. The wrapped callbacks
+ * follow the usual contracts and work with ymodem_send_file(), the
+ * event-driven sender and the windowed sender alike.
+ */
+
+#ifndef __YMODEM_READAHEAD_H__
+#define __YMODEM_READAHEAD_H__
+
+#include "ymodem_common.h"
+
+#ifndef YMODEM_READAHEAD_ENABLE
+    #if defined(__unix__) || defined(__APPLE__)
+        #define YMODEM_READAHEAD_ENABLE 1
+    #else
+        #define YMODEM_READAHEAD_ENABLE 0
+    #endif
+#endif
+
+#if YMODEM_READAHEAD_ENABLE
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of blocks in the read-ahead ring */
+#ifndef YMODEM_READAHEAD_MAX_BLOCKS
+#define YMODEM_READAHEAD_MAX_BLOCKS     64
+#endif
+
+/* Read-ahead stage, one file at a time */
+typedef struct {
+    ymodem_callbacks_t inner;            /* Callbacks being wrapped */
+    uint8_t*           ring;             /* block_count blocks of block_size bytes */
+    size_t             block_size;       /* Bytes requested from inner file_read per block */
+    size_t             block_count;      /* Blocks prefetched ahead of the sender */
+    size_t             lengths[YMODEM_READAHEAD_MAX_BLOCKS]; /* Valid bytes in each block */
+    size_t             head;             /* Blocks consumed by the sender */
+    size_t             tail;             /* Blocks filled by the producer */
+    size_t             offset;           /* Bytes already consumed from the head block */
+    void*              file_handle;      /* Inner handle of the file being read */
+    int64_t            file_size;        /* Taken before the producer starts */
+    bool               threaded;         /* Fill the ring on a producer thread */
+    bool               eof;              /* Producer hit the end of the file */
+    bool               filling;          /* Producer is reading a block without the lock */
+    bool               seeking;          /* The sender moves the file, the producer waits */
+    bool               stop;             /* Ask the producer to exit */
+    pthread_t          thread;
+    pthread_mutex_t    lock;
+    pthread_cond_t     cond;
+} ymodem_readahead_t;
+
+/**
+ * @brief Set up a read-ahead stage in front of a set of callbacks
+ * 
+ * On return wrapped holds callbacks to pass to ymodem_send_init() (or any
+ * other engine). Their user data is ra, the original user pointer is still
+ * handed to every original callback. Files opened for writing are passed
+ * straight through. A file_seek on the file being read waits for the
+ * producer, moves the inner file and drops the blocks read ahead, so resume
+ * and delta mode work behind the stage; file_peek is not offered, the data
+ * is copied out of the ring.
+ * 
+ * @param ra Read-ahead stage, must outlive the transfer
+ * @param callbacks Original callbacks
+ * @param ring Buffer of block_size * block_count bytes
+ * @param block_size Bytes per block, e.g. YMODEM_STX_DATA_SIZE or a flash page
+ * @param block_count Number of blocks prefetched (2..YMODEM_READAHEAD_MAX_BLOCKS)
+ * @param threaded Fill the ring on a POSIX thread while the sender transmits
+ * @param wrapped Returns the callbacks that read through the stage
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_readahead_init(ymodem_readahead_t* ra,
+                         const ymodem_callbacks_t* callbacks,
+                         uint8_t* ring,
+                         size_t block_size,
+                         size_t block_count,
+                         bool threaded,
+                         ymodem_callbacks_t* wrapped);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YMODEM_READAHEAD_ENABLE */
+
+#endif /* __YMODEM_READAHEAD_H__ */
@@ -22,21 +22,147 @@ extern "C" {
  * @param callbacks Callback functions
  * @param buffer Buffer for YMODEM data (must be at least YMODEM_MAX_PACKET_SIZE bytes)
  * @param buffer_size Size of the provided buffer
+ * @param mode YMODEM_MODE_CRC to request classic YMODEM with 'C', YMODEM_MODE_G
+ *             to request YMODEM-G streaming with 'G' (any error aborts the transfer)
  * @return int YMODEM_ERR_NONE on success, error code otherwise
  */
 int ymodem_receive_init(ymodem_context_t* ctx, 
                        const ymodem_callbacks_t* callbacks,
                        uint8_t* buffer,
-                       size_t buffer_size);
+                       size_t buffer_size,
+                       enum ymodem_mode mode);
+
+/* Called after each file of a batch, return non-zero to stop the batch */
+typedef int (*ymodem_file_done_func)(void* user, const ymodem_file_info_t* file_info);
+
+/**
+ * @brief Enable write-behind buffering on the receiver
+ * 
+ * Received data is collected in wb_buffer and handed to file_write in chunks
+ * of exactly wb_size bytes (e.g. one flash sector), only the last chunk of
+ * the file can be shorter. A packet is ACKed as soon as its CRC checks and
+ * its data is in the buffer, the file write overlaps with the next packet on
+ * the wire. The buffer is flushed before the final EOT is ACKed and when the
+ * transfer fails.
+ * 
+ * @param ctx Pointer to YMODEM context
+ * @param wb_buffer Chunk buffer, NULL to write every packet directly
+ * @param wb_size Size of wb_buffer, the chunk size
+ * @param sync When to call the file_sync callback (ignored if it is NULL)
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_receive_set_write_behind(ymodem_context_t* ctx,
+                                   uint8_t* wb_buffer,
+                                   size_t wb_size,
+                                   enum ymodem_sync sync);
+
+/**
+ * @brief Keep a resume journal and continue interrupted files
+ * 
+ * For every file whose sender offers resuming (see ymodem_send_init()) a
+ * journal named after the file plus YMODEM_JOURNAL_SUFFIX records size and
+ * mtime from packet 0, how many bytes have been written and their CRC32. It
+ * is written through the file callbacks every YMODEM_RESUME_JOURNAL_INTERVAL
+ * bytes and when the transfer fails. When the same file is offered again the
+ * kept part is opened with YMODEM_OPEN_RESUME, read back and checked, and
+ * the sender is asked to continue after it; file_info->resumed reports how
+ * many bytes were kept. Needs file_seek and file_read.
+ * 
+ * @param ctx Pointer to YMODEM context
+ * @param enable true to journal and resume
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_receive_set_resume(ymodem_context_t* ctx, bool enable);
+
+/**
+ * @brief Accept large blocks from senders that offer them
+ * 
+ * When packet 0 carries YMODEM_EXT_BLOCK (see ymodem_send_set_large_blocks())
+ * the smaller of the offered size and block_size is accepted by sending BLK
+ * and the size in KiB before the 'C' ('G') that starts the data. The sender
+ * then sends BLK packets with a CRC32, and a tail that fits in 1 KiB as
+ * STX/SOH. Senders that do not offer large blocks are unaffected. Call
+ * after ymodem_receive_init(); the buffer given there must hold
+ * YMODEM_BLK_PACKET_SIZE(block_size) bytes.
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param block_size YMODEM_BLK8K_DATA_SIZE or YMODEM_BLK32K_DATA_SIZE, 0 to refuse large blocks
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_receive_set_large_blocks(ymodem_context_t* ctx, size_t block_size);
+
+/**
+ * @brief Accept compressed data from senders that offer it
+ * 
+ * When packet 0 carries YMODEM_EXT_LZ with a window of at most
+ * YMODEM_LZ_WINDOW_SIZE bytes (see ymodem_send_set_compression()) the sender
+ * is answered with 'Z' before the 'C' ('G') and the data packets are
+ * expanded before file_write, up to the size announced in packet 0. The
+ * decoder is the only extra memory, its window, and is reset for every file.
+ * Plain senders, and files without a size, are received as before. Call
+ * after ymodem_receive_init().
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param decoder Decompressor, kept for the whole session; NULL to refuse compression
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_receive_set_compression(ymodem_context_t* ctx, ymodem_lz_decoder_t* decoder);
+
+/**
+ * @brief Update older copies in place, receiving only the blocks that changed
+ * 
+ * When packet 0 carries YMODEM_EXT_DELTA (see ymodem_send_set_delta()) and
+ * a file of that name exists, it is opened with YMODEM_OPEN_RESUME and the
+ * CRC32 of each of its YMODEM_DELTA_BLOCK_SIZE blocks is sent to the
+ * sender, a few hundred bytes per megabyte. The sender then replaces every
+ * run of unchanged blocks by an SKP frame and the file is moved past them
+ * with file_seek; the other bytes are written as usual. A copy longer than
+ * the new file needs file_reserve to be cut to size, without it the file is
+ * received in full. Since the copy is overwritten, a transfer that ends
+ * short is an error. Large blocks, compression and the resume journal are
+ * not used for a delta transfer. Needs file_read and file_seek. Call after
+ * ymodem_receive_init().
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param enable true to answer delta offers
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_receive_set_delta(ymodem_context_t* ctx, bool enable);
+
+/**
+ * @brief Check every file against a digest the sender computes while reading it
+ * 
+ * When packet 0 carries YMODEM_EXT_DIGEST with a known type (see
+ * ymodem_send_set_digest()) the sender is answered with 'V' before the 'C'
+ * ('G'). The bytes handed to the file are hashed as they are written, after
+ * decompression and the cut of the last packet, together with the kept
+ * part of a resumed file and the skipped blocks of a delta transfer (read
+ * back through file_read). The sender's digest follows the last data
+ * packet in a SUM frame; when they differ the transfer is cancelled and
+ * YMODEM_ERR_SUM returned. A file that passes reports the digest in
+ * file_info->verified and file_info->digest, so it does not need to be read
+ * again. Files of senders without the extension are received unchecked,
+ * with file_info->verified YMODEM_DIGEST_NONE. Call after
+ * ymodem_receive_init().
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param digest Digest state, kept for the whole session; NULL to refuse digests
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_receive_set_digest(ymodem_context_t* ctx, ymodem_digest_t* digest);
 
 /**
  * @brief Receive a file via YMODEM protocol
  * 
  * This function handles the complete YMODEM receive process including handshake,
- * receiving data packets, and finishing the transmission.
+ * receiving data packets, and finishing the transmission. If the sender puts
+ * more files in the same batch they are stored as well, see ymodem_receive_files().
+ * With YMODEM_BATCH_ENABLE set to 0 they are refused and the session ends after
+ * the first file.
  * 
  * @param ctx Pointer to initialized YMODEM context
- * @param file_info Pointer to struct that will be filled with received file info
+ * @param file_info Pointer to struct that will be filled with the first file's info,
+ *                  including its verified digest if one was agreed
  * @param handshake_timeout_s Timeout for handshake in seconds
  * @return int YMODEM_ERR_NONE on success, error code otherwise
  */
@@ -44,6 +170,25 @@ int ymodem_receive_file(ymodem_context_t* ctx,
                        ymodem_file_info_t* file_info,
                        int handshake_timeout_s);
 
+/**
+ * @brief Receive all files of a YMODEM batch
+ * 
+ * Files are stored through the file callbacks one after the other. The
+ * session only ends on the NULL filename packet. on_file is called after
+ * every complete file and can stop the batch by returning non-zero (the
+ * transfer is then cancelled and YMODEM_ERR_CAN returned).
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param on_file Optional per-file callback, its user argument is callbacks.user
+ * @param file_count Optional, returns the number of files received
+ * @param handshake_timeout_s Timeout for handshake in seconds
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_receive_files(ymodem_context_t* ctx,
+                        ymodem_file_done_func on_file,
+                        size_t* file_count,
+                        int handshake_timeout_s);
+
 /**
  * @brief Clean up YMODEM receive resources
  * 
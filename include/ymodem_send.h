@@ -11,6 +11,8 @@
 
 #include "ymodem_common.h"
 
+#if YMODEM_SEND_ENABLE
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -20,16 +22,157 @@ extern "C" {
  * 
  * @param ctx Pointer to YMODEM context
  * @param callbacks Callback functions
- * @param buffer Buffer for YMODEM data (must be at least YMODEM_MAX_PACKET_SIZE bytes)
+ * @param buffer Buffer for YMODEM data (must be at least YMODEM_MAX_PACKET_SIZE bytes),
+ *               packets are built and sent in place from it
  * @param buffer_size Size of the provided buffer
+ * @param mode YMODEM_MODE_CRC for classic YMODEM, YMODEM_MODE_G to also accept
+ *             a YMODEM-G receiver and stream packets without waiting for ACK
  * @return int YMODEM_ERR_NONE on success, error code otherwise
+ * 
+ * With file_stat packet 0 also carries the modification time and mode.
  */
 int ymodem_send_init(ymodem_context_t* ctx, 
                     const ymodem_callbacks_t* callbacks,
                     uint8_t* buffer,
                     size_t buffer_size,
-                    uint8_t* send_buffer,
-                    size_t send_buffer_size);
+                    enum ymodem_mode mode);
+
+/**
+ * @brief Enable pipelined (sliding window) sending
+ * 
+ * The sender keeps up to window_count packets in flight instead of waiting for
+ * an ACK after every packet. Built packets are kept in window_buffer so that a
+ * NAK or timeout resends from the oldest unacknowledged packet without reading
+ * the file again. The receiver must ACK packets in order and ignore packets
+ * ahead of the one it expects, which the receiver in this library does.
+ * Call after ymodem_send_init; it has no effect when YMODEM-G is negotiated.
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param window_buffer Ring buffer (at least window_count * YMODEM_MAX_PACKET_SIZE bytes),
+ *                      NULL to go back to stop-and-wait
+ * @param window_buffer_size Size of the provided ring buffer
+ * @param window_count Number of packets in flight (2..YMODEM_MAX_WINDOW, 0 or 1 for stop-and-wait)
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_send_set_window(ymodem_context_t* ctx,
+                          uint8_t* window_buffer,
+                          size_t window_buffer_size,
+                          uint8_t window_count);
+
+/**
+ * @brief Offer receivers to continue interrupted files
+ * 
+ * Packet 0 of every file with a known size carries YMODEM_EXT_RESUME, and a
+ * receiver that kept part of the file may ask to continue after it, see
+ * ymodem_receive_set_resume(); the file is then read from that offset. Off
+ * by default. Call after ymodem_send_init().
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param enable true to offer resuming
+ * @return int YMODEM_ERR_NONE on success, YMODEM_ERR_FILE without file_seek, error code otherwise
+ */
+int ymodem_send_set_resume(ymodem_context_t* ctx, bool enable);
+
+/**
+ * @brief Adapt packet size and retransmit timeout to the link
+ * 
+ * A NAKed 1 KiB packet is resent as 128-byte packets and any NAK or timeout
+ * keeps the following packets that short, so a bad byte on a noisy line
+ * costs a short resend; after YMODEM_ADAPT_CLEAN_PACKETS
+ * packets ACKed at the first attempt the sender goes back to 1 KiB. With a
+ * get_time_ms callback the stop-and-wait sender also measures the round trip
+ * of every packet and waits srtt + 4 * rttvar for the ACK (RFC 6298, bounded
+ * by YMODEM_RTO_MIN_MS and YMODEM_WAIT_PACKET_TIMEOUT_MS) instead of the flat
+ * timeout, doubling it on each timeout. The windowed sender adapts the size
+ * only; YMODEM-G, which never retries, is not affected.
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param enable true to adapt, false for fixed 1 KiB packets and timeouts
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_send_set_adaptive(ymodem_context_t* ctx, bool enable);
+
+/**
+ * @brief Offer large blocks to the receiver
+ * 
+ * Packet 0 of every file carries YMODEM_EXT_BLOCK with block_size. If the
+ * receiver answers with BLK and a size in KiB before its 'C' ('G'), see
+ * ymodem_receive_set_large_blocks(), the data goes out in BLK packets of that
+ * size with a CRC32, and a tail that fits in 1 KiB as STX/SOH. Any other
+ * receiver gets standard STX packets. Large blocks cut the per-packet
+ * overhead and ACK turnarounds on fast links (USB-CDC, serial at several
+ * Mbaud); each must arrive within YMODEM_WAIT_PACKET_TIMEOUT_MS. They are
+ * not offered while a window is in use, the ring holds STX packets, and not
+ * for streams of unknown length, which carry no packet 0 fields. Call after
+ * ymodem_send_init(); the buffer given there must hold
+ * YMODEM_BLK_PACKET_SIZE(block_size) bytes.
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param block_size YMODEM_BLK8K_DATA_SIZE or YMODEM_BLK32K_DATA_SIZE, 0 for standard packets only
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_send_set_large_blocks(ymodem_context_t* ctx, size_t block_size);
+
+/**
+ * @brief Offer compressed data to the receiver
+ * 
+ * Packet 0 of every file with a known, non-zero size carries YMODEM_EXT_LZ
+ * with YMODEM_LZ_WINDOW_BITS. If the receiver answers with 'Z' before its
+ * 'C' ('G'), see ymodem_receive_set_compression(), the file is read through
+ * the compressor and the packets carry the compressed stream; only the last
+ * one is short, at the end of the stream. Any other receiver gets the plain
+ * file. Works with every sending mode (window, large blocks, YMODEM-G,
+ * resume); file_peek is not used for compressed files. With compression on,
+ * payload_bytes in the statistics counts packet data, lz_file_bytes the file
+ * bytes behind it. Call after ymodem_send_init().
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param encoder Compressor, kept for the whole session; NULL to send plain data
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_send_set_compression(ymodem_context_t* ctx, ymodem_lz_encoder_t* encoder);
+
+/**
+ * @brief Offer to skip the blocks the receiver already has (delta mode)
+ * 
+ * Packet 0 of every file with a known, non-zero size carries
+ * YMODEM_EXT_DELTA. A receiver with an older copy of the file answers with
+ * the CRC32 of each of its YMODEM_DELTA_BLOCK_SIZE blocks, see
+ * ymodem_receive_set_delta(), which are kept in map. Every run of blocks
+ * whose hash matches then goes out as a single SKP frame carrying the
+ * number of bytes to skip, instead of the data; changed blocks are sent as
+ * usual. Any other receiver gets the whole file. Works with stop-and-wait,
+ * windows, YMODEM-G and adaptive packets; the receiver turns down large
+ * blocks and compression for a delta transfer. file_peek is not used and
+ * file_seek is required. Skipped bytes count in payload_bytes and in
+ * delta_skipped_bytes of the statistics. Call after ymodem_send_init().
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param map Room for the receiver's hashes, kept for the whole session; NULL to send whole files
+ * @param map_size Hashes map can hold, blocks beyond it are always sent
+ * @return int YMODEM_ERR_NONE on success, YMODEM_ERR_FILE without file_seek, error code otherwise
+ */
+int ymodem_send_set_delta(ymodem_context_t* ctx, uint32_t* map, size_t map_size);
+
+/**
+ * @brief Offer a whole-file digest to the receiver
+ *
+ * Packet 0 of every file with a known size carries YMODEM_EXT_DIGEST and
+ * the name of type. If the receiver answers with 'V' before its 'C' ('G'),
+ * see ymodem_receive_set_digest(), every file byte is hashed as it is read
+ * (or peeked), and the digest follows the last data packet in a SUM frame
+ * the receiver ACKs; a receiver whose own digest differs cancels and the
+ * send fails with YMODEM_ERR_SUM. Skipped delta blocks are hashed too, a
+ * compressed file before compression, and a resumed file is read from the
+ * start up to the offset once more. Any other receiver gets the file
+ * without a digest. Call after ymodem_send_init().
+ *
+ * @param ctx Pointer to initialized YMODEM context
+ * @param digest Digest state, kept for the whole session; NULL to send no digest
+ * @param type YMODEM_DIGEST_CRC32 or YMODEM_DIGEST_SHA256
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_send_set_digest(ymodem_context_t* ctx, ymodem_digest_t* digest, enum ymodem_digest_type type);
 
 /**
  * @brief Send a file via YMODEM protocol
@@ -46,6 +189,24 @@ int ymodem_send_file(ymodem_context_t* ctx,
                     const char* filename,
                     int handshake_timeout_s);
 
+/**
+ * @brief Send several files in one YMODEM batch
+ * 
+ * The receiver's 'C' is waited for once, every file follows the previous one
+ * right after its EOT sequence and the NULL filename packet is only sent
+ * after the last file, so a batch costs a single handshake.
+ * 
+ * @param ctx Pointer to initialized YMODEM context
+ * @param filenames Full paths of the files to send
+ * @param file_count Number of files
+ * @param handshake_timeout_s Timeout for the first handshake in seconds
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_send_files(ymodem_context_t* ctx,
+                     const char* const* filenames,
+                     size_t file_count,
+                     int handshake_timeout_s);
+
 /**
  * @brief Clean up YMODEM send resources
  * 
@@ -57,4 +218,6 @@ void ymodem_send_cleanup(ymodem_context_t* ctx);
 }
 #endif
 
+#endif /* YMODEM_SEND_ENABLE */
+
 #endif /* __YMODEM_SEND_H__ */
\ No newline at end of file
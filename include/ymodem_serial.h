@@ -0,0 +1,131 @@
+/**
+ * @file ymodem_serial.h
+ * @brief POSIX serial transport header
+ * @date 2025-04-09
+ * 
+ * This file contains the API of the built-in transport for hosted
+ * platforms. It opens and tunes a serial port (any baud rate, RTS/CTS,
+ * low-latency hints) and provides the communication and timing callbacks.
+ * The descriptor is non-blocking: a read is tried first and the port is only
+ * waited on (epoll on Linux, poll elsewhere) when nothing is there, and every
+ * read takes all the bytes the kernel has into a receive buffer, so the
+ * single-byte reads of the engine cost no system call.
+ */
+
+#ifndef __YMODEM_SERIAL_H__
+#define __YMODEM_SERIAL_H__
+
+#include "ymodem_common.h"
+
+#ifndef YMODEM_SERIAL_ENABLE
+    #if defined(__unix__) || defined(__APPLE__)
+        #define YMODEM_SERIAL_ENABLE    1
+    #else
+        #define YMODEM_SERIAL_ENABLE    0
+    #endif
+#endif
+
+#if YMODEM_SERIAL_ENABLE
+
+/* Wait with epoll instead of poll */
+#ifndef YMODEM_SERIAL_EPOLL
+    #if defined(__linux__)
+        #define YMODEM_SERIAL_EPOLL     1
+    #else
+        #define YMODEM_SERIAL_EPOLL     0
+    #endif
+#endif
+
+#ifndef YMODEM_SERIAL_RX_BUFFER_SIZE
+#define YMODEM_SERIAL_RX_BUFFER_SIZE    65536 /* Bytes taken from the kernel in one read */
+#endif
+
+#ifndef YMODEM_SERIAL_TX_TIMEOUT_MS
+#define YMODEM_SERIAL_TX_TIMEOUT_MS     YMODEM_WAIT_PACKET_TIMEOUT_MS /* Longest wait for room to write */
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Port settings, see ymodem_serial_default_config() */
+typedef struct {
+    uint32_t baud;              /* Any rate: standard ones by Bxxx, others by termios2 BOTHER on Linux */
+    bool     flow_control;      /* RTS/CTS hardware flow control */
+    bool     low_latency;       /* ASYNC_LOW_LATENCY and FTDI latency timer of 1 ms */
+    size_t   kernel_buffer;     /* Socket buffers (SO_RCVBUF/SO_SNDBUF) when the descriptor is a socket, 0 to keep */
+} ymodem_serial_config_t;
+
+/* An open port */
+typedef struct {
+    int      fd;
+    int      epoll_fd;          /* -1 when poll is used */
+    bool     owned;             /* fd is closed by ymodem_serial_close() */
+    bool     low_latency_set;   /* ASYNC_LOW_LATENCY was accepted by the driver */
+    bool     latency_timer_set; /* The FTDI latency timer was lowered */
+    size_t   rx_head;           /* Next byte to hand out */
+    size_t   rx_tail;           /* End of the buffered bytes */
+    uint8_t  rx_buffer[YMODEM_SERIAL_RX_BUFFER_SIZE];
+} ymodem_serial_t;
+
+/**
+ * @brief Settings of a 115200 8N1 port without flow control
+ * 
+ * @param config Settings to fill in
+ */
+void ymodem_serial_default_config(ymodem_serial_config_t* config);
+
+/**
+ * @brief Open and set up a serial port
+ * 
+ * The port is put into raw 8N1 mode at config->baud, queued input is
+ * discarded. The low-latency hints need a cooperating driver (and for the
+ * FTDI timer write access to sysfs); when they are refused the port still
+ * opens, see low_latency_set and latency_timer_set.
+ * 
+ * @param serial Port to set up
+ * @param path Device, e.g. "/dev/ttyUSB0"
+ * @param config Settings, NULL for ymodem_serial_default_config()
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_serial_open(ymodem_serial_t* serial, const char* path, const ymodem_serial_config_t* config);
+
+/**
+ * @brief Use an already open descriptor
+ * 
+ * For pseudo terminals, sockets or pipes opened by the caller. A terminal is
+ * configured like ymodem_serial_open() does, anything else is only made
+ * non-blocking. The descriptor stays the caller's, ymodem_serial_close()
+ * does not close it.
+ * 
+ * @param serial Port to set up
+ * @param fd Open descriptor, read and write
+ * @param config Settings, NULL for ymodem_serial_default_config()
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+int ymodem_serial_attach(ymodem_serial_t* serial, int fd, const ymodem_serial_config_t* config);
+
+/**
+ * @brief Install the transport callbacks
+ * 
+ * Sets comm_send, comm_sendv, comm_receive, get_time_ms and delay_ms and
+ * makes serial the user pointer, file callbacks that need their own user
+ * data have to be wrapped. The file callbacks are left untouched.
+ * 
+ * @param serial Open port
+ * @param callbacks Callbacks to fill in
+ */
+void ymodem_serial_set_callbacks(ymodem_serial_t* serial, ymodem_callbacks_t* callbacks);
+
+/**
+ * @brief Close a port opened with ymodem_serial_open() or ymodem_serial_attach()
+ */
+void ymodem_serial_close(ymodem_serial_t* serial);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YMODEM_SERIAL_ENABLE */
+
+#endif /* __YMODEM_SERIAL_H__ */
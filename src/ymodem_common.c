@@ -7,43 +7,10 @@
  */
 
 #include "ymodem_common.h"
+#include <stdarg.h>
 #include <string.h>
 
-/* CRC16 table for faster computation */
-static const uint16_t crc16_ccitt_table[256] = {
-    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
-    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
-    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
-    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
-    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
-    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
-    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
-    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
-    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
-    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
-    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
-    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
-    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
-    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
-    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
-    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
-    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
-    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
-    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
-    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
-    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
-    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
-    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
-    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
-    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
-    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
-    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
-    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
-    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
-    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
-    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
-    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
-};
+static void _ymodem_trace_bytes(ymodem_context_t* ctx, const char* what, const uint8_t* data, size_t length);
 
 /**
  * @brief Convert YMODEM code to string representation for debugging
@@ -54,11 +21,17 @@ const char* ymodem_code_to_str(enum ymodem_code code)
         case YMODEM_CODE_NONE: return "NONE";
         case YMODEM_CODE_SOH: return "SOH";
         case YMODEM_CODE_STX: return "STX";
+        case YMODEM_CODE_BLK: return "BLK";
         case YMODEM_CODE_EOT: return "EOT";
+        case YMODEM_CODE_SKP: return "SKP";
         case YMODEM_CODE_ACK: return "ACK";
+        case YMODEM_CODE_SUM: return "SUM";
         case YMODEM_CODE_NAK: return "NAK";
         case YMODEM_CODE_CAN: return "CAN";
         case YMODEM_CODE_C: return "C";
+        case YMODEM_CODE_G: return "G";
+        case YMODEM_CODE_V: return "V";
+        case YMODEM_CODE_Z: return "Z";
         default: return "UNKNOWN";
     }
 }
@@ -79,6 +52,7 @@ const char* ymodem_error_to_str(enum ymodem_error error)
         case YMODEM_ERR_ACK: return "ACK_ERROR";
         case YMODEM_ERR_FILE: return "FILE_ERROR";
         case YMODEM_ERR_MEM: return "MEMORY_ERROR";
+        case YMODEM_ERR_SUM: return "DIGEST_MISMATCH";
         default: return "UNKNOWN_ERROR";
     }
 }
@@ -99,24 +73,6 @@ const char* ymodem_stage_to_str(enum ymodem_stage stage)
     }
 }
 
-/**
- * @brief Calculate CRC16 CCITT for a buffer
- * 
- * @param buffer Buffer to calculate CRC for
- * @param size Size of the buffer
- * @return uint16_t Calculated CRC16
- */
-uint16_t ymodem_calc_crc16(const uint8_t* buffer, size_t size)
-{
-    uint16_t crc = 0;
-    
-    while (size-- > 0) {
-        crc = (crc << 8) ^ crc16_ccitt_table[((crc >> 8) ^ *buffer++) & 0xFF];
-    }
-    
-    return crc;
-}
-
 /**
  * @brief Get basename from path
  * 
@@ -154,29 +110,58 @@ const char* ymodem_get_path_basename(const char* path)
 size_t ymodem_send_bytes(ymodem_context_t* ctx, const uint8_t* data, size_t length)
 {
     if (ctx->callbacks.comm_send == NULL) {
-        YMODEM_DEBUG_PRINT("Send failed: comm_send callback is NULL\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Send failed: comm_send callback is NULL");
         return 0;
     }
     
-    size_t sent = ctx->callbacks.comm_send(data, length);
+    size_t sent = ctx->callbacks.comm_send(ctx->callbacks.user, data, length);
+    YMODEM_STATS_ADD(ctx, bytes_sent, sent);
     
-    // 添加调试输出 - 只打印前几个字节避免大量输出
+    // 添加调试输出 - 只打印前几个字节避免大量输出, 没有编进 YMODEM_TRACE_BYTES 时整段消失
     if (sent > 0) {
-        YMODEM_DEBUG_PRINT("Sent %zu bytes: ", sent);
-        for (size_t i = 0; i < (sent > 8 ? 8 : sent); i++) {
-            YMODEM_DEBUG_PRINT("%02X ", data[i]);
-        }
-        if (sent > 8) {
-            YMODEM_DEBUG_PRINT("...");
+        if (YMODEM_TRACE_ON(ctx, YMODEM_TRACE_BYTES)) {
+            _ymodem_trace_bytes(ctx, "Sent", data, sent);
         }
-        YMODEM_DEBUG_PRINT("\n");
     } else {
-        YMODEM_DEBUG_PRINT("Failed to send data (sent 0 bytes)\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Failed to send data (sent 0 bytes)");
     }
     
     return sent;
 }
 
+/**
+ * @brief Send several buffers, in one call when comm_sendv is registered
+ * 
+ * Without comm_sendv the pieces are sent one by one through comm_send.
+ * 
+ * @param ctx YMODEM context
+ * @param iov Buffers to send, in order
+ * @param iov_count Number of buffers
+ * @return size_t Total number of bytes sent
+ */
+size_t ymodem_send_vec(ymodem_context_t* ctx, const ymodem_iovec_t* iov, size_t iov_count)
+{
+    size_t total = 0;
+    size_t i;
+    
+    if (ctx->callbacks.comm_sendv != NULL) {
+        total = ctx->callbacks.comm_sendv(ctx->callbacks.user, iov, iov_count);
+        YMODEM_STATS_ADD(ctx, bytes_sent, total);
+        YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "Sent %zu bytes in %zu pieces", total, iov_count);
+        return total;
+    }
+    
+    for (i = 0; i < iov_count; i++) {
+        size_t sent = ymodem_send_bytes(ctx, iov[i].data, iov[i].length);
+        total += sent;
+        if (sent != iov[i].length) {
+            break;
+        }
+    }
+    
+    return total;
+}
+
 /**
  * @brief Send a single byte using the registered callback
  * 
@@ -189,12 +174,12 @@ bool ymodem_send_byte(ymodem_context_t* ctx, uint8_t data)
     bool result = (ymodem_send_bytes(ctx, &data, 1) == 1);
     if (result) {
         if (data >= 32 && data <= 126) {
-            YMODEM_DEBUG_PRINT("Sent byte: 0x%02X ('%c') [%s]\n", data, data, ymodem_code_to_str(data));
+            YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "Sent byte: 0x%02X ('%c') [%s]", data, data, ymodem_code_to_str(data));
         } else {
-            YMODEM_DEBUG_PRINT("Sent byte: 0x%02X [%s]\n", data, ymodem_code_to_str(data));
+            YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "Sent byte: 0x%02X [%s]", data, ymodem_code_to_str(data));
         }
     } else {
-        YMODEM_DEBUG_PRINT("Failed to send byte: 0x%02X\n", data);
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Failed to send byte: 0x%02X", data);
     }
     return result;
 }
@@ -211,24 +196,20 @@ bool ymodem_send_byte(ymodem_context_t* ctx, uint8_t data)
 size_t ymodem_receive_bytes(ymodem_context_t* ctx, uint8_t* data, size_t length, uint32_t timeout_ms)
 {
     if (ctx->callbacks.comm_receive == NULL) {
-        YMODEM_DEBUG_PRINT("Receive failed: comm_receive callback is NULL\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Receive failed: comm_receive callback is NULL");
         return 0;
     }
     
-    YMODEM_DEBUG_PRINT("Waiting to receive up to %zu bytes (timeout %u ms)...\n", length, timeout_ms);
-    size_t received = ctx->callbacks.comm_receive(data, length, timeout_ms);
+    YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "Waiting to receive up to %zu bytes (timeout %u ms)...", length, timeout_ms);
+    size_t received = ctx->callbacks.comm_receive(ctx->callbacks.user, data, length, timeout_ms);
+    YMODEM_STATS_ADD(ctx, bytes_received, received);
     
     if (received > 0) {
-        YMODEM_DEBUG_PRINT("Received %zu bytes: ", received);
-        for (size_t i = 0; i < (received > 8 ? 8 : received); i++) {
-            YMODEM_DEBUG_PRINT("%02X ", data[i]);
+        if (YMODEM_TRACE_ON(ctx, YMODEM_TRACE_BYTES)) {
+            _ymodem_trace_bytes(ctx, "Received", data, received);
         }
-        if (received > 8) {
-            YMODEM_DEBUG_PRINT("...");
-        }
-        YMODEM_DEBUG_PRINT("\n");
     } else {
-        YMODEM_DEBUG_PRINT("Receive timeout or error (received 0 bytes)\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "Receive timeout or error (received 0 bytes)");
     }
     
     return received;
@@ -247,22 +228,1203 @@ int ymodem_receive_byte(ymodem_context_t* ctx, uint32_t timeout_ms)
     size_t received;
     
     if (ctx->callbacks.comm_receive == NULL) {
-        YMODEM_DEBUG_PRINT("Receive byte failed: comm_receive callback is NULL\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Receive byte failed: comm_receive callback is NULL");
         return YMODEM_ERR_CODE;
     }
     
-    YMODEM_DEBUG_PRINT("Waiting for single byte (timeout %u ms)...\n", timeout_ms);
+    YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "Waiting for single byte (timeout %u ms)...", timeout_ms);
     received = ymodem_receive_bytes(ctx, &data, 1, timeout_ms);
     if (received == 0) {
-        YMODEM_DEBUG_PRINT("Byte receive timeout\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "Byte receive timeout");
         return YMODEM_ERR_TMO;  /* Timeout */
     }
     
     if (data >= 32 && data <= 126) {
-        YMODEM_DEBUG_PRINT("Received byte: 0x%02X ('%c') [%s]\n", data, data, ymodem_code_to_str(data));
+        YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "Received byte: 0x%02X ('%c') [%s]", data, data, ymodem_code_to_str(data));
     } else {
-        YMODEM_DEBUG_PRINT("Received byte: 0x%02X [%s]\n", data, ymodem_code_to_str(data));
+        YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "Received byte: 0x%02X [%s]", data, ymodem_code_to_str(data));
     }
     
     return data;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Abort the session by sending a burst of CAN bytes
+ * 
+ * @param ctx YMODEM context
+ */
+void ymodem_send_cancel(ymodem_context_t* ctx)
+{
+    uint8_t cancel[YMODEM_CAN_SEND_COUNT];
+    
+    memset(cancel, YMODEM_CODE_CAN, sizeof(cancel));
+    ymodem_send_bytes(ctx, cancel, sizeof(cancel));
+    YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Sent %d CAN bytes, session aborted", YMODEM_CAN_SEND_COUNT);
+}
+
+/**
+ * @brief Discard incoming bytes until the line has been idle for YMODEM_PURGE_TIMEOUT_MS
+ * 
+ * Used before a NAK so that the rest of a broken packet (or packets still in
+ * flight from a pipelined sender) is not mistaken for a new packet header.
+ * 
+ * @param ctx YMODEM context
+ */
+void ymodem_purge(ymodem_context_t* ctx)
+{
+    uint8_t discard[64];
+    size_t total = 0;
+    size_t received;
+    
+    do {
+        received = ctx->callbacks.comm_receive(ctx->callbacks.user, discard, sizeof(discard), YMODEM_PURGE_TIMEOUT_MS);
+        total += received;
+    } while (received > 0);
+    YMODEM_STATS_ADD(ctx, bytes_received, total);
+    
+    YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Purged %zu bytes from the line", total);
+}
+
+/**
+ * @brief Current time for the statistics
+ * 
+ * @param ctx YMODEM context
+ * @return uint32_t get_time_ms, or the event-driven engine's clock without it
+ */
+uint32_t ymodem_now_ms(ymodem_context_t* ctx)
+{
+    if (ctx->callbacks.get_time_ms != NULL) {
+        return ctx->callbacks.get_time_ms(ctx->callbacks.user);
+    }
+    return ctx->now_ms;
+}
+
+#if YMODEM_STATS_ENABLE
+/**
+ * @brief Clear the statistics at the start of a session, the progress callback is kept
+ * 
+ * @param ctx YMODEM context
+ */
+void ymodem_stats_reset(ymodem_context_t* ctx)
+{
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->rtt_total_ms = 0;
+    ctx->stats_start_ms = ymodem_now_ms(ctx);
+    ctx->stage_start_ms = ctx->stats_start_ms;
+    ctx->progress_last_ms = ctx->stats_start_ms;
+}
+
+/**
+ * @brief Bring elapsed time and throughput up to date
+ */
+static void _ymodem_stats_update(ymodem_context_t* ctx, uint32_t now_ms)
+{
+    ymodem_stats_t* stats = &ctx->stats;
+    
+    stats->elapsed_ms = now_ms - ctx->stats_start_ms;
+    if (stats->elapsed_ms > 0) {
+        stats->raw_bps = (uint32_t)((stats->bytes_sent + stats->bytes_received) * 1000 / stats->elapsed_ms);
+        stats->effective_bps = (uint32_t)(stats->payload_bytes * 1000 / stats->elapsed_ms);
+    }
+}
+
+/**
+ * @brief Enter a stage: the time spent in the previous one is accounted and progress is reported
+ * 
+ * Entering the current stage again only brings the timings up to date, the
+ * engines do that when a session ends on an error.
+ * 
+ * @param ctx YMODEM context
+ * @param stage New stage
+ */
+void ymodem_set_stage(ymodem_context_t* ctx, enum ymodem_stage stage)
+{
+    uint32_t now_ms = ymodem_now_ms(ctx);
+    
+    ctx->stats.stage_ms[ctx->stage] += now_ms - ctx->stage_start_ms;
+    ctx->stage_start_ms = now_ms;
+    _ymodem_stats_update(ctx, now_ms);
+    if (stage == ctx->stage) {
+        return;
+    }
+    ctx->stage = stage;
+    
+    if (ctx->progress != NULL) {
+        ctx->progress_last_ms = now_ms;
+        ctx->progress(ctx->callbacks.user, stage, &ctx->stats);
+    }
+}
+
+/**
+ * @brief Account for one measured ACK round trip
+ * 
+ * @param ctx YMODEM context
+ * @param rtt_ms Time from sending the packet to its ACK
+ */
+void ymodem_stats_rtt(ymodem_context_t* ctx, uint32_t rtt_ms)
+{
+    ymodem_stats_t* stats = &ctx->stats;
+    
+    if (stats->rtt_samples == 0 || rtt_ms < stats->rtt_min_ms) {
+        stats->rtt_min_ms = rtt_ms;
+    }
+    if (rtt_ms > stats->rtt_max_ms) {
+        stats->rtt_max_ms = rtt_ms;
+    }
+    stats->rtt_samples++;
+    ctx->rtt_total_ms += rtt_ms;
+    stats->rtt_avg_ms = (uint32_t)(ctx->rtt_total_ms / stats->rtt_samples);
+}
+
+/**
+ * @brief Account for file data that got through, and report progress when it is due
+ * 
+ * @param ctx YMODEM context
+ * @param length File bytes acknowledged (sender) or written (receiver)
+ */
+void ymodem_stats_payload(ymodem_context_t* ctx, size_t length)
+{
+    uint32_t now_ms = ymodem_now_ms(ctx);
+    
+    ctx->stats.payload_bytes += length;
+    _ymodem_stats_update(ctx, now_ms);
+    
+    if (ctx->progress != NULL && now_ms - ctx->progress_last_ms >= ctx->progress_interval_ms) {
+        ctx->progress_last_ms = now_ms;
+        ctx->progress(ctx->callbacks.user, ctx->stage, &ctx->stats);
+    }
+}
+
+/**
+ * @brief Get the statistics of the current (or last) session
+ */
+const ymodem_stats_t* ymodem_get_stats(const ymodem_context_t* ctx)
+{
+    return (ctx != NULL) ? &ctx->stats : NULL;
+}
+
+/**
+ * @brief Register a progress callback
+ */
+int ymodem_set_progress(ymodem_context_t* ctx, ymodem_progress_func progress, uint32_t interval_ms)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ctx->progress = progress;
+    ctx->progress_interval_ms = interval_ms;
+    
+    return YMODEM_ERR_NONE;
+}
+#else /* !YMODEM_STATS_ENABLE */
+
+/* Without statistics the engines only keep track of the stage */
+void ymodem_stats_reset(ymodem_context_t* ctx)
+{
+    (void)ctx;
+}
+
+void ymodem_set_stage(ymodem_context_t* ctx, enum ymodem_stage stage)
+{
+    ctx->stage = stage;
+}
+
+void ymodem_stats_rtt(ymodem_context_t* ctx, uint32_t rtt_ms)
+{
+    (void)ctx;
+    (void)rtt_ms;
+}
+
+void ymodem_stats_payload(ymodem_context_t* ctx, size_t length)
+{
+    (void)ctx;
+    (void)length;
+}
+
+const ymodem_stats_t* ymodem_get_stats(const ymodem_context_t* ctx)
+{
+    static const ymodem_stats_t none;
+    
+    return (ctx != NULL) ? &none : NULL;
+}
+
+int ymodem_set_progress(ymodem_context_t* ctx, ymodem_progress_func progress, uint32_t interval_ms)
+{
+    (void)interval_ms;
+    
+    if (ctx == NULL || progress != NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    return YMODEM_ERR_NONE;
+}
+#endif /* YMODEM_STATS_ENABLE */
+
+/**
+ * @brief Tune the handshake for short sessions
+ */
+int ymodem_set_handshake(ymodem_context_t* ctx, uint32_t interval_ms, uint32_t timeout_ms, bool peer_waiting)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ctx->handshake_interval_ms = (interval_ms > 0) ? interval_ms : YMODEM_HANDSHAKE_INTERVAL_MS;
+    ctx->handshake_timeout_ms = timeout_ms;
+    ctx->peer_waiting = peer_waiting;
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Start a deadline budget_ms from now
+ * 
+ * @param ctx YMODEM context
+ * @param deadline Deadline to start
+ * @param budget_ms Length of the wait
+ */
+void ymodem_deadline_start(ymodem_context_t* ctx, ymodem_deadline_t* deadline, uint32_t budget_ms)
+{
+    deadline->clock = (ctx->callbacks.get_time_ms != NULL);
+    deadline->start_ms = deadline->clock ? ctx->callbacks.get_time_ms(ctx->callbacks.user) : 0;
+    deadline->budget_ms = budget_ms;
+    deadline->spent_ms = 0;
+}
+
+/**
+ * @brief Time since the deadline was started, at most its budget
+ */
+uint32_t ymodem_deadline_elapsed(ymodem_context_t* ctx, const ymodem_deadline_t* deadline)
+{
+    uint32_t elapsed = deadline->clock ? ctx->callbacks.get_time_ms(ctx->callbacks.user) - deadline->start_ms
+                                       : deadline->spent_ms;
+    return (elapsed < deadline->budget_ms) ? elapsed : deadline->budget_ms;
+}
+
+/**
+ * @brief Without a clock, count the time a receive took
+ * 
+ * @param deadline Deadline
+ * @param ms The whole wait if it timed out, 1 if a byte came (so garbage cannot stall the loop)
+ */
+void ymodem_deadline_spend(ymodem_deadline_t* deadline, uint32_t ms)
+{
+    deadline->spent_ms += ms;
+}
+
+/**
+ * @brief Handshake timeout in milliseconds, see ymodem_set_handshake()
+ */
+uint32_t ymodem_handshake_budget_ms(const ymodem_context_t* ctx, int timeout_s)
+{
+    if (ctx->handshake_timeout_ms > 0) {
+        return ctx->handshake_timeout_ms;
+    }
+    return (timeout_s > 0) ? (uint32_t)timeout_s * 1000 : 0;
+}
+
+/**
+ * @brief Throw away bytes that are already waiting, without waiting for more
+ * 
+ * @param ctx YMODEM context
+ */
+void ymodem_drain(ymodem_context_t* ctx)
+{
+    uint8_t discard[16];
+    size_t received;
+    
+    do {
+        received = ctx->callbacks.comm_receive(ctx->callbacks.user, discard, sizeof(discard), 0);
+        YMODEM_STATS_ADD(ctx, bytes_received, received);
+    } while (received > 0);
+}
+
+/**
+ * @brief Route the trace of a context to a sink
+ */
+int ymodem_set_trace(ymodem_context_t* ctx, ymodem_trace_func trace, void* trace_user, int level)
+{
+    if (ctx == NULL || level < YMODEM_TRACE_NONE || level > YMODEM_TRACE_BYTES) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_TRACE_LEVEL > YMODEM_TRACE_NONE
+    ctx->trace = trace;
+    ctx->trace_user = trace_user;
+    ctx->trace_level = level;
+#else
+    /* Nothing is compiled in to pass on */
+    (void)trace;
+    (void)trace_user;
+#endif
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Format a trace message and hand it to the sink, use YMODEM_TRACE()
+ * 
+ * @param ctx YMODEM context
+ * @param level Level of the message
+ * @param format printf format, without a trailing newline
+ */
+void ymodem_trace(ymodem_context_t* ctx, int level, const char* format, ...)
+{
+#if YMODEM_TRACE_LEVEL > YMODEM_TRACE_NONE
+    char line[YMODEM_TRACE_LINE_SIZE];
+    va_list args;
+    
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    
+    if (ctx->trace != NULL) {
+        ctx->trace(ctx->trace_user, level, line);
+    } else {
+        printf("[YMODEM] %s\n", line);
+    }
+#else
+    (void)ctx;
+    (void)level;
+    (void)format;
+#endif
+}
+
+/**
+ * @brief Hex dump the first bytes of a link read or write at YMODEM_TRACE_BYTES
+ */
+static void _ymodem_trace_bytes(ymodem_context_t* ctx, const char* what, const uint8_t* data, size_t length)
+{
+    char hex[8 * 3 + 4];
+    size_t shown = (length > 8) ? 8 : length;
+    size_t i;
+    
+    for (i = 0; i < shown; i++) {
+        snprintf(hex + i * 3, 4, "%02X ", data[i]);
+    }
+    snprintf(hex + shown * 3, sizeof(hex) - shown * 3, "%s", (length > 8) ? "..." : "");
+    YMODEM_TRACE(ctx, YMODEM_TRACE_BYTES, "%s %zu bytes: %s", what, length, hex);
+}
+
+/**
+ * @brief Get the name of a trace level
+ */
+const char* ymodem_trace_level_to_str(int level)
+{
+    switch (level) {
+        case YMODEM_TRACE_ERROR: return "E";
+        case YMODEM_TRACE_WARN:  return "W";
+        case YMODEM_TRACE_INFO:  return "I";
+        case YMODEM_TRACE_DEBUG: return "D";
+        case YMODEM_TRACE_BYTES: return "B";
+        default:                 return "?";
+    }
+}
+
+/**
+ * @brief Prepare a ring buffer for ymodem_trace_ring_sink()
+ */
+void ymodem_trace_ring_init(ymodem_trace_ring_t* ring, char* buffer, size_t size)
+{
+    ring->buffer = buffer;
+    ring->size = size;
+    ring->head = 0;
+    ring->wrapped = false;
+}
+
+/* Append bytes to the ring, overwriting the oldest ones */
+static void _ymodem_trace_ring_put(ymodem_trace_ring_t* ring, const char* text, size_t length)
+{
+    while (length > 0) {
+        size_t chunk = ring->size - ring->head;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(ring->buffer + ring->head, text, chunk);
+        ring->head += chunk;
+        text += chunk;
+        length -= chunk;
+        if (ring->head == ring->size) {
+            ring->head = 0;
+            ring->wrapped = true;
+        }
+    }
+}
+
+/**
+ * @brief Trace sink that appends to a ymodem_trace_ring_t given as user
+ */
+void ymodem_trace_ring_sink(void* user, int level, const char* message)
+{
+    ymodem_trace_ring_t* ring = (ymodem_trace_ring_t*)user;
+    
+    if (ring == NULL || ring->buffer == NULL || ring->size == 0) {
+        return;
+    }
+    
+    _ymodem_trace_ring_put(ring, ymodem_trace_level_to_str(level), 1);
+    _ymodem_trace_ring_put(ring, " ", 1);
+    _ymodem_trace_ring_put(ring, message, strlen(message));
+    _ymodem_trace_ring_put(ring, "\n", 1);
+}
+
+/**
+ * @brief Copy the kept messages out of a ring, oldest first
+ */
+size_t ymodem_trace_ring_read(const ymodem_trace_ring_t* ring, char* out, size_t out_size)
+{
+    size_t start = ring->wrapped ? ring->head : 0;
+    size_t length = ring->wrapped ? ring->size : ring->head;
+    size_t copied = 0;
+    size_t i = 0;
+    
+    if (out == NULL || out_size == 0) {
+        return 0;
+    }
+    
+    /* After a wrap the first message may be cut, start at the next one */
+    if (ring->wrapped) {
+        while (i < length && ring->buffer[(start + i) % ring->size] != '\n') {
+            i++;
+        }
+        i++;
+    }
+    
+    for (; i < length && copied + 1 < out_size; i++) {
+        out[copied++] = ring->buffer[(start + i) % ring->size];
+    }
+    out[copied] = '\0';
+    
+    return copied;
+}
+
+/**
+ * @brief Get the full on-wire size of a packet from its header byte
+ * 
+ * @param code Header byte (SOH or STX)
+ * @return size_t Packet size including header and CRC, 0 if code is not a packet header
+ */
+size_t ymodem_packet_size(uint8_t code)
+{
+    if (code == YMODEM_CODE_SOH) {
+        return YMODEM_SOH_PACKET_SIZE;
+    }
+    if (YMODEM_STX_ENABLE && code == YMODEM_CODE_STX) {
+        return YMODEM_STX_PACKET_SIZE;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the full on-wire size of a packet in this session
+ * 
+ * Like ymodem_packet_size(), and a BLK header is also known once a large
+ * block size has been agreed for the current file, an SKP header once delta
+ * mode has and a SUM header once a whole-file digest has.
+ * 
+ * @param ctx YMODEM context
+ * @param code Header byte
+ * @return size_t Packet size including header and CRC, 0 if code is not a packet header
+ */
+size_t ymodem_frame_size(const ymodem_context_t* ctx, uint8_t code)
+{
+    if (YMODEM_BLK_ENABLE && code == YMODEM_CODE_BLK) {
+        return (ctx->block_size > 0) ? YMODEM_BLK_PACKET_SIZE(ctx->block_size) : 0;
+    }
+#if YMODEM_DELTA_ENABLE
+    if (code == YMODEM_CODE_SKP) {
+        return ctx->delta ? YMODEM_SKP_PACKET_SIZE : 0;
+    }
+#endif
+#if YMODEM_DIGEST_ENABLE
+    if (code == YMODEM_CODE_SUM) {
+        return ctx->verify ? YMODEM_SUM_PACKET_SIZE : 0;
+    }
+#endif
+    return ymodem_packet_size(code);
+}
+
+/**
+ * @brief Fill in header and CRC around data already placed at packet + 3
+ * 
+ * Data larger than YMODEM_STX_DATA_SIZE is framed as a large block, with a
+ * BLK header and a big-endian CRC32 instead of the CRC16.
+ * 
+ * @param packet Packet buffer
+ * @param seq Sequence number
+ * @param data_size YMODEM_SOH_DATA_SIZE, YMODEM_STX_DATA_SIZE or an agreed large block size
+ */
+void ymodem_frame_packet(uint8_t* packet, uint8_t seq, size_t data_size)
+{
+    uint16_t crc;
+    
+    packet[1] = seq;
+    packet[2] = ~seq;
+    
+    if (YMODEM_BLK_ENABLE && data_size > YMODEM_STX_DATA_SIZE) {
+        uint32_t crc32 = ymodem_crc32_update(0, packet + 3, data_size);
+        
+        packet[0] = YMODEM_CODE_BLK;
+        packet[3 + data_size] = (uint8_t)(crc32 >> 24);
+        packet[3 + data_size + 1] = (uint8_t)(crc32 >> 16);
+        packet[3 + data_size + 2] = (uint8_t)(crc32 >> 8);
+        packet[3 + data_size + 3] = (uint8_t)crc32;
+        return;
+    }
+    
+    packet[0] = (data_size == YMODEM_SOH_DATA_SIZE) ? YMODEM_CODE_SOH : YMODEM_CODE_STX;
+    crc = ymodem_calc_crc16(packet + 3, data_size);
+    packet[3 + data_size] = (crc >> 8) & 0xFF;
+    packet[3 + data_size + 1] = crc & 0xFF;
+}
+
+/**
+ * @brief Start the running check of a packet whose header byte has arrived
+ * 
+ * @param rc Running check
+ * @param code Header byte, BLK packets carry a CRC32, SOH/STX a CRC16
+ * @param packet_size Full packet size, header and CRC included
+ */
+void ymodem_rx_crc_start(ymodem_rx_crc_t* rc, uint8_t code, size_t packet_size)
+{
+    rc->size = packet_size;
+    rc->trailer = (YMODEM_BLK_ENABLE && code == YMODEM_CODE_BLK) ? 4 : 2;
+    rc->checked = 3; /* Header and sequence numbers are not covered by the CRC */
+    rc->crc = 0;
+}
+
+/**
+ * @brief Fold the data bytes that arrived since the last call into the CRC
+ * 
+ * Called after every chunk (e.g. a DMA half buffer), so that when the last
+ * byte lands only the trailer is left to compare.
+ * 
+ * @param rc Running check
+ * @param packet Start of the packet in the receive buffer
+ * @param length Bytes of the packet received so far
+ */
+void ymodem_rx_crc_update(ymodem_rx_crc_t* rc, const uint8_t* packet, size_t length)
+{
+    size_t data_end = rc->size - rc->trailer;
+    
+    if (length > data_end) {
+        length = data_end;
+    }
+    if (length <= rc->checked) {
+        return;
+    }
+    
+    if (YMODEM_BLK_ENABLE && rc->trailer == 4) {
+        rc->crc = ymodem_crc32_update(rc->crc, packet + rc->checked, length - rc->checked);
+    } else {
+        rc->crc = ymodem_crc16_update((uint16_t)rc->crc, packet + rc->checked, length - rc->checked);
+    }
+    rc->checked = length;
+}
+
+/**
+ * @brief Check sequence numbers and compare the trailer of a complete packet
+ * 
+ * @param rc Running check, fed up to the full packet size
+ * @param packet Complete packet
+ * @param seq Returns the sequence number
+ * @param data_size Returns the data size
+ * @return int YMODEM_ERR_NONE if the packet is intact, error code otherwise
+ */
+int ymodem_rx_crc_finish(const ymodem_rx_crc_t* rc, const uint8_t* packet, uint8_t* seq, size_t* data_size)
+{
+    const uint8_t* trailer = packet + rc->size - rc->trailer;
+    uint32_t received_crc;
+    
+    *data_size = rc->size - 3 - rc->trailer;
+    
+    /* Check sequence numbers */
+    *seq = packet[1];
+    if ((uint8_t)(packet[1] ^ packet[2]) != 0xFF) {
+        return YMODEM_ERR_SEQ;
+    }
+    
+    if (rc->checked != rc->size - rc->trailer) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    /* Verify CRC */
+    if (YMODEM_BLK_ENABLE && rc->trailer == 4) {
+        received_crc = ((uint32_t)trailer[0] << 24) | ((uint32_t)trailer[1] << 16) |
+                       ((uint32_t)trailer[2] << 8) | trailer[3];
+    } else {
+        received_crc = ((uint32_t)trailer[0] << 8) | trailer[1];
+    }
+    if (received_crc != rc->crc) {
+        return YMODEM_ERR_CRC;
+    }
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Check sequence numbers and CRC of a complete packet
+ * 
+ * @param packet Complete packet, starting with SOH/STX
+ * @param seq Returns the sequence number
+ * @param data_size Returns the data size
+ * @return int YMODEM_ERR_NONE if the packet is intact, error code otherwise
+ */
+int ymodem_check_packet(const uint8_t* packet, uint8_t* seq, size_t* data_size)
+{
+    ymodem_rx_crc_t rc;
+    size_t packet_size = ymodem_packet_size(packet[0]);
+    
+    if (packet_size == 0) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ymodem_rx_crc_start(&rc, packet[0], packet_size);
+    ymodem_rx_crc_update(&rc, packet, packet_size);
+    return ymodem_rx_crc_finish(&rc, packet, seq, data_size);
+}
+
+/**
+ * @brief Check sequence numbers and CRC32 of a complete large block
+ * 
+ * @param packet Complete packet, starting with BLK
+ * @param data_size Agreed block data size
+ * @param seq Returns the sequence number
+ * @return int YMODEM_ERR_NONE if the block is intact, error code otherwise
+ */
+int ymodem_check_block(const uint8_t* packet, size_t data_size, uint8_t* seq)
+{
+    ymodem_rx_crc_t rc;
+    size_t checked_size;
+    
+    if (packet[0] != YMODEM_CODE_BLK) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ymodem_rx_crc_start(&rc, YMODEM_CODE_BLK, YMODEM_BLK_PACKET_SIZE(data_size));
+    ymodem_rx_crc_update(&rc, packet, rc.size);
+    return ymodem_rx_crc_finish(&rc, packet, seq, &checked_size);
+}
+
+#if YMODEM_SEND_ENABLE
+#if YMODEM_LZ_ENABLE
+/**
+ * @brief Fill the data area of a packet with compressed file data
+ * 
+ * The file is read into the compressor whenever it runs dry, so a packet is
+ * only short at the end of the compressed stream.
+ * 
+ * @return size_t Number of compressed bytes in data, 0 once the stream is complete
+ */
+static size_t _ymodem_lz_fill(ymodem_context_t* ctx, uint8_t* data, size_t size)
+{
+    ymodem_lz_encoder_t* lz = ctx->lz_encoder;
+    uint64_t file_bytes = lz->total_in;
+    size_t filled = 0;
+    
+    for (;;) {
+        uint8_t* input;
+        size_t room;
+        size_t length;
+    
+        filled += ymodem_lz_encode(lz, data + filled, size - filled);
+        if (filled == size || ymodem_lz_encoder_done(lz)) {
+            break;
+        }
+        /* Stalled for input, there is always room then */
+        input = ymodem_lz_encoder_input(lz, &room);
+        length = ctx->callbacks.file_read(ctx->callbacks.user, ctx->file_handle, input, room);
+#if YMODEM_DIGEST_ENABLE
+        if (ctx->verify) {
+            ymodem_digest_update(ctx->digest, input, length);
+        }
+#endif
+        ymodem_lz_encoder_commit(lz, length);
+    }
+    
+    YMODEM_STATS_ADD(ctx, lz_file_bytes, lz->total_in - file_bytes);
+    YMODEM_STATS_ADD(ctx, lz_wire_bytes, filled);
+    return filled;
+}
+#endif
+
+/**
+ * @brief Read up to size bytes, giving a slow source a few more tries
+ */
+static size_t _ymodem_read_full(ymodem_context_t* ctx, uint8_t* data, size_t size)
+{
+    size_t actual_read = 0;
+    int retry_read;
+    
+    for (retry_read = 0; retry_read < 10; retry_read++) {
+        actual_read += ctx->callbacks.file_read(ctx->callbacks.user, ctx->file_handle, 
+                                              data + actual_read, 
+                                              size - actual_read);
+        if (actual_read == size)
+            break;
+    }
+    return actual_read;
+}
+
+#if YMODEM_DELTA_ENABLE
+/**
+ * @brief Pass over the blocks at the read position that the receiver already has
+ * 
+ * Whole blocks are read into data and compared with the map for as long as
+ * they match. The first block that differs stays in data when the next
+ * packet would read exactly it anyway, otherwise the file is moved back to
+ * its start.
+ * 
+ * @param ctx YMODEM context in delta mode
+ * @param data Data area of the packet, room for YMODEM_DELTA_BLOCK_SIZE bytes
+ * @param have Returns the file bytes left in data for the next packet, 0 for none
+ * @return uint64_t Bytes that can be skipped, 0 if the next packet has to carry data
+ */
+static uint64_t _ymodem_delta_skip(ymodem_context_t* ctx, uint8_t* data, size_t* have)
+{
+    uint64_t skipped = 0;
+    uint64_t known = (ctx->delta_blocks < ctx->delta_map_size) ? ctx->delta_blocks : ctx->delta_map_size;
+    
+    *have = 0;
+    while (ctx->delta_offset % YMODEM_DELTA_BLOCK_SIZE == 0) {
+        uint64_t block = ctx->delta_offset / YMODEM_DELTA_BLOCK_SIZE;
+        size_t length;
+    
+        /* The count of a skip frame is 32 bits */
+        if (block >= known || skipped > UINT32_MAX - YMODEM_DELTA_BLOCK_SIZE) {
+            return skipped;
+        }
+        length = _ymodem_read_full(ctx, data, YMODEM_DELTA_BLOCK_SIZE);
+        if (length == YMODEM_DELTA_BLOCK_SIZE && ymodem_crc32_update(0, data, length) == ctx->delta_map[block]) {
+#if YMODEM_DIGEST_ENABLE
+            if (ctx->verify) {
+                ymodem_digest_update(ctx->digest, data, length);
+            }
+#endif
+            skipped += length;
+            ctx->delta_offset += length;
+            continue;
+        }
+    
+        if (skipped == 0 && ctx->packet_data_size == YMODEM_DELTA_BLOCK_SIZE) {
+            *have = length;
+            ctx->delta_offset += length;
+        } else if (ctx->callbacks.file_seek(ctx->callbacks.user, ctx->file_handle, ctx->delta_offset) != 0) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Cannot go back to offset %llu of %s", (unsigned long long)ctx->delta_offset, ctx->filename);
+            ctx->delta_offset = UINT64_MAX; /* Ends the file here, the receiver reports it short */
+        }
+        break;
+    }
+    return skipped;
+}
+#endif
+
+/**
+ * @brief Read the next packet from the file and build it in place
+ * 
+ * File data is read directly into the data area of the packet, padded with
+ * 0x1A, then the header and CRC are filled in around it. Up to
+ * ctx->packet_data_size bytes are read; a short piece goes out in the
+ * smallest packet that holds it. A compressed file fills the packet from
+ * the compressor instead. In delta mode a run of blocks the receiver
+ * already has becomes one SKP frame carrying the number of bytes to skip.
+ * 
+ * @param ctx YMODEM context
+ * @param packet Packet buffer (at least the packet size of ctx->packet_data_size)
+ * @param seq Sequence number of the packet
+ * @return size_t Number of file bytes in the packet, 0 at end of file
+ */
+size_t ymodem_load_packet(ymodem_context_t* ctx, uint8_t* packet, uint8_t seq)
+{
+    size_t data_size = ctx->packet_data_size;
+    size_t actual_read = 0;
+    uint32_t start_ms = ymodem_now_ms(ctx);
+    
+#if YMODEM_LZ_ENABLE
+    if (ctx->lz) {
+        actual_read = _ymodem_lz_fill(ctx, packet + 3, data_size);
+    } else
+#endif
+#if YMODEM_DELTA_ENABLE
+    if (ctx->delta) {
+        uint64_t skipped = _ymodem_delta_skip(ctx, packet + 3, &actual_read);
+    
+        if (skipped > 0) {
+            uint16_t crc;
+    
+            YMODEM_STATS_ADD(ctx, file_ms, ymodem_now_ms(ctx) - start_ms);
+            YMODEM_STATS_ADD(ctx, delta_skipped_bytes, skipped);
+            packet[0] = YMODEM_CODE_SKP;
+            packet[1] = seq;
+            packet[2] = ~seq;
+            packet[3] = (uint8_t)(skipped >> 24);
+            packet[4] = (uint8_t)(skipped >> 16);
+            packet[5] = (uint8_t)(skipped >> 8);
+            packet[6] = (uint8_t)skipped;
+            crc = ymodem_calc_crc16(packet + 3, 4);
+            packet[7] = (uint8_t)(crc >> 8);
+            packet[8] = (uint8_t)crc;
+            return (size_t)skipped;
+        }
+        if (actual_read == 0 && ctx->delta_offset != UINT64_MAX) {
+            actual_read = _ymodem_read_full(ctx, packet + 3, data_size);
+            ctx->delta_offset += actual_read;
+        }
+    } else
+#endif
+    {
+        actual_read = _ymodem_read_full(ctx, packet + 3, data_size);
+    }
+    YMODEM_STATS_ADD(ctx, file_ms, ymodem_now_ms(ctx) - start_ms);
+    
+    if (actual_read == 0) {
+        return 0;
+    }
+#if YMODEM_DIGEST_ENABLE
+    /* Every file byte is in exactly one built packet (or skipped block), resends are not built again.
+     * The compressor hashes what it reads itself */
+#if YMODEM_LZ_ENABLE
+    if (ctx->verify && !ctx->lz) {
+#else
+    if (ctx->verify) {
+#endif
+        ymodem_digest_update(ctx->digest, packet + 3, actual_read);
+    }
+#endif
+    
+    if (actual_read <= YMODEM_SOH_DATA_SIZE) {
+        data_size = YMODEM_SOH_DATA_SIZE;
+    } else if (YMODEM_STX_ENABLE && actual_read <= YMODEM_STX_DATA_SIZE) {
+        data_size = YMODEM_STX_DATA_SIZE;
+    }
+    if (actual_read < data_size) {
+        memset(packet + 3 + actual_read, 0x1A, data_size - actual_read);
+    }
+    
+    ymodem_frame_packet(packet, seq, data_size);
+    
+    return actual_read;
+}
+
+/**
+ * @brief Append a space separated field to the packet 0 fields if it fits
+ * 
+ * @param fields Fields built so far, NUL terminated
+ * @param length Length of fields, updated
+ * @param room Longest the fields may get
+ * @param field Field with its leading space
+ * @return bool false if the field does not fit and was left out
+ */
+static bool _ymodem_append_field(char* fields, size_t* length, size_t room, const char* field)
+{
+    size_t field_len = strlen(field);
+    
+    if (*length + field_len > room) {
+        return false;
+    }
+    memcpy(fields + *length, field, field_len + 1);
+    *length += field_len;
+    
+    return true;
+}
+
+/**
+ * @brief Prepare file info packet (packet 0)
+ * 
+ * Only the name and the size must fit in the 128 bytes. Modification time,
+ * mode and the extension tokens are optional: a token that does not fit is
+ * left out, so its extension is simply not negotiated for this file.
+ */
+int ymodem_prepare_file_info_packet(ymodem_context_t* ctx, const char* filename)
+{
+    uint8_t* data = ctx->buffer + 3; /* Skip header bytes (SOH/STX + seq + ~seq) */
+    char fields[YMODEM_SOH_DATA_SIZE]; /* Size, mtime, mode, serial number and extensions */
+    char spec[48];
+    char tokens[5][32]; /* Extension tokens, each with its leading space */
+    size_t token_count = 0;
+    size_t name_len;
+    size_t size_len;
+    size_t room;
+    size_t i;
+    
+    /* Clear the packet data area */
+    memset(data, 0, YMODEM_SOH_DATA_SIZE);
+    
+    /* Add filename */
+    name_len = strlen(filename);
+    if (name_len >= YMODEM_SOH_DATA_SIZE) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    memcpy(data, filename, name_len);
+    data[name_len] = '\0';
+    
+    /* Add file size, a stream of unknown length announces none */
+    if (ctx->file_size < 0) {
+        return YMODEM_ERR_NONE;
+    }
+    
+    /* The fields sit between the name's NUL and a NUL of their own */
+    room = (name_len + 2 < YMODEM_SOH_DATA_SIZE) ? YMODEM_SOH_DATA_SIZE - name_len - 2 : 0;
+    snprintf(fields, sizeof(fields), "%lld", (long long)ctx->file_size);
+    size_len = strlen(fields);
+    if (size_len > room) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    /* Extension tokens in order of benefit, the first ones get the room left */
+#if YMODEM_RESUME_ENABLE
+    if (ctx->resume) {
+        snprintf(tokens[token_count++], sizeof(tokens[0]), " " YMODEM_EXT_RESUME);
+    }
+#endif
+    /* Large blocks are offered to stop-and-wait and streaming senders, the window ring holds STX packets */
+    if (ctx->block_max > 0 && !(ctx->window_count > 1 && ctx->start_code == YMODEM_CODE_C)) {
+        snprintf(tokens[token_count++], sizeof(tokens[0]), " " YMODEM_EXT_BLOCK "%zu", ctx->block_max);
+    }
+#if YMODEM_LZ_ENABLE
+    /* Compression is offered for files with data, the receiver stops decoding at their size */
+    if (ctx->lz_encoder != NULL && ctx->file_size > 0) {
+        snprintf(tokens[token_count++], sizeof(tokens[0]), " " YMODEM_EXT_LZ "%u", (unsigned int)YMODEM_LZ_WINDOW_BITS);
+    }
+#endif
+#if YMODEM_DELTA_ENABLE
+    if (ctx->delta_map != NULL && ctx->file_size > 0) {
+        snprintf(tokens[token_count++], sizeof(tokens[0]), " " YMODEM_EXT_DELTA);
+    }
+#endif
+#if YMODEM_DIGEST_ENABLE
+    /* The digest covers the whole file, whatever skips or compresses it on the way */
+    if (ctx->digest != NULL) {
+        snprintf(tokens[token_count++], sizeof(tokens[0]), " " YMODEM_EXT_DIGEST "%s", ymodem_digest_name(ctx->digest->type));
+    }
+#endif
+    
+    if (ctx->file_mtime != 0 || ctx->file_mode != 0 || token_count > 0) {
+        /* "length modtime mode serial", as in the YMODEM spec, then our extension tokens */
+        snprintf(spec, sizeof(spec), " %llo %o 0", (unsigned long long)ctx->file_mtime, (unsigned int)ctx->file_mode);
+        if (!_ymodem_append_field(fields, &size_len, room, spec)) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "No room in packet 0 for the mtime, mode and extensions of %s", filename);
+            token_count = 0;
+        }
+        /* The receiver answers only what it was offered, a token left out is not negotiated */
+        for (i = 0; i < token_count; i++) {
+            if (!_ymodem_append_field(fields, &size_len, room, tokens[i])) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "No room in packet 0 for '%s', not offered", tokens[i] + 1);
+            }
+        }
+    }
+    
+    memcpy(data + name_len + 1, fields, size_len);
+    
+    return YMODEM_ERR_NONE;
+}
+#endif /* YMODEM_SEND_ENABLE */
+
+/**
+ * @brief Parse an octal field of packet 0
+ * 
+ * @param field Start of the field
+ * @param length Length of the field
+ * @param value Returns the value
+ * @return bool false if the field is not a valid octal number
+ */
+static bool _ymodem_parse_octal(const char* field, size_t length, uint64_t* value)
+{
+    size_t i;
+    
+    *value = 0;
+    for (i = 0; i < length; i++) {
+        if (field[i] < '0' || field[i] > '7' || *value > (UINT64_MAX >> 3)) {
+            *value = 0;
+            return false;
+        }
+        *value = (*value << 3) | (uint64_t)(field[i] - '0');
+    }
+    
+    return true;
+}
+
+/**
+ * @brief Parse file information from packet 0
+ */
+int ymodem_parse_file_info(ymodem_context_t* ctx, ymodem_file_info_t* file_info)
+{
+    char* filename;
+    char* file_size_str;
+    const char* data_end;
+    size_t name_len;
+    size_t copy_len;
+    size_t packet_size;
+    int field_index;
+    uint64_t value;
+    
+    /* Packet 0 contains filename and optionally file size */
+    filename = (char*)(ctx->buffer + 3); /* Skip SOH/STX + seq + ~seq */
+    
+    /* Check if this is an empty packet (end of batch) */
+    if (filename[0] == '\0') {
+        return YMODEM_ERR_FILE;
+    }
+    
+    /* Find the end of filename, the size field follows it even when the name is cut */
+    packet_size = ymodem_packet_size(ctx->buffer[0]);
+    data_end = (const char*)ctx->buffer + (packet_size > 0 ? packet_size - 2 : YMODEM_SOH_PACKET_SIZE - 2);
+    name_len = 0;
+    while (filename + name_len < data_end - 1 && filename[name_len] != '\0') {
+        name_len++;
+    }
+    
+    if (name_len == 0) {
+        return YMODEM_ERR_FILE;
+    }
+    
+    /* Copy filename, cut to the buffers of the profile */
+    copy_len = name_len;
+    if (copy_len >= YMODEM_MAX_FILENAME_LENGTH) {
+        copy_len = YMODEM_MAX_FILENAME_LENGTH - 1;
+    }
+    
+    /* Copy filename to context and file_info */
+    memcpy(ctx->filename, filename, copy_len);
+    ctx->filename[copy_len] = '\0';
+    memcpy(file_info->filename, filename, copy_len);
+    file_info->filename[copy_len] = '\0';
+    
+    /* Optional fields are reset first, a packet 0 without them announces nothing */
+    ctx->file_mtime = 0;
+    ctx->file_mode = 0;
+    ctx->peer_block = 0;
+#if YMODEM_RESUME_ENABLE
+    ctx->peer_resume = false;
+#endif
+#if YMODEM_LZ_ENABLE
+    ctx->peer_lz = 0;
+#endif
+#if YMODEM_DELTA_ENABLE
+    ctx->peer_delta = false;
+#endif
+#if YMODEM_DIGEST_ENABLE
+    ctx->peer_digest = YMODEM_DIGEST_NONE;
+    file_info->verified = YMODEM_DIGEST_NONE;
+    memset(file_info->digest, 0, sizeof(file_info->digest));
+#endif
+    file_info->mtime = 0;
+    file_info->mode = 0;
+    file_info->resumed = 0;
+    
+    /* Get file size if available */
+    file_size_str = filename + name_len + 1;
+    if (file_size_str < data_end && file_size_str[0] != '\0') {
+        /* Convert file size string to a 64-bit integer, the digits end with the data at the latest */
+        ctx->file_size = 0;
+        while (file_size_str < data_end && *file_size_str >= '0' && *file_size_str <= '9') {
+            int digit = *file_size_str - '0';
+            if (ctx->file_size > (INT64_MAX - digit) / 10) {
+                return YMODEM_ERR_DSZ;
+            }
+            ctx->file_size = ctx->file_size * 10 + digit;
+            file_size_str++;
+        }
+        file_info->filesize = (uint64_t)ctx->file_size;
+        
+        /* Space separated fields after the size: modtime and mode in octal, serial number, extensions */
+        field_index = 0;
+        while (file_size_str < data_end && *file_size_str != '\0') {
+            const char* field = file_size_str;
+            size_t field_len = 0;
+            
+            if (*field == ' ') {
+                file_size_str++;
+                continue;
+            }
+            while (field + field_len < data_end && field[field_len] != ' ' && field[field_len] != '\0') {
+                field_len++;
+            }
+            file_size_str += field_len;
+            
+            if (field_index == 0 && _ymodem_parse_octal(field, field_len, &value)) {
+                ctx->file_mtime = value;
+            } else if (field_index == 1 && _ymodem_parse_octal(field, field_len, &value)) {
+                ctx->file_mode = (uint32_t)value;
+#if YMODEM_RESUME_ENABLE
+            } else if (field_len == sizeof(YMODEM_EXT_RESUME) - 1 &&
+                       memcmp(field, YMODEM_EXT_RESUME, field_len) == 0) {
+                ctx->peer_resume = true;
+#endif
+#if YMODEM_DELTA_ENABLE
+            } else if (field_len == sizeof(YMODEM_EXT_DELTA) - 1 &&
+                       memcmp(field, YMODEM_EXT_DELTA, field_len) == 0) {
+                ctx->peer_delta = true;
+#endif
+            } else if (YMODEM_BLK_ENABLE && field_len > sizeof(YMODEM_EXT_BLOCK) - 1 &&
+                       memcmp(field, YMODEM_EXT_BLOCK, sizeof(YMODEM_EXT_BLOCK) - 1) == 0) {
+                /* Only the block sizes defined here are understood, anything else is ignored */
+                size_t block = 0;
+                size_t i;
+                for (i = sizeof(YMODEM_EXT_BLOCK) - 1; i < field_len && field[i] >= '0' && field[i] <= '9' && block <= YMODEM_BLK32K_DATA_SIZE; i++) {
+                    block = block * 10 + (size_t)(field[i] - '0');
+                }
+                if (i == field_len && (block == YMODEM_BLK8K_DATA_SIZE || block == YMODEM_BLK32K_DATA_SIZE)) {
+                    ctx->peer_block = block;
+                }
+#if YMODEM_LZ_ENABLE
+            } else if (field_len > sizeof(YMODEM_EXT_LZ) - 1 &&
+                       memcmp(field, YMODEM_EXT_LZ, sizeof(YMODEM_EXT_LZ) - 1) == 0) {
+                /* Window bits of the compressor, 8 to 12 */
+                unsigned int bits = 0;
+                size_t i;
+                for (i = sizeof(YMODEM_EXT_LZ) - 1; i < field_len && field[i] >= '0' && field[i] <= '9' && bits <= 12; i++) {
+                    bits = bits * 10 + (unsigned int)(field[i] - '0');
+                }
+                if (i == field_len && bits >= 8 && bits <= 12) {
+                    ctx->peer_lz = (uint8_t)bits;
+                }
+#endif
+#if YMODEM_DIGEST_ENABLE
+            } else if (field_len > sizeof(YMODEM_EXT_DIGEST) - 1 &&
+                       memcmp(field, YMODEM_EXT_DIGEST, sizeof(YMODEM_EXT_DIGEST) - 1) == 0) {
+                /* An unknown digest name is ignored, the file is then received unchecked */
+                ctx->peer_digest = (uint8_t)ymodem_digest_parse(field + sizeof(YMODEM_EXT_DIGEST) - 1,
+                                                                field_len - (sizeof(YMODEM_EXT_DIGEST) - 1));
+#endif
+            }
+            field_index++;
+        }
+        file_info->mtime = ctx->file_mtime;
+        file_info->mode = ctx->file_mode;
+    } else {
+        /* File size not provided */
+        ctx->file_size = 0;
+        file_info->filesize = 0;
+    }
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Parsed file info: name='%s', size=%llu bytes, mtime=%llu, mode=%o",
+                 file_info->filename, (unsigned long long)file_info->filesize,
+                 (unsigned long long)file_info->mtime, (unsigned int)file_info->mode);
+#if YMODEM_RESUME_ENABLE
+    if (ctx->peer_resume) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Sender can resume the file");
+    }
+#endif
+#if YMODEM_DELTA_ENABLE
+    if (ctx->peer_delta) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Sender offers to skip the blocks we already have");
+    }
+#endif
+    if (ctx->peer_block > 0) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Sender offers blocks of up to %zu bytes", ctx->peer_block);
+    }
+#if YMODEM_LZ_ENABLE
+    if (ctx->peer_lz > 0) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Sender offers compression with a %u byte window", 1u << ctx->peer_lz);
+    }
+#endif
+#if YMODEM_DIGEST_ENABLE
+    if (ctx->peer_digest != YMODEM_DIGEST_NONE) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Sender offers a %s digest of the file",
+                     ymodem_digest_name((enum ymodem_digest_type)ctx->peer_digest));
+    }
+#endif
+    return YMODEM_ERR_NONE;
+}
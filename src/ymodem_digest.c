@@ -0,0 +1,216 @@
+/**
+ * @file ymodem_digest.c
+ * @brief Whole-file digest
+ * @date 2025-04-09
+ * 
+ * This file contains the digests of ymodem_digest.h: the CRC32 engine of
+ * ymodem_crc.c, and a compact SHA-256 that compresses whole 64-byte blocks
+ * straight from the input and only copies the pieces around them.
+ */
+
+#include "ymodem_common.h"
+
+#if YMODEM_DIGEST_ENABLE
+
+#include <string.h>
+
+#define _ROTR(x, n)     (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t _ymodem_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/**
+ * @brief Compress one 64-byte block into the chaining value
+ */
+static void _ymodem_sha256_block(uint32_t* state, const uint8_t* p)
+{
+    uint32_t w[16];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    int i;
+    
+    for (i = 0; i < 64; i++) {
+        uint32_t t1, t2;
+    
+        /* The message schedule is kept as a ring of 16 words */
+        if (i < 16) {
+            w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) |
+                   ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
+        } else {
+            uint32_t w15 = w[(i - 15) & 15];
+            uint32_t w2 = w[(i - 2) & 15];
+            uint32_t s0 = _ROTR(w15, 7) ^ _ROTR(w15, 18) ^ (w15 >> 3);
+            uint32_t s1 = _ROTR(w2, 17) ^ _ROTR(w2, 19) ^ (w2 >> 10);
+            w[i & 15] += s0 + w[(i - 7) & 15] + s1;
+        }
+    
+        t1 = h + (_ROTR(e, 6) ^ _ROTR(e, 11) ^ _ROTR(e, 25)) + ((e & f) ^ (~e & g)) + _ymodem_sha256_k[i] + w[i & 15];
+        t2 = (_ROTR(a, 2) ^ _ROTR(a, 13) ^ _ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/**
+ * @brief Start a new digest
+ */
+void ymodem_digest_init(ymodem_digest_t* digest, enum ymodem_digest_type type)
+{
+    static const uint32_t sha256_iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    
+    digest->type = type;
+    digest->length = 0;
+    if (type == YMODEM_DIGEST_SHA256) {
+        memcpy(digest->state, sha256_iv, sizeof(sha256_iv));
+    } else {
+        memset(digest->state, 0, sizeof(digest->state));
+    }
+    memset(digest->value, 0, sizeof(digest->value));
+}
+
+/**
+ * @brief Hash the next size bytes
+ */
+void ymodem_digest_update(ymodem_digest_t* digest, const uint8_t* data, size_t size)
+{
+    size_t fill = (size_t)(digest->length & 63);
+    
+    digest->length += size;
+    if (digest->type == YMODEM_DIGEST_CRC32) {
+        digest->state[0] = ymodem_crc32_update(digest->state[0], data, size);
+        return;
+    }
+    if (digest->type != YMODEM_DIGEST_SHA256) {
+        return;
+    }
+    
+    /* Complete a block started by an earlier call */
+    if (fill > 0) {
+        size_t chunk = 64 - fill;
+        if (chunk > size) {
+            chunk = size;
+        }
+        memcpy(digest->block + fill, data, chunk);
+        data += chunk;
+        size -= chunk;
+        if (fill + chunk < 64) {
+            return;
+        }
+        _ymodem_sha256_block(digest->state, digest->block);
+    }
+    
+    while (size >= 64) {
+        _ymodem_sha256_block(digest->state, data);
+        data += 64;
+        size -= 64;
+    }
+    memcpy(digest->block, data, size);
+}
+
+/**
+ * @brief Finish the digest into digest->value
+ */
+size_t ymodem_digest_final(ymodem_digest_t* digest)
+{
+    uint64_t bits = digest->length * 8;
+    size_t fill = (size_t)(digest->length & 63);
+    int i;
+    
+    if (digest->type == YMODEM_DIGEST_CRC32) {
+        uint32_t crc = digest->state[0];
+        digest->value[0] = (uint8_t)(crc >> 24);
+        digest->value[1] = (uint8_t)(crc >> 16);
+        digest->value[2] = (uint8_t)(crc >> 8);
+        digest->value[3] = (uint8_t)crc;
+        return 4;
+    }
+    if (digest->type != YMODEM_DIGEST_SHA256) {
+        return 0;
+    }
+    
+    /* 0x80, zeros up to 56 mod 64, then the length in bits, big-endian */
+    digest->block[fill++] = 0x80;
+    if (fill > 56) {
+        memset(digest->block + fill, 0, 64 - fill);
+        _ymodem_sha256_block(digest->state, digest->block);
+        fill = 0;
+    }
+    memset(digest->block + fill, 0, 56 - fill);
+    for (i = 0; i < 8; i++) {
+        digest->block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    _ymodem_sha256_block(digest->state, digest->block);
+    
+    for (i = 0; i < 8; i++) {
+        digest->value[4 * i] = (uint8_t)(digest->state[i] >> 24);
+        digest->value[4 * i + 1] = (uint8_t)(digest->state[i] >> 16);
+        digest->value[4 * i + 2] = (uint8_t)(digest->state[i] >> 8);
+        digest->value[4 * i + 3] = (uint8_t)digest->state[i];
+    }
+    return 32;
+}
+
+/**
+ * @brief Size of a digest of this type
+ */
+size_t ymodem_digest_size(enum ymodem_digest_type type)
+{
+    switch (type) {
+        case YMODEM_DIGEST_CRC32: return 4;
+        case YMODEM_DIGEST_SHA256: return 32;
+        default: return 0;
+    }
+}
+
+/**
+ * @brief Name of a digest type as used in packet 0
+ */
+const char* ymodem_digest_name(enum ymodem_digest_type type)
+{
+    switch (type) {
+        case YMODEM_DIGEST_CRC32: return "crc32";
+        case YMODEM_DIGEST_SHA256: return "sha256";
+        default: return "none";
+    }
+}
+
+/**
+ * @brief Digest type of a name used in packet 0
+ */
+enum ymodem_digest_type ymodem_digest_parse(const char* name, size_t length)
+{
+    if (length == 5 && memcmp(name, "crc32", 5) == 0) {
+        return YMODEM_DIGEST_CRC32;
+    }
+    if (length == 6 && memcmp(name, "sha256", 6) == 0) {
+        return YMODEM_DIGEST_SHA256;
+    }
+    return YMODEM_DIGEST_NONE;
+}
+
+#endif /* YMODEM_DIGEST_ENABLE */
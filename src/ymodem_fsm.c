@@ -0,0 +1,1012 @@
+/**
+ * @file ymodem_fsm.c
+ * @brief Non-blocking, event-driven YMODEM engine
+ * @date 2025-04-09
+ * 
+ * This file contains the implementation of the YMODEM state machine. It
+ * never blocks and never calls the communication or timing callbacks: bytes
+ * come in through ymodem_feed(), go out through ymodem_poll(), and every
+ * wait of the blocking engine becomes a deadline checked against the time
+ * passed in by the caller.
+ */
+
+#include "ymodem_fsm.h"
+#include <string.h>
+
+/* Steps inside the ymodem_stage values */
+enum {
+    _FSM_IDLE = 0,
+    
+    /* Receiver */
+    _FSM_RX_HANDSHAKE,      /* Sending 'C' ('G'), waiting for packet 0 */
+    _FSM_RX_DATA,           /* Waiting for SOH/STX/EOT */
+    _FSM_RX_PACKET,         /* Collecting the rest of a packet */
+    _FSM_RX_PURGE,          /* Draining the line before a NAK */
+    _FSM_RX_EOT,            /* First EOT NAKed, waiting for the second one */
+    _FSM_RX_NULL,           /* Waiting for the null packet 0 */
+    
+    /* Sender */
+    _FSM_TX_HANDSHAKE,      /* Waiting for 'C' ('G') */
+    _FSM_TX_INFO,           /* Packet 0 sent, waiting for ACK and 'C' */
+    _FSM_TX_DATA,           /* Data packet sent, waiting for ACK */
+    _FSM_TX_STREAM,         /* YMODEM-G, packets go out back to back */
+    _FSM_TX_EOT1,           /* First EOT sent, waiting for NAK */
+    _FSM_TX_EOT2,           /* Second EOT sent, waiting for ACK */
+    _FSM_TX_WAIT_C,         /* Waiting for 'C' before the null packet */
+    _FSM_TX_NULL,           /* Null packet sent, waiting for the final ACK */
+};
+
+/* Forward declarations of internal functions */
+static void _ymodem_fsm_arm(ymodem_fsm_t* fsm, uint32_t ms);
+static void _ymodem_fsm_queue(ymodem_fsm_t* fsm, const uint8_t* data, size_t length);
+static void _ymodem_fsm_queue_byte(ymodem_fsm_t* fsm, uint8_t code);
+static void _ymodem_fsm_finish(ymodem_fsm_t* fsm, int result);
+static void _ymodem_fsm_cancel(ymodem_fsm_t* fsm, int result);
+static void _ymodem_fsm_rx_byte(ymodem_fsm_t* fsm, uint8_t byte);
+static void _ymodem_fsm_rx_packet(ymodem_fsm_t* fsm);
+static void _ymodem_fsm_rx_error(ymodem_fsm_t* fsm, int error, bool purge);
+static void _ymodem_fsm_rx_timeout(ymodem_fsm_t* fsm);
+static void _ymodem_fsm_rx_null_retry(ymodem_fsm_t* fsm);
+#if YMODEM_SEND_ENABLE
+static void _ymodem_fsm_tx_byte(ymodem_fsm_t* fsm, uint8_t byte);
+static void _ymodem_fsm_tx_next(ymodem_fsm_t* fsm);
+static void _ymodem_fsm_tx_resend(ymodem_fsm_t* fsm);
+static void _ymodem_fsm_tx_eot(ymodem_fsm_t* fsm, uint8_t state);
+static void _ymodem_fsm_tx_null(ymodem_fsm_t* fsm);
+static void _ymodem_fsm_tx_timeout(ymodem_fsm_t* fsm);
+#else
+/* Receiver-only build: there is no sender init, the sender states are never entered */
+static void _ymodem_fsm_tx_byte(ymodem_fsm_t* fsm, uint8_t byte) { (void)fsm; (void)byte; }
+static void _ymodem_fsm_tx_next(ymodem_fsm_t* fsm) { (void)fsm; }
+static void _ymodem_fsm_tx_eot(ymodem_fsm_t* fsm, uint8_t state) { (void)fsm; (void)state; }
+static void _ymodem_fsm_tx_timeout(ymodem_fsm_t* fsm) { (void)fsm; }
+#endif
+
+/**
+ * @brief Common part of both init functions
+ */
+static int _ymodem_fsm_init(ymodem_fsm_t* fsm,
+                           const ymodem_callbacks_t* callbacks,
+                           uint8_t* buffer,
+                           size_t buffer_size,
+                           enum ymodem_mode mode,
+                           int handshake_timeout_s,
+                           uint32_t now_ms)
+{
+    if (fsm == NULL || callbacks == NULL || buffer == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    if (buffer_size < YMODEM_MAX_PACKET_SIZE) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    if (mode != YMODEM_MODE_CRC && mode != YMODEM_MODE_G) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    memset(fsm, 0, sizeof(*fsm));
+    fsm->ctx.callbacks = *callbacks;
+    fsm->ctx.buffer = buffer;
+    fsm->ctx.buffer_size = buffer_size;
+    fsm->ctx.stage = YMODEM_STAGE_ESTABLISHING;
+    fsm->ctx.mode = mode;
+    fsm->ctx.start_code = (mode == YMODEM_MODE_G) ? YMODEM_CODE_G : YMODEM_CODE_C;
+#if YMODEM_SEND_ENABLE
+    fsm->ctx.packet_data_size = YMODEM_MAX_DATA_SIZE;
+#endif
+    fsm->result = YMODEM_FSM_BUSY;
+    fsm->now = now_ms;
+    fsm->ctx.callbacks.get_time_ms = NULL; /* Statistics follow the clock given to feed/poll */
+    fsm->ctx.now_ms = now_ms;
+#if YMODEM_TRACE_LEVEL > YMODEM_TRACE_NONE
+    fsm->ctx.trace_level = YMODEM_TRACE_DEFAULT;
+#endif
+    fsm->ctx.handshake_interval_ms = YMODEM_HANDSHAKE_INTERVAL_MS;
+    ymodem_stats_reset(&fsm->ctx);
+    fsm->handshake_end = now_ms + (uint32_t)(handshake_timeout_s > 0 ? handshake_timeout_s : 0) * 1000;
+    
+    return YMODEM_ERR_NONE;
+}
+
+#if YMODEM_SEND_ENABLE
+/**
+ * @brief Start an event-driven sender
+ */
+int ymodem_fsm_send_init(ymodem_fsm_t* fsm,
+                        const ymodem_callbacks_t* callbacks,
+                        uint8_t* buffer,
+                        size_t buffer_size,
+                        enum ymodem_mode mode,
+                        const char* filename,
+                        int handshake_timeout_s,
+                        uint32_t now_ms)
+{
+    int ret;
+    
+    if (filename == NULL || callbacks == NULL ||
+        callbacks->file_open == NULL ||
+        callbacks->file_read == NULL ||
+        callbacks->file_close == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ret = _ymodem_fsm_init(fsm, callbacks, buffer, buffer_size, mode, handshake_timeout_s, now_ms);
+    if (ret != YMODEM_ERR_NONE) {
+        return ret;
+    }
+    fsm->sending = true;
+    
+    /* Open file for reading */
+    fsm->ctx.file_handle = fsm->ctx.callbacks.file_open(fsm->ctx.callbacks.user, filename, YMODEM_OPEN_READ);
+    if (fsm->ctx.file_handle == NULL) {
+        return YMODEM_ERR_FILE;
+    }
+    
+    fsm->ctx.file_size = YMODEM_FILE_SIZE_UNKNOWN;
+    if (fsm->ctx.callbacks.file_size != NULL) {
+        fsm->ctx.file_size = fsm->ctx.callbacks.file_size(fsm->ctx.callbacks.user, fsm->ctx.file_handle);
+    }
+    if (fsm->ctx.file_size < 0 && fsm->ctx.file_size != YMODEM_FILE_SIZE_UNKNOWN) {
+        fsm->ctx.callbacks.file_close(fsm->ctx.callbacks.user, fsm->ctx.file_handle);
+        fsm->ctx.file_handle = NULL;
+        return YMODEM_ERR_FILE;
+    }
+    
+    strncpy(fsm->ctx.filename, ymodem_get_path_basename(filename), YMODEM_MAX_FILENAME_LENGTH - 1);
+    fsm->ctx.filename[YMODEM_MAX_FILENAME_LENGTH - 1] = '\0';
+    
+    /* Wait for the receiver until the handshake times out */
+    fsm->state = _FSM_TX_HANDSHAKE;
+    fsm->deadline = fsm->handshake_end;
+    
+    return YMODEM_ERR_NONE;
+}
+#endif /* YMODEM_SEND_ENABLE */
+
+/**
+ * @brief Start an event-driven receiver
+ */
+int ymodem_fsm_receive_init(ymodem_fsm_t* fsm,
+                           const ymodem_callbacks_t* callbacks,
+                           uint8_t* buffer,
+                           size_t buffer_size,
+                           enum ymodem_mode mode,
+                           int handshake_timeout_s,
+                           uint32_t now_ms)
+{
+    int ret;
+    
+    if (callbacks == NULL ||
+        callbacks->file_open == NULL ||
+        callbacks->file_write == NULL ||
+        callbacks->file_close == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ret = _ymodem_fsm_init(fsm, callbacks, buffer, buffer_size, mode, handshake_timeout_s, now_ms);
+    if (ret != YMODEM_ERR_NONE) {
+        return ret;
+    }
+    
+    /* First 'C' ('G') goes out with the first poll */
+    fsm->state = _FSM_RX_HANDSHAKE;
+    _ymodem_fsm_queue_byte(fsm, fsm->ctx.start_code);
+    _ymodem_fsm_arm(fsm, fsm->ctx.handshake_interval_ms);
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Hand received bytes to the session
+ */
+int ymodem_feed(ymodem_fsm_t* fsm, const uint8_t* data, size_t length, uint32_t now_ms)
+{
+    if (fsm == NULL || (data == NULL && length > 0)) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    fsm->now = now_ms;
+    fsm->ctx.now_ms = now_ms;
+    YMODEM_STATS_ADD(&fsm->ctx, bytes_received, length);
+    
+    while (length > 0 && fsm->result == YMODEM_FSM_BUSY) {
+        if (fsm->state == _FSM_RX_PACKET) {
+            /* Copy as much of the packet as we have in one go */
+            size_t chunk = fsm->rx_expected - fsm->rx_length;
+            if (chunk > length) {
+                chunk = length;
+            }
+            memcpy(fsm->ctx.buffer + fsm->rx_length, data, chunk);
+            fsm->rx_length += chunk;
+            ymodem_rx_crc_update(&fsm->rx_crc, fsm->ctx.buffer, fsm->rx_length);
+            data += chunk;
+            length -= chunk;
+    
+            if (fsm->rx_length == fsm->rx_expected) {
+                _ymodem_fsm_rx_packet(fsm);
+            }
+        } else if (fsm->state == _FSM_RX_PURGE) {
+            /* Discard everything, the NAK goes out once the line is idle */
+            _ymodem_fsm_arm(fsm, YMODEM_PURGE_TIMEOUT_MS);
+            YMODEM_TRACE(&fsm->ctx, YMODEM_TRACE_DEBUG, "Purged %zu bytes from the line", length);
+            length = 0;
+        } else {
+            if (fsm->sending) {
+                _ymodem_fsm_tx_byte(fsm, *data);
+            } else {
+                _ymodem_fsm_rx_byte(fsm, *data);
+            }
+            data++;
+            length--;
+        }
+    }
+    
+    return fsm->result;
+}
+
+/**
+ * @brief Run expired timers and collect bytes to transmit
+ */
+size_t ymodem_poll(ymodem_fsm_t* fsm, uint32_t now_ms, uint8_t* out, size_t max_length, uint32_t* deadline_ms)
+{
+    size_t produced = 0;
+    
+    if (fsm == NULL) {
+        return 0;
+    }
+    
+    fsm->now = now_ms;
+    fsm->ctx.now_ms = now_ms;
+    
+    /* Timers only run once our own output has left, like the blocking waits */
+    if (fsm->result == YMODEM_FSM_BUSY && fsm->tx_length == 0 &&
+        (int32_t)(now_ms - fsm->deadline) >= 0) {
+        if (fsm->sending) {
+            _ymodem_fsm_tx_timeout(fsm);
+        } else {
+            _ymodem_fsm_rx_timeout(fsm);
+        }
+    }
+    
+    while (out != NULL && produced < max_length && fsm->tx_length > 0) {
+        size_t chunk = fsm->tx_length;
+        if (chunk > max_length - produced) {
+            chunk = max_length - produced;
+        }
+        memcpy(out + produced, fsm->tx_data, chunk);
+        fsm->tx_data += chunk;
+        fsm->tx_length -= chunk;
+        produced += chunk;
+        YMODEM_STATS_ADD(&fsm->ctx, bytes_sent, chunk);
+    
+        if (fsm->tx_length == 0 && fsm->result == YMODEM_FSM_BUSY) {
+            if (fsm->state == _FSM_TX_STREAM) {
+                /* YMODEM-G: the next packet follows right away */
+                fsm->ctx.packet_seq = (fsm->ctx.packet_seq + 1) & 0xFF;
+                if (fsm->last_packet) {
+                    _ymodem_fsm_tx_eot(fsm, _FSM_TX_EOT1);
+                } else {
+                    _ymodem_fsm_tx_next(fsm);
+                }
+            } else {
+                /* Output drained, the wait for the answer starts now */
+                fsm->deadline = now_ms + fsm->wait_ms;
+            }
+        }
+    }
+    
+    if (deadline_ms != NULL) {
+        *deadline_ms = (fsm->tx_length > 0) ? now_ms : fsm->deadline;
+    }
+    
+    return produced;
+}
+
+/**
+ * @brief Get the outcome of a session
+ */
+int ymodem_fsm_result(const ymodem_fsm_t* fsm)
+{
+    if (fsm == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    if (fsm->tx_length > 0) {
+        return YMODEM_FSM_BUSY;
+    }
+    
+    return fsm->result;
+}
+
+/**
+ * @brief Close the file if the session was abandoned before it finished
+ */
+void ymodem_fsm_cleanup(ymodem_fsm_t* fsm)
+{
+    if (fsm == NULL) {
+        return;
+    }
+    
+    if (fsm->ctx.file_handle != NULL) {
+        fsm->ctx.callbacks.file_close(fsm->ctx.callbacks.user, fsm->ctx.file_handle);
+        fsm->ctx.file_handle = NULL;
+    }
+    
+    fsm->ctx.stage = YMODEM_STAGE_NONE;
+    fsm->state = _FSM_IDLE;
+    fsm->tx_length = 0;
+}
+
+/**
+ * @brief Arm the timeout, it restarts once pending output has been polled out
+ */
+static void _ymodem_fsm_arm(ymodem_fsm_t* fsm, uint32_t ms)
+{
+    fsm->wait_ms = ms;
+    fsm->deadline = fsm->now + ms;
+}
+
+/**
+ * @brief Queue bytes for transmission
+ * 
+ * Control bytes are copied to tx_small and appended to any control bytes
+ * still pending. A whole packet is sent straight from ctx.buffer and
+ * replaces what was pending (only a cancel can interrupt a packet).
+ */
+static void _ymodem_fsm_queue(ymodem_fsm_t* fsm, const uint8_t* data, size_t length)
+{
+    if (data == fsm->ctx.buffer) {
+        fsm->tx_data = data;
+        fsm->tx_length = length;
+        return;
+    }
+    
+    if (fsm->tx_length > 0 && fsm->tx_data != fsm->ctx.buffer) {
+        /* Keep the control bytes still pending, move them to the front */
+        memmove(fsm->tx_small, fsm->tx_data, fsm->tx_length);
+    } else {
+        fsm->tx_length = 0;
+    }
+    
+    if (length > sizeof(fsm->tx_small) - fsm->tx_length) {
+        length = sizeof(fsm->tx_small) - fsm->tx_length;
+    }
+    memcpy(fsm->tx_small + fsm->tx_length, data, length);
+    fsm->tx_data = fsm->tx_small;
+    fsm->tx_length += length;
+}
+
+static void _ymodem_fsm_queue_byte(ymodem_fsm_t* fsm, uint8_t code)
+{
+    _ymodem_fsm_queue(fsm, &code, 1);
+}
+
+/**
+ * @brief End the session, pending output is still handed out by ymodem_poll()
+ */
+static void _ymodem_fsm_finish(ymodem_fsm_t* fsm, int result)
+{
+    if (fsm->ctx.file_handle != NULL) {
+        fsm->ctx.callbacks.file_close(fsm->ctx.callbacks.user, fsm->ctx.file_handle);
+        fsm->ctx.file_handle = NULL;
+    }
+    
+    YMODEM_TRACE(&fsm->ctx, YMODEM_TRACE_INFO, "Session finished: %s", ymodem_error_to_str(result));
+    fsm->result = result;
+    fsm->state = _FSM_IDLE;
+    ymodem_set_stage(&fsm->ctx, YMODEM_STAGE_FINISHED);
+}
+
+/**
+ * @brief Abort the session with a burst of CAN bytes
+ */
+static void _ymodem_fsm_cancel(ymodem_fsm_t* fsm, int result)
+{
+    uint8_t cancel[YMODEM_CAN_SEND_COUNT];
+    
+    memset(cancel, YMODEM_CODE_CAN, sizeof(cancel));
+    fsm->tx_length = 0;
+    _ymodem_fsm_queue(fsm, cancel, sizeof(cancel));
+    _ymodem_fsm_finish(fsm, result);
+}
+
+/**
+ * @brief Receiver: handle a byte outside of a packet
+ */
+static void _ymodem_fsm_rx_byte(ymodem_fsm_t* fsm, uint8_t byte)
+{
+    size_t packet_size = ymodem_packet_size(byte);
+    
+    /* Start collecting a packet */
+    if (packet_size > 0 && fsm->state != _FSM_RX_EOT) {
+        fsm->ctx.buffer[0] = byte;
+        fsm->rx_length = 1;
+        fsm->rx_expected = packet_size;
+        ymodem_rx_crc_start(&fsm->rx_crc, byte, packet_size);
+        fsm->state = _FSM_RX_PACKET;
+        _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+        return;
+    }
+    
+    switch (fsm->state) {
+        case _FSM_RX_HANDSHAKE:
+            /* Line noise before the sender starts */
+            break;
+    
+        case _FSM_RX_DATA:
+            if (byte == YMODEM_CODE_EOT) {
+                YMODEM_TRACE(&fsm->ctx, YMODEM_TRACE_INFO, "Received EOT, sending NAK to request final confirmation");
+                ymodem_set_stage(&fsm->ctx, YMODEM_STAGE_FINISHING);
+                fsm->state = _FSM_RX_EOT;
+                fsm->retries = 0;
+                _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_NAK);
+                _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+                break;
+            }
+    
+            /* Leftovers of a packet we already asked to be resent */
+            if (fsm->nak_pending && fsm->ctx.start_code != YMODEM_CODE_G) {
+                break;
+            }
+            _ymodem_fsm_rx_error(fsm, YMODEM_ERR_CODE, true);
+            break;
+    
+        case _FSM_RX_EOT:
+            if (byte == YMODEM_CODE_EOT) {
+                YMODEM_TRACE(&fsm->ctx, YMODEM_TRACE_INFO, "Received second EOT, sending ACK and '%c' for NULL packet", fsm->ctx.start_code);
+                fsm->state = _FSM_RX_NULL;
+                fsm->retries = 0;
+                _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_ACK);
+                _ymodem_fsm_queue_byte(fsm, fsm->ctx.start_code);
+                _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+            } else {
+                _ymodem_fsm_rx_timeout(fsm);
+            }
+            break;
+    
+        case _FSM_RX_NULL:
+            if (byte == YMODEM_CODE_EOT) {
+                /* Sender missed our ACK, send it again */
+                _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_ACK);
+            }
+            _ymodem_fsm_rx_null_retry(fsm);
+            break;
+    
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief Receiver: handle a complete packet in ctx.buffer
+ */
+static void _ymodem_fsm_rx_packet(ymodem_fsm_t* fsm)
+{
+    ymodem_context_t* ctx = &fsm->ctx;
+    uint8_t seq;
+    size_t data_size;
+    int ret;
+    
+    ret = ymodem_rx_crc_finish(&fsm->rx_crc, ctx->buffer, &seq, &data_size);
+    if (ret == YMODEM_ERR_NONE) {
+        YMODEM_STATS_ADD(ctx, packets_received, 1);
+    } else if (ret == YMODEM_ERR_CRC) {
+        YMODEM_STATS_ADD(ctx, crc_errors, 1);
+        YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "CRC check failed for packet #%d, calculated 0x%0*X",
+                     seq, (int)fsm->rx_crc.trailer * 2, (unsigned int)fsm->rx_crc.crc);
+    } else if (ret == YMODEM_ERR_SEQ) {
+        YMODEM_STATS_ADD(ctx, seq_errors, 1);
+    }
+    
+    if (ctx->stage == YMODEM_STAGE_ESTABLISHING) {
+        /* Broken or unexpected packet 0, keep on sending 'C' */
+        fsm->state = _FSM_RX_HANDSHAKE;
+        if (ret != YMODEM_ERR_NONE || seq != 0) {
+            _ymodem_fsm_arm(fsm, fsm->ctx.handshake_interval_ms);
+            return;
+        }
+    
+        ret = ymodem_parse_file_info(ctx, &fsm->file_info);
+        if (ret != YMODEM_ERR_NONE) {
+            _ymodem_fsm_finish(fsm, ret);
+            return;
+        }
+    
+        ctx->file_handle = ctx->callbacks.file_open(ctx->callbacks.user, fsm->file_info.filename, YMODEM_OPEN_WRITE);
+        if (ctx->file_handle == NULL) {
+            _ymodem_fsm_finish(fsm, YMODEM_ERR_FILE);
+            return;
+        }
+    
+        /* ACK packet 0 and send another 'C' ('G') to start data transfer */
+        _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_ACK);
+        _ymodem_fsm_queue_byte(fsm, ctx->start_code);
+        ymodem_set_stage(ctx, YMODEM_STAGE_TRANSMITTING);
+        ctx->error_count = 0;
+        fsm->expected_seq = 1;
+        fsm->nak_pending = false;
+        fsm->state = _FSM_RX_DATA;
+        _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+        return;
+    }
+    
+    if (ctx->stage == YMODEM_STAGE_FINISHING) {
+        fsm->state = _FSM_RX_NULL;
+        if (ret == YMODEM_ERR_NONE && seq == 0 && ctx->buffer[3] == 0) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received NULL filename packet, transfer complete");
+            _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_ACK);
+            _ymodem_fsm_finish(fsm, YMODEM_ERR_NONE);
+            return;
+        }
+        _ymodem_fsm_rx_null_retry(fsm);
+        return;
+    }
+    
+    /* Data packet */
+    fsm->state = _FSM_RX_DATA;
+    _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+    if (ret != YMODEM_ERR_NONE) {
+        _ymodem_fsm_rx_error(fsm, ret, true);
+        return;
+    }
+    
+    if (seq != fsm->expected_seq) {
+        if (ctx->start_code == YMODEM_CODE_G) {
+            _ymodem_fsm_cancel(fsm, YMODEM_ERR_SEQ);
+            return;
+        }
+    
+        /* Duplicate of a packet we already have (our ACK was lost), ACK it again */
+        if ((uint8_t)(fsm->expected_seq - seq) < 128) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Duplicate packet #%d (expected #%d), re-ACK", seq, fsm->expected_seq);
+            YMODEM_STATS_ADD(ctx, retries, 1);
+            _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_ACK);
+            return;
+        }
+    
+        /* Packet ahead of the expected one while the sender rewinds */
+        if (fsm->nak_pending) {
+            return;
+        }
+    
+        YMODEM_STATS_ADD(ctx, seq_errors, 1);
+        _ymodem_fsm_rx_error(fsm, YMODEM_ERR_SEQ, true);
+        return;
+    }
+    
+    ctx->error_count = 0;
+    fsm->nak_pending = false;
+    
+    if (ctx->file_handle != NULL) {
+        size_t bytes_to_write = data_size;
+        size_t written;
+        uint32_t start_ms;
+    
+        /* Only write what is left of a file of known size */
+        if (ctx->file_size > 0 && fsm->total + data_size >= (uint64_t)ctx->file_size) {
+            bytes_to_write = (size_t)((uint64_t)ctx->file_size - fsm->total);
+        }
+    
+        start_ms = ymodem_now_ms(ctx);
+        written = ctx->callbacks.file_write(ctx->callbacks.user, ctx->file_handle, ctx->buffer + 3, bytes_to_write);
+        YMODEM_STATS_ADD(ctx, file_ms, ymodem_now_ms(ctx) - start_ms);
+        if (written != bytes_to_write) {
+            if (ctx->start_code == YMODEM_CODE_G) {
+                _ymodem_fsm_cancel(fsm, YMODEM_ERR_FILE);
+            } else {
+                _ymodem_fsm_finish(fsm, YMODEM_ERR_FILE);
+            }
+            return;
+        }
+        fsm->total += written;
+        ymodem_stats_payload(ctx, written);
+    }
+    
+    /* YMODEM-G streams without per-packet ACK */
+    if (ctx->start_code != YMODEM_CODE_G) {
+        _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_ACK);
+    }
+    fsm->expected_seq = (fsm->expected_seq + 1) & 0xFF;
+}
+
+/**
+ * @brief Receiver: count an error in the data phase and ask for a resend
+ * 
+ * @param fsm Session
+ * @param error Error reported if YMODEM_MAX_ERRORS is exceeded
+ * @param purge Drain the line before the NAK
+ */
+static void _ymodem_fsm_rx_error(ymodem_fsm_t* fsm, int error, bool purge)
+{
+    if (error == YMODEM_ERR_TMO) {
+        YMODEM_STATS_ADD(&fsm->ctx, timeouts, 1);
+    }
+    
+    /* YMODEM-G has no retransmission */
+    if (fsm->ctx.start_code == YMODEM_CODE_G) {
+        _ymodem_fsm_cancel(fsm, error);
+        return;
+    }
+    
+    fsm->ctx.error_count++;
+    if (fsm->ctx.error_count > YMODEM_MAX_ERRORS) {
+        _ymodem_fsm_finish(fsm, error);
+        return;
+    }
+    
+    fsm->nak_pending = true;
+    if (purge) {
+        fsm->state = _FSM_RX_PURGE;
+        _ymodem_fsm_arm(fsm, YMODEM_PURGE_TIMEOUT_MS);
+    } else {
+        YMODEM_STATS_ADD(&fsm->ctx, naks, 1);
+        _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_NAK);
+        fsm->state = _FSM_RX_DATA;
+        _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+    }
+}
+
+/**
+ * @brief Receiver: count a retry while waiting for the null packet
+ */
+static void _ymodem_fsm_rx_null_retry(ymodem_fsm_t* fsm)
+{
+    fsm->retries++;
+    if (fsm->retries >= YMODEM_MAX_ERRORS) {
+        /* The file itself was received, consider the transfer complete */
+        YMODEM_TRACE(&fsm->ctx, YMODEM_TRACE_WARN, "Reached max retries but file was received, considering transfer complete");
+        _ymodem_fsm_finish(fsm, YMODEM_ERR_NONE);
+        return;
+    }
+    fsm->state = _FSM_RX_NULL;
+    _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+}
+
+/**
+ * @brief Receiver: the armed timeout expired
+ */
+static void _ymodem_fsm_rx_timeout(ymodem_fsm_t* fsm)
+{
+    switch (fsm->state) {
+        case _FSM_RX_PACKET:
+            if (fsm->ctx.stage == YMODEM_STAGE_ESTABLISHING) {
+                fsm->state = _FSM_RX_HANDSHAKE;
+                _ymodem_fsm_rx_timeout(fsm);
+            } else if (fsm->ctx.stage == YMODEM_STAGE_FINISHING) {
+                _ymodem_fsm_rx_null_retry(fsm);
+            } else {
+                /* Short packet */
+                _ymodem_fsm_rx_error(fsm, YMODEM_ERR_TMO, true);
+            }
+            break;
+    
+        case _FSM_RX_HANDSHAKE:
+            if ((int32_t)(fsm->now - fsm->handshake_end) >= 0) {
+                _ymodem_fsm_finish(fsm, YMODEM_ERR_TMO);
+                break;
+            }
+            _ymodem_fsm_queue_byte(fsm, fsm->ctx.start_code);
+            _ymodem_fsm_arm(fsm, fsm->ctx.handshake_interval_ms);
+            break;
+    
+        case _FSM_RX_DATA:
+            /* Sender may have lost our ACK/NAK, ask again */
+            _ymodem_fsm_rx_error(fsm, YMODEM_ERR_TMO, false);
+            break;
+    
+        case _FSM_RX_PURGE:
+            /* Line is idle, ask for the expected packet again */
+            YMODEM_STATS_ADD(&fsm->ctx, naks, 1);
+            _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_NAK);
+            fsm->state = _FSM_RX_DATA;
+            _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+            break;
+    
+        case _FSM_RX_EOT:
+            /* No second EOT, send NAK once more */
+            if (fsm->retries > 0) {
+                _ymodem_fsm_finish(fsm, YMODEM_ERR_CODE);
+                break;
+            }
+            fsm->retries++;
+            _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_NAK);
+            _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+            break;
+    
+        case _FSM_RX_NULL:
+            _ymodem_fsm_rx_null_retry(fsm);
+            break;
+    
+        default:
+            break;
+    }
+}
+
+#if YMODEM_SEND_ENABLE
+/**
+ * @brief Sender: handle a byte from the receiver
+ */
+static void _ymodem_fsm_tx_byte(ymodem_fsm_t* fsm, uint8_t byte)
+{
+    ymodem_context_t* ctx = &fsm->ctx;
+    int ret;
+    
+    switch (fsm->state) {
+        case _FSM_TX_HANDSHAKE:
+            if (byte != YMODEM_CODE_C && !(byte == YMODEM_CODE_G && ctx->mode == YMODEM_MODE_G)) {
+                break;
+            }
+            ctx->start_code = byte;
+            YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received '%c', sending file info packet for '%s'...", byte, ctx->filename);
+    
+            ret = ymodem_prepare_file_info_packet(ctx, ctx->filename);
+            if (ret != YMODEM_ERR_NONE) {
+                _ymodem_fsm_finish(fsm, ret);
+                break;
+            }
+            ymodem_frame_packet(ctx->buffer, 0, YMODEM_SOH_DATA_SIZE);
+            _ymodem_fsm_queue(fsm, ctx->buffer, YMODEM_SOH_PACKET_SIZE);
+            YMODEM_STATS_ADD(ctx, packets_sent, 1);
+            fsm->state = _FSM_TX_INFO;
+            fsm->got_ack = false;
+            fsm->late_c = false;
+            fsm->retries = 0;
+            _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+            break;
+    
+        case _FSM_TX_INFO:
+            if (byte == YMODEM_CODE_ACK) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Received ACK for file info packet");
+                fsm->got_ack = true;
+                if (fsm->late_c) {
+                    /* The 'C' was a poll that crossed packet 0, the real one follows the ACK */
+                    YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Late '%c' before the ACK of packet 0, ignored", ctx->start_code);
+                    fsm->late_c = false;
+                    _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+                }
+                break;
+            }
+            /* Only the 'C' after the ACK (or the NAK of a receiver whose 'C' got lost) starts the data,
+             * ctx.buffer still holds packet 0 until then */
+            if (fsm->got_ack && (byte == ctx->start_code || byte == YMODEM_CODE_NAK)) {
+                ymodem_set_stage(ctx, YMODEM_STAGE_ESTABLISHED);
+                ctx->packet_seq = 1;
+                _ymodem_fsm_tx_next(fsm);
+                break;
+            }
+            if (byte == ctx->start_code) {
+                if (fsm->tx_length > 0 || fsm->late_c) {
+                    /* A poll queued before packet 0 was seen, dropped like the blocking sender drains them */
+                    YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Surplus '%c' before the ACK of packet 0, ignored", byte);
+                    break;
+                }
+                /* Packet 0 is out: either this poll crossed it and the ACK is right behind,
+                 * or the receiver is still polling without it; a purge timeout tells which */
+                fsm->late_c = true;
+                _ymodem_fsm_arm(fsm, YMODEM_PURGE_TIMEOUT_MS);
+                break;
+            }
+            if (byte == YMODEM_CODE_CAN) {
+                _ymodem_fsm_finish(fsm, YMODEM_ERR_CAN);
+                break;
+            }
+            if (++fsm->retries >= YMODEM_MAX_ERRORS) {
+                _ymodem_fsm_finish(fsm, YMODEM_ERR_ACK);
+            }
+            break;
+    
+        case _FSM_TX_DATA:
+            if (byte == YMODEM_CODE_ACK || byte == YMODEM_CODE_C) {
+                /* The wait started when the packet had been polled out */
+                if (fsm->retries == 0) {
+                    ymodem_stats_rtt(ctx, fsm->now - (fsm->deadline - fsm->wait_ms));
+                }
+#if YMODEM_STATS_ENABLE
+                ymodem_stats_payload(ctx, (size_t)(fsm->total - ctx->stats.payload_bytes));
+#endif
+                ctx->packet_seq = (ctx->packet_seq + 1) & 0xFF;
+                if (fsm->last_packet) {
+                    _ymodem_fsm_tx_eot(fsm, _FSM_TX_EOT1);
+                } else {
+                    _ymodem_fsm_tx_next(fsm);
+                }
+            } else if (byte == YMODEM_CODE_CAN) {
+                _ymodem_fsm_finish(fsm, YMODEM_ERR_CAN);
+            } else {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Packet #%d not ACKed (0x%02X), retrying", ctx->packet_seq, byte);
+                if (byte == YMODEM_CODE_NAK) {
+                    YMODEM_STATS_ADD(ctx, naks, 1);
+                }
+                _ymodem_fsm_tx_resend(fsm);
+            }
+            break;
+    
+        case _FSM_TX_STREAM:
+            if (byte == YMODEM_CODE_CAN) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Receiver cancelled streaming at packet #%d", ctx->packet_seq);
+                fsm->tx_length = 0;
+                _ymodem_fsm_finish(fsm, YMODEM_ERR_CAN);
+            }
+            break;
+    
+        case _FSM_TX_EOT1:
+            if (byte == YMODEM_CODE_NAK) {
+                _ymodem_fsm_tx_eot(fsm, _FSM_TX_EOT2);
+            } else {
+                _ymodem_fsm_tx_timeout(fsm);
+            }
+            break;
+    
+        case _FSM_TX_EOT2:
+            if (byte == YMODEM_CODE_ACK || byte == YMODEM_CODE_NAK) {
+                fsm->state = _FSM_TX_WAIT_C;
+                fsm->retries = 0;
+                _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+            } else {
+                _ymodem_fsm_tx_timeout(fsm);
+            }
+            break;
+    
+        case _FSM_TX_WAIT_C:
+            if (byte == ctx->start_code) {
+                _ymodem_fsm_tx_null(fsm);
+            } else if (byte != YMODEM_CODE_ACK) {
+                _ymodem_fsm_tx_timeout(fsm);
+            }
+            break;
+    
+        case _FSM_TX_NULL:
+            if (byte == YMODEM_CODE_ACK) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received final ACK, transmission complete");
+                _ymodem_fsm_finish(fsm, YMODEM_ERR_NONE);
+            }
+            break;
+    
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief Sender: build and queue the next data packet, or start the finish sequence
+ */
+static void _ymodem_fsm_tx_next(ymodem_fsm_t* fsm)
+{
+    ymodem_context_t* ctx = &fsm->ctx;
+    size_t actual_read;
+    
+    ymodem_set_stage(ctx, YMODEM_STAGE_TRANSMITTING);
+    
+    actual_read = ymodem_load_packet(ctx, ctx->buffer, ctx->packet_seq);
+    if (actual_read == 0) {
+        _ymodem_fsm_tx_eot(fsm, _FSM_TX_EOT1);
+        return;
+    }
+    
+    fsm->last_packet = (actual_read < ctx->packet_data_size);
+    fsm->total += actual_read;
+    fsm->retries = 0;
+    _ymodem_fsm_queue(fsm, ctx->buffer, ymodem_packet_size(ctx->buffer[0]));
+    YMODEM_STATS_ADD(ctx, packets_sent, 1);
+    
+    /* YMODEM-G: no ACK to wait for */
+    if (ctx->start_code == YMODEM_CODE_G) {
+        fsm->state = _FSM_TX_STREAM;
+        ymodem_stats_payload(ctx, actual_read);
+        return;
+    }
+    
+    fsm->state = _FSM_TX_DATA;
+    _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+}
+
+/**
+ * @brief Sender: queue the packet in ctx.buffer again
+ */
+static void _ymodem_fsm_tx_resend(ymodem_fsm_t* fsm)
+{
+    fsm->retries++;
+    if (fsm->retries >= YMODEM_MAX_ERRORS) {
+        _ymodem_fsm_finish(fsm, YMODEM_ERR_ACK);
+        return;
+    }
+    
+    _ymodem_fsm_queue(fsm, fsm->ctx.buffer, ymodem_packet_size(fsm->ctx.buffer[0]));
+    YMODEM_STATS_ADD(&fsm->ctx, packets_sent, 1);
+    YMODEM_STATS_ADD(&fsm->ctx, retries, 1);
+    _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+}
+
+/**
+ * @brief Sender: send an EOT and wait for the answer to it
+ */
+static void _ymodem_fsm_tx_eot(ymodem_fsm_t* fsm, uint8_t state)
+{
+    ymodem_set_stage(&fsm->ctx, YMODEM_STAGE_FINISHING);
+    if (fsm->state != state) {
+        fsm->retries = 0;
+    }
+    fsm->state = state;
+    _ymodem_fsm_queue_byte(fsm, YMODEM_CODE_EOT);
+    _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+}
+
+/**
+ * @brief Sender: send the null packet 0 that ends the batch
+ */
+static void _ymodem_fsm_tx_null(ymodem_fsm_t* fsm)
+{
+    YMODEM_TRACE(&fsm->ctx, YMODEM_TRACE_INFO, "Sending NULL filename packet to indicate end of batch");
+    memset(fsm->ctx.buffer + 3, 0, YMODEM_SOH_DATA_SIZE);
+    ymodem_frame_packet(fsm->ctx.buffer, 0, YMODEM_SOH_DATA_SIZE);
+    _ymodem_fsm_queue(fsm, fsm->ctx.buffer, YMODEM_SOH_PACKET_SIZE);
+    YMODEM_STATS_ADD(&fsm->ctx, packets_sent, 1);
+    fsm->state = _FSM_TX_NULL;
+    _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+}
+
+/**
+ * @brief Sender: the armed timeout expired (or a wrong answer arrived)
+ */
+static void _ymodem_fsm_tx_timeout(ymodem_fsm_t* fsm)
+{
+    switch (fsm->state) {
+        case _FSM_TX_HANDSHAKE:
+            _ymodem_fsm_finish(fsm, YMODEM_ERR_TMO);
+            break;
+    
+        case _FSM_TX_INFO:
+            if (fsm->got_ack) {
+                /* Packet 0 arrived, only its 'C' is missing */
+                if (++fsm->retries >= YMODEM_MAX_ERRORS) {
+                    YMODEM_TRACE(&fsm->ctx, YMODEM_TRACE_ERROR, "Handshake failed: ACK=1, C=0");
+                    _ymodem_fsm_finish(fsm, YMODEM_ERR_ACK);
+                } else {
+                    _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+                }
+                break;
+            }
+            /* No ACK, packet 0 is still in ctx.buffer: send it again */
+            if (fsm->late_c) {
+                YMODEM_TRACE(&fsm->ctx, YMODEM_TRACE_WARN, "Receiver still polling, resending packet 0");
+                fsm->late_c = false;
+            } else {
+                YMODEM_STATS_ADD(&fsm->ctx, timeouts, 1);
+            }
+            _ymodem_fsm_tx_resend(fsm);
+            break;
+    
+        case _FSM_TX_DATA:
+            YMODEM_STATS_ADD(&fsm->ctx, timeouts, 1);
+            _ymodem_fsm_tx_resend(fsm);
+            break;
+    
+        case _FSM_TX_EOT1:
+        case _FSM_TX_EOT2:
+            if (++fsm->retries >= YMODEM_MAX_ERRORS) {
+                _ymodem_fsm_finish(fsm, YMODEM_ERR_ACK);
+            } else {
+                _ymodem_fsm_tx_eot(fsm, fsm->state);
+            }
+            break;
+    
+        case _FSM_TX_WAIT_C:
+            if (++fsm->retries >= YMODEM_MAX_ERRORS) {
+                /* No 'C', send the null packet anyway */
+                _ymodem_fsm_tx_null(fsm);
+            } else {
+                _ymodem_fsm_arm(fsm, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+            }
+            break;
+    
+        case _FSM_TX_NULL:
+            YMODEM_TRACE(&fsm->ctx, YMODEM_TRACE_WARN, "Did not receive final ACK, transmission still considered complete");
+            _ymodem_fsm_finish(fsm, YMODEM_ERR_NONE);
+            break;
+    
+        default:
+            break;
+    }
+}
+#endif /* YMODEM_SEND_ENABLE */
@@ -0,0 +1,313 @@
+/**
+ * @file ymodem_lz.c
+ * @brief Streaming LZ compression
+ * @date 2025-04-09
+ * 
+ * This file contains the LZSS compressor and decompressor of ymodem_lz.h.
+ * The compressor searches a hash chain of depth YMODEM_LZ_CHAIN_DEPTH and
+ * takes the longest match (greedy). Positions are kept as stream offsets,
+ * so sliding the buffer never touches the tables: stale entries fall out of
+ * the window by their distance.
+ */
+
+#include "ymodem_common.h"
+
+#if YMODEM_LZ_ENABLE
+
+#include <string.h>
+
+#define _LZ_LENGTH_BITS     (16 - YMODEM_LZ_WINDOW_BITS)
+
+static uint32_t _ymodem_lz_hash(const uint8_t* p)
+{
+    uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | (uint32_t)p[2];
+    return (v * 2654435761u) >> (32 - YMODEM_LZ_HASH_BITS);
+}
+
+/**
+ * @brief Enter buffer position index in the hash chains, it needs 3 bytes of input
+ */
+static void _ymodem_lz_insert(ymodem_lz_encoder_t* enc, size_t index)
+{
+    uint32_t hash = _ymodem_lz_hash(enc->buffer + index);
+    uint32_t stream = enc->base + (uint32_t)index;
+    
+    enc->prev[stream & (YMODEM_LZ_WINDOW_SIZE - 1)] = enc->head[hash];
+    enc->head[hash] = stream + 1;
+}
+
+/**
+ * @brief Longest earlier match of the bytes at enc->pos
+ * 
+ * @param enc Compressor
+ * @param limit Bytes available at enc->pos, at most YMODEM_LZ_MAX_MATCH
+ * @param distance Returns the distance of the match
+ * @return size_t Length of the match, below YMODEM_LZ_MIN_MATCH if there is none
+ */
+static size_t _ymodem_lz_find(const ymodem_lz_encoder_t* enc, size_t limit, size_t* distance)
+{
+    const uint8_t* here = enc->buffer + enc->pos;
+    uint32_t stream = enc->base + (uint32_t)enc->pos;
+    uint32_t candidate = enc->head[_ymodem_lz_hash(here)];
+    uint32_t last_distance = 0;
+    size_t best = 0;
+    int depth;
+    
+    for (depth = 0; depth < YMODEM_LZ_CHAIN_DEPTH && candidate != 0; depth++) {
+        uint32_t dist = stream - (candidate - 1);
+        const uint8_t* there;
+        size_t length = 0;
+    
+        /* Out of the window, or a slot that was taken over by a newer position */
+        if (dist == 0 || dist > YMODEM_LZ_WINDOW_SIZE || dist > enc->pos || dist <= last_distance) {
+            break;
+        }
+        last_distance = dist;
+    
+        there = here - dist;
+        if (there[best] == here[best]) {
+            while (length < limit && there[length] == here[length]) {
+                length++;
+            }
+            if (length > best) {
+                best = length;
+                *distance = dist;
+                if (best == limit) {
+                    break;
+                }
+            }
+        }
+        candidate = enc->prev[(candidate - 1) & (YMODEM_LZ_WINDOW_SIZE - 1)];
+    }
+    
+    return best;
+}
+
+/**
+ * @brief Close the group being collected so that it can be handed out
+ */
+static void _ymodem_lz_close_group(ymodem_lz_encoder_t* enc)
+{
+    enc->ready = enc->group_length;
+    enc->ready_pos = 0;
+    enc->group_length = 0;
+    enc->group_items = 0;
+}
+
+/**
+ * @brief Start a new stream
+ */
+void ymodem_lz_encoder_reset(ymodem_lz_encoder_t* encoder)
+{
+    memset(encoder->head, 0, sizeof(encoder->head));
+    encoder->base = 0;
+    encoder->pos = 0;
+    encoder->end = 0;
+    encoder->eof = false;
+    encoder->group_length = 0;
+    encoder->group_items = 0;
+    encoder->ready = 0;
+    encoder->ready_pos = 0;
+    encoder->total_in = 0;
+    encoder->total_out = 0;
+}
+
+/**
+ * @brief Room for more input
+ */
+uint8_t* ymodem_lz_encoder_input(ymodem_lz_encoder_t* encoder, size_t* room)
+{
+    /* Keep one window of history before the next byte to encode */
+    if (encoder->pos > YMODEM_LZ_WINDOW_SIZE) {
+        size_t shift = encoder->pos - YMODEM_LZ_WINDOW_SIZE;
+    
+        memmove(encoder->buffer, encoder->buffer + shift, encoder->end - shift);
+        encoder->base += (uint32_t)shift;
+        encoder->pos -= shift;
+        encoder->end -= shift;
+    }
+    
+    *room = encoder->eof ? 0 : YMODEM_LZ_BUFFER_SIZE - encoder->end;
+    return encoder->buffer + encoder->end;
+}
+
+/**
+ * @brief Take length bytes stored at ymodem_lz_encoder_input(), 0 marks the end of the input
+ */
+void ymodem_lz_encoder_commit(ymodem_lz_encoder_t* encoder, size_t length)
+{
+    if (length == 0) {
+        encoder->eof = true;
+        return;
+    }
+    encoder->end += length;
+    encoder->total_in += length;
+}
+
+/**
+ * @brief Produce compressed bytes
+ */
+size_t ymodem_lz_encode(ymodem_lz_encoder_t* encoder, uint8_t* out, size_t size)
+{
+    size_t produced = 0;
+    
+    while (produced < size) {
+        size_t available;
+        size_t length;
+        size_t distance = 0;
+    
+        /* Hand out what is complete first */
+        if (encoder->ready > 0) {
+            size_t chunk = encoder->ready;
+            if (chunk > size - produced) {
+                chunk = size - produced;
+            }
+            memcpy(out + produced, encoder->group + encoder->ready_pos, chunk);
+            encoder->ready_pos += chunk;
+            encoder->ready -= chunk;
+            produced += chunk;
+            continue;
+        }
+    
+        available = encoder->end - encoder->pos;
+        if (available == 0 || (!encoder->eof && available < YMODEM_LZ_MAX_MATCH)) {
+            /* The last group is cut short at the end of the input */
+            if (encoder->eof && available == 0 && encoder->group_items > 0) {
+                _ymodem_lz_close_group(encoder);
+                continue;
+            }
+            break;
+        }
+        if (available > YMODEM_LZ_MAX_MATCH) {
+            available = YMODEM_LZ_MAX_MATCH;
+        }
+    
+        if (encoder->group_items == 0) {
+            encoder->group[0] = 0;
+            encoder->group_length = 1;
+        }
+    
+        length = (available >= YMODEM_LZ_MIN_MATCH) ? _ymodem_lz_find(encoder, available, &distance) : 0;
+        if (length >= YMODEM_LZ_MIN_MATCH) {
+            uint16_t token = (uint16_t)(((distance - 1) << _LZ_LENGTH_BITS) | (length - YMODEM_LZ_MIN_MATCH));
+            size_t i;
+    
+            encoder->group[0] |= (uint8_t)(1u << encoder->group_items);
+            encoder->group[encoder->group_length++] = (uint8_t)(token >> 8);
+            encoder->group[encoder->group_length++] = (uint8_t)token;
+            for (i = 0; i < length; i++) {
+                if (encoder->pos + i + YMODEM_LZ_MIN_MATCH <= encoder->end) {
+                    _ymodem_lz_insert(encoder, encoder->pos + i);
+                }
+            }
+            encoder->pos += length;
+        } else {
+            encoder->group[encoder->group_length++] = encoder->buffer[encoder->pos];
+            if (available >= YMODEM_LZ_MIN_MATCH) {
+                _ymodem_lz_insert(encoder, encoder->pos);
+            }
+            encoder->pos++;
+        }
+    
+        if (++encoder->group_items == 8) {
+            _ymodem_lz_close_group(encoder);
+        }
+    }
+    
+    encoder->total_out += produced;
+    return produced;
+}
+
+/**
+ * @brief Whether the input has ended and all of it was handed out compressed
+ */
+bool ymodem_lz_encoder_done(const ymodem_lz_encoder_t* encoder)
+{
+    return encoder->eof && encoder->pos == encoder->end && encoder->group_items == 0 && encoder->ready == 0;
+}
+
+/**
+ * @brief Start a new stream
+ */
+bool ymodem_lz_decoder_reset(ymodem_lz_decoder_t* decoder, unsigned int bits)
+{
+    if (bits < 8 || bits > YMODEM_LZ_WINDOW_BITS) {
+        return false;
+    }
+    
+    decoder->pos = 0;
+    decoder->bits = (uint8_t)bits;
+    decoder->flags = 0;
+    decoder->flag_count = 0;
+    decoder->split = false;
+    decoder->match_length = 0;
+    decoder->match_distance = 0;
+    decoder->total_in = 0;
+    decoder->total_out = 0;
+    
+    return true;
+}
+
+/**
+ * @brief Decompress the next piece of the stream
+ */
+size_t ymodem_lz_decode(ymodem_lz_decoder_t* decoder, const uint8_t* in, size_t length,
+                        size_t* consumed, const uint8_t** out)
+{
+    const unsigned int length_bits = 16u - decoder->bits;
+    uint8_t* window = decoder->window;
+    size_t start;
+    size_t pos;
+    size_t i = 0;
+    
+    /* The previous call filled the window up to its end */
+    if (decoder->pos == YMODEM_LZ_WINDOW_SIZE) {
+        decoder->pos = 0;
+    }
+    start = decoder->pos;
+    pos = start;
+    
+    while (pos < YMODEM_LZ_WINDOW_SIZE) {
+        if (decoder->match_length > 0) {
+            /* A whole window back is this very slot, read before it is written */
+            window[pos] = window[(pos - decoder->match_distance) & (YMODEM_LZ_WINDOW_SIZE - 1)];
+            pos++;
+            decoder->match_length--;
+            continue;
+        }
+        if (i == length) {
+            break;
+        }
+        if (decoder->flag_count == 0) {
+            decoder->flags = in[i++];
+            decoder->flag_count = 8;
+            continue;
+        }
+        if (decoder->flags & 1) {
+            uint16_t token;
+    
+            if (!decoder->split) {
+                decoder->token = in[i++];
+                decoder->split = true;
+                continue;
+            }
+            token = (uint16_t)((decoder->token << 8) | in[i++]);
+            decoder->split = false;
+            decoder->match_distance = (uint16_t)((token >> length_bits) + 1);
+            decoder->match_length = (uint16_t)((token & ((1u << length_bits) - 1)) + YMODEM_LZ_MIN_MATCH);
+        } else {
+            window[pos++] = in[i++];
+        }
+        decoder->flags >>= 1;
+        decoder->flag_count--;
+    }
+    
+    decoder->pos = pos;
+    decoder->total_in += i;
+    decoder->total_out += pos - start;
+    *consumed = i;
+    *out = window + start;
+    return pos - start;
+}
+
+#endif /* YMODEM_LZ_ENABLE */
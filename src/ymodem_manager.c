@@ -0,0 +1,510 @@
+/**
+ * @file ymodem_manager.c
+ * @brief Multi-port YMODEM transfer manager
+ * @date 2025-04-09
+ * 
+ * This file contains the implementation of the multi-port manager. Every
+ * port gets its own ymodem_context_t and buffers, the sessions are run on a
+ * fixed pool of POSIX threads. The manager keeps no global state.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include "ymodem_manager.h"
+
+#if YMODEM_MANAGER_ENABLE
+
+#include "ymodem_send.h"
+#include "ymodem_receive.h"
+#include "ymodem_mmap.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Work shared by all worker threads of one run */
+typedef struct {
+    ymodem_port_t*  ports;
+    size_t          port_count;
+    size_t          next_port;          /* Next port to hand out, protected by lock */
+    pthread_mutex_t lock;
+    bool            sending;
+    const char*     filename;           /* Name announced in packet 0 (send only) */
+    const uint8_t*  image;              /* Shared read-only image (send only) */
+    size_t          image_size;
+    int             handshake_timeout_s;
+} _ymodem_job_t;
+
+/* Per-session state, passed as user data to the trampolines below */
+typedef struct {
+    ymodem_port_t*  port;
+    const _ymodem_job_t* job;
+    size_t          offset;             /* Read cursor into the shared image */
+} _ymodem_session_t;
+
+static void* _ymodem_manager_worker(void* arg);
+static int _ymodem_manager_run(_ymodem_job_t* job, size_t worker_count, ymodem_manager_stats_t* stats);
+static uint32_t _ymodem_manager_now_ms(void);
+
+/* Communication and timing go straight to the port's own callbacks */
+static size_t _session_comm_send(void* user, const uint8_t* data, size_t length)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    return port->callbacks.comm_send(port->callbacks.user, data, length);
+}
+
+static size_t _session_comm_sendv(void* user, const ymodem_iovec_t* iov, size_t iov_count)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    return port->callbacks.comm_sendv(port->callbacks.user, iov, iov_count);
+}
+
+static size_t _session_comm_receive(void* user, uint8_t* data, size_t max_length, uint32_t timeout_ms)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    return port->callbacks.comm_receive(port->callbacks.user, data, max_length, timeout_ms);
+}
+
+static uint32_t _session_get_time_ms(void* user)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    return port->callbacks.get_time_ms(port->callbacks.user);
+}
+
+static void _session_delay_ms(void* user, uint32_t ms)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    port->callbacks.delay_ms(port->callbacks.user, ms);
+}
+
+/* Sending: the "file" is a cursor over the shared image */
+static void* _image_open(void* user, const char* filename, enum ymodem_open_mode mode)
+{
+    _ymodem_session_t* session = (_ymodem_session_t*)user;
+    (void)filename;
+    
+    if (mode != YMODEM_OPEN_READ) {
+        return NULL;
+    }
+    session->offset = 0;
+    return session;
+}
+
+static size_t _image_read(void* user, void* file_handle, uint8_t* buffer, size_t size)
+{
+    _ymodem_session_t* session = (_ymodem_session_t*)file_handle;
+    size_t remaining = session->job->image_size - session->offset;
+    (void)user;
+    
+    if (size > remaining) {
+        size = remaining;
+    }
+    memcpy(buffer, session->job->image + session->offset, size);
+    session->offset += size;
+    session->port->bytes += size;
+    return size;
+}
+
+static const uint8_t* _image_peek(void* user, void* file_handle, size_t size, size_t* available)
+{
+    _ymodem_session_t* session = (_ymodem_session_t*)file_handle;
+    const uint8_t* data = session->job->image + session->offset;
+    size_t remaining = session->job->image_size - session->offset;
+    (void)user;
+    
+    /* Full packets are sent straight from the shared image */
+    if (size > remaining) {
+        size = remaining;
+    }
+    session->offset += size;
+    session->port->bytes += size;
+    *available = size;
+    return data;
+}
+
+static int _image_seek(void* user, void* file_handle, uint64_t offset)
+{
+    _ymodem_session_t* session = (_ymodem_session_t*)file_handle;
+    (void)user;
+    
+    /* A receiver that kept part of the image continues after it */
+    if (offset > (uint64_t)session->job->image_size) {
+        return -1;
+    }
+    session->offset = (size_t)offset;
+    return 0;
+}
+
+static void _image_close(void* user, void* file_handle)
+{
+    (void)user;
+    (void)file_handle;
+}
+
+static int64_t _image_size(void* user, void* file_handle)
+{
+    _ymodem_session_t* session = (_ymodem_session_t*)file_handle;
+    (void)user;
+    
+    return (int64_t)session->job->image_size;
+}
+
+/* Receiving: the port's own file callbacks, counting what is written */
+static void* _port_file_open(void* user, const char* filename, enum ymodem_open_mode mode)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    return port->callbacks.file_open(port->callbacks.user, filename, mode);
+}
+
+static size_t _port_file_write(void* user, void* file_handle, const uint8_t* buffer, size_t size)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    size_t written = port->callbacks.file_write(port->callbacks.user, file_handle, buffer, size);
+    port->bytes += written;
+    return written;
+}
+
+static int _port_file_sync(void* user, void* file_handle)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    return port->callbacks.file_sync(port->callbacks.user, file_handle);
+}
+
+static int _port_file_reserve(void* user, void* file_handle, uint64_t size)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    return port->callbacks.file_reserve(port->callbacks.user, file_handle, size);
+}
+
+static void _port_file_close(void* user, void* file_handle)
+{
+    ymodem_port_t* port = ((_ymodem_session_t*)user)->port;
+    port->callbacks.file_close(port->callbacks.user, file_handle);
+}
+
+/**
+ * @brief Send one in-memory image to many ports in parallel
+ */
+int ymodem_manager_send_image(ymodem_port_t* ports,
+                             size_t port_count,
+                             size_t worker_count,
+                             const char* filename,
+                             const uint8_t* image,
+                             size_t image_size,
+                             int handshake_timeout_s,
+                             ymodem_manager_stats_t* stats)
+{
+    _ymodem_job_t job;
+    
+    if (ports == NULL || filename == NULL || (image == NULL && image_size > 0)) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    memset(&job, 0, sizeof(job));
+    job.ports = ports;
+    job.port_count = port_count;
+    job.sending = true;
+    job.filename = filename;
+    job.image = image;
+    job.image_size = image_size;
+    job.handshake_timeout_s = handshake_timeout_s;
+    
+    return _ymodem_manager_run(&job, worker_count, stats);
+}
+
+/**
+ * @brief Send a file to many ports in parallel
+ */
+int ymodem_manager_send_file(ymodem_port_t* ports,
+                            size_t port_count,
+                            size_t worker_count,
+                            const char* path,
+                            int handshake_timeout_s,
+                            ymodem_manager_stats_t* stats)
+{
+#if YMODEM_MMAP_ENABLE
+    const uint8_t* image;
+    size_t size;
+    int ret;
+    
+    if (path == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    /* Map the file once, every session sends from the same page cache pages */
+    image = ymodem_mmap_map(path, &size);
+    if (image == NULL) {
+        return YMODEM_ERR_FILE;
+    }
+    
+    ret = ymodem_manager_send_image(ports, port_count, worker_count, ymodem_get_path_basename(path),
+                                    image, size, handshake_timeout_s, stats);
+    ymodem_mmap_unmap(image, size);
+    return ret;
+#else
+    FILE* file;
+    long size;
+    uint8_t* image;
+    int ret;
+    
+    if (path == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    /* Read the file once, every session shares this copy */
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return YMODEM_ERR_FILE;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return YMODEM_ERR_FILE;
+    }
+    
+    image = (uint8_t*)malloc(size > 0 ? (size_t)size : 1);
+    if (image == NULL) {
+        fclose(file);
+        return YMODEM_ERR_MEM;
+    }
+    if (fread(image, 1, (size_t)size, file) != (size_t)size) {
+        free(image);
+        fclose(file);
+        return YMODEM_ERR_FILE;
+    }
+    fclose(file);
+    
+    ret = ymodem_manager_send_image(ports, port_count, worker_count, ymodem_get_path_basename(path),
+                                    image, (size_t)size, handshake_timeout_s, stats);
+    free(image);
+    return ret;
+#endif
+}
+
+/**
+ * @brief Receive one file on each of many ports in parallel
+ */
+int ymodem_manager_receive(ymodem_port_t* ports,
+                          size_t port_count,
+                          size_t worker_count,
+                          int handshake_timeout_s,
+                          ymodem_manager_stats_t* stats)
+{
+    _ymodem_job_t job;
+    
+    if (ports == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    memset(&job, 0, sizeof(job));
+    job.ports = ports;
+    job.port_count = port_count;
+    job.sending = false;
+    job.handshake_timeout_s = handshake_timeout_s;
+    
+    return _ymodem_manager_run(&job, worker_count, stats);
+}
+
+/**
+ * @brief Run a single port to completion on the calling thread
+ */
+static int _ymodem_manager_session(const _ymodem_job_t* job, ymodem_port_t* port)
+{
+    _ymodem_session_t session;
+    ymodem_callbacks_t callbacks;
+    ymodem_context_t ctx;
+    uint8_t* buffer = NULL;
+    uint8_t* window_buffer = NULL;
+    int ret;
+    
+    if (port->callbacks.comm_send == NULL || port->callbacks.comm_receive == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    session.port = port;
+    session.job = job;
+    session.offset = 0;
+    
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.comm_send = _session_comm_send;
+    callbacks.comm_sendv = port->callbacks.comm_sendv ? _session_comm_sendv : NULL;
+    callbacks.comm_receive = _session_comm_receive;
+    callbacks.get_time_ms = port->callbacks.get_time_ms ? _session_get_time_ms : NULL;
+    callbacks.delay_ms = port->callbacks.delay_ms ? _session_delay_ms : NULL;
+    callbacks.user = &session;
+    
+    buffer = (uint8_t*)malloc(YMODEM_MAX_PACKET_SIZE);
+    if (buffer == NULL) {
+        return YMODEM_ERR_MEM;
+    }
+    
+    if (job->sending) {
+        callbacks.file_open = _image_open;
+        callbacks.file_read = _image_read;
+        callbacks.file_close = _image_close;
+        callbacks.file_size = _image_size;
+        callbacks.file_peek = _image_peek;
+        callbacks.file_seek = _image_seek;
+        
+        if (port->window_count > 1) {
+            window_buffer = (uint8_t*)malloc((size_t)port->window_count * YMODEM_MAX_PACKET_SIZE);
+        }
+        if (port->window_count > 1 && window_buffer == NULL) {
+            ret = YMODEM_ERR_MEM;
+            goto out;
+        }
+        
+        ret = ymodem_send_init(&ctx, &callbacks, buffer, YMODEM_MAX_PACKET_SIZE, port->mode);
+        if (ret == YMODEM_ERR_NONE && window_buffer != NULL) {
+            ret = ymodem_send_set_window(&ctx, window_buffer,
+                                         (size_t)port->window_count * YMODEM_MAX_PACKET_SIZE,
+                                         port->window_count);
+        }
+        if (ret == YMODEM_ERR_NONE) {
+            ret = ymodem_send_file(&ctx, job->filename, job->handshake_timeout_s);
+            port->stats = *ymodem_get_stats(&ctx);
+            YMODEM_TRACE(&ctx, YMODEM_TRACE_INFO, "Port %s finished: %s, %llu bytes",
+                         port->name ? port->name : "?", ymodem_error_to_str(ret), (unsigned long long)port->bytes);
+            ymodem_send_cleanup(&ctx);
+        }
+    } else {
+        if (port->callbacks.file_open == NULL || port->callbacks.file_write == NULL ||
+            port->callbacks.file_close == NULL) {
+            ret = YMODEM_ERR_CODE;
+            goto out;
+        }
+        callbacks.file_open = _port_file_open;
+        callbacks.file_write = _port_file_write;
+        callbacks.file_close = _port_file_close;
+        callbacks.file_sync = port->callbacks.file_sync ? _port_file_sync : NULL;
+        callbacks.file_reserve = port->callbacks.file_reserve ? _port_file_reserve : NULL;
+        
+        ret = ymodem_receive_init(&ctx, &callbacks, buffer, YMODEM_MAX_PACKET_SIZE, port->mode);
+        if (ret == YMODEM_ERR_NONE) {
+            ret = ymodem_receive_file(&ctx, &port->file_info, job->handshake_timeout_s);
+            port->stats = *ymodem_get_stats(&ctx);
+            YMODEM_TRACE(&ctx, YMODEM_TRACE_INFO, "Port %s finished: %s, %llu bytes",
+                         port->name ? port->name : "?", ymodem_error_to_str(ret), (unsigned long long)port->bytes);
+            ymodem_receive_cleanup(&ctx);
+        }
+    }
+    
+out:
+    free(buffer);
+    free(window_buffer);
+    return ret;
+}
+
+/**
+ * @brief Worker thread, takes ports from the job until none are left
+ */
+static void* _ymodem_manager_worker(void* arg)
+{
+    _ymodem_job_t* job = (_ymodem_job_t*)arg;
+    
+    while (1) {
+        ymodem_port_t* port;
+        uint32_t start;
+        
+        pthread_mutex_lock(&job->lock);
+        if (job->next_port >= job->port_count) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        port = &job->ports[job->next_port++];
+        pthread_mutex_unlock(&job->lock);
+        
+        start = _ymodem_manager_now_ms();
+        port->result = _ymodem_manager_session(job, port);
+        port->elapsed_ms = _ymodem_manager_now_ms() - start;
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief Start the worker pool, wait for it and collect the results
+ */
+static int _ymodem_manager_run(_ymodem_job_t* job, size_t worker_count, ymodem_manager_stats_t* stats)
+{
+    pthread_t* threads;
+    size_t started = 0;
+    size_t i;
+    uint32_t start;
+    int ret = YMODEM_ERR_NONE;
+    
+    for (i = 0; i < job->port_count; i++) {
+        job->ports[i].result = YMODEM_ERR_NONE;
+        job->ports[i].bytes = 0;
+        job->ports[i].elapsed_ms = 0;
+        memset(&job->ports[i].stats, 0, sizeof(job->ports[i].stats));
+        memset(&job->ports[i].file_info, 0, sizeof(job->ports[i].file_info));
+    }
+    
+    if (worker_count == 0 || worker_count > job->port_count) {
+        worker_count = job->port_count;
+    }
+    
+    threads = (pthread_t*)malloc((worker_count > 0 ? worker_count : 1) * sizeof(pthread_t));
+    if (threads == NULL) {
+        return YMODEM_ERR_MEM;
+    }
+    if (pthread_mutex_init(&job->lock, NULL) != 0) {
+        free(threads);
+        return YMODEM_ERR_MEM;
+    }
+    
+    start = _ymodem_manager_now_ms();
+    for (i = 0; i < worker_count; i++) {
+        if (pthread_create(&threads[i], NULL, _ymodem_manager_worker, job) != 0) {
+            break;
+        }
+        started++;
+    }
+    
+    /* No thread could be started at all, run on the caller's thread */
+    if (started == 0) {
+        _ymodem_manager_worker(job);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    pthread_mutex_destroy(&job->lock);
+    free(threads);
+    
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(*stats));
+        stats->elapsed_ms = _ymodem_manager_now_ms() - start;
+    }
+    
+    for (i = 0; i < job->port_count; i++) {
+        if (job->ports[i].result != YMODEM_ERR_NONE && ret == YMODEM_ERR_NONE) {
+            ret = job->ports[i].result;
+        }
+        if (stats != NULL) {
+            if (job->ports[i].result == YMODEM_ERR_NONE) {
+                stats->ports_ok++;
+            } else {
+                stats->ports_failed++;
+            }
+            stats->total_bytes += job->ports[i].bytes;
+        }
+    }
+    
+    if (stats != NULL && stats->elapsed_ms > 0) {
+        stats->bytes_per_second = stats->total_bytes * 1000 / stats->elapsed_ms;
+    }
+    
+    return ret;
+}
+
+/**
+ * @brief Monotonic time for the per-port and aggregate statistics
+ */
+static uint32_t _ymodem_manager_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+#endif /* YMODEM_MANAGER_ENABLE */
@@ -0,0 +1,337 @@
+/**
+ * @file ymodem_mmap.c
+ * @brief Memory-mapped file backend
+ * @date 2025-04-09
+ * 
+ * This file contains the implementation of the memory-mapped file backend.
+ * A file handle is a small heap object that owns the descriptor and the
+ * mapping; the read/write position is a plain offset into the mapping.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "ymodem_mmap.h"
+
+#if YMODEM_MMAP_ENABLE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Stands in for the mapping of an empty file */
+static const uint8_t _ymodem_mmap_empty[1];
+
+/* One open file */
+typedef struct {
+    int      fd;
+    uint8_t* base;         /* Mapping, NULL until something is mapped */
+    size_t   size;         /* Bytes mapped */
+    size_t   offset;       /* Read/write position */
+    size_t   kept;         /* Length of an existing file opened to resume or update */
+    bool     writing;
+} _ymodem_mmap_file_t;
+
+static void* _mmap_file_open(void* user, const char* filename, enum ymodem_open_mode mode)
+{
+    _ymodem_mmap_file_t* file;
+    struct stat st;
+    bool writing = (mode != YMODEM_OPEN_READ);
+    (void)user;
+    
+    file = (_ymodem_mmap_file_t*)calloc(1, sizeof(*file));
+    if (file == NULL) {
+        return NULL;
+    }
+    
+    /* A resumed file keeps its contents, it is mapped once file_reserve gives the full size */
+    file->writing = writing;
+    file->fd = (mode == YMODEM_OPEN_WRITE)  ? open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644) :
+               (mode == YMODEM_OPEN_RESUME) ? open(filename, O_RDWR) :
+                                              open(filename, O_RDONLY);
+    if (file->fd < 0) {
+        free(file);
+        return NULL;
+    }
+    
+    if (mode == YMODEM_OPEN_RESUME) {
+        if (fstat(file->fd, &st) != 0 || st.st_size < 0) {
+            goto fail;
+        }
+        file->kept = (size_t)st.st_size;
+    }
+    
+    if (!writing) {
+        if (fstat(file->fd, &st) != 0 || st.st_size < 0) {
+            goto fail;
+        }
+        file->size = (size_t)st.st_size;
+        if (file->size > 0) {
+            void* base = mmap(NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+            if (base == MAP_FAILED) {
+                goto fail;
+            }
+            file->base = (uint8_t*)base;
+            posix_madvise(base, file->size, POSIX_MADV_SEQUENTIAL);
+        }
+    }
+    
+    return file;
+    
+fail:
+    close(file->fd);
+    free(file);
+    return NULL;
+}
+
+static const uint8_t* _mmap_file_peek(void* user, void* file_handle, size_t size, size_t* available)
+{
+    _ymodem_mmap_file_t* file = (_ymodem_mmap_file_t*)file_handle;
+    size_t remaining = file->size - file->offset;
+    const uint8_t* data;
+    (void)user;
+    
+    if (file->writing) {
+        return NULL;
+    }
+    
+    if (size > remaining) {
+        size = remaining;
+    }
+    data = (file->base != NULL) ? file->base + file->offset : _ymodem_mmap_empty;
+    file->offset += size;
+    *available = size;
+    return data;
+}
+
+static size_t _mmap_file_read(void* user, void* file_handle, uint8_t* buffer, size_t size)
+{
+    _ymodem_mmap_file_t* file = (_ymodem_mmap_file_t*)file_handle;
+    size_t available = 0;
+    const uint8_t* data;
+    
+    if (file->writing) {
+        /* Reading back a resumed file before it is mapped, or past the mapping */
+        if (file->base == NULL || file->offset >= file->size) {
+            ssize_t length = pread(file->fd, buffer, size, (off_t)file->offset);
+            if (length <= 0) {
+                return 0;
+            }
+            file->offset += (size_t)length;
+            return (size_t)length;
+        }
+    
+        /* Kept bytes in the writable mapping, e.g. the blocks a delta transfer skips */
+        if (size > file->size - file->offset) {
+            size = file->size - file->offset;
+        }
+        memcpy(buffer, file->base + file->offset, size);
+        file->offset += size;
+        return size;
+    }
+    
+    data = _mmap_file_peek(user, file_handle, size, &available);
+    if (data == NULL) {
+        return 0;
+    }
+    memcpy(buffer, data, available);
+    return available;
+}
+
+static int _mmap_file_reserve(void* user, void* file_handle, uint64_t size)
+{
+    _ymodem_mmap_file_t* file = (_ymodem_mmap_file_t*)file_handle;
+    void* base;
+    (void)user;
+    
+    if (!file->writing || file->base != NULL || size == 0 || size > (uint64_t)SIZE_MAX) {
+        return -1;
+    }
+    
+    /* An older, longer copy keeps its tail until the transfer is complete, see _mmap_file_close() */
+    if (size > (uint64_t)file->kept && ftruncate(file->fd, (off_t)size) != 0) {
+        return -1;
+    }
+    
+    base = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    file->base = (uint8_t*)base;
+    file->size = (size_t)size;
+    return 0;
+}
+
+static size_t _mmap_file_write(void* user, void* file_handle, const uint8_t* buffer, size_t size)
+{
+    _ymodem_mmap_file_t* file = (_ymodem_mmap_file_t*)file_handle;
+    (void)user;
+    
+    if (!file->writing) {
+        return 0;
+    }
+    
+    /* Inside the reserved size: a plain copy into the mapping */
+    if (file->base != NULL && size <= file->size - file->offset) {
+        memcpy(file->base + file->offset, buffer, size);
+        file->offset += size;
+        return size;
+    }
+    
+    /* Size unknown (or exceeded): ordinary write at the position */
+    ssize_t written = pwrite(file->fd, buffer, size, (off_t)file->offset);
+    if (written <= 0) {
+        return 0;
+    }
+    file->offset += (size_t)written;
+    return (size_t)written;
+}
+
+static int _mmap_file_seek(void* user, void* file_handle, uint64_t offset)
+{
+    _ymodem_mmap_file_t* file = (_ymodem_mmap_file_t*)file_handle;
+    (void)user;
+    
+    if (offset > (uint64_t)SIZE_MAX || (!file->writing && offset > file->size)) {
+        return -1;
+    }
+    file->offset = (size_t)offset;
+    return 0;
+}
+
+static int _mmap_file_stat(void* user, void* file_handle, uint64_t* mtime, uint32_t* mode)
+{
+    _ymodem_mmap_file_t* file = (_ymodem_mmap_file_t*)file_handle;
+    struct stat st;
+    (void)user;
+    
+    if (fstat(file->fd, &st) != 0) {
+        return -1;
+    }
+    *mtime = (st.st_mtime > 0) ? (uint64_t)st.st_mtime : 0;
+    *mode = (uint32_t)st.st_mode;
+    return 0;
+}
+
+static int _mmap_file_sync(void* user, void* file_handle)
+{
+    _ymodem_mmap_file_t* file = (_ymodem_mmap_file_t*)file_handle;
+    (void)user;
+    
+    if (file->base != NULL && file->writing && msync(file->base, file->size, MS_SYNC) != 0) {
+        return -1;
+    }
+    return fsync(file->fd);
+}
+
+static int64_t _mmap_file_size(void* user, void* file_handle)
+{
+    _ymodem_mmap_file_t* file = (_ymodem_mmap_file_t*)file_handle;
+    (void)user;
+    
+    return (int64_t)file->size;
+}
+
+static void _mmap_file_close(void* user, void* file_handle)
+{
+    _ymodem_mmap_file_t* file = (_ymodem_mmap_file_t*)file_handle;
+    size_t length;
+    (void)user;
+    
+    if (file->base != NULL) {
+        munmap(file->base, file->size);
+    }
+    
+    /*
+     * A complete file is cut where it ends, which drops the tail of an
+     * older, longer copy. A transfer that stopped early must not leave
+     * the reserved tail behind, but does not cut into the length the file
+     * was opened with either: an update that failed keeps the blocks of the
+     * old copy past the point it stopped.
+     */
+    if (file->writing && file->base != NULL) {
+        length = (file->offset >= file->size || file->offset >= file->kept) ? file->offset : file->kept;
+        if (length != ((file->size > file->kept) ? file->size : file->kept) &&
+            ftruncate(file->fd, (off_t)length) != 0) {
+            /* file_close has no error to report, a failed trim only leaves the file longer */
+        }
+    }
+    
+    close(file->fd);
+    free(file);
+}
+
+/**
+ * @brief Install the memory-mapped file callbacks
+ */
+void ymodem_mmap_set_callbacks(ymodem_callbacks_t* callbacks)
+{
+    if (callbacks == NULL) {
+        return;
+    }
+    
+    callbacks->file_open = _mmap_file_open;
+    callbacks->file_read = _mmap_file_read;
+    callbacks->file_write = _mmap_file_write;
+    callbacks->file_close = _mmap_file_close;
+    callbacks->file_size = _mmap_file_size;
+    callbacks->file_sync = _mmap_file_sync;
+    callbacks->file_peek = _mmap_file_peek;
+    callbacks->file_reserve = _mmap_file_reserve;
+    callbacks->file_seek = _mmap_file_seek;
+    callbacks->file_stat = _mmap_file_stat;
+}
+
+/**
+ * @brief Map a whole file read-only
+ */
+const uint8_t* ymodem_mmap_map(const char* path, size_t* size)
+{
+    struct stat st;
+    void* base;
+    int fd;
+    
+    if (path == NULL || size == NULL) {
+        return NULL;
+    }
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    if (fstat(fd, &st) != 0 || st.st_size < 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    *size = (size_t)st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return _ymodem_mmap_empty;
+    }
+    
+    /* The mapping keeps the file alive, the descriptor is not needed any more */
+    base = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    posix_madvise(base, *size, POSIX_MADV_SEQUENTIAL);
+    
+    return (const uint8_t*)base;
+}
+
+/**
+ * @brief Release a mapping returned by ymodem_mmap_map()
+ */
+void ymodem_mmap_unmap(const uint8_t* data, size_t size)
+{
+    if (data == NULL || data == _ymodem_mmap_empty || size == 0) {
+        return;
+    }
+    munmap((void*)data, size);
+}
+
+#endif /* YMODEM_MMAP_ENABLE */
@@ -0,0 +1,346 @@
+/**
+ * @file ymodem_mux.c
+ * @brief Channel multiplexer
+ * @date 2025-04-09
+ * 
+ * This file contains the implementation of the channel multiplexer. Each
+ * frame carries at most frame_data_size bytes of one session's output, so
+ * the channels take turns on the wire a frame at a time. Frames have no
+ * CRC and no acknowledgement of their own, the YMODEM packets inside carry
+ * theirs: only the header is checked, so the bytes of a frame are handed to
+ * the session of its channel as they come in and a damaged or lost frame
+ * shows up there as a bad or missing packet (or control byte) and is retried.
+ */
+
+#include "ymodem_mux.h"
+
+#if YMODEM_MUX_ENABLE
+
+#include <string.h>
+
+/* Steps of the frame parser */
+enum {
+    _MUX_HUNT = 0,          /* Looking for YMODEM_CODE_MUX */
+    _MUX_ID,                /* Channel ID */
+    _MUX_LENGTH,            /* Payload length */
+    _MUX_CHECK,             /* ~(ID ^ length) */
+    _MUX_DATA,              /* Payload */
+};
+
+/* Forward declarations of internal functions */
+static ymodem_mux_channel_t* _ymodem_mux_find(ymodem_mux_t* mux, uint8_t id);
+static int _ymodem_mux_pick(const ymodem_mux_t* mux);
+
+/**
+ * @brief Initialize a multiplexer without channels
+ */
+int ymodem_mux_init(ymodem_mux_t* mux, size_t frame_data_size)
+{
+    if (mux == NULL || frame_data_size > YMODEM_MUX_MAX_FRAME_DATA_SIZE) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    memset(mux, 0, sizeof(*mux));
+    mux->frame_data_size = (frame_data_size > 0) ? frame_data_size : YMODEM_MUX_FRAME_DATA_SIZE;
+    mux->rx_state = _MUX_HUNT;
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Put a session on a channel
+ */
+int ymodem_mux_add(ymodem_mux_t* mux, uint8_t id, ymodem_fsm_t* fsm, uint8_t priority)
+{
+    ymodem_mux_channel_t* channel;
+    
+    if (mux == NULL || fsm == NULL || _ymodem_mux_find(mux, id) != NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    if (mux->channel_count >= YMODEM_MUX_MAX_CHANNELS) {
+        return YMODEM_ERR_MEM;
+    }
+    
+    channel = &mux->channels[mux->channel_count++];
+    memset(channel, 0, sizeof(*channel));
+    channel->fsm = fsm;
+    channel->id = id;
+    channel->priority = priority;
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Hand received link bytes to the multiplexer
+ */
+int ymodem_mux_feed(ymodem_mux_t* mux, const uint8_t* data, size_t length, uint32_t now_ms)
+{
+    if (mux == NULL || (data == NULL && length > 0)) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    while (length > 0) {
+        switch (mux->rx_state) {
+        case _MUX_HUNT:
+            if (*data == YMODEM_CODE_MUX) {
+                mux->rx_state = _MUX_ID;
+            } else {
+                mux->bytes_skipped++;
+            }
+            data++;
+            length--;
+            break;
+    
+        case _MUX_ID:
+            mux->rx_id = *data++;
+            length--;
+            mux->rx_state = _MUX_LENGTH;
+            break;
+    
+        case _MUX_LENGTH:
+            mux->rx_length = *data++;
+            length--;
+            mux->rx_state = _MUX_CHECK;
+            break;
+    
+        case _MUX_CHECK:
+            if (*data == (uint8_t)~(mux->rx_id ^ mux->rx_length) && mux->rx_length > 0) {
+                mux->rx_channel = _ymodem_mux_find(mux, mux->rx_id);
+                mux->rx_left = mux->rx_length;
+                mux->rx_state = _MUX_DATA;
+                if (mux->rx_channel != NULL) {
+                    mux->rx_channel->frames_received++;
+                } else {
+                    mux->frames_dropped++;
+                }
+            } else {
+                /* Noise that looked like a frame, the check byte may start the real one */
+                mux->frames_dropped++;
+                mux->bytes_skipped += 3;
+                mux->rx_state = (*data == YMODEM_CODE_MUX) ? _MUX_ID : _MUX_HUNT;
+            }
+            data++;
+            length--;
+            break;
+    
+        default: {
+            /* Hand over as much of the payload as we have in one go */
+            size_t chunk = mux->rx_left;
+            if (chunk > length) {
+                chunk = length;
+            }
+            if (mux->rx_channel != NULL) {
+                ymodem_feed(mux->rx_channel->fsm, data, chunk, now_ms);
+            }
+            mux->rx_left -= (uint8_t)chunk;
+            data += chunk;
+            length -= chunk;
+    
+            if (mux->rx_left == 0) {
+                mux->rx_state = _MUX_HUNT;
+            }
+            break;
+        }
+        }
+    }
+    
+    return ymodem_mux_result(mux);
+}
+
+/**
+ * @brief Run the timers of all channels and collect frames to transmit
+ */
+size_t ymodem_mux_poll(ymodem_mux_t* mux, uint32_t now_ms, uint8_t* out, size_t max_length, uint32_t* deadline_ms)
+{
+    size_t produced = 0;
+    uint32_t deadline = now_ms;
+    bool waiting = false;
+    size_t i;
+    
+    if (mux == NULL) {
+        return 0;
+    }
+    
+    /* Timers first, a timeout queues a resend or a NAK */
+    for (i = 0; i < mux->channel_count; i++) {
+        ymodem_poll(mux->channels[i].fsm, now_ms, NULL, 0, NULL);
+    }
+    
+    while (out != NULL && max_length - produced >= YMODEM_MUX_FRAME_SIZE(1)) {
+        int index = _ymodem_mux_pick(mux);
+        ymodem_mux_channel_t* channel;
+        uint8_t* frame = out + produced;
+        size_t room = max_length - produced - YMODEM_MUX_FRAME_SIZE(0);
+        size_t n;
+    
+        if (index < 0) {
+            break;
+        }
+        channel = &mux->channels[index];
+    
+        if (room > mux->frame_data_size) {
+            room = mux->frame_data_size;
+        }
+        n = ymodem_poll(channel->fsm, now_ms, frame + YMODEM_MUX_HEADER_SIZE, room, NULL);
+        if (n == 0) {
+            break;
+        }
+    
+        frame[0] = YMODEM_CODE_MUX;
+        frame[1] = channel->id;
+        frame[2] = (uint8_t)n;
+        frame[3] = (uint8_t)~(channel->id ^ n);
+        produced += YMODEM_MUX_FRAME_SIZE(n);
+        channel->frames_sent++;
+    
+        /* Equal priorities take turns frame by frame */
+        mux->next = (size_t)index + 1;
+    }
+    
+    if (deadline_ms != NULL) {
+        for (i = 0; i < mux->channel_count; i++) {
+            uint32_t channel_deadline;
+    
+            if (ymodem_fsm_result(mux->channels[i].fsm) != YMODEM_FSM_BUSY) {
+                continue;
+            }
+            ymodem_poll(mux->channels[i].fsm, now_ms, NULL, 0, &channel_deadline);
+            if (!waiting || (int32_t)(channel_deadline - deadline) < 0) {
+                deadline = channel_deadline;
+                waiting = true;
+            }
+        }
+        *deadline_ms = deadline;
+    }
+    
+    return produced;
+}
+
+/**
+ * @brief Get the outcome of all channels
+ */
+int ymodem_mux_result(const ymodem_mux_t* mux)
+{
+    int result = YMODEM_ERR_NONE;
+    size_t i;
+    
+    if (mux == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    for (i = 0; i < mux->channel_count; i++) {
+        int channel_result = ymodem_fsm_result(mux->channels[i].fsm);
+        if (channel_result == YMODEM_FSM_BUSY) {
+            return YMODEM_FSM_BUSY;
+        }
+        if (result == YMODEM_ERR_NONE) {
+            result = channel_result;
+        }
+    }
+    
+    return result;
+}
+
+/**
+ * @brief Drive the multiplexer over blocking link callbacks until all channels are done
+ */
+int ymodem_mux_run(ymodem_mux_t* mux, const ymodem_callbacks_t* link)
+{
+    uint8_t out[YMODEM_MUX_IO_SIZE];
+    uint8_t in[YMODEM_MUX_IO_SIZE];
+    
+    if (mux == NULL || link == NULL || link->comm_send == NULL ||
+        link->comm_receive == NULL || link->get_time_ms == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    while (ymodem_mux_result(mux) == YMODEM_FSM_BUSY) {
+        uint32_t now = link->get_time_ms(link->user);
+        uint32_t deadline;
+        uint32_t timeout = 0;
+        size_t length = ymodem_mux_poll(mux, now, out, sizeof(out), &deadline);
+        size_t sent = 0;
+    
+        while (sent < length) {
+            size_t n = link->comm_send(link->user, out + sent, length - sent);
+            if (n == 0) {
+                break;  /* The rest is lost like line noise, the sessions retry */
+            }
+            sent += n;
+        }
+    
+        /* Only wait for input when there is nothing more to send */
+        if (length == 0 && (int32_t)(deadline - now) > 0) {
+            timeout = deadline - now;
+        }
+        length = link->comm_receive(link->user, in, sizeof(in), timeout);
+        if (length > 0) {
+            ymodem_mux_feed(mux, in, length, link->get_time_ms(link->user));
+        }
+    }
+    
+    return ymodem_mux_result(mux);
+}
+
+/**
+ * @brief Close the files of the channels that did not finish
+ */
+void ymodem_mux_cleanup(ymodem_mux_t* mux)
+{
+    size_t i;
+    
+    if (mux == NULL) {
+        return;
+    }
+    
+    for (i = 0; i < mux->channel_count; i++) {
+        ymodem_fsm_cleanup(mux->channels[i].fsm);
+    }
+}
+
+/**
+ * @brief Find a channel by its ID
+ */
+static ymodem_mux_channel_t* _ymodem_mux_find(ymodem_mux_t* mux, uint8_t id)
+{
+    size_t i;
+    
+    for (i = 0; i < mux->channel_count; i++) {
+        if (mux->channels[i].id == id) {
+            return &mux->channels[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief Pick the channel for the next frame
+ * 
+ * The most urgent channel with pending output wins; the scan starts after
+ * the channel served last, so equal priorities are served round-robin.
+ * 
+ * @return int Index of the channel, -1 if no channel has output
+ */
+static int _ymodem_mux_pick(const ymodem_mux_t* mux)
+{
+    int best = -1;
+    size_t i;
+    
+    for (i = 0; i < mux->channel_count; i++) {
+        size_t index = (mux->next + i) % mux->channel_count;
+        const ymodem_mux_channel_t* channel = &mux->channels[index];
+    
+        if (channel->fsm->tx_length == 0) {
+            continue;
+        }
+        if (best < 0 || channel->priority < mux->channels[best].priority) {
+            best = (int)index;
+        }
+    }
+    
+    return best;
+}
+
+#endif /* YMODEM_MUX_ENABLE */
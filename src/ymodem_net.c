@@ -0,0 +1,751 @@
+/**
+ * @file ymodem_net.c
+ * @brief Network transport
+ * @date 2025-04-09
+ * 
+ * This file contains the implementation of the TCP, RFC 2217 and UDP
+ * transports. Raw TCP sends straight from the caller's buffers with
+ * sendmsg(). RFC 2217 and UDP assemble the outgoing bytes in tx_buffer:
+ * Telnet doubles every 0xFF, UDP cuts the stream into datagrams. Incoming
+ * Telnet commands are stripped in place in rx_buffer, so only data is
+ * handed to the engine.
+ */
+
+#define _DEFAULT_SOURCE
+#include "ymodem_net.h"
+
+#if YMODEM_NET_ENABLE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef MSG_NOSIGNAL
+#define YMODEM_NET_SEND_FLAGS   MSG_NOSIGNAL
+#else
+#define YMODEM_NET_SEND_FLAGS   0
+#endif
+
+/* Telnet (RFC 854/856/858) and COM-PORT-OPTION (RFC 2217) codes */
+#define TELNET_IAC              255
+#define TELNET_DONT             254
+#define TELNET_DO               253
+#define TELNET_WONT             252
+#define TELNET_WILL             251
+#define TELNET_SB               250
+#define TELNET_SE               240
+#define TELNET_BINARY           0
+#define TELNET_SGA              3
+#define TELNET_COM_PORT         44
+#define COM_PORT_SET_BAUDRATE   1
+#define COM_PORT_SET_DATASIZE   2
+#define COM_PORT_SET_PARITY     3
+#define COM_PORT_SET_STOPSIZE   4
+#define COM_PORT_SET_CONTROL    5
+#define COM_PORT_SERVER_OFFSET  100   /* Server answers carry the command plus 100 */
+
+/* Telnet parser states */
+enum {
+    _TELNET_DATA = 0,
+    _TELNET_IAC,
+    _TELNET_OPTION,
+    _TELNET_SB,
+    _TELNET_SB_IAC
+};
+
+static bool _ymodem_net_fill(ymodem_net_t* net, uint32_t timeout_ms);
+
+static uint32_t _ymodem_net_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u);
+}
+
+static bool _ymodem_net_wait(int fd, short events, uint32_t timeout_ms)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    int wait_ms = (timeout_ms > INT_MAX) ? INT_MAX : (int)timeout_ms;
+    int ret;
+    
+    do {
+        ret = poll(&pfd, 1, wait_ms);
+    } while (ret < 0 && errno == EINTR);
+    
+    return (ret > 0 && (pfd.revents & events));
+}
+
+/**
+ * @brief Split "scheme://host:port" into its parts
+ */
+static int _ymodem_net_parse_url(const char* url, enum ymodem_net_kind* kind,
+                                 char* host, size_t host_size, char* port, size_t port_size)
+{
+    const char* rest;
+    const char* colon;
+    size_t host_length;
+    
+    if (strncmp(url, "tcp://", 6) == 0) {
+        *kind = YMODEM_NET_TCP;
+        rest = url + 6;
+    } else if (strncmp(url, "rfc2217://", 10) == 0) {
+        *kind = YMODEM_NET_RFC2217;
+        rest = url + 10;
+    } else if (strncmp(url, "udp://", 6) == 0) {
+        *kind = YMODEM_NET_UDP;
+        rest = url + 6;
+    } else {
+        return YMODEM_ERR_CODE;
+    }
+    
+    /* [v6 address]:port or host:port */
+    if (rest[0] == '[') {
+        const char* close = strchr(rest, ']');
+        if (close == NULL || close[1] != ':') {
+            return YMODEM_ERR_CODE;
+        }
+        rest++;
+        host_length = (size_t)(close - rest);
+        colon = close + 1;
+    } else {
+        colon = strrchr(rest, ':');
+        if (colon == NULL) {
+            return YMODEM_ERR_CODE;
+        }
+        host_length = (size_t)(colon - rest);
+    }
+    
+    if (host_length == 0 || host_length >= host_size || colon[1] == '\0' || strlen(colon + 1) >= port_size) {
+        return YMODEM_ERR_CODE;
+    }
+    memcpy(host, rest, host_length);
+    host[host_length] = '\0';
+    strcpy(port, colon + 1);
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Connect a non-blocking socket to the first address that answers
+ */
+static int _ymodem_net_connect(const char* host, const char* port, int socktype, uint32_t timeout_ms)
+{
+    struct addrinfo hints;
+    struct addrinfo* list;
+    struct addrinfo* ai;
+    int fd = -1;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    if (getaddrinfo(host, port, &hints, &list) != 0) {
+        return -1;
+    }
+    
+    for (ai = list; ai != NULL; ai = ai->ai_next) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+    
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        if (errno == EINPROGRESS && _ymodem_net_wait(fd, POLLOUT, timeout_ms) &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    
+    freeaddrinfo(list);
+    return fd;
+}
+
+/**
+ * @brief Write everything, waiting for room in the socket buffer
+ */
+static bool _ymodem_net_write_all(ymodem_net_t* net, const uint8_t* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = send(net->fd, data, length, YMODEM_NET_SEND_FLAGS);
+        if (written > 0) {
+            data += written;
+            length -= (size_t)written;
+        } else if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!_ymodem_net_wait(net->fd, POLLOUT, YMODEM_NET_TX_TIMEOUT_MS)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Send one datagram, waiting for room in the socket buffer
+ */
+static bool _ymodem_net_send_datagram(ymodem_net_t* net, const uint8_t* data, size_t length)
+{
+    for (;;) {
+        ssize_t written = send(net->fd, data, length, YMODEM_NET_SEND_FLAGS);
+        if (written >= 0) {
+            return ((size_t)written == length);
+        }
+        if (errno == EINTR || errno == ECONNREFUSED) {
+            continue;   /* ECONNREFUSED reports an earlier datagram, this one was not sent yet */
+        }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+            !_ymodem_net_wait(net->fd, POLLOUT, YMODEM_NET_TX_TIMEOUT_MS)) {
+            return false;
+        }
+    }
+}
+
+/**
+ * @brief Send what is assembled in tx_buffer
+ */
+static bool _ymodem_net_flush(ymodem_net_t* net, size_t* fill)
+{
+    bool ok = true;
+    
+    if (*fill > 0) {
+        ok = (net->kind == YMODEM_NET_UDP) ? _ymodem_net_send_datagram(net, net->tx_buffer, *fill)
+                                           : _ymodem_net_write_all(net, net->tx_buffer, *fill);
+    }
+    *fill = 0;
+    return ok;
+}
+
+/**
+ * @brief Add bytes to tx_buffer, escaping for Telnet, sending whenever it is full
+ */
+static bool _ymodem_net_put(ymodem_net_t* net, size_t* fill, const uint8_t* data, size_t length)
+{
+    size_t limit = sizeof(net->tx_buffer);
+    size_t i;
+    
+    if (net->kind == YMODEM_NET_UDP && net->config.datagram_size < limit) {
+        limit = net->config.datagram_size;
+    }
+    
+    for (i = 0; i < length; i++) {
+        /* Room for a doubled IAC */
+        if (*fill + 2 > limit && !_ymodem_net_flush(net, fill)) {
+            return false;
+        }
+        net->tx_buffer[(*fill)++] = data[i];
+        if (net->kind == YMODEM_NET_RFC2217 && data[i] == TELNET_IAC) {
+            net->tx_buffer[(*fill)++] = TELNET_IAC;
+        }
+    }
+    
+    return true;
+}
+
+/**
+ * @brief Answer an option request so that neither side waits for us
+ * 
+ * BINARY, SGA and COM-PORT-OPTION were offered at the start, anything else
+ * is refused. Confirmations of our own offers are not answered again.
+ */
+static void _ymodem_net_telnet_option(ymodem_net_t* net, uint8_t command, uint8_t option)
+{
+    uint8_t reply[3] = { TELNET_IAC, 0, option };
+    
+    if (command == TELNET_DO && option != TELNET_BINARY && option != TELNET_SGA && option != TELNET_COM_PORT) {
+        reply[1] = TELNET_WONT;
+    } else if (command == TELNET_WILL && option != TELNET_BINARY && option != TELNET_SGA) {
+        reply[1] = TELNET_DONT;
+    } else {
+        return;
+    }
+    _ymodem_net_write_all(net, reply, sizeof(reply));
+}
+
+/**
+ * @brief Take note of a COM-PORT-OPTION answer
+ */
+static void _ymodem_net_telnet_subnegotiation(ymodem_net_t* net)
+{
+    const uint8_t* sb = net->sb_buffer;
+    
+    if (net->sb_length >= 6 && sb[0] == TELNET_COM_PORT &&
+        sb[1] == COM_PORT_SET_BAUDRATE + COM_PORT_SERVER_OFFSET) {
+        net->server_baud = ((uint32_t)sb[2] << 24) | ((uint32_t)sb[3] << 16) |
+                           ((uint32_t)sb[4] << 8) | (uint32_t)sb[5];
+    }
+}
+
+/**
+ * @brief Strip Telnet commands from freshly received bytes, in place
+ * 
+ * The parser state is kept in net, a command may be split over two reads.
+ * 
+ * @return size_t Number of data bytes left at the start of data
+ */
+static size_t _ymodem_net_telnet_decode(ymodem_net_t* net, uint8_t* data, size_t length)
+{
+    size_t out = 0;
+    size_t i;
+    
+    for (i = 0; i < length; i++) {
+        uint8_t byte = data[i];
+    
+        switch (net->telnet_state) {
+        case _TELNET_DATA:
+            if (byte == TELNET_IAC) {
+                net->telnet_state = _TELNET_IAC;
+            } else {
+                data[out++] = byte;
+            }
+            break;
+    
+        case _TELNET_IAC:
+            if (byte == TELNET_IAC) {
+                data[out++] = byte;
+                net->telnet_state = _TELNET_DATA;
+            } else if (byte >= TELNET_WILL && byte <= TELNET_DONT) {
+                net->telnet_command = byte;
+                net->telnet_state = _TELNET_OPTION;
+            } else if (byte == TELNET_SB) {
+                net->sb_length = 0;
+                net->telnet_state = _TELNET_SB;
+            } else {
+                net->telnet_state = _TELNET_DATA;   /* NOP, GA, ... */
+            }
+            break;
+    
+        case _TELNET_OPTION:
+            _ymodem_net_telnet_option(net, net->telnet_command, byte);
+            net->telnet_state = _TELNET_DATA;
+            break;
+    
+        case _TELNET_SB:
+            if (byte == TELNET_IAC) {
+                net->telnet_state = _TELNET_SB_IAC;
+            } else if (net->sb_length < sizeof(net->sb_buffer)) {
+                net->sb_buffer[net->sb_length++] = byte;
+            }
+            break;
+    
+        default: /* _TELNET_SB_IAC */
+            if (byte == TELNET_SE) {
+                _ymodem_net_telnet_subnegotiation(net);
+                net->telnet_state = _TELNET_DATA;
+            } else {
+                if (byte == TELNET_IAC && net->sb_length < sizeof(net->sb_buffer)) {
+                    net->sb_buffer[net->sb_length++] = byte;
+                }
+                net->telnet_state = (byte == TELNET_IAC) ? _TELNET_SB : _TELNET_DATA;
+            }
+            break;
+        }
+    }
+    
+    return out;
+}
+
+/**
+ * @brief Offer binary mode and the COM-PORT-OPTION, then set up the server's port
+ */
+static bool _ymodem_net_rfc2217_start(ymodem_net_t* net)
+{
+    static const uint8_t offer[] = {
+        TELNET_IAC, TELNET_WILL, TELNET_BINARY, TELNET_IAC, TELNET_DO, TELNET_BINARY,
+        TELNET_IAC, TELNET_WILL, TELNET_SGA,    TELNET_IAC, TELNET_DO, TELNET_SGA,
+        TELNET_IAC, TELNET_WILL, TELNET_COM_PORT
+    };
+    const uint8_t settings[][2] = {
+        { COM_PORT_SET_DATASIZE, 8 },
+        { COM_PORT_SET_PARITY, 1 },                              /* NONE */
+        { COM_PORT_SET_STOPSIZE, 1 },
+        { COM_PORT_SET_CONTROL, net->config.flow_control ? 3 : 1 } /* HARDWARE or NONE */
+    };
+    uint8_t message[32];
+    size_t length = 0;
+    uint32_t start;
+    size_t i;
+    
+    if (!_ymodem_net_write_all(net, offer, sizeof(offer))) {
+        return false;
+    }
+    
+    /* SET-BAUDRATE 0 only asks for the current rate */
+    message[length++] = TELNET_IAC;
+    message[length++] = TELNET_SB;
+    message[length++] = TELNET_COM_PORT;
+    message[length++] = COM_PORT_SET_BAUDRATE;
+    for (i = 0; i < 4; i++) {
+        uint8_t byte = (uint8_t)(net->config.baud >> (24 - 8 * i));
+        message[length++] = byte;
+        if (byte == TELNET_IAC) {
+            message[length++] = TELNET_IAC;
+        }
+    }
+    message[length++] = TELNET_IAC;
+    message[length++] = TELNET_SE;
+    for (i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+        const uint8_t sb[] = { TELNET_IAC, TELNET_SB, TELNET_COM_PORT, settings[i][0], settings[i][1], TELNET_IAC, TELNET_SE };
+        memcpy(message + length, sb, sizeof(sb));
+        length += sizeof(sb);
+    }
+    if (!_ymodem_net_write_all(net, message, length)) {
+        return false;
+    }
+    
+    /* The answer to the speed shows that the server speaks RFC 2217, data that comes first is kept */
+    start = _ymodem_net_now_ms();
+    net->negotiating = true;
+    while (net->server_baud == 0 && net->rx_tail < sizeof(net->rx_buffer)) {
+        uint32_t elapsed = _ymodem_net_now_ms() - start;
+        if (elapsed >= net->config.connect_timeout_ms || !_ymodem_net_fill(net, net->config.connect_timeout_ms - elapsed)) {
+            break;
+        }
+    }
+    net->negotiating = false;
+    
+    return true;
+}
+
+/**
+ * @brief Read what the kernel has into rx_buffer after the bytes already there
+ * 
+ * @return bool true if new data bytes arrived within timeout_ms
+ */
+static bool _ymodem_net_fill(ymodem_net_t* net, uint32_t timeout_ms)
+{
+    uint32_t start = _ymodem_net_now_ms();
+    
+    if (net->rx_head == net->rx_tail) {
+        net->rx_head = 0;
+        net->rx_tail = 0;
+    }
+    
+    for (;;) {
+        uint8_t* data = net->rx_buffer + net->rx_tail;
+        ssize_t length = recv(net->fd, data, sizeof(net->rx_buffer) - net->rx_tail, 0);
+        uint32_t elapsed;
+    
+        if (length > 0) {
+#if defined(__linux__) && defined(TCP_QUICKACK)
+            /* The kernel falls back to delayed ACKs, ask again after every read */
+            if (net->kind != YMODEM_NET_UDP && net->config.quickack) {
+                int on = 1;
+                setsockopt(net->fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+            }
+#endif
+            if (net->kind == YMODEM_NET_RFC2217) {
+                length = (ssize_t)_ymodem_net_telnet_decode(net, data, (size_t)length);
+            }
+            if (length > 0) {
+                net->rx_tail += (size_t)length;
+                return true;
+            }
+            if (net->negotiating && net->server_baud != 0) {
+                return false;   /* The answer is in, stop waiting */
+            }
+            continue;   /* Only Telnet commands */
+        }
+        if (length == 0 && net->kind != YMODEM_NET_UDP) {
+            return false;   /* Connection closed */
+        }
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        /* A datagram that found no listener comes back as ECONNREFUSED, the peer may just not be up yet */
+        if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            !(net->kind == YMODEM_NET_UDP && errno == ECONNREFUSED)) {
+            return false;
+        }
+    
+        elapsed = _ymodem_net_now_ms() - start;
+        if (elapsed >= timeout_ms || !_ymodem_net_wait(net->fd, POLLIN, timeout_ms - elapsed)) {
+            return false;
+        }
+    }
+}
+
+static size_t _net_comm_send(void* user, const uint8_t* data, size_t length)
+{
+    ymodem_net_t* net = (ymodem_net_t*)user;
+    size_t fill = 0;
+    
+    if (net->kind == YMODEM_NET_TCP) {
+        return _ymodem_net_write_all(net, data, length) ? length : 0;
+    }
+    if (!_ymodem_net_put(net, &fill, data, length) || !_ymodem_net_flush(net, &fill)) {
+        return 0;
+    }
+    return length;
+}
+
+static size_t _net_comm_sendv(void* user, const ymodem_iovec_t* iov, size_t iov_count)
+{
+    ymodem_net_t* net = (ymodem_net_t*)user;
+    size_t total = 0;
+    size_t fill = 0;
+    size_t i;
+    
+    if (net->kind == YMODEM_NET_TCP) {
+        struct iovec vec[YMODEM_MAX_WINDOW];
+        size_t first = 0;
+        size_t skip = 0;    /* Bytes of iov[first] already sent */
+    
+        while (first < iov_count) {
+            struct msghdr msg;
+            size_t count = 0;
+            ssize_t written;
+    
+            while (count < YMODEM_MAX_WINDOW && first + count < iov_count) {
+                size_t k = first + count;
+                vec[count].iov_base = (void*)(iov[k].data + (count == 0 ? skip : 0));
+                vec[count].iov_len = iov[k].length - (count == 0 ? skip : 0);
+                count++;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = vec;
+            msg.msg_iovlen = count;
+    
+            written = sendmsg(net->fd, &msg, YMODEM_NET_SEND_FLAGS);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!_ymodem_net_wait(net->fd, POLLOUT, YMODEM_NET_TX_TIMEOUT_MS)) {
+                    break;
+                }
+                continue;
+            }
+            if (written <= 0) {
+                break;
+            }
+    
+            total += (size_t)written;
+            while (written > 0 && first < iov_count) {
+                size_t left = iov[first].length - skip;
+                if ((size_t)written < left) {
+                    skip += (size_t)written;
+                    written = 0;
+                } else {
+                    written -= (ssize_t)left;
+                    first++;
+                    skip = 0;
+                }
+            }
+            while (first < iov_count && iov[first].length == 0) {
+                first++;
+            }
+        }
+        return total;
+    }
+    
+    /* Telnet escaping and datagrams: all pieces through tx_buffer, then one flush */
+    for (i = 0; i < iov_count; i++) {
+        if (!_ymodem_net_put(net, &fill, iov[i].data, iov[i].length)) {
+            return 0;
+        }
+        total += iov[i].length;
+    }
+    return _ymodem_net_flush(net, &fill) ? total : 0;
+}
+
+static size_t _net_comm_receive(void* user, uint8_t* data, size_t max_length, uint32_t timeout_ms)
+{
+    ymodem_net_t* net = (ymodem_net_t*)user;
+    size_t length;
+    
+    if (net->rx_head == net->rx_tail && !_ymodem_net_fill(net, timeout_ms)) {
+        return 0;
+    }
+    
+    length = net->rx_tail - net->rx_head;
+    if (length > max_length) {
+        length = max_length;
+    }
+    memcpy(data, net->rx_buffer + net->rx_head, length);
+    net->rx_head += length;
+    
+    return length;
+}
+
+static uint32_t _net_get_time_ms(void* user)
+{
+    (void)user;
+    return _ymodem_net_now_ms();
+}
+
+static void _net_delay_ms(void* user, uint32_t ms)
+{
+    struct timespec ts;
+    (void)user;
+    
+    ts.tv_sec = (time_t)(ms / 1000u);
+    ts.tv_nsec = (long)(ms % 1000u) * 1000000L;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * @brief Defaults: Nagle and delayed ACKs off, 1472-byte datagrams, 3 s to connect
+ */
+void ymodem_net_default_config(ymodem_net_config_t* config)
+{
+    if (config == NULL) {
+        return;
+    }
+    
+    config->baud = 0;
+    config->flow_control = false;
+    config->nodelay = true;
+    config->quickack = true;
+    config->socket_buffer = 0;
+    config->datagram_size = 1472;   /* One Ethernet frame */
+    config->connect_timeout_ms = 3000;
+}
+
+/**
+ * @brief Use a connected socket, e.g. one returned by accept()
+ */
+int ymodem_net_attach(ymodem_net_t* net, int fd, enum ymodem_net_kind kind, const ymodem_net_config_t* config)
+{
+    if (net == NULL || fd < 0) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    memset(net, 0, offsetof(ymodem_net_t, rx_buffer));
+    net->fd = fd;
+    net->kind = kind;
+    if (config != NULL) {
+        net->config = *config;
+    } else {
+        ymodem_net_default_config(&net->config);
+    }
+    if (net->config.datagram_size == 0) {
+        net->config.datagram_size = 1472;
+    }
+    
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+        ymodem_net_close(net);
+        return YMODEM_ERR_CODE;
+    }
+    
+    if (net->config.socket_buffer > 0) {
+        int size = (net->config.socket_buffer > INT_MAX) ? INT_MAX : (int)net->config.socket_buffer;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+    
+    if (kind != YMODEM_NET_UDP) {
+        /* Nagle holds a small write until the previous one is ACKed, which the peer delays */
+        int on = net->config.nodelay ? 1 : 0;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#if defined(__linux__) && defined(TCP_QUICKACK)
+        on = net->config.quickack ? 1 : 0;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+    }
+    
+    if (kind == YMODEM_NET_RFC2217 && !_ymodem_net_rfc2217_start(net)) {
+        ymodem_net_close(net);
+        return YMODEM_ERR_CODE;
+    }
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Connect to a port
+ */
+int ymodem_net_open(ymodem_net_t* net, const char* url, const ymodem_net_config_t* config)
+{
+    ymodem_net_config_t defaults;
+    enum ymodem_net_kind kind;
+    char host[256];
+    char port[32];
+    int fd;
+    
+    if (net == NULL || url == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    net->fd = -1;
+    
+    if (_ymodem_net_parse_url(url, &kind, host, sizeof(host), port, sizeof(port)) != YMODEM_ERR_NONE) {
+        return YMODEM_ERR_CODE;
+    }
+    if (config == NULL) {
+        ymodem_net_default_config(&defaults);
+        config = &defaults;
+    }
+    
+    fd = _ymodem_net_connect(host, port, (kind == YMODEM_NET_UDP) ? SOCK_DGRAM : SOCK_STREAM,
+                             config->connect_timeout_ms);
+    if (fd < 0) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    return ymodem_net_attach(net, fd, kind, config);
+}
+
+/**
+ * @brief Install the transport callbacks
+ */
+void ymodem_net_set_callbacks(ymodem_net_t* net, ymodem_callbacks_t* callbacks)
+{
+    if (net == NULL || callbacks == NULL) {
+        return;
+    }
+    
+    callbacks->comm_send = _net_comm_send;
+    callbacks->comm_sendv = _net_comm_sendv;
+    callbacks->comm_receive = _net_comm_receive;
+    callbacks->get_time_ms = _net_get_time_ms;
+    callbacks->delay_ms = _net_delay_ms;
+    callbacks->user = net;
+}
+
+/**
+ * @brief Close a connection
+ */
+void ymodem_net_close(ymodem_net_t* net)
+{
+    if (net == NULL) {
+        return;
+    }
+    
+    if (net->fd >= 0) {
+        close(net->fd);
+    }
+    net->fd = -1;
+    net->rx_head = 0;
+    net->rx_tail = 0;
+}
+
+#endif /* YMODEM_NET_ENABLE */
@@ -0,0 +1,378 @@
+/**
+ * @file ymodem_readahead.c
+ * @brief Sender read-ahead stage
+ * @date 2025-04-09
+ * 
+ * This file contains the implementation of the read-ahead stage. The ring
+ * is a single-producer/single-consumer queue of blocks: the producer (the
+ * thread, or file_read itself when there is no thread) only writes the slot
+ * at tail, the sender only reads the slot at head, head and tail are
+ * protected by the lock.
+ */
+
+#include "ymodem_readahead.h"
+
+#if YMODEM_READAHEAD_ENABLE
+
+#include <string.h>
+
+static void* _ymodem_readahead_producer(void* arg);
+static size_t _ymodem_readahead_fill(ymodem_readahead_t* ra, uint8_t* block);
+
+/* Everything that is not a file read goes straight to the original callbacks */
+static size_t _ra_comm_send(void* user, const uint8_t* data, size_t length)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    return ra->inner.comm_send(ra->inner.user, data, length);
+}
+
+static size_t _ra_comm_sendv(void* user, const ymodem_iovec_t* iov, size_t iov_count)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    return ra->inner.comm_sendv(ra->inner.user, iov, iov_count);
+}
+
+static size_t _ra_comm_receive(void* user, uint8_t* data, size_t max_length, uint32_t timeout_ms)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    return ra->inner.comm_receive(ra->inner.user, data, max_length, timeout_ms);
+}
+
+static uint32_t _ra_get_time_ms(void* user)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    return ra->inner.get_time_ms(ra->inner.user);
+}
+
+static void _ra_delay_ms(void* user, uint32_t ms)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    ra->inner.delay_ms(ra->inner.user, ms);
+}
+
+static size_t _ra_file_write(void* user, void* file_handle, const uint8_t* buffer, size_t size)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    return ra->inner.file_write(ra->inner.user, file_handle, buffer, size);
+}
+
+static int _ra_file_sync(void* user, void* file_handle)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    return ra->inner.file_sync(ra->inner.user, file_handle);
+}
+
+static int _ra_file_reserve(void* user, void* file_handle, uint64_t size)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    return (file_handle == ra) ? -1 : ra->inner.file_reserve(ra->inner.user, file_handle, size);
+}
+
+static int _ra_file_stat(void* user, void* file_handle, uint64_t* mtime, uint32_t* mode)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    return ra->inner.file_stat(ra->inner.user, (file_handle == ra) ? ra->file_handle : file_handle, mtime, mode);
+}
+
+/* Reading: the handle given to the engine is the stage itself */
+static void* _ra_file_open(void* user, const char* filename, enum ymodem_open_mode mode)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    
+    if (mode != YMODEM_OPEN_READ) {
+        return ra->inner.file_open(ra->inner.user, filename, mode);
+    }
+    
+    if (ra->file_handle != NULL) {
+        return NULL; /* One file at a time */
+    }
+    
+    ra->file_handle = ra->inner.file_open(ra->inner.user, filename, YMODEM_OPEN_READ);
+    if (ra->file_handle == NULL) {
+        return NULL;
+    }
+    
+    /* The producer owns the inner handle from now on, take the size first */
+    ra->file_size = YMODEM_FILE_SIZE_UNKNOWN;
+    if (ra->inner.file_size != NULL) {
+        ra->file_size = ra->inner.file_size(ra->inner.user, ra->file_handle);
+    }
+    ra->head = 0;
+    ra->tail = 0;
+    ra->offset = 0;
+    ra->eof = false;
+    ra->filling = false;
+    ra->seeking = false;
+    ra->stop = false;
+    
+    if (ra->threaded) {
+        if (pthread_mutex_init(&ra->lock, NULL) != 0) {
+            goto fail;
+        }
+        if (pthread_cond_init(&ra->cond, NULL) != 0) {
+            pthread_mutex_destroy(&ra->lock);
+            goto fail;
+        }
+        if (pthread_create(&ra->thread, NULL, _ymodem_readahead_producer, ra) != 0) {
+            pthread_cond_destroy(&ra->cond);
+            pthread_mutex_destroy(&ra->lock);
+            goto fail;
+        }
+    }
+    
+    return ra;
+    
+fail:
+    ra->inner.file_close(ra->inner.user, ra->file_handle);
+    ra->file_handle = NULL;
+    return NULL;
+}
+
+static size_t _ra_file_read(void* user, void* file_handle, uint8_t* buffer, size_t size)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    size_t copied = 0;
+    
+    if (file_handle != ra) {
+        return ra->inner.file_read(ra->inner.user, file_handle, buffer, size);
+    }
+    
+    while (copied < size) {
+        size_t slot;
+        size_t chunk;
+    
+        if (ra->threaded) {
+            pthread_mutex_lock(&ra->lock);
+            while (ra->head == ra->tail && !ra->eof) {
+                pthread_cond_wait(&ra->cond, &ra->lock);
+            }
+            if (ra->head == ra->tail) {
+                pthread_mutex_unlock(&ra->lock);
+                break;
+            }
+            pthread_mutex_unlock(&ra->lock);
+        } else if (ra->head == ra->tail) {
+            /* No thread: refill one block in line */
+            if (ra->eof) {
+                break;
+            }
+            slot = ra->tail % ra->block_count;
+            ra->lengths[slot] = _ymodem_readahead_fill(ra, ra->ring + slot * ra->block_size);
+            if (ra->lengths[slot] < ra->block_size) {
+                ra->eof = true;
+            }
+            if (ra->lengths[slot] == 0) {
+                break;
+            }
+            ra->tail++;
+        }
+    
+        /* The producer never touches the head slot, copy without the lock */
+        slot = ra->head % ra->block_count;
+        chunk = ra->lengths[slot] - ra->offset;
+        if (chunk > size - copied) {
+            chunk = size - copied;
+        }
+        memcpy(buffer + copied, ra->ring + slot * ra->block_size + ra->offset, chunk);
+        copied += chunk;
+        ra->offset += chunk;
+    
+        if (ra->offset == ra->lengths[slot]) {
+            ra->offset = 0;
+            if (ra->threaded) {
+                pthread_mutex_lock(&ra->lock);
+                ra->head++;
+                pthread_cond_signal(&ra->cond);
+                pthread_mutex_unlock(&ra->lock);
+            } else {
+                ra->head++;
+            }
+        }
+    }
+    
+    return copied;
+}
+
+/**
+ * @brief Move the file being read, what was read ahead is dropped
+ * 
+ * The producer is held off while the inner file moves, it is never stopped
+ * in the middle of a block.
+ */
+static int _ra_file_seek(void* user, void* file_handle, uint64_t offset)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    int ret;
+    
+    if (file_handle != ra) {
+        return ra->inner.file_seek(ra->inner.user, file_handle, offset);
+    }
+    
+    if (ra->threaded) {
+        pthread_mutex_lock(&ra->lock);
+        ra->seeking = true;
+        while (ra->filling) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        }
+    }
+    
+    ret = ra->inner.file_seek(ra->inner.user, ra->file_handle, offset);
+    if (ret == 0) {
+        ra->head = 0;
+        ra->tail = 0;
+        ra->offset = 0;
+        ra->eof = false;
+    }
+    
+    if (ra->threaded) {
+        ra->seeking = false;
+        pthread_cond_signal(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+    }
+    
+    return ret;
+}
+
+static void _ra_file_close(void* user, void* file_handle)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    
+    if (file_handle != ra) {
+        ra->inner.file_close(ra->inner.user, file_handle);
+        return;
+    }
+    
+    if (ra->threaded) {
+        pthread_mutex_lock(&ra->lock);
+        ra->stop = true;
+        pthread_cond_signal(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        pthread_join(ra->thread, NULL);
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+    }
+    
+    ra->inner.file_close(ra->inner.user, ra->file_handle);
+    ra->file_handle = NULL;
+}
+
+static int64_t _ra_file_size(void* user, void* file_handle)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)user;
+    
+    if (file_handle != ra) {
+        return ra->inner.file_size ? ra->inner.file_size(ra->inner.user, file_handle) : YMODEM_FILE_SIZE_UNKNOWN;
+    }
+    return ra->file_size;
+}
+
+/**
+ * @brief Set up a read-ahead stage in front of a set of callbacks
+ */
+int ymodem_readahead_init(ymodem_readahead_t* ra,
+                         const ymodem_callbacks_t* callbacks,
+                         uint8_t* ring,
+                         size_t block_size,
+                         size_t block_count,
+                         bool threaded,
+                         ymodem_callbacks_t* wrapped)
+{
+    if (ra == NULL || callbacks == NULL || ring == NULL || wrapped == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    if (block_size == 0 || block_count < 2 || block_count > YMODEM_READAHEAD_MAX_BLOCKS) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    if (callbacks->file_open == NULL ||
+        callbacks->file_read == NULL ||
+        callbacks->file_close == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    memset(ra, 0, sizeof(*ra));
+    ra->inner = *callbacks;
+    ra->ring = ring;
+    ra->block_size = block_size;
+    ra->block_count = block_count;
+    ra->threaded = threaded;
+    
+    /* wrapped may alias callbacks, only ra->inner is used from here on */
+    memset(wrapped, 0, sizeof(*wrapped));
+    wrapped->file_open = _ra_file_open;
+    wrapped->file_read = _ra_file_read;
+    wrapped->file_close = _ra_file_close;
+    wrapped->file_size = _ra_file_size;
+    wrapped->file_write = ra->inner.file_write ? _ra_file_write : NULL;
+    wrapped->file_sync = ra->inner.file_sync ? _ra_file_sync : NULL;
+    wrapped->file_reserve = ra->inner.file_reserve ? _ra_file_reserve : NULL;
+    wrapped->file_seek = ra->inner.file_seek ? _ra_file_seek : NULL;
+    wrapped->file_stat = ra->inner.file_stat ? _ra_file_stat : NULL;
+    wrapped->comm_send = ra->inner.comm_send ? _ra_comm_send : NULL;
+    wrapped->comm_sendv = ra->inner.comm_sendv ? _ra_comm_sendv : NULL;
+    wrapped->comm_receive = ra->inner.comm_receive ? _ra_comm_receive : NULL;
+    wrapped->get_time_ms = ra->inner.get_time_ms ? _ra_get_time_ms : NULL;
+    wrapped->delay_ms = ra->inner.delay_ms ? _ra_delay_ms : NULL;
+    wrapped->user = ra;
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Read one block from the inner file, tolerating short reads like ymodem_load_packet()
+ */
+static size_t _ymodem_readahead_fill(ymodem_readahead_t* ra, uint8_t* block)
+{
+    size_t filled = 0;
+    int retry_read;
+    
+    for (retry_read = 0; retry_read < 10 && filled < ra->block_size; retry_read++) {
+        filled += ra->inner.file_read(ra->inner.user, ra->file_handle,
+                                      block + filled,
+                                      ra->block_size - filled);
+    }
+    
+    return filled;
+}
+
+/**
+ * @brief Producer thread, keeps the ring full until close
+ * 
+ * At the end of the file it waits as well, a seek may move the file back.
+ */
+static void* _ymodem_readahead_producer(void* arg)
+{
+    ymodem_readahead_t* ra = (ymodem_readahead_t*)arg;
+    
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop) {
+        if (ra->eof || ra->seeking || ra->tail - ra->head == ra->block_count) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+    
+        size_t slot = ra->tail % ra->block_count;
+        ra->filling = true;
+        pthread_mutex_unlock(&ra->lock);
+    
+        /* The slow read happens without the lock, the sender keeps draining */
+        size_t length = _ymodem_readahead_fill(ra, ra->ring + slot * ra->block_size);
+    
+        pthread_mutex_lock(&ra->lock);
+        ra->filling = false;
+        ra->lengths[slot] = length;
+        if (length > 0) {
+            ra->tail++;
+        }
+        if (length < ra->block_size) {
+            ra->eof = true;
+        }
+        pthread_cond_signal(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    
+    return NULL;
+}
+
+#endif /* YMODEM_READAHEAD_ENABLE */
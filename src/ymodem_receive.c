@@ -7,13 +7,41 @@
  */
 
 #include "ymodem_receive.h"
+#include <string.h>
+#include <stdio.h>
 
 /* Forward declarations of internal functions */
 static int _ymodem_do_handshake(ymodem_context_t* ctx, int timeout_s);
 static int _ymodem_receive_packet(ymodem_context_t* ctx, uint8_t* seq, size_t* data_size);
+static int _ymodem_sync_packet(ymodem_context_t* ctx, uint8_t expected_seq, bool resync, uint8_t* seq, size_t* data_size);
 static int _ymodem_do_trans(ymodem_context_t* ctx);
 static int _ymodem_do_fin(ymodem_context_t* ctx);
-static int _ymodem_parse_file_info(ymodem_context_t* ctx, ymodem_file_info_t* file_info);
+static int _ymodem_receive_batch(ymodem_context_t* ctx, ymodem_file_done_func on_file,
+                                ymodem_file_info_t* first_info, size_t* file_count, int handshake_timeout_s);
+static int _ymodem_receive_one_file(ymodem_context_t* ctx, ymodem_file_info_t* file_info);
+static bool _ymodem_request_retransmit(ymodem_context_t* ctx);
+static bool _ymodem_send_ack_start(ymodem_context_t* ctx);
+static bool _ymodem_send_data_start(ymodem_context_t* ctx, bool ack);
+static int _ymodem_write_data(ymodem_context_t* ctx, const uint8_t* data, size_t size);
+#if YMODEM_LZ_ENABLE
+static int _ymodem_write_compressed(ymodem_context_t* ctx, const uint8_t* data, size_t size, uint64_t remaining, size_t* written);
+#endif
+static int _ymodem_flush(ymodem_context_t* ctx, bool final);
+static int _ymodem_commit(ymodem_context_t* ctx, const uint8_t* data, size_t size);
+#if YMODEM_RESUME_ENABLE
+static bool _ymodem_journaling(const ymodem_context_t* ctx);
+static void _ymodem_journal_save(ymodem_context_t* ctx, uint64_t offset, uint32_t crc);
+static bool _ymodem_resume_open(ymodem_context_t* ctx);
+static int _ymodem_resume_request(ymodem_context_t* ctx);
+#endif
+#if YMODEM_DELTA_ENABLE
+static bool _ymodem_delta_open(ymodem_context_t* ctx);
+static int _ymodem_delta_request(ymodem_context_t* ctx);
+static int _ymodem_skip_data(ymodem_context_t* ctx, uint64_t offset, uint32_t* skipped);
+#endif
+#if YMODEM_DIGEST_ENABLE
+static int _ymodem_check_sum(ymodem_context_t* ctx);
+#endif
 
 /**
  * @brief Initialize YMODEM context for receiving
@@ -21,7 +49,8 @@ static int _ymodem_parse_file_info(ymodem_context_t* ctx, ymodem_file_info_t* fi
 int ymodem_receive_init(ymodem_context_t* ctx, 
                        const ymodem_callbacks_t* callbacks,
                        uint8_t* buffer,
-                       size_t buffer_size)
+                       size_t buffer_size,
+                       enum ymodem_mode mode)
 {
     if (ctx == NULL || callbacks == NULL || buffer == NULL) {
         return YMODEM_ERR_CODE;
@@ -31,6 +60,10 @@ int ymodem_receive_init(ymodem_context_t* ctx,
         return YMODEM_ERR_DSZ;
     }
     
+    if (mode != YMODEM_MODE_CRC && mode != YMODEM_MODE_G) {
+        return YMODEM_ERR_CODE;
+    }
+    
     /* Check required callbacks */
     if (callbacks->comm_send == NULL || 
         callbacks->comm_receive == NULL || 
@@ -50,8 +83,205 @@ int ymodem_receive_init(ymodem_context_t* ctx,
     ctx->packet_seq = 0;
     ctx->error_count = 0;
     ctx->filename[0] = '\0';
+    ctx->mode = mode;
+    ctx->start_code = (mode == YMODEM_MODE_G) ? YMODEM_CODE_G : YMODEM_CODE_C;
+#if YMODEM_WRITE_BEHIND_ENABLE
+    ctx->wb_buffer = NULL;
+    ctx->wb_size = 0;
+    ctx->wb_fill = 0;
+#endif
+    ctx->sync = YMODEM_SYNC_NONE;
+    ctx->file_mtime = 0;
+    ctx->file_mode = 0;
+    ctx->file_offset = 0;
+    ctx->block_max = 0;
+    ctx->block_size = 0;
+    ctx->peer_block = 0;
+#if YMODEM_RESUME_ENABLE
+    ctx->resume = false;
+    ctx->peer_resume = false;
+    ctx->committed = 0;
+    ctx->committed_crc = 0;
+    ctx->journal_mark = 0;
+#endif
+#if YMODEM_LZ_ENABLE
+    ctx->lz_decoder = NULL;
+    ctx->peer_lz = 0;
+    ctx->lz = false;
+#endif
+#if YMODEM_DELTA_ENABLE
+    ctx->delta_blocks = 0;
+    ctx->delta_accept = false;
+    ctx->peer_delta = false;
+    ctx->delta = false;
+#endif
+#if YMODEM_DIGEST_ENABLE
+    ctx->digest = NULL;
+    ctx->peer_digest = YMODEM_DIGEST_NONE;
+    ctx->verify = false;
+#endif
+#if YMODEM_SEND_ENABLE
+#if YMODEM_LZ_ENABLE
+    ctx->lz_encoder = NULL;
+#endif
+#if YMODEM_DELTA_ENABLE
+    ctx->delta_map = NULL;
+    ctx->delta_map_size = 0;
+    ctx->delta_offset = 0;
+#endif
+#endif
+#if YMODEM_STATS_ENABLE
+    ctx->progress = NULL;
+    ctx->progress_interval_ms = 0;
+#endif
+    ctx->handshake_interval_ms = YMODEM_HANDSHAKE_INTERVAL_MS;
+    ctx->handshake_timeout_ms = 0;
+    ctx->peer_waiting = false;
+#if YMODEM_TRACE_LEVEL > YMODEM_TRACE_NONE
+    ctx->trace = NULL;
+    ctx->trace_user = NULL;
+    ctx->trace_level = YMODEM_TRACE_DEFAULT;
+#endif
+    ctx->now_ms = 0;
+    ymodem_stats_reset(ctx);
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Enable write-behind buffering on the receiver
+ */
+int ymodem_receive_set_write_behind(ymodem_context_t* ctx,
+                                   uint8_t* wb_buffer,
+                                   size_t wb_size,
+                                   enum ymodem_sync sync)
+{
+    if (ctx == NULL || (wb_buffer != NULL && wb_size == 0)) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    if (sync != YMODEM_SYNC_NONE && sync != YMODEM_SYNC_END && sync != YMODEM_SYNC_CHUNK) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_WRITE_BEHIND_ENABLE
+    ctx->wb_buffer = wb_buffer;
+    ctx->wb_size = (wb_buffer != NULL) ? wb_size : 0;
+    ctx->wb_fill = 0;
+#else
+    if (wb_buffer != NULL) {
+        return YMODEM_ERR_CODE;
+    }
+#endif
+    ctx->sync = sync;
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Keep a resume journal and continue interrupted files
+ */
+int ymodem_receive_set_resume(ymodem_context_t* ctx, bool enable)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_RESUME_ENABLE
+    /* The kept part is read back to check it, then written after */
+    if (enable && (ctx->callbacks.file_seek == NULL || ctx->callbacks.file_read == NULL)) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ctx->resume = enable;
+    
+    return YMODEM_ERR_NONE;
+#else
+    return enable ? YMODEM_ERR_CODE : YMODEM_ERR_NONE;
+#endif
+}
+
+/**
+ * @brief Accept large blocks from senders that offer them
+ */
+int ymodem_receive_set_large_blocks(ymodem_context_t* ctx, size_t block_size)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    if (block_size != 0 && (!YMODEM_BLK_ENABLE ||
+                            (block_size != YMODEM_BLK8K_DATA_SIZE && block_size != YMODEM_BLK32K_DATA_SIZE))) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    /* The whole block is received into the packet buffer */
+    if (block_size != 0 && ctx->buffer_size < YMODEM_BLK_PACKET_SIZE(block_size)) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    ctx->block_max = block_size;
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Accept compressed data from senders that offer it
+ */
+int ymodem_receive_set_compression(ymodem_context_t* ctx, ymodem_lz_decoder_t* decoder)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_LZ_ENABLE
+    ctx->lz_decoder = decoder;
+    
+    return YMODEM_ERR_NONE;
+#else
+    return (decoder != NULL) ? YMODEM_ERR_CODE : YMODEM_ERR_NONE;
+#endif
+}
+
+/**
+ * @brief Let senders that offer it skip the blocks of an existing copy
+ */
+int ymodem_receive_set_delta(ymodem_context_t* ctx, bool enable)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_DELTA_ENABLE
+    /* The copy is read to hash it, then written in place */
+    if (enable && (ctx->callbacks.file_seek == NULL || ctx->callbacks.file_read == NULL)) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ctx->delta_accept = enable;
+    
+    return YMODEM_ERR_NONE;
+#else
+    return enable ? YMODEM_ERR_CODE : YMODEM_ERR_NONE;
+#endif
+}
+
+/**
+ * @brief Check the files of senders that offer a whole-file digest
+ */
+int ymodem_receive_set_digest(ymodem_context_t* ctx, ymodem_digest_t* digest)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_DIGEST_ENABLE
+    ctx->digest = digest;
     
     return YMODEM_ERR_NONE;
+#else
+    return (digest != NULL) ? YMODEM_ERR_CODE : YMODEM_ERR_NONE;
+#endif
 }
 
 /**
@@ -61,43 +291,292 @@ int ymodem_receive_file(ymodem_context_t* ctx,
                        ymodem_file_info_t* file_info,
                        int handshake_timeout_s)
 {
-    int ret;
+    size_t file_count = 0;
     
     if (ctx == NULL || file_info == NULL) {
         return YMODEM_ERR_CODE;
     }
     
-    /* Start handshake */
+    return _ymodem_receive_batch(ctx, NULL, file_info, &file_count, handshake_timeout_s);
+}
+
+/**
+ * @brief Receive all files of a YMODEM batch
+ */
+int ymodem_receive_files(ymodem_context_t* ctx,
+                        ymodem_file_done_func on_file,
+                        size_t* file_count,
+                        int handshake_timeout_s)
+{
+    size_t count = 0;
+    int ret;
+    
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ret = _ymodem_receive_batch(ctx, on_file, NULL, &count, handshake_timeout_s);
+    if (file_count != NULL) {
+        *file_count = count;
+    }
+    return ret;
+}
+
+/**
+ * @brief Receive files until the NULL filename packet
+ * 
+ * @param ctx YMODEM context
+ * @param on_file Optional, called after every complete file
+ * @param first_info Optional, returns the info of the first file
+ * @param file_count Returns the number of complete files
+ * @param handshake_timeout_s Handshake timeout in seconds
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+static int _ymodem_receive_batch(ymodem_context_t* ctx,
+                                ymodem_file_done_func on_file,
+                                ymodem_file_info_t* first_info,
+                                size_t* file_count,
+                                int handshake_timeout_s)
+{
+    ymodem_file_info_t file_info;
+    int ret;
+    
+    ymodem_stats_reset(ctx);
+    
+    /* Start handshake, packet 0 of the first file ends up in ctx->buffer */
     ret = _ymodem_do_handshake(ctx, handshake_timeout_s);
     if (ret != YMODEM_ERR_NONE) {
+        ymodem_set_stage(ctx, ctx->stage);
         return ret;
     }
     
+    /* Every file is followed by another packet 0, the session ends on an empty one */
+    while (ctx->buffer[3] != 0) {
+        /* Without batch support the session ends after the first file, the rest is refused */
+        if (!YMODEM_BATCH_ENABLE && *file_count > 0) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Refusing '%.*s', one file per session",
+                         YMODEM_SOH_DATA_SIZE, (const char*)ctx->buffer + 3);
+            ymodem_send_cancel(ctx);
+            ymodem_set_stage(ctx, YMODEM_STAGE_FINISHED);
+            return YMODEM_ERR_NONE;
+        }
+        
+        ret = _ymodem_receive_one_file(ctx, &file_info);
+        if (ret != YMODEM_ERR_NONE) {
+            ymodem_set_stage(ctx, ctx->stage);
+            return ret;
+        }
+        
+        if (*file_count == 0 && first_info != NULL) {
+            *first_info = file_info;
+        }
+        (*file_count)++;
+        
+        if (on_file != NULL && on_file(ctx->callbacks.user, &file_info) != 0) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Batch stopped after '%s'", file_info.filename);
+            ymodem_send_cancel(ctx);
+            ymodem_set_stage(ctx, ctx->stage);
+            return YMODEM_ERR_CAN;
+        }
+    }
+    
+    /* ACK the NULL filename packet */
+    ymodem_set_stage(ctx, YMODEM_STAGE_FINISHED);
+    if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
+        return YMODEM_ERR_CODE;
+    }
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received NULL filename packet, transfer complete (%zu files)", *file_count);
+    
+    /* A batch that carried no file at all is not a successful receive */
+    return (*file_count > 0) ? YMODEM_ERR_NONE : YMODEM_ERR_FILE;
+}
+
+/**
+ * @brief Receive one file whose packet 0 is in ctx->buffer
+ * 
+ * Packet 0 is ACKed once the file is open. On success the packet 0 that
+ * followed the EOT sequence (next file or end of batch) is left in ctx->buffer.
+ */
+static int _ymodem_receive_one_file(ymodem_context_t* ctx, ymodem_file_info_t* file_info)
+{
+    int ret;
+    bool acked = false;
+    
     /* Parse file info from packet 0 */
-    ret = _ymodem_parse_file_info(ctx, file_info);
+    ret = ymodem_parse_file_info(ctx, file_info);
     if (ret != YMODEM_ERR_NONE) {
         return ret;
     }
     
+    ctx->file_handle = NULL;
+    ctx->file_offset = 0;
+#if YMODEM_RESUME_ENABLE
+    ctx->committed = 0;
+    ctx->committed_crc = 0;
+    ctx->journal_mark = 0;
+#endif
+#if YMODEM_DELTA_ENABLE
+    ctx->delta = false;
+    ctx->delta_blocks = 0;
+#endif
+    
+    /* The smaller of the offered and the accepted block size, both are one of the two defined */
+    ctx->block_size = 0;
+    if (ctx->block_max > 0 && ctx->peer_block > 0) {
+        ctx->block_size = (ctx->peer_block < ctx->block_max) ? ctx->peer_block : ctx->block_max;
+    }
+    
+#if YMODEM_LZ_ENABLE
+    /* Compressed data if offered with a window that fits ours, a new stream for every file */
+    ctx->lz = (ctx->lz_decoder != NULL && ctx->file_size > 0 && ymodem_lz_decoder_reset(ctx->lz_decoder, ctx->peer_lz));
+    if (ctx->lz) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Accepting compressed data for %s", file_info->filename);
+    }
+#endif
+#if YMODEM_DIGEST_ENABLE
+    /* Any digest we know, started before a kept part is read back into it */
+    ctx->verify = (ctx->digest != NULL && ctx->peer_digest != YMODEM_DIGEST_NONE && ctx->file_size >= 0);
+    if (ctx->verify) {
+        ymodem_digest_init(ctx->digest, (enum ymodem_digest_type)ctx->peer_digest);
+    }
+#endif
+    
+#if YMODEM_RESUME_ENABLE
+    /* Continue an interrupted transfer of the same file if the sender agrees */
+    if (_ymodem_journaling(ctx) && _ymodem_resume_open(ctx)) {
+        ret = _ymodem_resume_request(ctx);
+        if (ret != YMODEM_ERR_NONE && ret != YMODEM_ERR_ACK) {
+            ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
+            ctx->file_handle = NULL;
+            return ret;
+        }
+        acked = true;
+        
+        if (ret == YMODEM_ERR_ACK) {
+            /* Declined, start over */
+            ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
+            ctx->file_handle = NULL;
+            ctx->file_offset = 0;
+            ctx->committed = 0;
+            ctx->committed_crc = 0;
+            ctx->journal_mark = 0;
+        }
+    }
+#if YMODEM_DIGEST_ENABLE
+    /* Nothing kept after all, whatever was read back is not part of the file */
+    if (ctx->verify && ctx->file_offset == 0) {
+        ymodem_digest_init(ctx->digest, ctx->digest->type);
+    }
+#endif
+#endif
+    
+#if YMODEM_DELTA_ENABLE
+    /* Otherwise update an older copy in place, the sender skips what is unchanged */
+    if (!acked && _ymodem_delta_open(ctx)) {
+        ret = _ymodem_delta_request(ctx);
+        if (ret != YMODEM_ERR_NONE) {
+            if (ret != YMODEM_ERR_CAN) {
+                ymodem_send_cancel(ctx);
+            }
+            ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
+            ctx->file_handle = NULL;
+            return ret;
+        }
+        acked = true;
+        
+        /* Skip frames count file bytes, only plain packets line up with them */
+        ctx->delta = true;
+        ctx->block_size = 0;
+#if YMODEM_LZ_ENABLE
+        ctx->lz = false;
+#endif
+    }
+#endif
+    file_info->resumed = ctx->file_offset;
+    
     /* Open file for writing */
-    ctx->file_handle = ctx->callbacks.file_open(file_info->filename, true);
     if (ctx->file_handle == NULL) {
+        ctx->file_handle = ctx->callbacks.file_open(ctx->callbacks.user, file_info->filename, YMODEM_OPEN_WRITE);
+    }
+    if (ctx->file_handle == NULL) {
+        if (acked) {
+            ymodem_send_cancel(ctx);
+        }
+        return YMODEM_ERR_FILE;
+    }
+    
+    /* 让存储端按packet 0中的文件大小预先分配空间（例如预先映射的文件） */
+    if (ctx->callbacks.file_reserve != NULL && ctx->file_size > 0 &&
+        ctx->callbacks.file_reserve(ctx->callbacks.user, ctx->file_handle, (uint64_t)ctx->file_size) != 0) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Cannot reserve %lld bytes for %s", (long long)ctx->file_size, file_info->filename);
+        if (acked) {
+            ymodem_send_cancel(ctx);
+        }
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
+        ctx->file_handle = NULL;
         return YMODEM_ERR_FILE;
     }
     
+    /* ACK packet 0 (unless the resume request did) and send another 'C' ('G') to start data transfer */
+    if (!_ymodem_send_data_start(ctx, !acked)) {
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
+        ctx->file_handle = NULL;
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_WRITE_BEHIND_ENABLE
+    ctx->wb_fill = 0;
+#endif
+    
     /* Receive file data */
     ret = _ymodem_do_trans(ctx);
     if (ret != YMODEM_ERR_NONE) {
-        ctx->callbacks.file_close(ctx->file_handle);
+        /* Keep what was received intact, and remember how far we got */
+        _ymodem_flush(ctx, true);
+#if YMODEM_RESUME_ENABLE
+        if (_ymodem_journaling(ctx)) {
+            /* A file that failed its digest is not worth continuing */
+            if (ret == YMODEM_ERR_SUM) {
+                _ymodem_journal_save(ctx, 0, 0);
+            } else {
+                _ymodem_journal_save(ctx, ctx->committed, ctx->committed_crc);
+            }
+        }
+#endif
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
         ctx->file_handle = NULL;
         return ret;
     }
     
+#if YMODEM_DIGEST_ENABLE
+    /* The data is verified, no second read of the file is needed */
+    if (ctx->verify) {
+        file_info->verified = ctx->digest->type;
+        memcpy(file_info->digest, ctx->digest->value, sizeof(file_info->digest));
+    }
+#endif
+    
     /* Finish transmission */
     ret = _ymodem_do_fin(ctx);
+#if YMODEM_WRITE_BEHIND_ENABLE
+    if (ret != YMODEM_ERR_NONE && ctx->wb_fill > 0) {
+        _ymodem_flush(ctx, true);
+    }
+#endif
+    
+#if YMODEM_RESUME_ENABLE
+    /* A complete file leaves a journal with nothing to resume */
+    if (_ymodem_journaling(ctx)) {
+        if (ret == YMODEM_ERR_NONE) {
+            _ymodem_journal_save(ctx, 0, 0);
+        } else {
+            _ymodem_journal_save(ctx, ctx->committed, ctx->committed_crc);
+        }
+    }
+#endif
     
     /* Close file */
-    ctx->callbacks.file_close(ctx->file_handle);
+    ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
     ctx->file_handle = NULL;
     
     return ret;
@@ -114,7 +593,7 @@ void ymodem_receive_cleanup(ymodem_context_t* ctx)
     
     /* If file is still open, close it */
     if (ctx->file_handle != NULL) {
-        ctx->callbacks.file_close(ctx->file_handle);
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
         ctx->file_handle = NULL;
     }
     
@@ -124,38 +603,49 @@ void ymodem_receive_cleanup(ymodem_context_t* ctx)
 /**
  * @brief Perform YMODEM handshake
  * 
- * Send 'C' characters to initiate CRC mode transfer until a valid response is received.
+ * Send 'C' characters to initiate CRC mode transfer (or 'G' for YMODEM-G streaming)
+ * until a valid response is received.
  */
 static int _ymodem_do_handshake(ymodem_context_t* ctx, int timeout_s)
 {
-    int i;
-    enum ymodem_code code;
+    ymodem_deadline_t deadline;
+    uint32_t budget_ms = ymodem_handshake_budget_ms(ctx, timeout_s);
+    uint32_t next_poll_ms = 0;
+    uint32_t elapsed;
+    uint32_t wait;
+    int attempts = 0;
     uint8_t seq;
     size_t data_size;
     int ret;
-    YMODEM_DEBUG_PRINT("Starting handshake, sending 'C' (timeout: %d seconds)...\n", timeout_s);
-    ctx->stage = YMODEM_STAGE_ESTABLISHING;
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Starting handshake, sending '%c' every %u ms (timeout: %u ms)...",
+                 ctx->start_code, (unsigned int)ctx->handshake_interval_ms, (unsigned int)budget_ms);
+    ymodem_set_stage(ctx, YMODEM_STAGE_ESTABLISHING);
     
-    /* Send 'C' periodically until we get a response or timeout */
-    for (i = 0; i < timeout_s; i++) {
-        /* Send 'C' character to request CRC mode */
-        if (!ymodem_send_byte(ctx, YMODEM_CODE_C)) {
-            return YMODEM_ERR_CODE;
-        }
-        YMODEM_DEBUG_PRINT("Sent 'C', waiting for response (attempt %d of %d)...\n", i+1, timeout_s);
-        /* Wait for SOH or STX */
-        ret = ymodem_receive_byte(ctx, YMODEM_HANDSHAKE_INTERVAL_MS);
-        YMODEM_DEBUG_PRINT("Received %s packet header\n", (code == YMODEM_CODE_SOH) ? "SOH" : "STX");
-        if (ret >= 0) {
-            code = ret;
-            if (code == YMODEM_CODE_SOH || code == YMODEM_CODE_STX) {
-                ctx->buffer[0] = (uint8_t)code;
-                break;
+    /* Send 'C' periodically until we get a response or the deadline passes */
+    ymodem_deadline_start(ctx, &deadline, budget_ms);
+    while ((elapsed = ymodem_deadline_elapsed(ctx, &deadline)) < budget_ms) {
+        if (elapsed >= next_poll_ms) {
+            /* Send 'C' character to request CRC mode ('G' requests streaming) */
+            if (!ymodem_send_byte(ctx, ctx->start_code)) {
+                return YMODEM_ERR_CODE;
             }
+            attempts++;
+            next_poll_ms = elapsed + ctx->handshake_interval_ms;
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Sent '%c', waiting for response (attempt %d)...", ctx->start_code, attempts);
+        }
+        
+        /* Wait for SOH or STX until the next 'C' is due, the first byte wakes us up */
+        wait = ((next_poll_ms < budget_ms) ? next_poll_ms : budget_ms) - elapsed;
+        ret = ymodem_receive_byte(ctx, wait);
+        ymodem_deadline_spend(&deadline, (ret < 0) ? wait : 1);
+        if (ret == YMODEM_CODE_SOH || (YMODEM_STX_ENABLE && ret == YMODEM_CODE_STX)) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Received %s packet header", ymodem_code_to_str(ret));
+            ctx->buffer[0] = (uint8_t)ret;
+            break;
         }
     }
     
-    if (i == timeout_s) {
+    if (elapsed >= budget_ms) {
         return YMODEM_ERR_TMO;
     }
     
@@ -169,329 +659,419 @@ static int _ymodem_do_handshake(ymodem_context_t* ctx, int timeout_s)
     if (seq != 0) {
         return YMODEM_ERR_SEQ;
     }
-    YMODEM_DEBUG_PRINT("Received valid file info packet (packet 0)\n");
-    /* We got packet 0, now we're established */
-    ctx->stage = YMODEM_STAGE_ESTABLISHED;
-    
-    /* ACK the packet and send another 'C' to start data transfer */
-    if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK) ||
-        !ymodem_send_byte(ctx, YMODEM_CODE_C)) {
-        return YMODEM_ERR_CODE;
-    }
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received valid file info packet (packet 0)");
+    /* We got packet 0, now we're established. It is ACKed once the file is open. */
+    ymodem_set_stage(ctx, YMODEM_STAGE_ESTABLISHED);
     
     return YMODEM_ERR_NONE;
 }
 
 /**
- * @brief Parse file information from packet 0
+ * @brief Receive a packet (sequence numbers, data and CRC)
  */
-static int _ymodem_parse_file_info(ymodem_context_t* ctx, ymodem_file_info_t* file_info)
+static int _ymodem_receive_packet(ymodem_context_t* ctx, uint8_t* seq, size_t* data_size)
 {
-    char* filename;
-    char* file_size_str;
-    size_t name_len;
-    
-    /* Packet 0 contains filename and optionally file size */
-    filename = (char*)(ctx->buffer + 3); /* Skip SOH/STX + seq + ~seq */
-    
-    /* Check if this is an empty packet (end of batch) */
-    if (filename[0] == '\0') {
-        return YMODEM_ERR_FILE;
-    }
-    
-    /* Find the end of filename */
-    name_len = 0;
-    while (filename[name_len] != '\0' && name_len < YMODEM_MAX_FILENAME_LENGTH - 1) {
-        name_len++;
-    }
+    size_t packet_size;
+    uint8_t* buf = ctx->buffer;
+    ymodem_rx_crc_t rc;
     
-    if (name_len == 0) {
-        return YMODEM_ERR_FILE;
+    /* Determine packet size based on header byte (BLK only once a block size is agreed) */
+    packet_size = ymodem_frame_size(ctx, buf[0]);
+    if (packet_size == 0) {
+        return YMODEM_ERR_CODE;
     }
+    YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Receiving %s packet (expected %zu bytes)...",
+                 ymodem_code_to_str(buf[0]), packet_size);
     
-    /* Copy filename */
-    if (name_len >= YMODEM_MAX_FILENAME_LENGTH) {
-        name_len = YMODEM_MAX_FILENAME_LENGTH - 1;
+    /* We already have the first byte, take the rest as it comes (e.g. DMA half
+     * buffers) and run the CRC (CRC32 for a large block) over every piece, so
+     * only the trailer is left to compare when the last byte lands */
+    ymodem_rx_crc_start(&rc, buf[0], packet_size);
+    size_t received = 1;
+    while (received < packet_size) {
+        size_t chunk = ymodem_receive_bytes(ctx, buf + received, packet_size - received, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+        if (chunk == 0) {
+            YMODEM_STATS_ADD(ctx, timeouts, 1);
+            return YMODEM_ERR_TMO;
+        }
+        received += chunk;
+        ymodem_rx_crc_update(&rc, buf, received);
     }
     
-    /* Copy filename to context and file_info */
-    memcpy(ctx->filename, filename, name_len);
-    ctx->filename[name_len] = '\0';
-    memcpy(file_info->filename, filename, name_len);
-    file_info->filename[name_len] = '\0';
+    /* Check sequence numbers and CRC */
+    int ret = ymodem_rx_crc_finish(&rc, buf, seq, data_size);
     
-    /* Get file size if available */
-    file_size_str = filename + name_len + 1;
-    if (file_size_str[0] != '\0') {
-        /* Convert file size string to integer */
-        ctx->file_size = 0;
-        while (*file_size_str >= '0' && *file_size_str <= '9') {
-            ctx->file_size = ctx->file_size * 10 + (*file_size_str - '0');
-            file_size_str++;
-        }
-        file_info->filesize = ctx->file_size;
-    } else {
-        /* File size not provided */
-        ctx->file_size = 0;
-        file_info->filesize = 0;
+    if (ret == YMODEM_ERR_NONE) {
+        YMODEM_STATS_ADD(ctx, packets_received, 1);
+    } else if (ret == YMODEM_ERR_CRC) {
+        YMODEM_STATS_ADD(ctx, crc_errors, 1);
+        YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "CRC check failed for packet #%d, calculated 0x%0*X",
+                     *seq, (int)rc.trailer * 2, (unsigned int)rc.crc);
+    } else if (ret == YMODEM_ERR_SEQ) {
+        YMODEM_STATS_ADD(ctx, seq_errors, 1);
     }
-    YMODEM_DEBUG_PRINT("Parsed file info: name='%s', size=%zu bytes\n", 
-                  file_info->filename, file_info->filesize);
-    return YMODEM_ERR_NONE;
+    return ret;
 }
 
 /**
- * @brief Receive a packet (sequence numbers, data and CRC)
+ * @brief Could a packet with this header be the next one, or a resend or window packet around it
  */
-static int _ymodem_receive_packet(ymodem_context_t* ctx, uint8_t* seq, size_t* data_size)
+static bool _ymodem_plausible_header(const uint8_t* header, uint8_t expected_seq)
 {
-    size_t i;
-    uint16_t received_crc, calculated_crc;
-    size_t packet_size;
-    uint8_t* buf = ctx->buffer;
-    
-    /* Determine packet size based on header byte */
-    if (buf[0] == YMODEM_CODE_SOH) {
-        packet_size = YMODEM_SOH_PACKET_SIZE;
-        *data_size = YMODEM_SOH_DATA_SIZE;
-    } else if (buf[0] == YMODEM_CODE_STX) {
-        packet_size = YMODEM_STX_PACKET_SIZE;
-        *data_size = YMODEM_STX_DATA_SIZE;
-    } else {
-        return YMODEM_ERR_CODE;
-    }
-    
-    /* We already have the first byte, receive the rest */
-    size_t received = ymodem_receive_bytes(ctx, buf+1, packet_size-1, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-    if(received != packet_size-1) {
-        return YMODEM_ERR_TMO;
-    }
-    YMODEM_DEBUG_PRINT("Receiving %s packet (expected %zu bytes)...\n", 
-                 (buf[0] == YMODEM_CODE_SOH) ? "SOH" : "STX", packet_size);
-    /* Check sequence numbers */
-    *seq = buf[1];
-    if (buf[2] != (uint8_t)(~(*seq))) {
-        return YMODEM_ERR_SEQ;
-    }
-    
-    /* Verify CRC */
-    received_crc = (uint16_t)(buf[packet_size - 2] << 8) | buf[packet_size - 1];
-    calculated_crc = ymodem_calc_crc16(buf + 3, *data_size);
-    YMODEM_DEBUG_PRINT("CRC check: received=0x%04X, calculated=0x%04X, %s\n", 
-                  received_crc, calculated_crc, 
-                  (received_crc == calculated_crc) ? "MATCH" : "MISMATCH");
-    if (received_crc != calculated_crc) {
-        return YMODEM_ERR_CRC;
+    if ((uint8_t)(header[1] ^ header[2]) != 0xFF) {
+        return false;
     }
-    
-    return YMODEM_ERR_NONE;
+    /* From the duplicate of the last packet up to a full window ahead */
+    return (uint8_t)(header[1] - expected_seq + 1) <= YMODEM_MAX_WINDOW + 1;
 }
 
 /**
- * @brief Main data transfer loop
+ * @brief Find and receive the next data packet, resynchronizing over line garbage
+ * 
+ * The bytes already received stay at the start of ctx->buffer while they are
+ * scanned, so nothing that could belong to a good packet is thrown away:
+ * - bytes that cannot start a packet are skipped instead of NAKed, once the
+ *   line has been idle for YMODEM_PURGE_TIMEOUT_MS after them the search ends
+ * - a header is taken only when seq/~seq pair up and are near expected_seq,
+ *   a damaged header costs three bytes instead of a packet time
+ * - when the CRC fails, the rest of the bytes is searched for the header of
+ *   the expected packet (the failed one was line garbage) before giving up
+ * 
+ * @param ctx YMODEM context
+ * @param expected_seq Sequence number of the next packet
+ * @param resync false to fail on the first bad byte (YMODEM-G)
+ * @param seq Returns the sequence number
+ * @param data_size Returns the data size
+ * @return int YMODEM_ERR_NONE for a packet in ctx->buffer, YMODEM_CODE_EOT,
+ *         YMODEM_ERR_TMO if nothing arrived, YMODEM_ERR_CODE if only garbage
+ *         did, or the error of a packet that could not be received
  */
-// static int _ymodem_do_trans(ymodem_context_t* ctx)
-// {
-//     int ret;
-//     enum ymodem_code code;
-//     uint8_t seq;
-//     size_t data_size;
-//     uint8_t expected_seq = 1; /* We expect packet 1 after packet 0 */
-    
-//     ctx->stage = YMODEM_STAGE_TRANSMITTING;
-//     ctx->error_count = 0;
-    
-//     while (1) {
-//         /* Wait for SOH/STX/EOT */
-//         ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//         if (ret < 0) {
-//             return YMODEM_ERR_TMO;
-//         }
+static int _ymodem_sync_packet(ymodem_context_t* ctx, uint8_t expected_seq, bool resync, uint8_t* seq, size_t* data_size)
+{
+    uint8_t* buf = ctx->buffer;
+    size_t have = 0;      /* Bytes at the start of buf not parsed yet */
+    size_t skipped = 0;   /* Garbage bytes dropped while looking for a header */
+    size_t packet_size;
+    size_t chunk;
+    size_t k;
+    ymodem_rx_crc_t rc;
+    int ret;
+    
+    while (1) {
+        /* Header byte, a quiet line after garbage ends the search */
+        if (have == 0) {
+            if (ymodem_receive_bytes(ctx, buf, 1, skipped > 0 ? YMODEM_PURGE_TIMEOUT_MS : YMODEM_WAIT_PACKET_TIMEOUT_MS) == 0) {
+                return (skipped > 0) ? YMODEM_ERR_CODE : YMODEM_ERR_TMO;
+            }
+            have = 1;
+        }
         
-//         code = ret;
-//         ctx->buffer[0] = (uint8_t)code;
+        /* An EOT right after garbage is line noise too, the sender only sends it once its last packet is ACKed */
+        if (buf[0] == YMODEM_CODE_EOT && skipped == 0 && have == 1) {
+            return YMODEM_CODE_EOT;
+        }
         
-//         /* Check for end of transmission */
-//         if (code == YMODEM_CODE_EOT) {
-//             return YMODEM_ERR_NONE;
-//         }
+        packet_size = ymodem_frame_size(ctx, buf[0]);
+        if (packet_size == 0) {
+            if (!resync) {
+                return YMODEM_ERR_CODE;
+            }
+            goto skip;
+        }
         
-//         /* Check for valid packet start */
-//         if (code != YMODEM_CODE_SOH && code != YMODEM_CODE_STX) {
-//             ctx->error_count++;
-//             if (ctx->error_count > YMODEM_MAX_ERRORS) {
-//                 return YMODEM_ERR_CODE;
-//             }
-            
-//             /* Request retransmission */
-//             if (!ymodem_send_byte(ctx, YMODEM_CODE_NAK)) {
-//                 return YMODEM_ERR_CODE;
-//             }
-//             continue;
-//         }
+        /* Sequence numbers first, they decide whether this is a header at all */
+        while (have < 3) {
+            chunk = ymodem_receive_bytes(ctx, buf + have, 3 - have, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+            if (chunk == 0) {
+                YMODEM_STATS_ADD(ctx, timeouts, 1);
+                return YMODEM_ERR_DSZ;
+            }
+            have += chunk;
+        }
+        if (!_ymodem_plausible_header(buf, expected_seq)) {
+            if (!resync) {
+                YMODEM_STATS_ADD(ctx, seq_errors, 1);
+                return YMODEM_ERR_SEQ;
+            }
+            goto skip;
+        }
         
-//         /* Receive the rest of the packet */
-//         ret = _ymodem_receive_packet(ctx, &seq, &data_size);
-//         if (ret != YMODEM_ERR_NONE) {
-//             ctx->error_count++;
-//             if (ctx->error_count > YMODEM_MAX_ERRORS) {
-//                 return ret;
-//             }
-            
-//             /* Request retransmission */
-//             if (!ymodem_send_byte(ctx, YMODEM_CODE_NAK)) {
-//                 return YMODEM_ERR_CODE;
-//             }
-//             continue;
-//         }
-//         YMODEM_DEBUG_PRINT("Received packet with sequence #%d (expected #%d)\n", 
-//                   seq, expected_seq);
-//         /* Check sequence number */
-//         if (seq != expected_seq) {
-//             ctx->error_count++;
-//             if (ctx->error_count > YMODEM_MAX_ERRORS) {
-//                 return YMODEM_ERR_SEQ; // 使用序列号错误的专用错误码
-//             }
-//             /* Out of sequence packet - possible duplicate or missed packet */
-//             if (!ymodem_send_byte(ctx, YMODEM_CODE_NAK)) {
-//                 return YMODEM_ERR_CODE;
-//             }
-//             continue;
-//         }
-
-                
-//         /* Reset error counter on successful packet */
-//         ctx->error_count = 0;
+        /* The rest as it comes, with the running CRC (see _ymodem_receive_packet()) */
+        ymodem_rx_crc_start(&rc, buf[0], packet_size);
+        ymodem_rx_crc_update(&rc, buf, have);
+        while (have < packet_size) {
+            chunk = ymodem_receive_bytes(ctx, buf + have, packet_size - have, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+            if (chunk == 0) {
+                YMODEM_STATS_ADD(ctx, timeouts, 1);
+                return YMODEM_ERR_DSZ;
+            }
+            have += chunk;
+            ymodem_rx_crc_update(&rc, buf, have);
+        }
         
-//         /* Process packet data */
-//         if (ctx->file_handle != NULL) {
-//             /* Write data to file */
-//             size_t written = ctx->callbacks.file_write(
-//                 ctx->file_handle, 
-//                 ctx->buffer + 3, /* Skip SOH/STX + seq + ~seq */
-//                 data_size
-//             );
-//             YMODEM_DEBUG_PRINT("Wrote %zu bytes to file\n", written);
-//             if (written != data_size) {
-//                 return YMODEM_ERR_FILE;
-//             }
-//         }
+        ret = ymodem_rx_crc_finish(&rc, buf, seq, data_size);
+        if (ret == YMODEM_ERR_NONE) {
+            YMODEM_STATS_ADD(ctx, packets_received, 1);
+            if (skipped > 0) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Resynchronized on packet #%d after %zu garbage bytes", *seq, skipped);
+            }
+            return YMODEM_ERR_NONE;
+        }
+        YMODEM_STATS_ADD(ctx, crc_errors, 1);
+        if (ret == YMODEM_ERR_CRC) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "CRC check failed for packet #%d, calculated 0x%0*X",
+                         *seq, (int)rc.trailer * 2, (unsigned int)rc.crc);
+        }
+        if (!resync) {
+            return ret;
+        }
         
-//         /* ACK the packet */
-//         if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
-//             return YMODEM_ERR_CODE;
-//         }
+        /* Was the header garbage in front of the real packet? */
+        for (k = 1; k + 3 <= have; k++) {
+            if (ymodem_frame_size(ctx, buf[k]) != 0 && buf[k + 1] == expected_seq &&
+                (uint8_t)(buf[k + 1] ^ buf[k + 2]) == 0xFF) {
+                break;
+            }
+        }
+        if (k + 3 > have) {
+            return ret;
+        }
+        memmove(buf, buf + k, have - k);
+        have -= k;
+        skipped += k;
+        continue;
         
-//         /* Increment sequence number for next packet */
-//         expected_seq = (expected_seq + 1) & 0xFF;
-//     }
-// }
+skip:
+        /* Drop one byte and look at the next, received or not */
+        memmove(buf, buf + 1, have - 1);
+        have--;
+        skipped++;
+    }
+}
 
+/**
+ * @brief Main data transfer loop
+ */
 static int _ymodem_do_trans(ymodem_context_t* ctx)
 {
     int ret;
-    enum ymodem_code code;
     uint8_t seq;
     size_t data_size;
     uint8_t expected_seq = 1; /* We expect packet 1 after packet 0 */
-    size_t total_received = 0; /* 累计已接收的有效字节数 */
+    uint64_t total_received = ctx->file_offset; /* 累计已接收的有效字节数（含续传前已有的部分） */
+    bool streaming = (ctx->start_code == YMODEM_CODE_G); /* YMODEM-G: no ACK, no retransmission */
+    bool nak_pending = false; /* NAK sent, waiting for the expected packet to be resent */
+#if YMODEM_DIGEST_ENABLE
+    bool summed = false; /* The SUM frame has been checked */
+#endif
     
-    ctx->stage = YMODEM_STAGE_TRANSMITTING;
+    ymodem_set_stage(ctx, YMODEM_STAGE_TRANSMITTING);
     ctx->error_count = 0;
     
     while (1) {
-        /* Wait for SOH/STX/EOT */
-        ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-        if (ret < 0) {
-            return YMODEM_ERR_TMO;
-        }
-        
-        code = ret;
-        ctx->buffer[0] = (uint8_t)code;
+        /* Next packet or EOT, skipping line garbage (YMODEM-G fails on it instead) */
+        ret = _ymodem_sync_packet(ctx, expected_seq, !streaming, &seq, &data_size);
         
         /* Check for end of transmission */
-        if (code == YMODEM_CODE_EOT) {
+        if (ret == YMODEM_CODE_EOT) {
+#if YMODEM_DELTA_ENABLE
+            /* The older copy is overwritten in place, a short file must not pass for the new one */
+            if (ctx->delta && total_received != (uint64_t)ctx->file_size) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "End of %s after %llu of %lld bytes", ctx->filename,
+                             (unsigned long long)total_received, (long long)ctx->file_size);
+                ymodem_send_cancel(ctx);
+                return YMODEM_ERR_DSZ;
+            }
+#endif
+#if YMODEM_DIGEST_ENABLE
+            /* The sender agreed to a digest, a file that ends without one is not verified */
+            if (ctx->verify && !summed) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "End of %s without its digest", ctx->filename);
+                ymodem_send_cancel(ctx);
+                return YMODEM_ERR_SUM;
+            }
+#endif
             return YMODEM_ERR_NONE;
         }
         
-        /* Check for valid packet start */
-        if (code != YMODEM_CODE_SOH && code != YMODEM_CODE_STX) {
+        if (ret == YMODEM_ERR_TMO) {
+            YMODEM_STATS_ADD(ctx, timeouts, 1);
+            if (streaming) {
+                ymodem_send_cancel(ctx);
+                return YMODEM_ERR_TMO;
+            }
             ctx->error_count++;
             if (ctx->error_count > YMODEM_MAX_ERRORS) {
-                return YMODEM_ERR_CODE;
+                return YMODEM_ERR_TMO;
             }
             
-            /* Request retransmission */
+            /* Sender may have lost our ACK/NAK, ask again */
             if (!ymodem_send_byte(ctx, YMODEM_CODE_NAK)) {
                 return YMODEM_ERR_CODE;
             }
+            YMODEM_STATS_ADD(ctx, naks, 1);
+            nak_pending = true;
             continue;
         }
         
-        /* Receive the rest of the packet */
-        ret = _ymodem_receive_packet(ctx, &seq, &data_size);
+        /* Garbage only, broken packet or packet cut short */
         if (ret != YMODEM_ERR_NONE) {
+            if (streaming) {
+                ymodem_send_cancel(ctx);
+                return ret;
+            }
             ctx->error_count++;
             if (ctx->error_count > YMODEM_MAX_ERRORS) {
                 return ret;
             }
             
-            /* Request retransmission */
-            if (!ymodem_send_byte(ctx, YMODEM_CODE_NAK)) {
+            /* Request retransmission, after garbage the line is already idle */
+            if (ret == YMODEM_ERR_CODE) {
+                if (!ymodem_send_byte(ctx, YMODEM_CODE_NAK)) {
+                    return YMODEM_ERR_CODE;
+                }
+                YMODEM_STATS_ADD(ctx, naks, 1);
+            } else if (!_ymodem_request_retransmit(ctx)) {
                 return YMODEM_ERR_CODE;
             }
+            nak_pending = true;
             continue;
         }
         
         /* Check sequence number */
         if (seq != expected_seq) {
+            if (streaming) {
+                ymodem_send_cancel(ctx);
+                return YMODEM_ERR_SEQ;
+            }
+            
+            /* Duplicate of a packet we already have (our ACK was lost), ACK it again */
+            if ((uint8_t)(expected_seq - seq) < 128) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Duplicate packet #%d (expected #%d), re-ACK", seq, expected_seq);
+                YMODEM_STATS_ADD(ctx, retries, 1);
+                if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
+                    return YMODEM_ERR_CODE;
+                }
+                continue;
+            }
+            
+            /* Packet ahead of the expected one: a pipelined sender is still
+             * draining its window after our NAK, drop it until it rewinds */
+            if (nak_pending) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Dropping packet #%d while waiting for #%d", seq, expected_seq);
+                continue;
+            }
+            
+            YMODEM_STATS_ADD(ctx, seq_errors, 1);
             ctx->error_count++;
             if (ctx->error_count > YMODEM_MAX_ERRORS) {
                 return YMODEM_ERR_SEQ;
             }
-            /* Out of sequence packet - possible duplicate or missed packet */
-            if (!ymodem_send_byte(ctx, YMODEM_CODE_NAK)) {
+            /* Missed packet - ask the sender to go back */
+            if (!_ymodem_request_retransmit(ctx)) {
                 return YMODEM_ERR_CODE;
             }
+            nak_pending = true;
             continue;
         }
                 
         /* Reset error counter on successful packet */
         ctx->error_count = 0;
+        nak_pending = false;
+        
+#if YMODEM_DIGEST_ENABLE
+        /* Digest of the sender after the last data packet, ACKed even when streaming */
+        if (ctx->buffer[0] == YMODEM_CODE_SUM) {
+            ret = _ymodem_check_sum(ctx);
+            if (ret != YMODEM_ERR_NONE) {
+                ymodem_send_cancel(ctx);
+                return ret;
+            }
+            if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
+                return YMODEM_ERR_CODE;
+            }
+            summed = true;
+            expected_seq = (expected_seq + 1) & 0xFF;
+            continue;
+        }
+#endif
+        
+        /* With write-behind the data only has to reach RAM, ACK before the file write */
+        bool acked = false;
+#if YMODEM_WRITE_BEHIND_ENABLE
+        if (ctx->wb_buffer != NULL && !streaming) {
+            if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
+                return YMODEM_ERR_CODE;
+            }
+            acked = true;
+        }
+#endif
         
         /* Process packet data */
+#if YMODEM_DELTA_ENABLE
+        if (ctx->file_handle != NULL && ctx->buffer[0] == YMODEM_CODE_SKP) {
+            uint32_t skipped;
+            
+            /* Delta mode: the copy already has these bytes */
+            ret = _ymodem_skip_data(ctx, total_received, &skipped);
+            if (ret != YMODEM_ERR_NONE) {
+                if (streaming || acked) {
+                    ymodem_send_cancel(ctx);
+                }
+                return ret;
+            }
+            total_received += skipped;
+            ymodem_stats_payload(ctx, skipped);
+        } else
+#endif
+#if YMODEM_LZ_ENABLE
+        if (ctx->file_handle != NULL && ctx->lz) {
+            size_t bytes_written;
+            
+            /* Compressed data: expanded up to the announced size, the rest of the last packet is padding */
+            ret = _ymodem_write_compressed(ctx, ctx->buffer + 3, data_size,
+                                           (uint64_t)ctx->file_size - total_received, &bytes_written);
+            if (ret != YMODEM_ERR_NONE) {
+                if (streaming || acked) {
+                    ymodem_send_cancel(ctx);
+                }
+                return ret;
+            }
+            total_received += bytes_written;
+            ymodem_stats_payload(ctx, bytes_written);
+        } else
+#endif
         if (ctx->file_handle != NULL) {
             size_t bytes_to_write = data_size;
             
             /* 只在文件大小已知，且本次写入可能超过总大小时处理 */
             if (ctx->file_size > 0) {
                 /* 检查这是否是最后一帧数据 */
-                if (total_received + data_size >= ctx->file_size) {
+                if (total_received + data_size >= (uint64_t)ctx->file_size) {
                     /* 这是最后一帧，只写入需要的字节数 */
-                    bytes_to_write = ctx->file_size - total_received;
-                    YMODEM_DEBUG_PRINT("Last packet: writing only %zu of %zu bytes\n", 
-                                      bytes_to_write, data_size);
+                    bytes_to_write = (size_t)((uint64_t)ctx->file_size - total_received);
+                    YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Last packet: writing only %zu of %zu bytes",
+                                 bytes_to_write, data_size);
                 }
             }
             
-            /* Write data to file */
-            size_t written = ctx->callbacks.file_write(
-                ctx->file_handle, 
-                ctx->buffer + 3, /* Skip SOH/STX + seq + ~seq */
-                bytes_to_write
-            );
-            
-            YMODEM_DEBUG_PRINT("Wrote %zu bytes to file\n", written);
-            if (written != bytes_to_write) {
-                return YMODEM_ERR_FILE;
+            /* Write data to file (or to the write-behind buffer) */
+            ret = _ymodem_write_data(ctx, ctx->buffer + 3, bytes_to_write); /* Skip SOH/STX + seq + ~seq */
+            if (ret != YMODEM_ERR_NONE) {
+                /* The sender already has our ACK, it must be told to stop */
+                if (streaming || acked) {
+                    ymodem_send_cancel(ctx);
+                }
+                return ret;
             }
             
             /* 更新已接收字节计数 */
-            total_received += written;
+            total_received += bytes_to_write;
+            ymodem_stats_payload(ctx, bytes_to_write);
         }
         
-        /* ACK the packet */
-        if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
+        /* ACK the packet (YMODEM-G streams without per-packet ACK) */
+        if (!streaming && !acked && !ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
             return YMODEM_ERR_CODE;
         }
         
@@ -501,81 +1081,630 @@ static int _ymodem_do_trans(ymodem_context_t* ctx)
 }
 
 /**
- * @brief Finish the YMODEM transmission
+ * @brief Write received data to the file, through the write-behind buffer if enabled
  */
-// static int _ymodem_do_fin(ymodem_context_t* ctx)
-// {
-//     int ret;
-//     uint8_t seq;
-//     size_t data_size;
-    
-//     ctx->stage = YMODEM_STAGE_FINISHING;
-//     YMODEM_DEBUG_PRINT("Received EOT, sending NAK to request final confirmation\n");
-//     /* We've already received one EOT, send NAK to request final confirmation */
-//     if (!ymodem_send_byte(ctx, YMODEM_CODE_NAK)) {
-//         return YMODEM_ERR_CODE;
-//     }
-    
-//     /* Wait for second EOT */
-//     ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//     if (ret < 0 || ret != YMODEM_CODE_EOT) {
-//         return YMODEM_ERR_CODE;
-//     }
-//     YMODEM_DEBUG_PRINT("Received second EOT, sending ACK and 'C' for NULL packet\n");
-//     /* Send ACK for the EOT */
-//     if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
-//         return YMODEM_ERR_CODE;
-//     }
-    
-//     /* Send C to request final NULL packet */
-//     if (!ymodem_send_byte(ctx, YMODEM_CODE_C)) {
-//         return YMODEM_ERR_CODE;
-//     }
-    
-//     /* Wait for final packet header */
-//     ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//     if (ret < 0) {
-//         return YMODEM_ERR_TMO;
-//     }
-    
-//     ctx->buffer[0] = (uint8_t)ret;
-    
-//     /* Check header */
-//     if (ctx->buffer[0] != YMODEM_CODE_SOH && ctx->buffer[0] != YMODEM_CODE_STX) {
-//         return YMODEM_ERR_CODE;
-//     }
-    
-//     /* Receive the rest of the packet */
-//     ret = _ymodem_receive_packet(ctx, &seq, &data_size);
-//     if (ret != YMODEM_ERR_NONE) {
-//         return ret;
-//     }
-    
-//     /* Final packet should have sequence number 0 */
-//     if (seq != 0) {
-//         return YMODEM_ERR_SEQ;
-//     }
-    
-//     /* Check if it's a NULL filename packet (end of batch) */
-//     if (ctx->buffer[3] == 0) {
-//         ctx->stage = YMODEM_STAGE_FINISHED;
+static int _ymodem_write_data(ymodem_context_t* ctx, const uint8_t* data, size_t size)
+{
+    size_t written;
+    uint32_t start_ms;
+    
+#if YMODEM_DIGEST_ENABLE
+    /* Everything that goes to the file, in file order, whatever buffers it on the way */
+    if (ctx->verify) {
+        ymodem_digest_update(ctx->digest, data, size);
+    }
+#endif
+    
+#if YMODEM_WRITE_BEHIND_ENABLE
+    if (ctx->wb_buffer != NULL) {
+        while (size > 0) {
+            size_t chunk = ctx->wb_size - ctx->wb_fill;
+            if (chunk > size) {
+                chunk = size;
+            }
+            memcpy(ctx->wb_buffer + ctx->wb_fill, data, chunk);
+            ctx->wb_fill += chunk;
+            data += chunk;
+            size -= chunk;
+            
+            /* A whole chunk is ready */
+            if (ctx->wb_fill == ctx->wb_size) {
+                int ret = _ymodem_flush(ctx, false);
+                if (ret != YMODEM_ERR_NONE) {
+                    return ret;
+                }
+            }
+        }
         
-//         /* Send final ACK */
-//         if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
-//             return YMODEM_ERR_CODE;
-//         }
+        return YMODEM_ERR_NONE;
+    }
+#endif
+    
+    start_ms = ymodem_now_ms(ctx);
+    written = ctx->callbacks.file_write(ctx->callbacks.user, ctx->file_handle, data, size);
+    YMODEM_STATS_ADD(ctx, file_ms, ymodem_now_ms(ctx) - start_ms);
+    YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Wrote %zu bytes to file", written);
+    return (written == size) ? _ymodem_commit(ctx, data, size) : YMODEM_ERR_FILE;
+}
+
+#if YMODEM_LZ_ENABLE
+/**
+ * @brief Decompress the data of a packet and write the file bytes it holds
+ * 
+ * The output is taken straight from the decompressor's window, through the
+ * write-behind buffer if enabled.
+ * 
+ * @param ctx YMODEM context
+ * @param data Packet data
+ * @param size Packet data size
+ * @param remaining File bytes still expected, decoding stops there
+ * @param written Returns the number of file bytes written
+ * @return int YMODEM_ERR_NONE on success, YMODEM_ERR_FILE if writing failed
+ */
+static int _ymodem_write_compressed(ymodem_context_t* ctx, const uint8_t* data, size_t size, uint64_t remaining, size_t* written)
+{
+    *written = 0;
+    YMODEM_STATS_ADD(ctx, lz_wire_bytes, size);
+    
+    while (remaining > 0) {
+        const uint8_t* out;
+        size_t consumed;
+        size_t produced = ymodem_lz_decode(ctx->lz_decoder, data, size, &consumed, &out);
+        int ret;
+    
+        if (produced == 0 && consumed == size) {
+            break;
+        }
+        data += consumed;
+        size -= consumed;
+        if (produced > remaining) {
+            produced = (size_t)remaining;
+        }
+    
+        ret = _ymodem_write_data(ctx, out, produced);
+        if (ret != YMODEM_ERR_NONE) {
+            return ret;
+        }
+        remaining -= produced;
+        *written += produced;
+    }
+    
+    YMODEM_STATS_ADD(ctx, lz_file_bytes, *written);
+    return YMODEM_ERR_NONE;
+}
+#endif
+
+#if YMODEM_DELTA_ENABLE
+/**
+ * @brief Move past bytes the older copy already holds (SKP frame of delta mode)
+ * 
+ * Data waiting in the write-behind buffer is written first, it belongs in
+ * front of the skipped bytes.
+ * 
+ * @param ctx YMODEM context, the SKP frame is in ctx->buffer
+ * @param offset File bytes in place so far
+ * @param skipped Returns the number of bytes skipped
+ * @return int YMODEM_ERR_NONE on success, YMODEM_ERR_DSZ past the announced size, YMODEM_ERR_FILE if the file failed
+ */
+static int _ymodem_skip_data(ymodem_context_t* ctx, uint64_t offset, uint32_t* skipped)
+{
+    const uint8_t* data = ctx->buffer + 3;
+    int ret;
+    
+    *skipped = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    if (*skipped == 0 || offset + *skipped > (uint64_t)ctx->file_size) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    ret = _ymodem_flush(ctx, false);
+    if (ret != YMODEM_ERR_NONE) {
+        return ret;
+    }
+    
+#if YMODEM_DIGEST_ENABLE
+    /* The digest covers the kept bytes as well, they are read through the packet buffer */
+    if (ctx->verify) {
+        uint64_t hashed = 0;
+        
+        while (hashed < *skipped) {
+            size_t chunk = ctx->buffer_size;
+            size_t length;
+            
+            if (chunk > *skipped - hashed) {
+                chunk = (size_t)(*skipped - hashed);
+            }
+            length = ctx->callbacks.file_read(ctx->callbacks.user, ctx->file_handle, ctx->buffer, chunk);
+            if (length == 0) {
+                return YMODEM_ERR_FILE;
+            }
+            ymodem_digest_update(ctx->digest, ctx->buffer, length);
+            hashed += length;
+        }
+    }
+#endif
+    if (ctx->callbacks.file_seek(ctx->callbacks.user, ctx->file_handle, offset + *skipped) != 0) {
+        return YMODEM_ERR_FILE;
+    }
+    
+    YMODEM_STATS_ADD(ctx, delta_skipped_bytes, *skipped);
+    YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Skipped %u unchanged bytes at offset %llu", (unsigned int)*skipped, (unsigned long long)offset);
+    return YMODEM_ERR_NONE;
+}
+#endif
+
+#if YMODEM_DIGEST_ENABLE
+/**
+ * @brief Compare the sender's digest (SUM frame) with the one of the data written
+ * 
+ * @param ctx YMODEM context, the SUM frame is in ctx->buffer
+ * @return int YMODEM_ERR_NONE if they match, YMODEM_ERR_SUM otherwise
+ */
+static int _ymodem_check_sum(ymodem_context_t* ctx)
+{
+    size_t size = ymodem_digest_final(ctx->digest);
+    
+    /* Both are padded with zeros to YMODEM_DIGEST_MAX_SIZE */
+    if (memcmp(ctx->buffer + 3, ctx->digest->value, YMODEM_DIGEST_MAX_SIZE) != 0) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "The %s digest of %s does not match the sender's",
+                     ymodem_digest_name(ctx->digest->type), ctx->filename);
+        return YMODEM_ERR_SUM;
+    }
+    
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "%s verified with a %zu byte %s digest", ctx->filename, size,
+                 ymodem_digest_name(ctx->digest->type));
+    return YMODEM_ERR_NONE;
+}
+#endif
+
+/**
+ * @brief Write out the write-behind buffer and sync as configured
+ * 
+ * @param ctx YMODEM context
+ * @param final true at the end of the file (or on error)
+ * @return int YMODEM_ERR_NONE on success, YMODEM_ERR_FILE if writing or syncing failed
+ */
+static int _ymodem_flush(ymodem_context_t* ctx, bool final)
+{
+    if (ctx->file_handle == NULL) {
+        return YMODEM_ERR_NONE;
+    }
+    
+#if YMODEM_WRITE_BEHIND_ENABLE
+    if (ctx->wb_fill > 0) {
+        uint32_t start_ms = ymodem_now_ms(ctx);
+        size_t written = ctx->callbacks.file_write(ctx->callbacks.user, ctx->file_handle, ctx->wb_buffer, ctx->wb_fill);
+        YMODEM_STATS_ADD(ctx, file_ms, ymodem_now_ms(ctx) - start_ms);
+        YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Flushed %zu of %zu buffered bytes to file", written, ctx->wb_fill);
+        if (written != ctx->wb_fill) {
+            ctx->wb_fill = 0;
+            return YMODEM_ERR_FILE;
+        }
+        ctx->wb_fill = 0;
+        
+        if (ctx->sync == YMODEM_SYNC_CHUNK && ctx->callbacks.file_sync != NULL &&
+            ctx->callbacks.file_sync(ctx->callbacks.user, ctx->file_handle) != 0) {
+            return YMODEM_ERR_FILE;
+        }
         
-//         return YMODEM_ERR_NONE;
-//     }
-    
-//     /* If not a NULL filename packet, it's start of next file */
-//     /* We don't handle multiple files in one session, so just ACK and return */
-//     if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
-//         return YMODEM_ERR_CODE;
-//     }
-//     YMODEM_DEBUG_PRINT("Received NULL filename packet, transfer complete\n");
-//     return YMODEM_ERR_NONE;
-// }
+        if (_ymodem_commit(ctx, ctx->wb_buffer, written) != YMODEM_ERR_NONE) {
+            return YMODEM_ERR_FILE;
+        }
+    }
+#endif
+    
+    if (final && ctx->sync != YMODEM_SYNC_NONE && ctx->callbacks.file_sync != NULL &&
+        ctx->callbacks.file_sync(ctx->callbacks.user, ctx->file_handle) != 0) {
+        return YMODEM_ERR_FILE;
+    }
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Account for data that reached file_write, for the resume journal
+ * 
+ * The journal is rewritten every YMODEM_RESUME_JOURNAL_INTERVAL bytes, after
+ * a file_sync so that it never claims more than the storage holds.
+ */
+static int _ymodem_commit(ymodem_context_t* ctx, const uint8_t* data, size_t size)
+{
+#if YMODEM_RESUME_ENABLE
+    if (!_ymodem_journaling(ctx)) {
+        return YMODEM_ERR_NONE;
+    }
+    
+    ctx->committed_crc = ymodem_crc32_update(ctx->committed_crc, data, size);
+    ctx->committed += size;
+    
+    if (ctx->committed - ctx->journal_mark >= YMODEM_RESUME_JOURNAL_INTERVAL) {
+        if (ctx->callbacks.file_sync != NULL &&
+            ctx->callbacks.file_sync(ctx->callbacks.user, ctx->file_handle) != 0) {
+            return YMODEM_ERR_FILE;
+        }
+        _ymodem_journal_save(ctx, ctx->committed, ctx->committed_crc);
+    }
+    
+    return YMODEM_ERR_NONE;
+#else
+    (void)ctx;
+    (void)data;
+    (void)size;
+    return YMODEM_ERR_NONE;
+#endif
+}
+
+#if YMODEM_RESUME_ENABLE
+/**
+ * @brief Whether the current file is journalled: resume is on and the sender can resume
+ */
+static bool _ymodem_journaling(const ymodem_context_t* ctx)
+{
+#if YMODEM_DELTA_ENABLE
+    return ctx->resume && ctx->peer_resume && ctx->file_size > 0 && !ctx->delta;
+#else
+    return ctx->resume && ctx->peer_resume && ctx->file_size > 0;
+#endif
+}
+
+/**
+ * @brief Build the journal name of the current file
+ */
+static void _ymodem_journal_name(const ymodem_context_t* ctx, char* name, size_t size)
+{
+    snprintf(name, size, "%s%s", ctx->filename, YMODEM_JOURNAL_SUFFIX);
+}
+
+/**
+ * @brief Write the resume journal of the current file
+ * 
+ * One line: size, mtime, committed offset and CRC32 of the committed bytes.
+ * Failing to write it only costs the ability to resume, it is not an error.
+ * 
+ * @param ctx YMODEM context
+ * @param offset Bytes of the file known to be written, 0 when there is nothing to resume
+ * @param crc CRC32 of those bytes
+ */
+static void _ymodem_journal_save(ymodem_context_t* ctx, uint64_t offset, uint32_t crc)
+{
+    char name[YMODEM_MAX_FILENAME_LENGTH + sizeof(YMODEM_JOURNAL_SUFFIX)];
+    char line[96];
+    void* journal;
+    int length;
+    
+    _ymodem_journal_name(ctx, name, sizeof(name));
+    length = snprintf(line, sizeof(line), "YMJ1 %llu %llu %llu %08lx\n",
+                      (unsigned long long)ctx->file_size,
+                      (unsigned long long)ctx->file_mtime,
+                      (unsigned long long)offset,
+                      (unsigned long)crc);
+    
+    journal = ctx->callbacks.file_open(ctx->callbacks.user, name, YMODEM_OPEN_WRITE);
+    if (journal == NULL) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Cannot write resume journal %s", name);
+        return;
+    }
+    ctx->callbacks.file_write(ctx->callbacks.user, journal, (const uint8_t*)line, (size_t)length);
+    ctx->callbacks.file_close(ctx->callbacks.user, journal);
+    ctx->journal_mark = offset;
+    YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Resume journal %s at %llu bytes", name, (unsigned long long)offset);
+}
+
+/**
+ * @brief Reopen the partial file of an interrupted transfer
+ * 
+ * The journal must describe the same file (size and mtime from packet 0) and
+ * the kept bytes must still have the journalled CRC32. On success the file
+ * is open without truncation, positioned at the end of the kept part, and
+ * ctx->file_offset tells how much of it there is.
+ * 
+ * @param ctx YMODEM context, packet 0 already parsed
+ * @return bool true if the file can be continued
+ */
+static bool _ymodem_resume_open(ymodem_context_t* ctx)
+{
+    char name[YMODEM_MAX_FILENAME_LENGTH + sizeof(YMODEM_JOURNAL_SUFFIX)];
+    char line[96];
+    unsigned long long size, mtime, offset;
+    unsigned long crc;
+    uint64_t checked = 0;
+    uint32_t checked_crc = 0;
+    void* journal;
+    size_t length;
+    
+    _ymodem_journal_name(ctx, name, sizeof(name));
+    journal = ctx->callbacks.file_open(ctx->callbacks.user, name, YMODEM_OPEN_READ);
+    if (journal == NULL) {
+        return false;
+    }
+    length = ctx->callbacks.file_read(ctx->callbacks.user, journal, (uint8_t*)line, sizeof(line) - 1);
+    ctx->callbacks.file_close(ctx->callbacks.user, journal);
+    line[length] = '\0';
+    
+    if (sscanf(line, "YMJ1 %llu %llu %llu %lx", &size, &mtime, &offset, &crc) != 4 ||
+        size != (unsigned long long)ctx->file_size || mtime != ctx->file_mtime ||
+        offset == 0 || offset >= size) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "No usable resume journal for %s", ctx->filename);
+        return false;
+    }
+    
+    ctx->file_handle = ctx->callbacks.file_open(ctx->callbacks.user, ctx->filename, YMODEM_OPEN_RESUME);
+    if (ctx->file_handle == NULL) {
+        return false;
+    }
+    
+    /* Read the kept part back, packet 0 in ctx->buffer is no longer needed */
+    while (checked < offset) {
+        size_t chunk = ctx->buffer_size;
+        if (chunk > offset - checked) {
+            chunk = (size_t)(offset - checked);
+        }
+        length = ctx->callbacks.file_read(ctx->callbacks.user, ctx->file_handle, ctx->buffer, chunk);
+        if (length == 0) {
+            break;
+        }
+        checked_crc = ymodem_crc32_update(checked_crc, ctx->buffer, length);
+#if YMODEM_DIGEST_ENABLE
+        if (ctx->verify) {
+            ymodem_digest_update(ctx->digest, ctx->buffer, length);
+        }
+#endif
+        checked += length;
+    }
+    
+    if (checked != offset || checked_crc != (uint32_t)crc ||
+        ctx->callbacks.file_seek(ctx->callbacks.user, ctx->file_handle, offset) != 0) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Kept part of %s does not match its journal, starting over", ctx->filename);
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
+        ctx->file_handle = NULL;
+        return false;
+    }
+    
+    ctx->file_offset = offset;
+    ctx->committed = offset;
+    ctx->committed_crc = checked_crc;
+    ctx->journal_mark = offset;
+    return true;
+}
+
+/**
+ * @brief ACK packet 0 and ask the sender to continue from ctx->file_offset
+ * 
+ * The request is an SOH packet with sequence number 0 carrying the offset in
+ * decimal, the sender answers ACK (continuing) or NAK (starting over).
+ * 
+ * @param ctx YMODEM context
+ * @return int YMODEM_ERR_NONE if accepted, YMODEM_ERR_ACK if declined, other errors on line failure
+ */
+static int _ymodem_resume_request(ymodem_context_t* ctx)
+{
+    int retries;
+    int ret;
+    
+    if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    memset(ctx->buffer + 3, 0, YMODEM_SOH_DATA_SIZE);
+    snprintf((char*)ctx->buffer + 3, YMODEM_SOH_DATA_SIZE, "%llu", (unsigned long long)ctx->file_offset);
+    ymodem_frame_packet(ctx->buffer, 0, YMODEM_SOH_DATA_SIZE);
+    
+    for (retries = 0; retries < YMODEM_MAX_ERRORS; retries++) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Asking to resume %s at %llu bytes", ctx->filename, (unsigned long long)ctx->file_offset);
+        if (ymodem_send_bytes(ctx, ctx->buffer, YMODEM_SOH_PACKET_SIZE) != YMODEM_SOH_PACKET_SIZE) {
+            return YMODEM_ERR_CODE;
+        }
+        
+        ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+        if (ret == YMODEM_CODE_ACK) {
+            return YMODEM_ERR_NONE;
+        }
+        if (ret == YMODEM_CODE_NAK) {
+            return YMODEM_ERR_ACK;
+        }
+        if (ret == YMODEM_CODE_CAN) {
+            return YMODEM_ERR_CAN;
+        }
+    }
+    
+    return YMODEM_ERR_TMO;
+}
+#endif
+
+#if YMODEM_DELTA_ENABLE
+/**
+ * @brief Open an older copy of the file for delta mode
+ * 
+ * Only when the sender offered YMODEM_EXT_DELTA and the copy exists. A copy
+ * longer than the new file is only used when file_reserve can cut it to
+ * the new size.
+ * 
+ * @param ctx YMODEM context, packet 0 already parsed
+ * @return bool true if the copy is open in ctx->file_handle
+ */
+static bool _ymodem_delta_open(ymodem_context_t* ctx)
+{
+    uint8_t* scratch = ctx->buffer + YMODEM_SOH_PACKET_SIZE;
+    
+    if (!ctx->delta_accept || !ctx->peer_delta || ctx->file_size <= 0) {
+        return false;
+    }
+    
+    ctx->file_handle = ctx->callbacks.file_open(ctx->callbacks.user, ctx->filename, YMODEM_OPEN_RESUME);
+    if (ctx->file_handle == NULL) {
+        return false;
+    }
+    
+    if ((ctx->callbacks.file_reserve == NULL &&
+         ctx->callbacks.file_seek(ctx->callbacks.user, ctx->file_handle, (uint64_t)ctx->file_size) == 0 &&
+         ctx->callbacks.file_read(ctx->callbacks.user, ctx->file_handle, scratch, 1) == 1) ||
+        ctx->callbacks.file_seek(ctx->callbacks.user, ctx->file_handle, 0) != 0) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Copy of %s cannot be updated in place, receiving all of it", ctx->filename);
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
+        ctx->file_handle = NULL;
+        return false;
+    }
+    
+    return true;
+}
+
+/**
+ * @brief ACK packet 0 and send the block map of the older copy
+ * 
+ * Each YMODEM_DELTA_BLOCK_SIZE block the copy holds in full, up to the new
+ * size, is hashed with CRC32. The hashes go out YMODEM_DELTA_MAP_HASHES at
+ * a time in SOH packets with sequence number 1 (see _ymodem_take_map() of
+ * the sender), each one ACKed. The blocks are read into ctx->buffer behind
+ * the packet, no other memory is needed. The copy is left at offset 0.
+ * 
+ * @param ctx YMODEM context, the copy is open
+ * @return int YMODEM_ERR_NONE once the map is through, error code otherwise
+ */
+static int _ymodem_delta_request(ymodem_context_t* ctx)
+{
+    uint8_t* data = ctx->buffer + 3;
+    uint8_t* scratch = ctx->buffer + YMODEM_SOH_PACKET_SIZE;
+    size_t scratch_size = ctx->buffer_size - YMODEM_SOH_PACKET_SIZE;
+    uint64_t blocks = (uint64_t)ctx->file_size / YMODEM_DELTA_BLOCK_SIZE;
+    bool end = false;
+    int retries;
+    int ret;
+    
+    if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    if (blocks > UINT32_MAX) {
+        blocks = UINT32_MAX;
+    }
+    while (!end && ctx->delta_blocks < blocks) {
+        uint32_t first = ctx->delta_blocks;
+        uint32_t count = 0;
+    
+        memset(data, 0, YMODEM_SOH_DATA_SIZE);
+        while (count < YMODEM_DELTA_MAP_HASHES && first + count < blocks) {
+            uint32_t crc = 0;
+            size_t have = 0;
+            uint8_t* hash = data + 8 + 4 * count;
+    
+            while (have < YMODEM_DELTA_BLOCK_SIZE) {
+                size_t chunk = YMODEM_DELTA_BLOCK_SIZE - have;
+                size_t length;
+                if (chunk > scratch_size) {
+                    chunk = scratch_size;
+                }
+                length = ctx->callbacks.file_read(ctx->callbacks.user, ctx->file_handle, scratch, chunk);
+                if (length == 0) {
+                    break;
+                }
+                crc = ymodem_crc32_update(crc, scratch, length);
+                have += length;
+            }
+            /* The copy ends here, the rest is sent in full */
+            if (have < YMODEM_DELTA_BLOCK_SIZE) {
+                end = true;
+                break;
+            }
+            hash[0] = (uint8_t)(crc >> 24);
+            hash[1] = (uint8_t)(crc >> 16);
+            hash[2] = (uint8_t)(crc >> 8);
+            hash[3] = (uint8_t)crc;
+            count++;
+        }
+        if (count == 0) {
+            break;
+        }
+    
+        data[0] = (uint8_t)(first >> 24);
+        data[1] = (uint8_t)(first >> 16);
+        data[2] = (uint8_t)(first >> 8);
+        data[3] = (uint8_t)first;
+        data[4] = (uint8_t)count;
+        ymodem_frame_packet(ctx->buffer, 1, YMODEM_SOH_DATA_SIZE);
+    
+        for (retries = 0; retries < YMODEM_MAX_ERRORS; retries++) {
+            if (ymodem_send_bytes(ctx, ctx->buffer, YMODEM_SOH_PACKET_SIZE) != YMODEM_SOH_PACKET_SIZE) {
+                return YMODEM_ERR_CODE;
+            }
+            YMODEM_STATS_ADD(ctx, packets_sent, 1);
+            ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+            if (ret == YMODEM_CODE_ACK) {
+                break;
+            }
+            if (ret == YMODEM_CODE_CAN) {
+                return YMODEM_ERR_CAN;
+            }
+        }
+        if (retries == YMODEM_MAX_ERRORS) {
+            return YMODEM_ERR_TMO;
+        }
+        ctx->delta_blocks = first + count;
+    }
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Sent the hashes of %u blocks of %s", (unsigned int)ctx->delta_blocks, ctx->filename);
+    
+    return (ctx->callbacks.file_seek(ctx->callbacks.user, ctx->file_handle, 0) == 0) ? YMODEM_ERR_NONE : YMODEM_ERR_FILE;
+}
+#endif
+
+/**
+ * @brief Purge the line and send NAK to ask for the expected packet again
+ */
+static bool _ymodem_request_retransmit(ymodem_context_t* ctx)
+{
+    ymodem_purge(ctx);
+    YMODEM_STATS_ADD(ctx, naks, 1);
+    return ymodem_send_byte(ctx, YMODEM_CODE_NAK);
+}
+
+/**
+ * @brief Send ACK followed by 'C' ('G') in a single write
+ */
+static bool _ymodem_send_ack_start(ymodem_context_t* ctx)
+{
+    uint8_t codes[2] = { YMODEM_CODE_ACK, ctx->start_code };
+    return ymodem_send_bytes(ctx, codes, sizeof(codes)) == sizeof(codes);
+}
+
+/**
+ * @brief Start the data packets of a file, accepting large blocks and compression if agreed
+ * 
+ * An agreed block size is announced as BLK and the size in KiB, accepted
+ * compression as 'Z' and an accepted digest as 'V', right before the 'C' ('G'); a sender that did not
+ * offer them never sees these codes.
+ * 
+ * @param ctx YMODEM context
+ * @param ack true to ACK packet 0 first
+ * @return bool false if the codes could not be sent
+ */
+static bool _ymodem_send_data_start(ymodem_context_t* ctx, bool ack)
+{
+    uint8_t codes[6];
+    size_t count = 0;
+    
+    if (ack) {
+        codes[count++] = YMODEM_CODE_ACK;
+    }
+    if (YMODEM_BLK_ENABLE && ctx->block_size > 0) {
+        codes[count++] = YMODEM_CODE_BLK;
+        codes[count++] = (uint8_t)(ctx->block_size / 1024);
+    }
+#if YMODEM_LZ_ENABLE
+    if (ctx->lz) {
+        codes[count++] = YMODEM_CODE_Z;
+    }
+#endif
+#if YMODEM_DIGEST_ENABLE
+    if (ctx->verify) {
+        codes[count++] = YMODEM_CODE_V;
+    }
+#endif
+    codes[count++] = ctx->start_code;
+    
+    return ymodem_send_bytes(ctx, codes, count) == count;
+}
+
+/**
+ * @brief Finish the YMODEM transmission
+ */
 static int _ymodem_do_fin(ymodem_context_t* ctx)
 {
     int ret;
@@ -583,8 +1712,8 @@ static int _ymodem_do_fin(ymodem_context_t* ctx)
     size_t data_size;
     int retries = 0;
     
-    ctx->stage = YMODEM_STAGE_FINISHING;
-    YMODEM_DEBUG_PRINT("Received EOT, sending NAK to request final confirmation\n");
+    ymodem_set_stage(ctx, YMODEM_STAGE_FINISHING);
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received EOT, sending NAK to request final confirmation");
     /* 我们已经收到一个EOT，发送NAK请求最终确认 */
     if (!ymodem_send_byte(ctx, YMODEM_CODE_NAK)) {
         return YMODEM_ERR_CODE;
@@ -605,14 +1734,16 @@ static int _ymodem_do_fin(ymodem_context_t* ctx)
         }
     }
     
-    YMODEM_DEBUG_PRINT("Received second EOT, sending ACK and 'C' for NULL packet\n");
-    /* 发送ACK确认EOT */
-    if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
-        return YMODEM_ERR_CODE;
+    /* 在确认EOT之前把缓冲的数据写入文件并同步 */
+    ret = _ymodem_flush(ctx, true);
+    if (ret != YMODEM_ERR_NONE) {
+        ymodem_send_cancel(ctx);
+        return ret;
     }
     
-    /* 发送C请求最终NULL包 */
-    if (!ymodem_send_byte(ctx, YMODEM_CODE_C)) {
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received second EOT, sending ACK and 'C' for NULL packet");
+    /* 发送ACK确认EOT，并发送C请求最终NULL包（一次写入） */
+    if (!_ymodem_send_ack_start(ctx)) {
         return YMODEM_ERR_CODE;
     }
     
@@ -627,7 +1758,7 @@ static int _ymodem_do_fin(ymodem_context_t* ctx)
         ctx->buffer[0] = (uint8_t)ret;
         
         /* 检查头部 */
-        if (ctx->buffer[0] == YMODEM_CODE_SOH || ctx->buffer[0] == YMODEM_CODE_STX) {
+        if (ctx->buffer[0] == YMODEM_CODE_SOH || (YMODEM_STX_ENABLE && ctx->buffer[0] == YMODEM_CODE_STX)) {
             /* 接收包的其余部分 */
             ret = _ymodem_receive_packet(ctx, &seq, &data_size);
             if (ret != YMODEM_ERR_NONE) {
@@ -641,34 +1772,25 @@ static int _ymodem_do_fin(ymodem_context_t* ctx)
                 continue;
             }
             
-            /* 检查是否为NULL文件名包（批处理结束） */
-            if (ctx->buffer[3] == 0) {
-                ctx->stage = YMODEM_STAGE_FINISHED;
-                
-                /* 发送最终ACK */
-                if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
-                    return YMODEM_ERR_CODE;
-                }
-                
-                YMODEM_DEBUG_PRINT("Received NULL filename packet, transfer complete\n");
-                return YMODEM_ERR_NONE;
-            }
+            /* NULL文件名包（批处理结束）或下一个文件的packet 0，留在缓冲区中由调用者处理 */
+            YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received packet 0 after EOT (%s)", ctx->buffer[3] == 0 ? "end of batch" : "next file");
+            return YMODEM_ERR_NONE;
         } else if (ctx->buffer[0] == YMODEM_CODE_EOT) {
             /* 收到额外的EOT，再次发送ACK */
             if (!ymodem_send_byte(ctx, YMODEM_CODE_ACK)) {
                 return YMODEM_ERR_CODE;
             }
-            YMODEM_DEBUG_PRINT("Received another EOT, sent ACK again\n");
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Received another EOT, sent ACK again");
             retries++;
         } else {
             retries++;
         }
     }
     
-    // 如果超过最大重试次数但通信曾经成功，则视为成功
+    // 如果超过最大重试次数但通信曾经成功，则视为成功（当作收到了NULL文件名包）
     if (ctx->file_handle != NULL) {
-        YMODEM_DEBUG_PRINT("Reached max retries but file was received, considering transfer complete\n");
-        ctx->stage = YMODEM_STAGE_FINISHED;
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Reached max retries but file was received, considering transfer complete");
+        ctx->buffer[3] = 0;
         return YMODEM_ERR_NONE;
     }
     
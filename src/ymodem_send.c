@@ -10,12 +10,37 @@
 #include <stdio.h>
 #include <string.h>
 
+#if YMODEM_SEND_ENABLE
+
 /* Forward declarations of internal functions */
 static int _ymodem_do_send_handshake(ymodem_context_t* ctx, int timeout_s);
-static int _ymodem_send_packet(ymodem_context_t* ctx, enum ymodem_code code, uint8_t seq, const uint8_t* data, size_t data_size);
-static int _ymodem_prepare_file_info_packet(ymodem_context_t* ctx, const char* filename);
+static int _ymodem_do_send_info(ymodem_context_t* ctx);
+#if YMODEM_RESUME_ENABLE || YMODEM_DELTA_ENABLE
+static bool _ymodem_offers_request(const ymodem_context_t* ctx);
+static bool _ymodem_answer_request(ymodem_context_t* ctx);
+#endif
+#if YMODEM_RESUME_ENABLE
+static bool _ymodem_answer_resume(ymodem_context_t* ctx);
+#endif
+#if YMODEM_DELTA_ENABLE
+static bool _ymodem_take_map(ymodem_context_t* ctx);
+#endif
+static int _ymodem_send_one_file(ymodem_context_t* ctx, const char* filename, bool first, int handshake_timeout_s);
+static int _ymodem_send_packet(ymodem_context_t* ctx, uint8_t seq, size_t data_size);
 static int _ymodem_do_send_trans(ymodem_context_t* ctx);
+static int _ymodem_send_acked(ymodem_context_t* ctx, const ymodem_iovec_t* iov, size_t iov_count, size_t packet_size, size_t data_length);
+static int _ymodem_send_split(ymodem_context_t* ctx, const uint8_t* data, size_t data_length);
+static int _ymodem_do_send_trans_window(ymodem_context_t* ctx);
+static void _ymodem_adapt_size(ymodem_context_t* ctx, bool clean);
+static void _ymodem_adapt_rtt(ymodem_context_t* ctx, uint32_t rtt_ms);
+static uint32_t _ymodem_adapt_rto(const ymodem_context_t* ctx);
+static size_t _ymodem_load_packet_vec(ymodem_context_t* ctx, ymodem_iovec_t* iov, size_t* iov_count, size_t* packet_size);
+#if YMODEM_DIGEST_ENABLE
+static bool _ymodem_digest_prefix(ymodem_context_t* ctx);
+static int _ymodem_send_sum(ymodem_context_t* ctx);
+#endif
 static int _ymodem_do_send_fin(ymodem_context_t* ctx);
+static int _ymodem_do_send_end(ymodem_context_t* ctx);
 
 /**
  * @brief Initialize YMODEM context for sending
@@ -24,24 +49,26 @@ int ymodem_send_init(ymodem_context_t* ctx,
                     const ymodem_callbacks_t* callbacks,
                     uint8_t* buffer,
                     size_t buffer_size,
-                    uint8_t* send_buffer,
-                    size_t send_buffer_size)
+                    enum ymodem_mode mode)
 {
-    if (ctx == NULL || callbacks == NULL || buffer == NULL || send_buffer == NULL) {
+    if (ctx == NULL || callbacks == NULL || buffer == NULL) {
         return YMODEM_ERR_CODE;
     }
     
-    if (buffer_size < YMODEM_MAX_PACKET_SIZE || send_buffer_size < YMODEM_MAX_PACKET_SIZE) {
+    if (buffer_size < YMODEM_MAX_PACKET_SIZE) {
         return YMODEM_ERR_DSZ;
     }
     
+    if (mode != YMODEM_MODE_CRC && mode != YMODEM_MODE_G) {
+        return YMODEM_ERR_CODE;
+    }
+    
     /* Check required callbacks */
     if (callbacks->comm_send == NULL || 
         callbacks->comm_receive == NULL || 
         callbacks->file_open == NULL || 
         callbacks->file_read == NULL || 
-        callbacks->file_close == NULL || 
-        callbacks->file_size == NULL) {
+        callbacks->file_close == NULL) {
         return YMODEM_ERR_CODE;
     }
     
@@ -49,41 +76,344 @@ int ymodem_send_init(ymodem_context_t* ctx,
     ctx->callbacks = *callbacks;
     ctx->buffer = buffer;
     ctx->buffer_size = buffer_size;
-    ctx->send_buffer = send_buffer;
-    ctx->send_buffer_size = send_buffer_size;
     ctx->stage = YMODEM_STAGE_NONE;
     ctx->file_handle = NULL;
     ctx->file_size = 0;
     ctx->packet_seq = 0;
     ctx->error_count = 0;
     ctx->filename[0] = '\0';
+    ctx->mode = mode;
+    ctx->start_code = YMODEM_CODE_C;
+    ctx->window_buffer = NULL;
+    ctx->window_count = 0;
+    ctx->file_mtime = 0;
+    ctx->file_mode = 0;
+    ctx->file_offset = 0;
+    ctx->packet_data_size = YMODEM_MAX_DATA_SIZE;
+    ctx->adaptive = false;
+    ctx->srtt_ms = 0;
+    ctx->rttvar_ms = 0;
+    ctx->rto_ms = YMODEM_WAIT_PACKET_TIMEOUT_MS;
+    ctx->clean_packets = 0;
+    ctx->block_max = 0;
+    ctx->block_size = 0;
+    ctx->peer_block = 0;
+#if YMODEM_RESUME_ENABLE
+    ctx->resume = false;
+#endif
+#if YMODEM_LZ_ENABLE
+    ctx->lz_encoder = NULL;
+    ctx->lz_decoder = NULL;
+    ctx->peer_lz = 0;
+    ctx->lz = false;
+#endif
+#if YMODEM_DELTA_ENABLE
+    ctx->delta_map = NULL;
+    ctx->delta_map_size = 0;
+    ctx->delta_blocks = 0;
+    ctx->delta_offset = 0;
+    ctx->delta_accept = false;
+    ctx->peer_delta = false;
+    ctx->delta = false;
+#endif
+#if YMODEM_DIGEST_ENABLE
+    ctx->digest = NULL;
+    ctx->peer_digest = YMODEM_DIGEST_NONE;
+    ctx->verify = false;
+#endif
+#if YMODEM_STATS_ENABLE
+    ctx->progress = NULL;
+    ctx->progress_interval_ms = 0;
+#endif
+    ctx->handshake_interval_ms = YMODEM_HANDSHAKE_INTERVAL_MS;
+    ctx->handshake_timeout_ms = 0;
+    ctx->peer_waiting = false;
+#if YMODEM_TRACE_LEVEL > YMODEM_TRACE_NONE
+    ctx->trace = NULL;
+    ctx->trace_user = NULL;
+    ctx->trace_level = YMODEM_TRACE_DEFAULT;
+#endif
+    ctx->now_ms = 0;
+    ymodem_stats_reset(ctx);
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Offer receivers to continue interrupted files
+ */
+int ymodem_send_set_resume(ymodem_context_t* ctx, bool enable)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_RESUME_ENABLE
+    /* The file is read from the offset the receiver asks for */
+    if (enable && ctx->callbacks.file_seek == NULL) {
+        return YMODEM_ERR_FILE;
+    }
+    
+    ctx->resume = enable;
+    
+    return YMODEM_ERR_NONE;
+#else
+    return enable ? YMODEM_ERR_CODE : YMODEM_ERR_NONE;
+#endif
+}
+
+/**
+ * @brief Adapt packet size and retransmit timeout to the link
+ */
+int ymodem_send_set_adaptive(ymodem_context_t* ctx, bool enable)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ctx->adaptive = enable;
+    ctx->packet_data_size = YMODEM_MAX_DATA_SIZE;
+    ctx->srtt_ms = 0;
+    ctx->rttvar_ms = 0;
+    ctx->rto_ms = YMODEM_WAIT_PACKET_TIMEOUT_MS;
+    ctx->clean_packets = 0;
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Enable pipelined (sliding window) sending
+ */
+int ymodem_send_set_window(ymodem_context_t* ctx,
+                          uint8_t* window_buffer,
+                          size_t window_buffer_size,
+                          uint8_t window_count)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    /* A window of one packet is plain stop-and-wait */
+    if (window_buffer == NULL || window_count <= 1) {
+        ctx->window_buffer = NULL;
+        ctx->window_count = 0;
+        return YMODEM_ERR_NONE;
+    }
+    
+    if (window_count > YMODEM_MAX_WINDOW ||
+        window_buffer_size < (size_t)window_count * YMODEM_MAX_PACKET_SIZE) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    ctx->window_buffer = window_buffer;
+    ctx->window_count = window_count;
     
     return YMODEM_ERR_NONE;
 }
 
+/**
+ * @brief Offer large blocks to the receiver
+ */
+int ymodem_send_set_large_blocks(ymodem_context_t* ctx, size_t block_size)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    if (block_size != 0 && (!YMODEM_BLK_ENABLE ||
+                            (block_size != YMODEM_BLK8K_DATA_SIZE && block_size != YMODEM_BLK32K_DATA_SIZE))) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    /* Blocks are built in the packet buffer */
+    if (block_size != 0 && ctx->buffer_size < YMODEM_BLK_PACKET_SIZE(block_size)) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    ctx->block_max = block_size;
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Offer compressed data to the receiver
+ */
+int ymodem_send_set_compression(ymodem_context_t* ctx, ymodem_lz_encoder_t* encoder)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_LZ_ENABLE
+    ctx->lz_encoder = encoder;
+    
+    return YMODEM_ERR_NONE;
+#else
+    return (encoder != NULL) ? YMODEM_ERR_CODE : YMODEM_ERR_NONE;
+#endif
+}
+
+/**
+ * @brief Offer to skip the blocks the receiver already has
+ */
+int ymodem_send_set_delta(ymodem_context_t* ctx, uint32_t* map, size_t map_size)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_DELTA_ENABLE
+    if (map == NULL || map_size == 0) {
+        ctx->delta_map = NULL;
+        ctx->delta_map_size = 0;
+        return YMODEM_ERR_NONE;
+    }
+    
+    /* Blocks are compared in the packet data area, a whole one at a time */
+    if (!YMODEM_STX_ENABLE) {
+        return YMODEM_ERR_DSZ;
+    }
+    
+    /* After a run of skipped blocks the file goes back to the first one that differs */
+    if (ctx->callbacks.file_seek == NULL) {
+        return YMODEM_ERR_FILE;
+    }
+    
+    ctx->delta_map = map;
+    ctx->delta_map_size = map_size;
+    
+    return YMODEM_ERR_NONE;
+#else
+    return (map != NULL && map_size > 0) ? YMODEM_ERR_CODE : YMODEM_ERR_NONE;
+#endif
+}
+
+/**
+ * @brief Offer a whole-file digest to the receiver
+ */
+int ymodem_send_set_digest(ymodem_context_t* ctx, ymodem_digest_t* digest, enum ymodem_digest_type type)
+{
+    if (ctx == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_DIGEST_ENABLE
+    if (digest == NULL || type == YMODEM_DIGEST_NONE) {
+        ctx->digest = NULL;
+        return YMODEM_ERR_NONE;
+    }
+    
+    if (ymodem_digest_size(type) == 0) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    /* The type is kept in the state, it is started again for every file */
+    ymodem_digest_init(digest, type);
+    ctx->digest = digest;
+    
+    return YMODEM_ERR_NONE;
+#else
+    return (digest != NULL && type != YMODEM_DIGEST_NONE) ? YMODEM_ERR_CODE : YMODEM_ERR_NONE;
+#endif
+}
+
 /**
  * @brief Send a file via YMODEM protocol
  */
 int ymodem_send_file(ymodem_context_t* ctx, 
                     const char* filename,
                     int handshake_timeout_s)
+{
+    return ymodem_send_files(ctx, &filename, 1, handshake_timeout_s);
+}
+
+/**
+ * @brief Send several files in one YMODEM batch
+ */
+int ymodem_send_files(ymodem_context_t* ctx,
+                     const char* const* filenames,
+                     size_t file_count,
+                     int handshake_timeout_s)
 {
     int ret;
+    size_t i;
     
-    if (ctx == NULL || filename == NULL) {
+    if (ctx == NULL || filenames == NULL || file_count == 0) {
         return YMODEM_ERR_CODE;
     }
     
+    /* Without batch support a session carries one file */
+    if (!YMODEM_BATCH_ENABLE && file_count > 1) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    for (i = 0; i < file_count; i++) {
+        if (filenames[i] == NULL) {
+            return YMODEM_ERR_CODE;
+        }
+    }
+    
+    ymodem_stats_reset(ctx);
+    
+    for (i = 0; i < file_count; i++) {
+        ret = _ymodem_send_one_file(ctx, filenames[i], i == 0, handshake_timeout_s);
+        if (ret != YMODEM_ERR_NONE) {
+            /* The receiver is already waiting for the next packet 0 */
+            if (i > 0 && ret == YMODEM_ERR_FILE) {
+                ymodem_send_cancel(ctx);
+            }
+            ymodem_set_stage(ctx, ctx->stage);
+            return ret;
+        }
+    }
+    
+    /* Only the NULL filename packet ends the session */
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Sending NULL filename packet to indicate end of batch");
+    ret = _ymodem_do_send_end(ctx);
+    if (ret == YMODEM_ERR_NONE) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Transmission successfully completed");
+    }
+    ymodem_set_stage(ctx, ctx->stage);
+    return ret;
+}
+
+/**
+ * @brief Send one file of a batch, up to and including its EOT sequence
+ * 
+ * @param ctx YMODEM context
+ * @param filename Full path to the file to send
+ * @param first The first file waits for the receiver's 'C', later files follow
+ *              the 'C' that ended the previous file's EOT sequence
+ * @param handshake_timeout_s Timeout for the first handshake in seconds
+ * @return int YMODEM_ERR_NONE on success, error code otherwise
+ */
+static int _ymodem_send_one_file(ymodem_context_t* ctx, const char* filename, bool first, int handshake_timeout_s)
+{
+    int ret;
+    
     /* Open file for reading */
-    ctx->file_handle = ctx->callbacks.file_open(filename, false);
+    ctx->file_handle = ctx->callbacks.file_open(ctx->callbacks.user, filename, YMODEM_OPEN_READ);
     if (ctx->file_handle == NULL) {
         return YMODEM_ERR_FILE;
     }
     
-    /* Get file size */
-    ctx->file_size = ctx->callbacks.file_size(ctx->file_handle);
-    if (ctx->file_size < 0) {
-        ctx->callbacks.file_close(ctx->file_handle);
+    /* Modification time and mode go into packet 0 when the platform has them */
+    ctx->file_mtime = 0;
+    ctx->file_mode = 0;
+    ctx->file_offset = 0;
+    if (ctx->callbacks.file_stat != NULL &&
+        ctx->callbacks.file_stat(ctx->callbacks.user, ctx->file_handle, &ctx->file_mtime, &ctx->file_mode) != 0) {
+        ctx->file_mtime = 0;
+        ctx->file_mode = 0;
+    }
+    
+    /* Get file size, a source without one is streamed until it ends */
+    ctx->file_size = YMODEM_FILE_SIZE_UNKNOWN;
+    if (ctx->callbacks.file_size != NULL) {
+        ctx->file_size = ctx->callbacks.file_size(ctx->callbacks.user, ctx->file_handle);
+    }
+    if (ctx->file_size < 0 && ctx->file_size != YMODEM_FILE_SIZE_UNKNOWN) {
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
         ctx->file_handle = NULL;
         return YMODEM_ERR_FILE;
     }
@@ -93,31 +423,42 @@ int ymodem_send_file(ymodem_context_t* ctx,
     strncpy(ctx->filename, basename, YMODEM_MAX_FILENAME_LENGTH - 1);
     ctx->filename[YMODEM_MAX_FILENAME_LENGTH - 1] = '\0';
     
-    /* Start handshake */
-    ret = _ymodem_do_send_handshake(ctx, handshake_timeout_s);
+    /* Start handshake (first file) or go straight to packet 0 */
+    ret = first ? _ymodem_do_send_handshake(ctx, handshake_timeout_s) : _ymodem_do_send_info(ctx);
     if (ret != YMODEM_ERR_NONE) {
-        ctx->callbacks.file_close(ctx->file_handle);
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
         ctx->file_handle = NULL;
         return ret;
     }
-
-    YMODEM_DEBUG_PRINT("Handshake completed, starting file transfer\n"); 
+    
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Handshake completed, starting file transfer"); 
     /* Send file data */
     ret = _ymodem_do_send_trans(ctx);
     if (ret != YMODEM_ERR_NONE) {
-        ctx->callbacks.file_close(ctx->file_handle);
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
         ctx->file_handle = NULL;
         return ret;
     }
-    YMODEM_DEBUG_PRINT("Starting transmission finish sequence\n");
     
-    /* Finish transmission */
+#if YMODEM_DIGEST_ENABLE
+    /* The digest of everything read goes out after the last data packet */
+    if (ctx->verify) {
+        ret = _ymodem_send_sum(ctx);
+        if (ret != YMODEM_ERR_NONE) {
+            ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
+            ctx->file_handle = NULL;
+            return ret;
+        }
+    }
+#endif
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Starting transmission finish sequence");
+    
+    /* Finish this file */
     ret = _ymodem_do_send_fin(ctx);
     
     /* Close file */
-    ctx->callbacks.file_close(ctx->file_handle);
+    ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
     ctx->file_handle = NULL;
-    YMODEM_DEBUG_PRINT("Transmission successfully completed\n");
     return ret;
 }
 
@@ -132,7 +473,7 @@ void ymodem_send_cleanup(ymodem_context_t* ctx)
     
     /* If file is still open, close it */
     if (ctx->file_handle != NULL) {
-        ctx->callbacks.file_close(ctx->file_handle);
+        ctx->callbacks.file_close(ctx->callbacks.user, ctx->file_handle);
         ctx->file_handle = NULL;
     }
     
@@ -142,108 +483,143 @@ void ymodem_send_cleanup(ymodem_context_t* ctx)
 /**
  * @brief Perform YMODEM sender handshake
  * 
- * Wait for 'C' character and send file info packet.
- */
-// static int _ymodem_do_send_handshake(ymodem_context_t* ctx, int timeout_s)
-// {
-//     int i;
-//     int ret;
-//     YMODEM_DEBUG_PRINT("Starting handshake, waiting for 'C' (timeout: %d seconds)...\n", timeout_s);
-//     ctx->stage = YMODEM_STAGE_ESTABLISHING;
-    
-//     /* Wait for 'C' character to start transfer */
-//     for (i = 0; i < timeout_s; i++) {
-//         ret = ymodem_receive_byte(ctx, YMODEM_HANDSHAKE_INTERVAL_MS);
-//         if (ret == YMODEM_CODE_C) {
-//             YMODEM_DEBUG_PRINT("Received 'C', sending file info packet for '%s'...\n", ctx->filename);
-//             break;
-//         }
-//     }
-    
-//     if (i == timeout_s) {
-//         return YMODEM_ERR_TMO;
-//     }
-    
-//     /* Prepare and send file info packet (packet 0) */
-//     ret = _ymodem_prepare_file_info_packet(ctx, ctx->filename);
-//     if (ret != YMODEM_ERR_NONE) {
-//         return ret;
-//     }
-    
-//     /* Send the file info packet */
-//     ret = _ymodem_send_packet(ctx, YMODEM_CODE_SOH, 0, ctx->buffer + 3, YMODEM_SOH_DATA_SIZE);
-//     if (ret != YMODEM_ERR_NONE) {
-//         return ret;
-//     }
-//     YMODEM_DEBUG_PRINT("File info packet sent, file size: %d bytes\n", ctx->file_size);
-    
-//     /* Wait for ACK */
-//     ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//     if (ret != YMODEM_CODE_ACK) {
-//         return YMODEM_ERR_ACK;
-//     }
-//     YMODEM_DEBUG_PRINT("File info ACKed, waiting for second 'C'...\n");
-    
-//     /* Wait for 'C' */
-//     ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//     if (ret != YMODEM_CODE_C) {
-//         return YMODEM_ERR_ACK;
-//     }
-    
-//     ctx->stage = YMODEM_STAGE_ESTABLISHED;
-//     ctx->packet_seq = 1; /* Start with packet 1 for actual data */
-    
-//     return YMODEM_ERR_NONE;
-// }
+ * Wait for 'C' character (or 'G' when YMODEM-G is enabled) and send file info packet.
+ */
 static int _ymodem_do_send_handshake(ymodem_context_t* ctx, int timeout_s)
 {
-    int i;
+    ymodem_deadline_t deadline;
+    uint32_t budget_ms = ymodem_handshake_budget_ms(ctx, timeout_s);
+    uint32_t elapsed;
     int ret;
-    YMODEM_DEBUG_PRINT("Starting handshake, waiting for 'C' (timeout: %d seconds)...\n", timeout_s);
-    ctx->stage = YMODEM_STAGE_ESTABLISHING;
-    
-    /* Wait for 'C' character to start transfer */
-    for (i = 0; i < timeout_s; i++) {
-        ret = ymodem_receive_byte(ctx, YMODEM_HANDSHAKE_INTERVAL_MS);
-        if (ret == YMODEM_CODE_C) {
-            YMODEM_DEBUG_PRINT("Received 'C', sending file info packet for '%s'...\n", ctx->filename);
-            break;
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Starting handshake, waiting for 'C' (timeout: %u ms)...", (unsigned int)budget_ms);
+    ymodem_set_stage(ctx, YMODEM_STAGE_ESTABLISHING);
+    
+    /* The receiver is known to be polling: take what it already sent and start at once */
+    if (ctx->peer_waiting) {
+        ctx->start_code = YMODEM_CODE_C;
+        while ((ret = ymodem_receive_byte(ctx, 0)) >= 0) {
+            if (ret == YMODEM_CODE_G && ctx->mode == YMODEM_MODE_G) {
+                ctx->start_code = YMODEM_CODE_G;
+            }
         }
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Receiver waiting, sending file info packet for '%s' at once", ctx->filename);
+        return _ymodem_do_send_info(ctx);
     }
     
-    if (i == timeout_s) {
-        return YMODEM_ERR_TMO;
+    /* Wait for 'C' (or 'G' if streaming is allowed) to start transfer, each byte wakes us up */
+    ymodem_deadline_start(ctx, &deadline, budget_ms);
+    while ((elapsed = ymodem_deadline_elapsed(ctx, &deadline)) < budget_ms) {
+        uint32_t wait = budget_ms - elapsed;
+        ret = ymodem_receive_byte(ctx, wait);
+        ymodem_deadline_spend(&deadline, (ret < 0) ? wait : 1);
+        if (ret == YMODEM_CODE_C || (ret == YMODEM_CODE_G && ctx->mode == YMODEM_MODE_G)) {
+            ctx->start_code = (uint8_t)ret;
+            YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received '%c', sending file info packet for '%s'...", ret, ctx->filename);
+            
+            /* A receiver that polled for a while has more of them queued, they must not answer packet 0 */
+            ymodem_drain(ctx);
+            return _ymodem_do_send_info(ctx);
+        }
     }
     
+    return YMODEM_ERR_TMO;
+}
+
+/**
+ * @brief Send packet 0 for ctx->filename and wait for ACK and 'C' ('G')
+ */
+static int _ymodem_do_send_info(ymodem_context_t* ctx)
+{
+    int ret;
+    
+    /* Every file negotiates its block size, compression, delta mode and digest again */
+    ctx->block_size = 0;
+#if YMODEM_LZ_ENABLE
+    ctx->lz = false;
+#endif
+#if YMODEM_DIGEST_ENABLE
+    ctx->verify = false;
+#endif
+#if YMODEM_DELTA_ENABLE
+    ctx->delta = false;
+    ctx->delta_blocks = 0;
+#endif
+    
     /* Prepare and send file info packet (packet 0) */
-    ret = _ymodem_prepare_file_info_packet(ctx, ctx->filename);
+    ret = ymodem_prepare_file_info_packet(ctx, ctx->filename);
     if (ret != YMODEM_ERR_NONE) {
         return ret;
     }
     
     /* Send the file info packet */
-    ret = _ymodem_send_packet(ctx, YMODEM_CODE_SOH, 0, ctx->buffer + 3, YMODEM_SOH_DATA_SIZE);
+    ret = _ymodem_send_packet(ctx, 0, YMODEM_SOH_DATA_SIZE);
     if (ret != YMODEM_ERR_NONE) {
         return ret;
     }
-    YMODEM_DEBUG_PRINT("File info packet sent, file size: %d bytes\n", ctx->file_size);
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "File info packet sent, file size: %lld bytes", (long long)ctx->file_size);
     
-    /* Wait for ACK and/or C with multiple attempts - modified to be more flexible */
+    /* Wait for ACK and/or C (G) with multiple attempts - modified to be more flexible */
     bool got_ack = false;
     bool got_c = false;
-    
-    // Try to receive both ACK and C in any order, with multiple attempts
-    for (i = 0; i < 5; i++) {  // Try up to 5 times
-        ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+    ymodem_deadline_t deadline;
+    uint32_t budget_ms = 5 * YMODEM_WAIT_PACKET_TIMEOUT_MS;
+    uint32_t elapsed;
+    
+    // Try to receive both ACK and C in any order until the deadline, every byte wakes us up
+    ymodem_deadline_start(ctx, &deadline, budget_ms);
+    while ((elapsed = ymodem_deadline_elapsed(ctx, &deadline)) < budget_ms) {
+        uint32_t wait = budget_ms - elapsed;
+        if (wait > YMODEM_WAIT_PACKET_TIMEOUT_MS) {
+            wait = YMODEM_WAIT_PACKET_TIMEOUT_MS;
+        }
+        ret = ymodem_receive_byte(ctx, wait);
+        ymodem_deadline_spend(&deadline, (ret < 0) ? wait : 1);
         
         if (ret == YMODEM_CODE_ACK) {
-            YMODEM_DEBUG_PRINT("Received ACK for file info packet\n");
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Received ACK for file info packet");
             got_ack = true;
         } 
-        else if (ret == YMODEM_CODE_C) {
-            YMODEM_DEBUG_PRINT("Received 'C' to start data transfer\n");
+        else if (ret == ctx->start_code) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Received '%c' to start data transfer", ret);
             got_c = true;
         }
+#if YMODEM_RESUME_ENABLE || YMODEM_DELTA_ENABLE
+        else if (ret == YMODEM_CODE_SOH && got_ack && _ymodem_offers_request(ctx) && ctx->file_size >= 0) {
+            /* 接收端已有部分文件，请求从某个偏移继续，或发来已有副本的块哈希表 */
+            if (!_ymodem_answer_request(ctx)) {
+                return YMODEM_ERR_CODE;
+            }
+            /* A long map takes many packets, each one is progress */
+            ymodem_deadline_start(ctx, &deadline, budget_ms);
+            continue;
+        }
+#endif
+        else if (YMODEM_BLK_ENABLE && ret == YMODEM_CODE_BLK && got_ack && ctx->block_max > 0) {
+            /* 接收端接受大数据块，后跟以 KiB 为单位的块大小 */
+            ret = ymodem_receive_byte(ctx, YMODEM_WAIT_CHAR_TIMEOUT_MS);
+            if (ret > 0 && (size_t)ret * 1024 <= ctx->block_max &&
+                ((size_t)ret * 1024 == YMODEM_BLK8K_DATA_SIZE || (size_t)ret * 1024 == YMODEM_BLK32K_DATA_SIZE)) {
+                ctx->block_size = (size_t)ret * 1024;
+                YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Receiver accepts %zu byte blocks", ctx->block_size);
+            }
+            continue;
+        }
+#if YMODEM_LZ_ENABLE
+        else if (ret == YMODEM_CODE_Z && got_ack && ctx->lz_encoder != NULL && ctx->file_size > 0) {
+            /* 接收端接受压缩数据 */
+            ctx->lz = true;
+            YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Receiver accepts compressed data");
+            continue;
+        }
+#endif
+#if YMODEM_DIGEST_ENABLE
+        else if (ret == YMODEM_CODE_V && got_ack && ctx->digest != NULL && ctx->file_size >= 0) {
+            /* 接收端接受整个文件的摘要校验 */
+            ctx->verify = true;
+            YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Receiver checks a %s digest of the file", ymodem_digest_name(ctx->digest->type));
+            continue;
+        }
+#endif
         
         // If we've got both signals we need, we can proceed
         if (got_ack && got_c) {
@@ -255,108 +631,228 @@ static int _ymodem_do_send_handshake(ymodem_context_t* ctx, int timeout_s)
             continue;
         }
         
-        // If we got C but not ACK, we might have missed the ACK but can proceed anyway
+        // If we got C but not ACK, we might have missed the ACK but can proceed anyway,
+        // unless it was a late poll and the ACK (with the real C) is right behind it
         if (!got_ack && got_c) {
-            YMODEM_DEBUG_PRINT("Got C without ACK, assuming ACK was sent and proceeding\n");
+            if (ymodem_receive_byte(ctx, YMODEM_PURGE_TIMEOUT_MS) == YMODEM_CODE_ACK) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Late '%c' before the ACK of packet 0, ignored", ctx->start_code);
+                got_ack = true;
+                got_c = false;
+                continue;
+            }
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Got C without ACK, assuming ACK was sent and proceeding");
             got_ack = true;
             break;
         }
     }
     
     if (!got_ack || !got_c) {
-        YMODEM_DEBUG_PRINT("Handshake failed: ACK=%d, C=%d\n", got_ack, got_c);
+        YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Handshake failed: ACK=%d, C=%d", got_ack, got_c);
         return YMODEM_ERR_ACK;
     }
     
-    ctx->stage = YMODEM_STAGE_ESTABLISHED;
+    ymodem_set_stage(ctx, YMODEM_STAGE_ESTABLISHED);
     ctx->packet_seq = 1; /* Start with packet 1 for actual data */
     
+#if YMODEM_LZ_ENABLE
+    /* A new compressed stream, from the resume offset if one was agreed */
+    if (ctx->lz) {
+        ymodem_lz_encoder_reset(ctx->lz_encoder);
+    }
+#endif
+#if YMODEM_DIGEST_ENABLE
+    /* The digest covers the whole file, a resumed one is read up to the offset once more */
+    if (ctx->verify) {
+        ymodem_digest_init(ctx->digest, ctx->digest->type);
+        if (ctx->file_offset > 0 && !_ymodem_digest_prefix(ctx)) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Cannot read the first %llu bytes of %s for the digest",
+                         (unsigned long long)ctx->file_offset, ctx->filename);
+            return YMODEM_ERR_FILE;
+        }
+    }
+#endif
+#if YMODEM_DELTA_ENABLE
+    if (ctx->delta) {
+        ctx->delta_offset = 0;
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Receiver has %u blocks of %s, skipping the unchanged ones",
+                     (unsigned int)ctx->delta_blocks, ctx->filename);
+    }
+#endif
+    
+    /* Full packets of the agreed size, unless the adaptive sender is on short ones for a noisy link */
+    if (ctx->packet_data_size != YMODEM_SOH_DATA_SIZE) {
+        ctx->packet_data_size = (ctx->block_size > 0) ? ctx->block_size : YMODEM_MAX_DATA_SIZE;
+    }
+    
     return YMODEM_ERR_NONE;
 }
 
+#if YMODEM_RESUME_ENABLE || YMODEM_DELTA_ENABLE
+/**
+ * @brief Whether packet 0 offered something the receiver answers with a packet of its own
+ */
+static bool _ymodem_offers_request(const ymodem_context_t* ctx)
+{
+#if YMODEM_RESUME_ENABLE
+    if (ctx->resume) {
+        return true;
+    }
+#endif
+#if YMODEM_DELTA_ENABLE
+    if (ctx->delta_map != NULL) {
+        return true;
+    }
+#endif
+    return false;
+}
+
 /**
- * @brief Prepare file info packet (packet 0)
+ * @brief Answer a packet the receiver sent after the ACK of packet 0
+ * 
+ * Sequence number 0 is a resume request, see _ymodem_answer_resume(); 1 is
+ * a piece of the block map for delta mode, see _ymodem_take_map(). A packet
+ * that does not arrive intact is NAKed, which declines a resume request and
+ * has a map packet sent again.
+ * 
+ * @param ctx YMODEM context, the SOH byte has just been received
+ * @return bool false if the answer could not be sent
  */
-static int _ymodem_prepare_file_info_packet(ymodem_context_t* ctx, const char* filename)
+static bool _ymodem_answer_request(ymodem_context_t* ctx)
 {
-    uint8_t* data = ctx->buffer + 3; /* Skip header bytes (SOH/STX + seq + ~seq) */
-    char file_size_str[20]; /* Big enough for uint64_t as string */
-    size_t name_len;
-    size_t size_len;
+    uint8_t seq;
+    size_t data_size;
+    
+    ctx->buffer[0] = YMODEM_CODE_SOH;
+    if (ymodem_receive_bytes(ctx, ctx->buffer + 1, YMODEM_SOH_PACKET_SIZE - 1, YMODEM_WAIT_PACKET_TIMEOUT_MS) == YMODEM_SOH_PACKET_SIZE - 1 &&
+        ymodem_check_packet(ctx->buffer, &seq, &data_size) == YMODEM_ERR_NONE) {
+#if YMODEM_RESUME_ENABLE
+        if (seq == 0 && ctx->resume) {
+            return _ymodem_answer_resume(ctx);
+        }
+#endif
+#if YMODEM_DELTA_ENABLE
+        if (seq == 1 && ctx->delta_map != NULL && ctx->file_size > 0) {
+            return _ymodem_take_map(ctx);
+        }
+#endif
+    }
     
-    /* Clear the packet data area */
-    memset(data, 0, YMODEM_SOH_DATA_SIZE);
+    return ymodem_send_byte(ctx, YMODEM_CODE_NAK);
+}
+#endif
+
+#if YMODEM_RESUME_ENABLE
+/**
+ * @brief Answer a resume request that followed the ACK of packet 0
+ * 
+ * The request is an SOH packet with sequence number 0 carrying the offset in
+ * decimal. It is accepted with ACK once the file has been moved to the
+ * offset; NAK declines it and the file is sent from the start.
+ * 
+ * @param ctx YMODEM context, the intact request is in ctx->buffer
+ * @return bool false if the answer could not be sent
+ */
+static bool _ymodem_answer_resume(ymodem_context_t* ctx)
+{
+    uint64_t offset = 0;
+    const uint8_t* digit;
+    bool accept = true;
     
-    /* Add filename */
-    name_len = strlen(filename);
-    if (name_len >= YMODEM_SOH_DATA_SIZE) {
-        return YMODEM_ERR_DSZ;
+    for (digit = ctx->buffer + 3; *digit >= '0' && *digit <= '9'; digit++) {
+        if (offset > (UINT64_MAX - 9) / 10) {
+            accept = false;
+            break;
+        }
+        offset = offset * 10 + (uint64_t)(*digit - '0');
     }
     
-    memcpy(data, filename, name_len);
-    data[name_len] = '\0';
+    /* Only an offset inside the file we announced can be honoured */
+    if (accept && (offset == 0 || offset > (uint64_t)ctx->file_size ||
+                   ctx->callbacks.file_seek(ctx->callbacks.user, ctx->file_handle, offset) != 0)) {
+        accept = false;
+    }
+    YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Resume request for offset %llu %s", (unsigned long long)offset, accept ? "accepted" : "declined");
     
-    /* Add file size */
-    snprintf(file_size_str, sizeof(file_size_str), "%d", ctx->file_size);
-    size_len = strlen(file_size_str);
+    if (accept) {
+        ctx->file_offset = offset;
+    }
+    return ymodem_send_byte(ctx, accept ? YMODEM_CODE_ACK : YMODEM_CODE_NAK);
+}
+#endif
+
+#if YMODEM_DELTA_ENABLE
+/**
+ * @brief Store a piece of the receiver's block map
+ * 
+ * The data holds the index of the first block (big-endian, 4 bytes), the
+ * number of hashes (1 byte, at most YMODEM_DELTA_MAP_HASHES), three zero
+ * bytes and the big-endian CRC32 of each YMODEM_DELTA_BLOCK_SIZE block.
+ * Pieces come in order; a repeated one (our ACK was lost) is ACKed again.
+ * Hashes beyond delta_map_size are dropped, those blocks are simply sent.
+ * 
+ * @param ctx YMODEM context, the intact map packet is in ctx->buffer
+ * @return bool false if the answer could not be sent
+ */
+static bool _ymodem_take_map(ymodem_context_t* ctx)
+{
+    const uint8_t* data = ctx->buffer + 3;
+    uint32_t first = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    uint32_t count = data[4];
+    uint32_t i;
     
-    if (name_len + 1 + size_len >= YMODEM_SOH_DATA_SIZE) {
-        return YMODEM_ERR_DSZ;
+    if (count == 0 || count > YMODEM_DELTA_MAP_HASHES || (first != ctx->delta_blocks && first + count != ctx->delta_blocks)) {
+        return ymodem_send_byte(ctx, YMODEM_CODE_NAK);
     }
     
-    memcpy(data + name_len + 1, file_size_str, size_len);
+    if (first == ctx->delta_blocks) {
+        for (i = 0; i < count && first + i < ctx->delta_map_size; i++) {
+            const uint8_t* hash = data + 8 + 4 * i;
+            ctx->delta_map[first + i] = ((uint32_t)hash[0] << 24) | ((uint32_t)hash[1] << 16) | ((uint32_t)hash[2] << 8) | hash[3];
+        }
+        ctx->delta_blocks = first + count;
+        ctx->delta = true;
+    }
+    YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Block map: %u hashes from block %u", (unsigned int)count, (unsigned int)first);
     
-    return YMODEM_ERR_NONE;
+    return ymodem_send_byte(ctx, YMODEM_CODE_ACK);
 }
+#endif
 
 /**
- * @brief Send a packet (header, sequence numbers, data and CRC)
+ * @brief Send a packet built in place in ctx->buffer
+ * 
+ * The data must already be at ctx->buffer + 3, the header and CRC are filled
+ * in around it so the payload is never copied.
  * 
  * @param ctx YMODEM context
- * @param code SOH or STX depending on packet size
  * @param seq Sequence number
- * @param data Data to send
  * @param data_size Size of data (128 or 1024)
  * @return int YMODEM_ERR_NONE on success or error code
  */
-static int _ymodem_send_packet(ymodem_context_t* ctx, enum ymodem_code code, uint8_t seq, const uint8_t* data, size_t data_size) {
-    uint16_t crc;
+static int _ymodem_send_packet(ymodem_context_t* ctx, uint8_t seq, size_t data_size) {
     size_t packet_size;
     
     /* Validate parameters */
-    if (code == YMODEM_CODE_SOH && data_size != YMODEM_SOH_DATA_SIZE) {
-        return YMODEM_ERR_DSZ;
-    }
-    
-    if (code == YMODEM_CODE_STX && data_size != YMODEM_STX_DATA_SIZE) {
+    if (data_size != YMODEM_SOH_DATA_SIZE && !(YMODEM_STX_ENABLE && data_size == YMODEM_STX_DATA_SIZE)) {
         return YMODEM_ERR_DSZ;
     }
     
     /* Calculate full packet size */
     packet_size = 1 + 1 + 1 + data_size + 2; /* header + seq + ~seq + data + CRC16 */
     
-    /* Ensure our send buffer is large enough */
-    if (ctx->send_buffer_size < packet_size) {
+    /* Ensure our buffer is large enough */
+    if (ctx->buffer_size < packet_size) {
         return YMODEM_ERR_DSZ;
     }
     
-    /* Construct the packet */
-    ctx->send_buffer[0] = code;           /* SOH or STX */
-    ctx->send_buffer[1] = seq;            /* Sequence number */
-    ctx->send_buffer[2] = ~seq;           /* Complement of sequence number */
-    
-    /* Copy data */
-    memcpy(&ctx->send_buffer[3], data, data_size);
-    
-    /* Calculate and append CRC */
-    crc = ymodem_calc_crc16(&ctx->send_buffer[3], data_size);
-    ctx->send_buffer[3 + data_size] = (crc >> 8) & 0xFF;    /* High byte of CRC */
-    ctx->send_buffer[3 + data_size + 1] = crc & 0xFF;       /* Low byte of CRC */
+    /* Header and CRC around the data */
+    ymodem_frame_packet(ctx->buffer, seq, data_size);
     
     /* Send the packet */
-    if (!ymodem_send_bytes(ctx, ctx->send_buffer, packet_size)) {
+    if (!ymodem_send_bytes(ctx, ctx->buffer, packet_size)) {
         return YMODEM_ERR_CODE;
     }
+    YMODEM_STATS_ADD(ctx, packets_sent, 1);
     
     return YMODEM_ERR_NONE;
 }
@@ -364,235 +860,616 @@ static int _ymodem_send_packet(ymodem_context_t* ctx, enum ymodem_code code, uin
 
 
 /**
- * @brief Main data transfer loop
+ * @brief Get the next data packet, without copying the data when the file can be peeked
+ * 
+ * A full packet peeked from the file goes out as header, file data and CRC:
+ * the header sits in buffer[0..2], the CRC in buffer[3..4] and the data is
+ * never copied. Short packets, which need padding, files that cannot be
+ * peeked and compressed files are built in ctx->buffer by ymodem_load_packet().
+ * 
+ * @return size_t Number of file bytes in the packet, 0 at end of file
  */
-// static int _ymodem_do_send_trans(ymodem_context_t* ctx) {
-//     int ret;
-//     size_t read_size;
-//     enum ymodem_code packet_type;
-//     int retries;
+static size_t _ymodem_load_packet_vec(ymodem_context_t* ctx, ymodem_iovec_t* iov, size_t* iov_count, size_t* packet_size)
+{
+    const uint8_t* data = NULL;
+    size_t data_size = ctx->packet_data_size;
+    size_t available = 0;
+    size_t actual_read;
+    bool peek = (ctx->callbacks.file_peek != NULL);
+    
+    /* Compressed data is built by the compressor, delta mode compares whole blocks first: never peeked */
+#if YMODEM_LZ_ENABLE
+    peek = peek && !ctx->lz;
+#endif
+#if YMODEM_DELTA_ENABLE
+    peek = peek && !ctx->delta;
+#endif
+    if (peek) {
+        uint32_t start_ms = ymodem_now_ms(ctx);
+        
+        data = ctx->callbacks.file_peek(ctx->callbacks.user, ctx->file_handle, data_size, &available);
+        YMODEM_STATS_ADD(ctx, file_ms, ymodem_now_ms(ctx) - start_ms);
+    }
     
-//     ctx->stage = YMODEM_STAGE_TRANSMITTING;
-//     ctx->error_count = 0;
+#if YMODEM_DIGEST_ENABLE
+    /* Peeked data is sent once from the file's memory, or copied below, it is hashed here */
+    if (data != NULL && ctx->verify) {
+        ymodem_digest_update(ctx->digest, data, available);
+    }
+#endif
     
-//     while (1) {
-//         packet_type = YMODEM_CODE_STX;
-//         read_size = YMODEM_STX_DATA_SIZE;
-        
-//         size_t actual_read = 0;
-//         int retry_read;
-        
-//         for (retry_read = 0; retry_read < 10; retry_read++) {
-//             actual_read += ctx->callbacks.file_read(ctx->file_handle, 
-//                                                   ctx->buffer + 3 + actual_read, 
-//                                                   read_size - actual_read);
-//             if (actual_read == read_size)
-//                 break;
-//         }
-//         YMODEM_DEBUG_PRINT("Read %zu bytes from file\n", actual_read);
-        
-//         if (actual_read == 0) {
-//             break;
-//         }
-        
-//         if (actual_read < read_size) {
-//             memset(ctx->buffer + 3 + actual_read, 0x1A, read_size - actual_read);
-//             ctx->stage = YMODEM_STAGE_FINISHING;
-//         }
-        
-//         if (actual_read <= 128) {
-//             packet_type = YMODEM_CODE_SOH;
-//             read_size = YMODEM_SOH_DATA_SIZE;
-//         } else {
-//             packet_type = YMODEM_CODE_STX;
-//         }
-        
-//         retries = 0;
-//         while (retries < YMODEM_MAX_ERRORS) {
-//             ret = _ymodem_send_packet(ctx, packet_type, ctx->packet_seq, ctx->buffer + 3, read_size);
-//             if (ret != YMODEM_ERR_NONE) {
-//                 retries++;
-//                 continue;
-//             }
+    if (data != NULL && available == data_size) {
+        ctx->buffer[1] = ctx->packet_seq;
+        ctx->buffer[2] = ~ctx->packet_seq;
+        if (YMODEM_BLK_ENABLE && data_size > YMODEM_STX_DATA_SIZE) {
+            uint32_t crc32 = ymodem_crc32_update(0, data, data_size);
             
-//             ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//             if (ret == YMODEM_CODE_ACK) {
-//                 YMODEM_DEBUG_PRINT("Packet #%d ACKed\n", ctx->packet_seq);
-//                 break;
-//             } else if (ret == YMODEM_CODE_CAN) {
-//                 return YMODEM_ERR_CAN;
-//             } else {
-//                 retries++;
-//             }
-//             YMODEM_DEBUG_PRINT("Retry #%d for packet #%d\n", retries, ctx->packet_seq);
-//         }
-        
-//         if (retries >= YMODEM_MAX_ERRORS) {
-//             return YMODEM_ERR_ACK;
-//         }
-        
-//         ctx->packet_seq = (ctx->packet_seq + 1) & 0xFF;
+            ctx->buffer[0] = YMODEM_CODE_BLK;
+            ctx->buffer[3] = (uint8_t)(crc32 >> 24);
+            ctx->buffer[4] = (uint8_t)(crc32 >> 16);
+            ctx->buffer[5] = (uint8_t)(crc32 >> 8);
+            ctx->buffer[6] = (uint8_t)crc32;
+            iov[2].length = 4;
+        } else {
+            uint16_t crc = ymodem_calc_crc16(data, data_size);
+            
+            ctx->buffer[0] = (data_size == YMODEM_SOH_DATA_SIZE) ? YMODEM_CODE_SOH : YMODEM_CODE_STX;
+            ctx->buffer[3] = (uint8_t)(crc >> 8);
+            ctx->buffer[4] = (uint8_t)crc;
+            iov[2].length = 2;
+        }
         
-//         if (ctx->stage == YMODEM_STAGE_FINISHING) {
-//             break;
-//         }
-//     }
+        iov[0].data = ctx->buffer;
+        iov[0].length = 3;
+        iov[1].data = data;
+        iov[1].length = data_size;
+        iov[2].data = ctx->buffer + 3;
+        *iov_count = 3;
+        *packet_size = 3 + data_size + iov[2].length;
+        return data_size;
+    }
+    
+    if (data != NULL) {
+        /* Last, short piece of the file: copy it so it can be padded */
+        if (available == 0) {
+            return 0;
+        }
+        if (available <= YMODEM_SOH_DATA_SIZE) {
+            data_size = YMODEM_SOH_DATA_SIZE;
+        } else if (YMODEM_STX_ENABLE && available <= YMODEM_STX_DATA_SIZE) {
+            data_size = YMODEM_STX_DATA_SIZE;
+        }
+        memcpy(ctx->buffer + 3, data, available);
+        memset(ctx->buffer + 3 + available, 0x1A, data_size - available);
+        ymodem_frame_packet(ctx->buffer, ctx->packet_seq, data_size);
+        actual_read = available;
+    } else {
+        actual_read = ymodem_load_packet(ctx, ctx->buffer, ctx->packet_seq);
+        if (actual_read == 0) {
+            return 0;
+        }
+    }
     
-//     return YMODEM_ERR_NONE;
-// }
+    iov[0].data = ctx->buffer;
+    iov[0].length = ymodem_frame_size(ctx, ctx->buffer[0]);
+    *iov_count = 1;
+    *packet_size = iov[0].length;
+    return actual_read;
+}
+
+/**
+ * @brief Main data transfer loop
+ */
 static int _ymodem_do_send_trans(ymodem_context_t* ctx) {
     int ret;
-    size_t read_size;
-    enum ymodem_code packet_type;
-    int retries;
+    size_t packet_size;
+    ymodem_iovec_t iov[3];
+    size_t iov_count;
     
-    ctx->stage = YMODEM_STAGE_TRANSMITTING;
+    /* Pipelined sending only makes sense when every packet is acknowledged */
+    if (ctx->window_count > 1 && ctx->start_code == YMODEM_CODE_C) {
+        return _ymodem_do_send_trans_window(ctx);
+    }
+    
+    ymodem_set_stage(ctx, YMODEM_STAGE_TRANSMITTING);
     ctx->error_count = 0;
     
     while (1) {
-        packet_type = YMODEM_CODE_STX;
-        read_size = YMODEM_STX_DATA_SIZE;
+        /* File data is read straight into the packet (or sent from the file's own memory) */
+        size_t requested = ctx->packet_data_size;
+        size_t actual_read = _ymodem_load_packet_vec(ctx, iov, &iov_count, &packet_size);
+        YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Read %zu bytes from file", actual_read);
+        
+        if (actual_read == 0) {
+            break;
+        }
         
-        size_t actual_read = 0;
-        int retry_read;
+        if (actual_read < requested) {
+            ymodem_set_stage(ctx, YMODEM_STAGE_FINISHING);
+        }
         
-        for (retry_read = 0; retry_read < 10; retry_read++) {
-            actual_read += ctx->callbacks.file_read(ctx->file_handle, 
-                                                  ctx->buffer + 3 + actual_read, 
-                                                  read_size - actual_read);
-            if (actual_read == read_size)
+        /* YMODEM-G: stream the packet without waiting for an ACK, only watch for CAN */
+        if (ctx->start_code == YMODEM_CODE_G) {
+            if (ymodem_send_vec(ctx, iov, iov_count) != packet_size) {
+                return YMODEM_ERR_CODE;
+            }
+            YMODEM_STATS_ADD(ctx, packets_sent, 1);
+            ymodem_stats_payload(ctx, actual_read);
+            
+            if (ymodem_receive_byte(ctx, 0) == YMODEM_CODE_CAN) {
+                YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Receiver cancelled streaming at packet #%d", ctx->packet_seq);
+                return YMODEM_ERR_CAN;
+            }
+            
+            ctx->packet_seq = (ctx->packet_seq + 1) & 0xFF;
+            if (ctx->stage == YMODEM_STAGE_FINISHING) {
                 break;
+            }
+            continue;
         }
-        YMODEM_DEBUG_PRINT("Read %zu bytes from file\n", actual_read);
         
-        if (actual_read == 0) {
-            break;
+        ret = _ymodem_send_acked(ctx, iov, iov_count, packet_size, actual_read);
+        if (ret != YMODEM_ERR_NONE) {
+            return ret;
         }
         
-        if (actual_read < read_size) {
-            memset(ctx->buffer + 3 + actual_read, 0x1A, read_size - actual_read);
-            ctx->stage = YMODEM_STAGE_FINISHING;
+        ctx->packet_seq = (ctx->packet_seq + 1) & 0xFF;
+        YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Advancing to packet #%d", ctx->packet_seq);
+        
+        if (ctx->stage == YMODEM_STAGE_FINISHING) {
+            break;
+        }
+    }
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Send one data packet and wait until it is acknowledged
+ * 
+ * In adaptive mode the ACK is awaited for the measured retransmit timeout,
+ * and a 1 KiB (or large) packet the receiver NAKs is not sent again as it
+ * is: its data goes out as 128-byte packets instead, see _ymodem_send_split().
+ * 
+ * @param iov Packet as built by _ymodem_load_packet_vec()
+ * @param data_length File bytes in the packet
+ * @return int YMODEM_ERR_NONE once ACKed, error code otherwise
+ */
+static int _ymodem_send_acked(ymodem_context_t* ctx, const ymodem_iovec_t* iov, size_t iov_count, size_t packet_size, size_t data_length)
+{
+    int retries = 0;
+    bool timed_out = false;
+    uint32_t sent_ms = 0;
+    int ret;
+    
+    while (retries < YMODEM_MAX_ERRORS) {
+        if (ctx->callbacks.get_time_ms != NULL) {
+            sent_ms = ctx->callbacks.get_time_ms(ctx->callbacks.user);
         }
         
-        if (actual_read <= 128) {
-            packet_type = YMODEM_CODE_SOH;
-            read_size = YMODEM_SOH_DATA_SIZE;
-        } else {
-            packet_type = YMODEM_CODE_STX;
+        /* A resend is the same bytes again, nothing is rebuilt */
+        if (retries > 0) {
+            YMODEM_STATS_ADD(ctx, retries, 1);
+        }
+        if (ymodem_send_vec(ctx, iov, iov_count) != packet_size) {
+            retries++;
+            continue;
         }
+        YMODEM_STATS_ADD(ctx, packets_sent, 1);
         
-        retries = 0;
-        while (retries < YMODEM_MAX_ERRORS) {
-            ret = _ymodem_send_packet(ctx, packet_type, ctx->packet_seq, ctx->buffer + 3, read_size);
-            if (ret != YMODEM_ERR_NONE) {
-                retries++;
-                continue;
+        // 修改这里，使其更宽容地接受响应
+        ret = ymodem_receive_byte(ctx, ctx->adaptive ? ctx->rto_ms : YMODEM_WAIT_PACKET_TIMEOUT_MS);
+        if (ret == YMODEM_CODE_ACK) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Packet #%d ACKed", ctx->packet_seq);
+            
+            /* Karn: only a packet that went out once gives a usable round trip */
+            if (retries == 0 && ctx->callbacks.get_time_ms != NULL) {
+                uint32_t rtt_ms = ctx->callbacks.get_time_ms(ctx->callbacks.user) - sent_ms;
+                
+                ymodem_stats_rtt(ctx, rtt_ms);
+                if (ctx->adaptive) {
+                    _ymodem_adapt_rtt(ctx, rtt_ms);
+                }
             }
+            ymodem_stats_payload(ctx, data_length);
             
-            // 修改这里，使其更宽容地接受响应
-            ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-            if (ret == YMODEM_CODE_ACK) {
-                YMODEM_DEBUG_PRINT("Packet #%d ACKed\n", ctx->packet_seq);
-                break;
-            } else if (ret == YMODEM_CODE_NAK) {
-                YMODEM_DEBUG_PRINT("Packet #%d NAKed, retrying\n", ctx->packet_seq);
-                retries++;
-            } else if (ret == YMODEM_CODE_C) {
-                // 收到C也视为ACK，尤其是对于第一个数据包
-                YMODEM_DEBUG_PRINT("Received 'C' instead of ACK for packet #%d, treating as ACK\n", ctx->packet_seq);
-                break;
-            } else if (ret == YMODEM_CODE_CAN) {
-                return YMODEM_ERR_CAN;
-            } else {
-                YMODEM_DEBUG_PRINT("Unexpected response: %d\n", ret);
-                retries++;
+            if (ctx->adaptive) {
+                _ymodem_adapt_size(ctx, retries == 0);
+                
+                /*
+                 * The copy that timed out may still be ACKed late, that ACK must not count for the
+                 * next packet. It is due within a round trip, rto_ms is still backed off.
+                 */
+                if (timed_out && ymodem_receive_byte(ctx, _ymodem_adapt_rto(ctx)) == YMODEM_CODE_CAN) {
+                    return YMODEM_ERR_CAN;
+                }
+            }
+            return YMODEM_ERR_NONE;
+        } else if (ret == YMODEM_CODE_NAK) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Packet #%d NAKed, retrying", ctx->packet_seq);
+            YMODEM_STATS_ADD(ctx, naks, 1);
+            retries++;
+            
+            /* Only safe while every response answers this packet, i.e. nothing timed out */
+            if (ctx->adaptive && !timed_out && packet_size > YMODEM_SOH_PACKET_SIZE) {
+                _ymodem_adapt_size(ctx, false);
+                return _ymodem_send_split(ctx, (iov_count == 3) ? iov[1].data : ctx->buffer + 3, data_length);
+            }
+        } else if (ret == YMODEM_CODE_C) {
+            // 收到C也视为ACK，尤其是对于第一个数据包
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Received 'C' instead of ACK for packet #%d, treating as ACK", ctx->packet_seq);
+            ymodem_stats_payload(ctx, data_length);
+            return YMODEM_ERR_NONE;
+        } else if (ret == YMODEM_CODE_CAN) {
+            return YMODEM_ERR_CAN;
+        } else {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Unexpected response: %d", ret);
+            retries++;
+            if (ret == YMODEM_ERR_TMO) {
+                YMODEM_STATS_ADD(ctx, timeouts, 1);
+            }
+            
+            /* Back off until the next measured round trip */
+            if (ret == YMODEM_ERR_TMO && ctx->adaptive) {
+                timed_out = true;
+                ctx->rto_ms = (ctx->rto_ms > YMODEM_WAIT_PACKET_TIMEOUT_MS / 2) ? YMODEM_WAIT_PACKET_TIMEOUT_MS : ctx->rto_ms * 2;
             }
-            YMODEM_DEBUG_PRINT("Retry #%d for packet #%d\n", retries, ctx->packet_seq);
         }
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Retry #%d for packet #%d", retries, ctx->packet_seq);
+    }
+    
+    return YMODEM_ERR_ACK;
+}
+
+/**
+ * @brief Resend the data of a NAKed 1 KiB or large packet as 128-byte packets
+ * 
+ * The receiver has not taken the sequence number yet, so the same data can
+ * go out as consecutive SOH packets starting with it, without reading the
+ * file again. On return packet_seq is the number of the last of them.
+ * 
+ * @param data Data of the rejected packet, padded to its packet's data size
+ * @param data_length File bytes in it
+ * @return int YMODEM_ERR_NONE once all are ACKed, error code otherwise
+ */
+static int _ymodem_send_split(ymodem_context_t* ctx, const uint8_t* data, size_t data_length)
+{
+    uint8_t frame[5];
+    ymodem_iovec_t iov[3];
+    size_t offset;
+    int ret;
+    
+    for (offset = 0; ; offset += YMODEM_SOH_DATA_SIZE) {
+        uint16_t crc = ymodem_calc_crc16(data + offset, YMODEM_SOH_DATA_SIZE);
+        
+        frame[0] = YMODEM_CODE_SOH;
+        frame[1] = ctx->packet_seq;
+        frame[2] = ~ctx->packet_seq;
+        frame[3] = (uint8_t)(crc >> 8);
+        frame[4] = (uint8_t)crc;
+        iov[0].data = frame;
+        iov[0].length = 3;
+        iov[1].data = data + offset;
+        iov[1].length = YMODEM_SOH_DATA_SIZE;
+        iov[2].data = frame + 3;
+        iov[2].length = 2;
         
-        if (retries >= YMODEM_MAX_ERRORS) {
-            return YMODEM_ERR_ACK;
+        ret = _ymodem_send_acked(ctx, iov, 3, YMODEM_SOH_PACKET_SIZE,
+                                 (data_length - offset < YMODEM_SOH_DATA_SIZE) ? data_length - offset : YMODEM_SOH_DATA_SIZE);
+        if (ret != YMODEM_ERR_NONE) {
+            return ret;
         }
         
+        if (offset + YMODEM_SOH_DATA_SIZE >= data_length) {
+            return YMODEM_ERR_NONE;
+        }
         ctx->packet_seq = (ctx->packet_seq + 1) & 0xFF;
-        YMODEM_DEBUG_PRINT("Advancing to packet #%d\n", ctx->packet_seq);
+    }
+}
+
+/**
+ * @brief Pipelined data transfer loop (go-back-N)
+ * 
+ * Packets are built into the window ring and sent while fewer than
+ * window_count are unacknowledged. Each ACK releases the oldest packet in
+ * flight; a NAK or a timeout rewinds and resends everything from the oldest
+ * unacknowledged packet, straight from the ring.
+ */
+static int _ymodem_do_send_trans_window(ymodem_context_t* ctx)
+{
+    uint32_t acked = 0;   /* Packets acknowledged */
+    uint32_t sent = 0;    /* Packets put on the wire (rewound on NAK) */
+    uint32_t built = 0;   /* Packets read from file into the ring */
+    uint8_t first_seq = ctx->packet_seq;
+    uint32_t lengths[YMODEM_MAX_WINDOW]; /* File bytes of each packet in the ring, skipped ones for an SKP frame */
+    bool eof = false;
+    int retries = 0;
+    int ret;
+    
+    ymodem_set_stage(ctx, YMODEM_STAGE_TRANSMITTING);
+    ctx->error_count = 0;
+    
+    while (1) {
+        ymodem_iovec_t iov[YMODEM_MAX_WINDOW];
+        size_t iov_count = 0;
+        size_t iov_bytes = 0;
         
-        if (ctx->stage == YMODEM_STAGE_FINISHING) {
+        /* Fill the window, all new packets go out in one scatter-gather send */
+        while (sent - acked < ctx->window_count) {
+            uint8_t* packet = ctx->window_buffer + (sent % ctx->window_count) * YMODEM_MAX_PACKET_SIZE;
+            
+            if (sent == built) {
+                if (eof) {
+                    break;
+                }
+                size_t requested = ctx->packet_data_size;
+                size_t actual_read = ymodem_load_packet(ctx, packet, (uint8_t)(first_seq + built));
+                YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Read %zu bytes from file", actual_read);
+                if (actual_read == 0) {
+                    eof = true;
+                    break;
+                }
+                if (actual_read < requested) {
+                    eof = true;
+                }
+                lengths[built % ctx->window_count] = (uint32_t)actual_read;
+                built++;
+            } else {
+                YMODEM_STATS_ADD(ctx, retries, 1);
+            }
+            
+            iov[iov_count].data = packet;
+            iov[iov_count].length = ymodem_frame_size(ctx, packet[0]);
+            iov_bytes += iov[iov_count].length;
+            iov_count++;
+            sent++;
+        }
+        
+        if (iov_count > 0 && ymodem_send_vec(ctx, iov, iov_count) != iov_bytes) {
+            return YMODEM_ERR_CODE;
+        }
+        YMODEM_STATS_ADD(ctx, packets_sent, (uint32_t)iov_count);
+        
+        if (acked == built && eof) {
             break;
         }
+        
+        ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+        if (ret == YMODEM_CODE_ACK) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Packet #%d ACKed", (uint8_t)(first_seq + acked));
+            ymodem_stats_payload(ctx, lengths[acked % ctx->window_count]);
+            acked++;
+            _ymodem_adapt_size(ctx, retries == 0);
+            retries = 0;
+        } else if (ret == YMODEM_CODE_CAN) {
+            return YMODEM_ERR_CAN;
+        } else if (ret == YMODEM_CODE_NAK || ret == YMODEM_ERR_TMO) {
+            if (ret == YMODEM_CODE_NAK) {
+                YMODEM_STATS_ADD(ctx, naks, 1);
+            } else {
+                YMODEM_STATS_ADD(ctx, timeouts, 1);
+            }
+            retries++;
+            _ymodem_adapt_size(ctx, false);
+            if (retries >= YMODEM_MAX_ERRORS) {
+                return YMODEM_ERR_ACK;
+            }
+            
+            /* ACKs carry no sequence number: late ones for the packets about to be resent
+             * must not count for the copies, whose duplicates the receiver ACKs again */
+            if (ret == YMODEM_ERR_TMO) {
+                ymodem_purge(ctx);
+            }
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Retry #%d, resending from packet #%d", retries, (uint8_t)(first_seq + acked));
+            sent = acked;
+        } else {
+            /* E.g. a restarted receiver polling 'C', it must not keep us waiting forever */
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Unexpected response: %d", ret);
+            if (++retries >= YMODEM_MAX_ERRORS) {
+                return YMODEM_ERR_ACK;
+            }
+        }
     }
     
+    ctx->packet_seq = (uint8_t)(first_seq + built);
+    ymodem_set_stage(ctx, YMODEM_STAGE_FINISHING);
+    
     return YMODEM_ERR_NONE;
 }
 
 /**
- * @brief Finish the YMODEM transmission
+ * @brief Pick the size of the next packets from how the last one went
+ * 
+ * Any NAK or timeout drops to 128-byte packets, so a bad byte costs a short
+ * resend; YMODEM_ADAPT_CLEAN_PACKETS packets acknowledged at the first
+ * attempt climb back to 1 KiB, or to the agreed large block size. Packets
+ * already built keep their size.
+ * 
+ * @param clean true when the packet was ACKed without a retry
+ */
+static void _ymodem_adapt_size(ymodem_context_t* ctx, bool clean)
+{
+    bool aligned = true;
+    
+    if (!ctx->adaptive) {
+        return;
+    }
+    
+    if (!clean) {
+        if (ctx->packet_data_size != YMODEM_SOH_DATA_SIZE) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Noisy link, falling back to 128-byte packets");
+        }
+        ctx->clean_packets = 0;
+        ctx->packet_data_size = YMODEM_SOH_DATA_SIZE;
+        return;
+    }
+    
+    if (ctx->packet_data_size != YMODEM_SOH_DATA_SIZE) {
+        return;
+    }
+    
+    if (ctx->clean_packets < YMODEM_ADAPT_CLEAN_PACKETS) {
+        ctx->clean_packets++;
+    }
+#if YMODEM_DELTA_ENABLE
+    /* In delta mode full packets start on a block boundary, or no block would line up with the map again */
+    aligned = !(ctx->delta && ctx->delta_offset % YMODEM_DELTA_BLOCK_SIZE != 0);
+#endif
+    if (ctx->clean_packets >= YMODEM_ADAPT_CLEAN_PACKETS && aligned) {
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Link clean again, back to full packets");
+        ctx->clean_packets = 0;
+        ctx->packet_data_size = (ctx->block_size > 0) ? ctx->block_size : YMODEM_MAX_DATA_SIZE;
+        
+        /* Round trips measured on short packets are too small for long ones, measure again */
+        ctx->srtt_ms = 0;
+        ctx->rttvar_ms = 0;
+        ctx->rto_ms = YMODEM_WAIT_PACKET_TIMEOUT_MS;
+    }
+}
+
+/**
+ * @brief Update the retransmit timeout from a measured round trip (RFC 6298)
+ * 
+ * The receiver answers a damaged packet only after the line has been quiet
+ * for YMODEM_PURGE_TIMEOUT_MS, so that time is added on top of
+ * srtt + 4 * rttvar (at least YMODEM_RTO_MIN_MS); resending earlier would
+ * only extend its purge.
+ * 
+ * @param rtt_ms Time from sending a packet to its ACK
+ */
+static void _ymodem_adapt_rtt(ymodem_context_t* ctx, uint32_t rtt_ms)
+{
+    if (ctx->srtt_ms == 0) {
+        ctx->srtt_ms = (rtt_ms > 0) ? rtt_ms : 1;
+        ctx->rttvar_ms = rtt_ms / 2;
+    } else {
+        uint32_t delta = (ctx->srtt_ms > rtt_ms) ? ctx->srtt_ms - rtt_ms : rtt_ms - ctx->srtt_ms;
+        ctx->rttvar_ms = (3 * ctx->rttvar_ms + delta) / 4;
+        ctx->srtt_ms = (7 * ctx->srtt_ms + rtt_ms) / 8;
+    }
+    
+    ctx->rto_ms = _ymodem_adapt_rto(ctx);
+}
+
+/**
+ * @brief Retransmit timeout of the measured round trips, without the backoff of rto_ms
+ * 
+ * @return uint32_t srtt + 4 * rttvar, at least YMODEM_RTO_MIN_MS, plus YMODEM_PURGE_TIMEOUT_MS
  */
-// static int _ymodem_do_send_fin(ymodem_context_t* ctx)
-// {
-//     int ret;
-//     int retries;
+static uint32_t _ymodem_adapt_rto(const ymodem_context_t* ctx)
+{
+    uint32_t rto = ctx->srtt_ms + 4 * ctx->rttvar_ms;
     
-//     ctx->stage = YMODEM_STAGE_FINISHING;
+    if (rto < YMODEM_RTO_MIN_MS) {
+        rto = YMODEM_RTO_MIN_MS;
+    }
+    rto += YMODEM_PURGE_TIMEOUT_MS;
+    if (rto > YMODEM_WAIT_PACKET_TIMEOUT_MS) {
+        rto = YMODEM_WAIT_PACKET_TIMEOUT_MS;
+    }
+    return rto;
+}
+
+#if YMODEM_DIGEST_ENABLE
+/**
+ * @brief Hash the part of the file a resumed transfer does not send
+ * 
+ * The file is read from the start up to ctx->file_offset through
+ * ctx->buffer and left at the offset.
+ * 
+ * @return bool false if the file could not be read or moved
+ */
+static bool _ymodem_digest_prefix(ymodem_context_t* ctx)
+{
+    uint64_t hashed = 0;
     
-//     /* Send EOT and wait for NAK */
-//     retries = 0;
-//     while (retries < YMODEM_MAX_ERRORS) {
-//         if (!ymodem_send_byte(ctx, YMODEM_CODE_EOT)) {
-//             return YMODEM_ERR_CODE;
-//         }
-//         YMODEM_DEBUG_PRINT("Sent first EOT, waiting for NAK...\n");
+    if (ctx->callbacks.file_seek(ctx->callbacks.user, ctx->file_handle, 0) != 0) {
+        return false;
+    }
+    while (hashed < ctx->file_offset) {
+        size_t chunk = ctx->buffer_size;
+        size_t length;
         
-//         ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//         if (ret == YMODEM_CODE_NAK) {
-//             break;
-//         }
+        if (chunk > ctx->file_offset - hashed) {
+            chunk = (size_t)(ctx->file_offset - hashed);
+        }
+        length = ctx->callbacks.file_read(ctx->callbacks.user, ctx->file_handle, ctx->buffer, chunk);
+        if (length == 0) {
+            return false;
+        }
+        ymodem_digest_update(ctx->digest, ctx->buffer, length);
+        hashed += length;
+    }
+    
+    return ctx->callbacks.file_seek(ctx->callbacks.user, ctx->file_handle, ctx->file_offset) == 0;
+}
+
+/**
+ * @brief Send the digest of the file in a SUM frame and wait until it is acknowledged
+ * 
+ * The frame follows the last data packet with the next sequence number and
+ * is ACKed even by a YMODEM-G receiver. A receiver whose own digest differs
+ * cancels the transfer.
+ * 
+ * @return int YMODEM_ERR_NONE once ACKed, YMODEM_ERR_SUM if the receiver cancelled, error code otherwise
+ */
+static int _ymodem_send_sum(ymodem_context_t* ctx)
+{
+    uint8_t* packet = ctx->buffer;
+    uint16_t crc;
+    int retries;
+    int ret;
+    
+    ymodem_digest_final(ctx->digest);
+    packet[0] = YMODEM_CODE_SUM;
+    packet[1] = ctx->packet_seq;
+    packet[2] = ~ctx->packet_seq;
+    memcpy(packet + 3, ctx->digest->value, YMODEM_DIGEST_MAX_SIZE);
+    crc = ymodem_calc_crc16(packet + 3, YMODEM_DIGEST_MAX_SIZE);
+    packet[3 + YMODEM_DIGEST_MAX_SIZE] = (uint8_t)(crc >> 8);
+    packet[3 + YMODEM_DIGEST_MAX_SIZE + 1] = (uint8_t)crc;
+    
+    for (retries = 0; retries < YMODEM_MAX_ERRORS; retries++) {
+        if (retries > 0) {
+            YMODEM_STATS_ADD(ctx, retries, 1);
+        }
+        if (ymodem_send_bytes(ctx, packet, YMODEM_SUM_PACKET_SIZE) != YMODEM_SUM_PACKET_SIZE) {
+            return YMODEM_ERR_CODE;
+        }
+        YMODEM_STATS_ADD(ctx, packets_sent, 1);
         
-//         retries++;
-//     }
-    
-//     if (retries >= YMODEM_MAX_ERRORS) {
-//         return YMODEM_ERR_ACK;
-//     }
-    
-//     /* Send second EOT and wait for ACK */
-//     if (!ymodem_send_byte(ctx, YMODEM_CODE_EOT)) {
-//         return YMODEM_ERR_CODE;
-//     }
-//     YMODEM_DEBUG_PRINT("Sent second EOT, waiting for ACK...\n");
-//     ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//     if (ret != YMODEM_CODE_ACK) {
-//         return YMODEM_ERR_ACK;
-//     }
-    
-//     /* Wait for C */
-//     ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//     if (ret != YMODEM_CODE_C) {
-//         return YMODEM_ERR_ACK;
-//     }
-//     YMODEM_DEBUG_PRINT("Sending NULL filename packet to indicate end of batch\n");
-//     /* Prepare and send NULL filename packet to indicate end of batch */
-//     memset(ctx->buffer + 3, 0, YMODEM_SOH_DATA_SIZE);
-//     ret = _ymodem_send_packet(ctx, YMODEM_CODE_SOH, 0, ctx->buffer + 3, YMODEM_SOH_DATA_SIZE);
-//     if (ret != YMODEM_ERR_NONE) {
-//         return ret;
-//     }
-    
-//     /* Wait for final ACK */
-//     ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-//     if (ret != YMODEM_CODE_ACK) {
-//         return YMODEM_ERR_ACK;
-//     }
-
-//     ctx->stage = YMODEM_STAGE_FINISHED;
-//     return YMODEM_ERR_NONE;
-// }
+        ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
+        if (ret == YMODEM_CODE_ACK) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Receiver confirmed the %s digest of %s",
+                         ymodem_digest_name(ctx->digest->type), ctx->filename);
+            ctx->packet_seq = (ctx->packet_seq + 1) & 0xFF;
+            return YMODEM_ERR_NONE;
+        }
+        if (ret == YMODEM_CODE_CAN) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_ERROR, "Receiver rejected the digest of %s", ctx->filename);
+            return YMODEM_ERR_SUM;
+        }
+        if (ret == YMODEM_CODE_NAK) {
+            YMODEM_STATS_ADD(ctx, naks, 1);
+        } else if (ret == YMODEM_ERR_TMO) {
+            YMODEM_STATS_ADD(ctx, timeouts, 1);
+        }
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Retry #%d for the digest frame", retries + 1);
+    }
+    
+    return YMODEM_ERR_ACK;
+}
+#endif
+
+/**
+ * @brief Finish the YMODEM transmission
+ */
 static int _ymodem_do_send_fin(ymodem_context_t* ctx)
 {
     int ret;
     int retries;
     
-    ctx->stage = YMODEM_STAGE_FINISHING;
+    ymodem_set_stage(ctx, YMODEM_STAGE_FINISHING);
     
     /* 发送EOT并等待NAK */
     retries = 0;
@@ -600,7 +1477,7 @@ static int _ymodem_do_send_fin(ymodem_context_t* ctx)
         if (!ymodem_send_byte(ctx, YMODEM_CODE_EOT)) {
             return YMODEM_ERR_CODE;
         }
-        YMODEM_DEBUG_PRINT("Sent first EOT, waiting for NAK...\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Sent first EOT, waiting for NAK...");
         
         ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
         if (ret == YMODEM_CODE_NAK) {
@@ -620,15 +1497,15 @@ static int _ymodem_do_send_fin(ymodem_context_t* ctx)
         if (!ymodem_send_byte(ctx, YMODEM_CODE_EOT)) {
             return YMODEM_ERR_CODE;
         }
-        YMODEM_DEBUG_PRINT("Sent second EOT, waiting for ACK...\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Sent second EOT, waiting for ACK...");
         
         ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
         if (ret == YMODEM_CODE_ACK) {
-            YMODEM_DEBUG_PRINT("Received ACK for second EOT\n");
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Received ACK for second EOT");
             break;
         } else if (ret == YMODEM_CODE_NAK) {
             // 即使收到NAK也继续执行
-            YMODEM_DEBUG_PRINT("Received NAK instead of ACK, continuing anyway...\n");
+            YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Received NAK instead of ACK, continuing anyway...");
             break;
         }
         
@@ -644,13 +1521,13 @@ static int _ymodem_do_send_fin(ymodem_context_t* ctx)
     bool got_c = false;
     while (retries < YMODEM_MAX_ERRORS) {
         ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
-        if (ret == YMODEM_CODE_C) {
-            YMODEM_DEBUG_PRINT("Received 'C' for NULL packet\n");
+        if (ret == ctx->start_code) {
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Received '%c' for NULL packet", ret);
             got_c = true;
             break;
         } else if (ret == YMODEM_CODE_ACK) {
             // 可能同时接收到ACK和C，需要再次尝试接收C
-            YMODEM_DEBUG_PRINT("Received ACK, waiting for 'C'...\n");
+            YMODEM_TRACE(ctx, YMODEM_TRACE_DEBUG, "Received ACK, waiting for 'C'...");
         } else {
             retries++;
         }
@@ -658,13 +1535,22 @@ static int _ymodem_do_send_fin(ymodem_context_t* ctx)
     
     // 如果没有收到C，假装收到了继续执行
     if (!got_c) {
-        YMODEM_DEBUG_PRINT("Did not receive 'C', continuing anyway...\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Did not receive 'C', continuing anyway...");
     }
     
-    YMODEM_DEBUG_PRINT("Sending NULL filename packet to indicate end of batch\n");
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief End the batch with the NULL filename packet
+ */
+static int _ymodem_do_send_end(ymodem_context_t* ctx)
+{
+    int ret;
+    
     /* 准备并发送NULL文件名包，表示批处理结束 */
     memset(ctx->buffer + 3, 0, YMODEM_SOH_DATA_SIZE);
-    ret = _ymodem_send_packet(ctx, YMODEM_CODE_SOH, 0, ctx->buffer + 3, YMODEM_SOH_DATA_SIZE);
+    ret = _ymodem_send_packet(ctx, 0, YMODEM_SOH_DATA_SIZE);
     if (ret != YMODEM_ERR_NONE) {
         return ret;
     }
@@ -672,11 +1558,13 @@ static int _ymodem_do_send_fin(ymodem_context_t* ctx)
     /* 等待最后的ACK，但允许超时 */
     ret = ymodem_receive_byte(ctx, YMODEM_WAIT_PACKET_TIMEOUT_MS);
     if (ret != YMODEM_CODE_ACK) {
-        YMODEM_DEBUG_PRINT("Did not receive final ACK, transmission still considered complete\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_WARN, "Did not receive final ACK, transmission still considered complete");
     } else {
-        YMODEM_DEBUG_PRINT("Received final ACK, transmission complete\n");
+        YMODEM_TRACE(ctx, YMODEM_TRACE_INFO, "Received final ACK, transmission complete");
     }
-
-    ctx->stage = YMODEM_STAGE_FINISHED;
+    
+    ymodem_set_stage(ctx, YMODEM_STAGE_FINISHED);
     return YMODEM_ERR_NONE;
-}
\ No newline at end of file
+}
+
+#endif /* YMODEM_SEND_ENABLE */
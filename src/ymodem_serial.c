@@ -0,0 +1,561 @@
+/**
+ * @file ymodem_serial.c
+ * @brief POSIX serial transport
+ * @date 2025-04-09
+ * 
+ * This file contains the implementation of the serial transport. Reads are
+ * served from rx_buffer; when it is empty one non-blocking read() takes
+ * everything the kernel has, and only if that finds nothing the port is
+ * waited on. Writes run until everything is out, waiting for room with
+ * poll() when the driver queue is full.
+ */
+
+#define _DEFAULT_SOURCE
+#include "ymodem_serial.h"
+
+#if YMODEM_SERIAL_ENABLE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if YMODEM_SERIAL_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#if defined(__linux__)
+#include <asm/ioctls.h>      /* TCGETS2, TCSETS2 */
+#include <linux/serial.h>    /* struct serial_struct, ASYNC_LOW_LATENCY */
+
+/* Kernel termios2, <asm/termbits.h> cannot be included next to <termios.h> */
+struct termios2 {
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t     c_line;
+    cc_t     c_cc[19];
+    speed_t  c_ispeed;
+    speed_t  c_ospeed;
+};
+
+#define YMODEM_SERIAL_BOTHER    0010000   /* c_cflag: speed in c_ispeed/c_ospeed */
+#define YMODEM_SERIAL_IBSHIFT   16        /* Input speed bits in c_cflag */
+#endif
+
+/* Standard rates that have a Bxxx constant */
+static const struct {
+    uint32_t baud;
+    speed_t  speed;
+} _ymodem_serial_speeds[] = {
+    { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+    { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+    { 230400, B230400 },
+#ifdef B460800
+    { 460800, B460800 },
+#endif
+#ifdef B921600
+    { 921600, B921600 },
+#endif
+#ifdef B1000000
+    { 1000000, B1000000 },
+#endif
+#ifdef B1500000
+    { 1500000, B1500000 },
+#endif
+#ifdef B2000000
+    { 2000000, B2000000 },
+#endif
+#ifdef B3000000
+    { 3000000, B3000000 },
+#endif
+#ifdef B4000000
+    { 4000000, B4000000 },
+#endif
+};
+
+static uint32_t _ymodem_serial_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u);
+}
+
+/**
+ * @brief Set the line speed, termios are already in raw mode
+ */
+static int _ymodem_serial_set_baud(int fd, struct termios* tio, uint32_t baud)
+{
+    size_t i;
+    
+    for (i = 0; i < sizeof(_ymodem_serial_speeds) / sizeof(_ymodem_serial_speeds[0]); i++) {
+        if (_ymodem_serial_speeds[i].baud == baud) {
+            cfsetispeed(tio, _ymodem_serial_speeds[i].speed);
+            cfsetospeed(tio, _ymodem_serial_speeds[i].speed);
+            return tcsetattr(fd, TCSANOW, tio);
+        }
+    }
+    
+#if defined(__linux__)
+    /* Any other rate: the divisor is worked out by the driver */
+    struct termios2 tio2;
+    
+    if (tcsetattr(fd, TCSANOW, tio) != 0 || ioctl(fd, TCGETS2, &tio2) != 0) {
+        return -1;
+    }
+    tio2.c_cflag &= ~(tcflag_t)(CBAUD | (CBAUD << YMODEM_SERIAL_IBSHIFT));
+    tio2.c_cflag |= YMODEM_SERIAL_BOTHER | (YMODEM_SERIAL_BOTHER << YMODEM_SERIAL_IBSHIFT);
+    tio2.c_ispeed = baud;
+    tio2.c_ospeed = baud;
+    return ioctl(fd, TCSETS2, &tio2);
+#else
+    /* BSD and macOS take the rate itself as speed_t */
+    cfsetispeed(tio, (speed_t)baud);
+    cfsetospeed(tio, (speed_t)baud);
+    return tcsetattr(fd, TCSANOW, tio);
+#endif
+}
+
+/**
+ * @brief Ask the driver to hand bytes over at once instead of batching them
+ * 
+ * Both hints are best effort: ASYNC_LOW_LATENCY is ignored by many drivers
+ * and the FTDI latency timer (16 ms by default) is only writable by root.
+ */
+static void _ymodem_serial_low_latency(ymodem_serial_t* serial, const char* path)
+{
+#if defined(__linux__)
+    struct serial_struct info;
+    
+    if (ioctl(serial->fd, TIOCGSERIAL, &info) == 0) {
+        info.flags |= ASYNC_LOW_LATENCY;
+        serial->low_latency_set = (ioctl(serial->fd, TIOCSSERIAL, &info) == 0);
+    }
+    
+    if (path != NULL) {
+        char device[PATH_MAX];
+        char timer[PATH_MAX + 64];
+        const char* name;
+        int fd;
+    
+        if (realpath(path, device) == NULL) {
+            return;
+        }
+        name = strrchr(device, '/');
+        name = (name != NULL) ? name + 1 : device;
+        snprintf(timer, sizeof(timer), "/sys/bus/usb-serial/devices/%s/latency_timer", name);
+    
+        fd = open(timer, O_WRONLY);
+        if (fd >= 0) {
+            serial->latency_timer_set = (write(fd, "1", 1) == 1);
+            close(fd);
+        }
+    }
+#else
+    (void)serial;
+    (void)path;
+#endif
+}
+
+/**
+ * @brief Raw 8N1, no echo, no flow control unless asked, reads never block
+ */
+static int _ymodem_serial_configure_tty(ymodem_serial_t* serial, const ymodem_serial_config_t* config)
+{
+    struct termios tio;
+    
+    if (tcgetattr(serial->fd, &tio) != 0) {
+        return -1;
+    }
+    
+    tio.c_cflag |= (CLOCAL | CREAD);
+    tio.c_cflag &= ~(tcflag_t)(PARENB | CSTOPB | CSIZE);
+    tio.c_cflag |= CS8;
+#ifdef CRTSCTS
+    if (config->flow_control) {
+        tio.c_cflag |= CRTSCTS;
+    } else {
+        tio.c_cflag &= ~(tcflag_t)CRTSCTS;
+    }
+#endif
+    tio.c_lflag &= ~(tcflag_t)(ICANON | ECHO | ECHOE | ECHONL | ISIG | IEXTEN);
+    tio.c_iflag &= ~(tcflag_t)(IXON | IXOFF | IXANY | IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL);
+    tio.c_oflag &= ~(tcflag_t)OPOST;
+    
+    /* Waiting is done by epoll/poll, read() returns what is there */
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    
+    if (_ymodem_serial_set_baud(serial->fd, &tio, config->baud) != 0) {
+        return -1;
+    }
+    
+    tcflush(serial->fd, TCIOFLUSH);
+    return 0;
+}
+
+/**
+ * @brief Common setup of a descriptor
+ */
+static int _ymodem_serial_setup(ymodem_serial_t* serial, int fd, bool owned,
+                                const char* path, const ymodem_serial_config_t* config)
+{
+    ymodem_serial_config_t defaults;
+    struct stat st;
+    int flags;
+    
+    if (config == NULL) {
+        ymodem_serial_default_config(&defaults);
+        config = &defaults;
+    }
+    
+    serial->fd = fd;
+    serial->epoll_fd = -1;
+    serial->owned = owned;
+    serial->low_latency_set = false;
+    serial->latency_timer_set = false;
+    serial->rx_head = 0;
+    serial->rx_tail = 0;
+    
+    if (isatty(fd)) {
+        if (_ymodem_serial_configure_tty(serial, config) != 0) {
+            return YMODEM_ERR_CODE;
+        }
+        if (config->low_latency) {
+            _ymodem_serial_low_latency(serial, path);
+        }
+    } else if (config->kernel_buffer > 0 && fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int size = (config->kernel_buffer > INT_MAX) ? INT_MAX : (int)config->kernel_buffer;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return YMODEM_ERR_CODE;
+    }
+    
+#if YMODEM_SERIAL_EPOLL
+    serial->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (serial->epoll_fd >= 0) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        if (epoll_ctl(serial->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            /* e.g. a regular file, poll() copes with everything */
+            close(serial->epoll_fd);
+            serial->epoll_fd = -1;
+        }
+    }
+#endif
+    
+    return YMODEM_ERR_NONE;
+}
+
+/**
+ * @brief Wait until the port is readable
+ * 
+ * @return int 1 readable, 0 timeout, -1 error or hang-up
+ */
+static int _ymodem_serial_wait_readable(ymodem_serial_t* serial, uint32_t timeout_ms)
+{
+    int wait_ms = (timeout_ms > INT_MAX) ? INT_MAX : (int)timeout_ms;
+    int ret;
+    
+#if YMODEM_SERIAL_EPOLL
+    if (serial->epoll_fd >= 0) {
+        struct epoll_event event;
+        ret = epoll_wait(serial->epoll_fd, &event, 1, wait_ms);
+        if (ret > 0 && !(event.events & EPOLLIN)) {
+            return -1;
+        }
+        return (ret < 0 && errno == EINTR) ? 0 : ret;
+    }
+#endif
+    
+    struct pollfd pfd = { serial->fd, POLLIN, 0 };
+    ret = poll(&pfd, 1, wait_ms);
+    if (ret > 0 && !(pfd.revents & POLLIN)) {
+        return -1;
+    }
+    return (ret < 0 && errno == EINTR) ? 0 : ret;
+}
+
+/**
+ * @brief Refill rx_buffer, waiting up to timeout_ms for the first byte
+ * 
+ * @return bool true if there is something to hand out
+ */
+static bool _ymodem_serial_fill(ymodem_serial_t* serial, uint32_t timeout_ms)
+{
+    uint32_t start = _ymodem_serial_now_ms();
+    bool woken = false;
+    
+    for (;;) {
+        ssize_t length = read(serial->fd, serial->rx_buffer, sizeof(serial->rx_buffer));
+        uint32_t elapsed;
+        int ready;
+    
+        if (length > 0) {
+            serial->rx_head = 0;
+            serial->rx_tail = (size_t)length;
+            return true;
+        }
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+        if (length == 0 && woken) {
+            return false;   /* Readable but empty: the other end is gone */
+        }
+    
+        elapsed = _ymodem_serial_now_ms() - start;
+        if (elapsed >= timeout_ms) {
+            return false;
+        }
+        ready = _ymodem_serial_wait_readable(serial, timeout_ms - elapsed);
+        if (ready < 0) {
+            return false;
+        }
+        woken = (ready > 0);
+        /* After a timeout the loop reads once more and then gives up */
+    }
+}
+
+/**
+ * @brief Wait until the port takes more data
+ */
+static bool _ymodem_serial_wait_writable(ymodem_serial_t* serial)
+{
+    struct pollfd pfd = { serial->fd, POLLOUT, 0 };
+    int ret;
+    
+    do {
+        ret = poll(&pfd, 1, YMODEM_SERIAL_TX_TIMEOUT_MS);
+    } while (ret < 0 && errno == EINTR);
+    
+    return (ret > 0 && (pfd.revents & POLLOUT));
+}
+
+static size_t _serial_comm_send(void* user, const uint8_t* data, size_t length)
+{
+    ymodem_serial_t* serial = (ymodem_serial_t*)user;
+    size_t sent = 0;
+    
+    while (sent < length) {
+        ssize_t written = write(serial->fd, data + sent, length - sent);
+        if (written > 0) {
+            sent += (size_t)written;
+        } else if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!_ymodem_serial_wait_writable(serial)) {
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+    
+    return sent;
+}
+
+static size_t _serial_comm_sendv(void* user, const ymodem_iovec_t* iov, size_t iov_count)
+{
+    ymodem_serial_t* serial = (ymodem_serial_t*)user;
+    struct iovec vec[YMODEM_MAX_WINDOW];
+    size_t total = 0;
+    size_t first = 0;
+    size_t skip = 0;    /* Bytes of iov[first] already written */
+    
+    while (first < iov_count) {
+        size_t count = 0;
+        ssize_t written;
+    
+        while (count < YMODEM_MAX_WINDOW && first + count < iov_count) {
+            size_t k = first + count;
+            vec[count].iov_base = (void*)(iov[k].data + (count == 0 ? skip : 0));
+            vec[count].iov_len = iov[k].length - (count == 0 ? skip : 0);
+            count++;
+        }
+    
+        written = writev(serial->fd, vec, (int)count);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!_ymodem_serial_wait_writable(serial)) {
+                break;
+            }
+            continue;
+        }
+        if (written <= 0) {
+            break;
+        }
+    
+        /* Step over what went out, a piece may be left half written */
+        total += (size_t)written;
+        while (written > 0 && first < iov_count) {
+            size_t left = iov[first].length - skip;
+            if ((size_t)written < left) {
+                skip += (size_t)written;
+                written = 0;
+            } else {
+                written -= (ssize_t)left;
+                first++;
+                skip = 0;
+            }
+        }
+        while (first < iov_count && iov[first].length == 0) {
+            first++;
+        }
+    }
+    
+    return total;
+}
+
+static size_t _serial_comm_receive(void* user, uint8_t* data, size_t max_length, uint32_t timeout_ms)
+{
+    ymodem_serial_t* serial = (ymodem_serial_t*)user;
+    size_t length;
+    
+    if (serial->rx_head == serial->rx_tail && !_ymodem_serial_fill(serial, timeout_ms)) {
+        return 0;
+    }
+    
+    length = serial->rx_tail - serial->rx_head;
+    if (length > max_length) {
+        length = max_length;
+    }
+    memcpy(data, serial->rx_buffer + serial->rx_head, length);
+    serial->rx_head += length;
+    
+    return length;
+}
+
+static uint32_t _serial_get_time_ms(void* user)
+{
+    (void)user;
+    return _ymodem_serial_now_ms();
+}
+
+static void _serial_delay_ms(void* user, uint32_t ms)
+{
+    struct timespec ts;
+    (void)user;
+    
+    ts.tv_sec = (time_t)(ms / 1000u);
+    ts.tv_nsec = (long)(ms % 1000u) * 1000000L;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * @brief Settings of a 115200 8N1 port without flow control
+ */
+void ymodem_serial_default_config(ymodem_serial_config_t* config)
+{
+    if (config == NULL) {
+        return;
+    }
+    
+    config->baud = 115200;
+    config->flow_control = false;
+    config->low_latency = false;
+    config->kernel_buffer = 0;
+}
+
+/**
+ * @brief Open and set up a serial port
+ */
+int ymodem_serial_open(ymodem_serial_t* serial, const char* path, const ymodem_serial_config_t* config)
+{
+    int fd;
+    int ret;
+    
+    if (serial == NULL || path == NULL) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ret = _ymodem_serial_setup(serial, fd, true, path, config);
+    if (ret != YMODEM_ERR_NONE) {
+        ymodem_serial_close(serial);
+    }
+    return ret;
+}
+
+/**
+ * @brief Use an already open descriptor
+ */
+int ymodem_serial_attach(ymodem_serial_t* serial, int fd, const ymodem_serial_config_t* config)
+{
+    int ret;
+    
+    if (serial == NULL || fd < 0) {
+        return YMODEM_ERR_CODE;
+    }
+    
+    ret = _ymodem_serial_setup(serial, fd, false, NULL, config);
+    if (ret != YMODEM_ERR_NONE) {
+        ymodem_serial_close(serial);
+    }
+    return ret;
+}
+
+/**
+ * @brief Install the transport callbacks
+ */
+void ymodem_serial_set_callbacks(ymodem_serial_t* serial, ymodem_callbacks_t* callbacks)
+{
+    if (serial == NULL || callbacks == NULL) {
+        return;
+    }
+    
+    callbacks->comm_send = _serial_comm_send;
+    callbacks->comm_sendv = _serial_comm_sendv;
+    callbacks->comm_receive = _serial_comm_receive;
+    callbacks->get_time_ms = _serial_get_time_ms;
+    callbacks->delay_ms = _serial_delay_ms;
+    callbacks->user = serial;
+}
+
+/**
+ * @brief Close a port opened with ymodem_serial_open() or ymodem_serial_attach()
+ */
+void ymodem_serial_close(ymodem_serial_t* serial)
+{
+    if (serial == NULL) {
+        return;
+    }
+    
+    if (serial->epoll_fd >= 0) {
+        close(serial->epoll_fd);
+        serial->epoll_fd = -1;
+    }
+    if (serial->owned && serial->fd >= 0) {
+        close(serial->fd);
+    }
+    serial->fd = -1;
+    serial->rx_head = 0;
+    serial->rx_tail = 0;
+}
+
+#endif /* YMODEM_SERIAL_ENABLE */